@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "mdb.h"
 
 #include <stdio.h>
@@ -5,19 +7,358 @@
 #include <string.h>
 #include <inttypes.h>
 
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/// async contexts drive io_uring through the raw system calls, so only the
+/// kernel headers are needed; without them they fall back to threads
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define MDB_HAVE_URING 1
+#endif
+#endif
 
 typedef uint32_t mdb_size_t;
 typedef uint32_t mdb_ptr_t;
 
 enum {
   MDB_PTR_SIZE = sizeof(mdb_ptr_t),
-  MDB_DATALEN_SIZE = sizeof(mdb_size_t)
+  MDB_DATALEN_SIZE = sizeof(mdb_size_t),
+  MDB_HASH_SIZE = sizeof(uint32_t)
+};
+
+/// hash function ids as recorded in the superblock
+enum {
+  MDB_HASH_WY = 1
+};
+
+/// the index file is mapped with headroom so that it does not have to be
+/// remapped on every stretch; the mapping doubles from this size
+#define MDB_MMAP_MIN_SIZE ((size_t)1 << 20)
+
+/// the index and data files are preallocated this many bytes at a time,
+/// unless grow_chunk says otherwise, and carved up from memory after that
+#define MDB_DEFAULT_GROW_CHUNK ((size_t)1 << 20)
+
+/// freed values are not overwritten; the blocks wholly inside a freed
+/// extent of at least this size are punched out of the data file instead
+#define MDB_PUNCH_MIN_SIZE ((size_t)64 << 10)
+#define MDB_PUNCH_BLOCK ((size_t)4096)
+
+/// the bucket table grows by linear hashing once the average chain is
+/// longer than this, unless max_load_factor says otherwise
+#define MDB_DEFAULT_LOAD_FACTOR 4
+
+/// bucket slots beyond the initial hash_buckets live in segments appended to
+/// the index file; segment k holds buckets [n << (k - 1), n << k)
+#define MDB_SEGMENTS_MAX 32
+
+/// the superblock is a fixed header with a checksum of its own. A clean
+/// close adds what the scan at open would otherwise rebuild, and follows
+/// the header with the free data extents as (offset, size) pairs under a
+/// second checksum. Databases from before it have a text superblock, which
+/// is still read and replaced on open.
+#define MDB_SUPER_MAGIC 0x42444d89u
+#define MDB_SUPER_VERSION 2
+
+enum {
+  MDB_SUPER_MAGIC_AT = 0,
+  MDB_SUPER_VERSION_AT = 4,
+  MDB_SUPER_NAME_AT = 8,
+  MDB_SUPER_KEY_SIZE_AT = MDB_SUPER_NAME_AT + DB_NAME_MAX + 1,
+  MDB_SUPER_DATA_SIZE_AT = MDB_SUPER_KEY_SIZE_AT + 4,
+  MDB_SUPER_BUCKETS_AT = MDB_SUPER_DATA_SIZE_AT + 4,
+  MDB_SUPER_ITEMS_MAX_AT = MDB_SUPER_BUCKETS_AT + 4,
+  MDB_SUPER_HASH_AT = MDB_SUPER_ITEMS_MAX_AT + 4,
+  MDB_SUPER_SEED_AT = MDB_SUPER_HASH_AT + 4,
+  MDB_SUPER_SLAB_AT = MDB_SUPER_SEED_AT + 8,
+  MDB_SUPER_LEVEL_AT = MDB_SUPER_SLAB_AT + 4,
+  MDB_SUPER_SPLIT_AT = MDB_SUPER_LEVEL_AT + 4,
+  MDB_SUPER_SEGMENTS_AT = MDB_SUPER_SPLIT_AT + 4,
+  MDB_SUPER_FLAGS_AT = MDB_SUPER_SEGMENTS_AT + 4 * MDB_SEGMENTS_MAX,
+  MDB_SUPER_ITEMS_AT = MDB_SUPER_FLAGS_AT + 4,
+  MDB_SUPER_INDEX_END_AT = MDB_SUPER_ITEMS_AT + 4,
+  MDB_SUPER_DATA_END_AT = MDB_SUPER_INDEX_END_AT + 4,
+  MDB_SUPER_FREELIST_AT = MDB_SUPER_DATA_END_AT + 4,
+  MDB_SUPER_FREELIST_LENGTH_AT = MDB_SUPER_FREELIST_AT + 4,
+  MDB_SUPER_FREE_BYTES_AT = MDB_SUPER_FREELIST_LENGTH_AT + 4,
+  MDB_SUPER_EXTENTS_AT = MDB_SUPER_FREE_BYTES_AT + 8,
+  MDB_SUPER_EXTENTS_CRC_AT = MDB_SUPER_EXTENTS_AT + 4,
+  MDB_SUPER_CRC_AT = MDB_SUPER_EXTENTS_CRC_AT + 4,
+  MDB_SUPER_SIZE = MDB_SUPER_CRC_AT + 4
+};
+
+enum {
+  MDB_SUPER_CLEAN = 0x1
+};
+
+/// mdb_write_batch assembles at most this many value bytes before writing
+/// them to the data file in one go
+#define MDB_BATCH_DATA_CHUNK ((size_t)1 << 20)
+
+/// a cursor reads ahead this many bytes of index records at a time, and stops
+/// a batch early once its values add up to MDB_CURSOR_DATA_CHUNK bytes
+#define MDB_CURSOR_INDEX_CHUNK ((size_t)1 << 20)
+#define MDB_CURSOR_DATA_CHUNK ((size_t)4 << 20)
+
+/// values closer than this are fetched by one read, gap included
+#define MDB_CURSOR_DATA_GAP ((size_t)64 << 10)
+
+/// number of bucket lock stripes in thread safe mode; bucket b is guarded
+/// by stripe b % MDB_LOCK_STRIPES, so that a multi-get can note the stripes
+/// it needs in a single 64-bit mask
+#define MDB_LOCK_STRIPES 64
+
+/// in thread safe mode the index mapping covers the whole 32-bit pointer
+/// range up front, so that it never moves under a concurrent reader
+#define MDB_MMAP_FULL_SIZE ((size_t)UINT32_MAX + 1)
+
+typedef struct mdb_extent_s {
+  mdb_ptr_t offset;
+  mdb_size_t size;
+  mdb_size_t max_size;
+  uint32_t priority;
+  struct mdb_extent_s *left;
+  struct mdb_extent_s *right;
+} mdb_extent_t;
+
+/// Free space of the data file, kept as a treap ordered by offset. Every node
+/// also records the largest extent in its subtree, so first-fit allocation
+/// and coalescing with neighbours are both O(log n).
+typedef struct {
+  mdb_extent_t *root;
+  uint32_t seed;
+  /// nodes visited by mdb_extent_take, for mdb_get_stats
+  uint64_t steps;
+} mdb_extent_map_t;
+
+/// slab mode: slots are sized in powers of two from MDB_SLAB_MIN_SLOT up to
+/// a quarter page; larger values get a run of whole pages
+#define MDB_SLAB_MIN_SLOT 16
+#define MDB_SLAB_CLASSES_MAX 24
+#define MDB_SLAB_PAGE_MIN ((uint32_t)1 << 12)
+#define MDB_SLAB_PAGE_MAX ((uint32_t)1 << 24)
+#define MDB_SLAB_NONE UINT32_MAX
+
+/// every run of pages starts with a header of kind, size class, two spare
+/// bytes and the slot count or run length. A slab page follows it with the
+/// bitmap of its used slots. Free pages are all zero.
+enum {
+  MDB_PAGE_FREE = 0,
+  MDB_PAGE_SLAB,
+  MDB_PAGE_LARGE
+};
+
+enum {
+  MDB_SLAB_HEADER_SIZE = 8
 };
 
+typedef struct {
+  uint8_t kind;
+  uint8_t cls;
+  uint32_t pages;
+  uint32_t used;
+  uint32_t hint;
+  uint32_t prev;
+  uint32_t next;
+  uint64_t *bitmap;
+} mdb_slab_page_t;
+
+/// the pages of the data file, and per size class a list of the slab pages
+/// that still have a free slot
+typedef struct {
+  uint32_t page_size;
+  uint32_t class_count;
+  uint32_t slots[MDB_SLAB_CLASSES_MAX];
+  uint32_t header_size[MDB_SLAB_CLASSES_MAX];
+  uint32_t partial[MDB_SLAB_CLASSES_MAX];
+  mdb_slab_page_t *pages;
+  uint32_t page_count;
+} mdb_slab_t;
+
+/// hands out @p pages contiguous, page aligned pages
+typedef mdb_status_t (*mdb_page_source_t)(void *ctx, uint32_t pages,
+                                          mdb_ptr_t *ptr);
+
+/// the read cache is split into this many shards by the top bits of the
+/// key hash, each with its own lock and an equal part of the byte budget
+#define MDB_CACHE_SHARDS 16
+#define MDB_CACHE_TABLE_MIN 64
+
+/// a cached value, stored after its NUL terminated key
+typedef struct mdb_cache_entry_s {
+  struct mdb_cache_entry_s *next;
+  uint32_t hash;
+  mdb_size_t value_size;
+  uint32_t slot;
+  bool referenced;
+  char data[];
+} mdb_cache_entry_t;
+
+/// entries are found through a chained hash table and evicted by CLOCK:
+/// the hand sweeps the ring of all entries, sparing those read since it
+/// last passed them
+typedef struct {
+  pthread_mutex_t lock;
+  mdb_cache_entry_t **table;
+  uint32_t table_size;
+  mdb_cache_entry_t **ring;
+  uint32_t count;
+  uint32_t ring_cap;
+  uint32_t hand;
+  size_t bytes;
+  uint64_t hits;
+  uint64_t misses;
+} mdb_cache_shard_t;
+
+typedef struct {
+  size_t shard_budget;
+  bool locked;
+  mdb_cache_shard_t shards[MDB_CACHE_SHARDS];
+} mdb_cache_t;
+
+/// lookups of missing keys are answered by a split block Bloom filter over
+/// the key hashes. A key sets one bit in each of the eight words of a
+/// 32-byte block, chosen by multiplying with these odd constants.
+#define MDB_BLOOM_BITS_PER_KEY 10
+#define MDB_BLOOM_MIN_KEYS 1024
+
+static const uint32_t mdb_bloom_salts[8] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+typedef struct {
+  uint32_t *words;
+  uint32_t block_count;
+  /// keys the filter was sized for, and keys added since it was built
+  uint32_t capacity;
+  uint32_t added;
+  uint64_t lookups;
+  uint64_t negatives;
+  uint64_t false_positives;
+} mdb_bloom_t;
+
+/// MDB_FLAG_WAL: a transaction is logged as one record, its size and CRC
+/// followed by its entries, each a kind, an offset and a length. Writes and
+/// punched ranges carry the bytes or nothing; a layout entry carries level,
+/// split and the segment table. The pages the log covers are held in memory
+/// until a checkpoint, which comes once either grows past these.
+#define MDB_WAL_PAGE_SIZE 4096
+#define MDB_WAL_LOG_MAX ((uint64_t)64 << 20)
+#define MDB_WAL_PAGES_MAX 4096
+#define MDB_WAL_TABLE_MIN 256
+#define MDB_WAL_RECORD_HEADER 8
+#define MDB_WAL_ENTRY_HEADER 9
+
+/// async contexts: the ring size or pool threads when 0 is asked for, the
+/// most threads a pool gets, and how often a lookup on the ring may race a
+/// writer and start over before it is done synchronously instead
+#define MDB_ASYNC_DEPTH_DEFAULT 64
+#define MDB_ASYNC_DEPTH_MAX 4096
+#define MDB_ASYNC_THREADS_MAX 16
+#define MDB_ASYNC_RESTARTS_MAX 8
+
+enum {
+  MDB_WAL_INDEX = 0,
+  MDB_WAL_DATA,
+  MDB_WAL_PUNCH,
+  MDB_WAL_LAYOUT
+};
+
+/// the current contents of a page of the index or data file; a punched one
+/// is still all zeros, and goes back to the file as a hole
+typedef struct {
+  uint64_t key;
+  bool punched;
+  uint8_t *data;
+} mdb_wal_page_t;
+
+/// one writer at a time fills the transaction, and committers append it to
+/// the pending log bytes. Whoever then finds no sync running writes and
+/// syncs everything pending for all of them, while later commits pile up
+/// in the other buffer.
+typedef struct {
+  bool enabled;
+  bool locked;
+  int fd;
+
+  pthread_mutex_t writer;
+  uint8_t *txn;
+  size_t txn_size;
+  size_t txn_cap;
+  bool layout_changed;
+
+  pthread_mutex_t sync_lock;
+  pthread_cond_t synced;
+  bool syncing;
+  bool failed;
+  uint8_t *pending;
+  size_t pending_size;
+  size_t pending_cap;
+  uint8_t *spare;
+  size_t spare_cap;
+  /// log positions committed and, of those, written and synced; they
+  /// keep counting across checkpoints, which only reset the file size
+  uint64_t appended;
+  uint64_t durable;
+  uint64_t log_size;
+
+  /// page images by file and page number, in an open addressed table
+  pthread_rwlock_t page_lock;
+  mdb_wal_page_t *pages;
+  uint32_t page_count;
+  uint32_t table_size;
+} mdb_wal_t;
+
+/// MDB_DURABILITY_PERIODIC: the thread wakes every interval and syncs the
+/// files if a mutation has committed since it last did. It keeps its own
+/// copies of the descriptors, which compaction swaps under the lock.
+typedef struct {
+  bool running;
+  bool stop;
+  bool dirty;
+  int fd_index;
+  int fd_data;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} mdb_flusher_t;
+
+/// the state a clean close leaves in the superblock. The free extents are
+/// only kept outside slab mode, where the page headers say as much.
+typedef struct {
+  bool clean;
+  /// the superblock on disk says clean, whether or not the rest of the
+  /// summary could be used
+  bool marked_clean;
+  /// the superblock was in the old text format
+  bool legacy;
+  uint32_t item_count;
+  mdb_ptr_t index_end;
+  mdb_ptr_t data_end;
+  mdb_ptr_t freelist;
+  uint32_t freelist_length;
+  uint64_t free_bytes;
+  uint32_t extent_count;
+  mdb_ptr_t *extents;
+} mdb_summary_t;
+
 typedef struct {
   char *db_name;
 
+  /// the path the database was opened or created with; compaction builds
+  /// its replacement files next to the originals
+  char *path;
+
   FILE *fp_superblock;
   FILE *fp_index;
   FILE *fp_data;
@@ -25,10 +366,119 @@ typedef struct {
   mdb_options_t options;
 
   uint32_t index_record_size;
+
+  mdb_extent_map_t free_map;
+  mdb_ptr_t data_end;
+
+  /// how far the index and data files have been preallocated. The ends
+  /// above grow inside these, and the tail past them is cut off on close.
+  /// After a crash it is left behind as zeroed index records, which are
+  /// never handed out again, and free data space.
+  mdb_ptr_t index_cap;
+  mdb_ptr_t data_cap;
+
+  /// slab mode; free pages are kept in free_map
+  mdb_slab_t slab;
+
+  uint8_t *index_map;
+  size_t index_map_size;
+  mdb_ptr_t index_end;
+
+  uint8_t *data_map;
+  size_t data_map_size;
+
+  /// copy of the last value handed out by mdb_read_view when the data file
+  /// is not mapped
+  char *view_buf;
+  size_t view_buf_size;
+
+  /// in-memory copy of the freelist head followed by all bucket heads,
+  /// kept in sync by write-through
+  mdb_ptr_t *heads;
+
+  /// linear hashing state: buckets below split, and the ones split off
+  /// them, are addressed with the modulus of the next level
+  uint32_t level;
+  uint32_t split;
+  mdb_ptr_t segments[MDB_SEGMENTS_MAX];
+  uint32_t item_count;
+
+  /// the split pointer the superblock on disk holds. Through stdio it is
+  /// only moved on once the index writes of the splits behind it have been
+  /// flushed; until then layout_pending is set.
+  uint32_t super_level;
+  uint32_t super_split;
+  bool layout_pending;
+
+  /// set while a batch is applied; per-update flushes are skipped and the
+  /// batch flushes once at the end
+  bool batching;
+  /// the same for a single mutation done through stdio, which flushes when
+  /// it commits
+  bool deferring;
+
+  /// thread safe mode. Lock order is table, then stripes in ascending
+  /// order, then alloc. Operations hold the table lock shared and the
+  /// stripe of their bucket; splits and batches hold the table exclusively.
+  /// The alloc lock guards the index freelist, the data free map and the
+  /// item count.
+  bool thread_safe;
+  pthread_rwlock_t table_lock;
+  pthread_rwlock_t stripes[MDB_LOCK_STRIPES];
+  pthread_mutex_t alloc_lock;
+  /// bumped when the table or a stripe is taken exclusively and again when
+  /// it is released, so they are odd while a writer is in. Lookups on an
+  /// async ring hold no lock while their reads are in flight, and compare
+  /// these before and after to tell whether a writer got in between.
+  uint64_t table_seq;
+  uint64_t stripe_seq[MDB_LOCK_STRIPES];
+
+  /// positionless I/O: index and data are accessed with pread and pwrite on
+  /// these descriptors instead of through the shared FILE positions. Chosen
+  /// with MDB_FLAG_PIO, and always used in thread safe and shared mode.
+  bool pio;
+  int fd_index;
+  int fd_data;
+
+  /// online compaction: the next bucket a pass visits, and the index
+  /// records moved out of the way so far. Those are handed back to the
+  /// freelist, in address order, when the pass ends.
+  bool compacting;
+  uint32_t compact_bucket;
+  mdb_ptr_t *compact_vacated;
+  size_t compact_vacated_count;
+  size_t compact_vacated_cap;
+
+  /// multi-process mode. Chains are guarded by fcntl record locks on their
+  /// bucket slot and the freelist by one on offset 0, taken in that order;
+  /// appends to the data file lock the whole data file. Nothing cached in
+  /// memory is trusted: bucket heads are read from the file, the table does
+  /// not split and freed data is left for compaction.
+  bool shared;
+
+  /// values read recently, by key. Lookups do not take the table lock;
+  /// values are only added under the stripe of their bucket and writers
+  /// drop them under the same stripe, held exclusively.
+  mdb_cache_t cache;
+
+  /// MDB_FLAG_BLOOM: built at open from the chains and added to by every
+  /// new key; not available in shared mode
+  mdb_bloom_t bloom;
+
+  /// MDB_FLAG_WAL, when the log is in use
+  mdb_wal_t wal;
+  mdb_flusher_t flusher;
+
+  /// counters behind mdb_get_stats. They are only ever summed, so they are
+  /// bumped with relaxed atomics from whichever thread gets there.
+  mdb_stats_t stats;
 } mdb_int_t;
 
+/// on disk an index record is laid out as next_ptr, hash, key, value_ptr,
+/// value_size, so a chain walk can check the hash before reading the key
 typedef struct {
   mdb_ptr_t next_ptr;
+  uint32_t hash;
   mdb_ptr_t value_ptr;
   mdb_size_t value_size;
   char key[0];
@@ -37,12 +487,61 @@ typedef struct {
 static mdb_status_t mdb_status(uint8_t code, const char *desc);
 static mdb_int_t *mdb_alloc(void);
 static void mdb_free(mdb_int_t *db);
-static uint32_t mdb_hash(const char *key);
+static uint32_t mdb_hash(mdb_int_t *db, const char *key);
+static uint64_t mdb_wymix(uint64_t a, uint64_t b);
+static uint32_t mdb_bucket_of(mdb_int_t *db, uint32_t hash);
+static uint32_t mdb_bucket_count(mdb_int_t *db);
+static mdb_ptr_t mdb_bucket_slot(mdb_int_t *db, uint32_t bucket);
+static bool mdb_head_slot(mdb_int_t *db, mdb_ptr_t ptr, size_t *slot);
+static mdb_status_t mdb_maybe_split(mdb_int_t *db);
+static mdb_status_t mdb_split_undo(mdb_int_t *db);
+static mdb_status_t mdb_unsplit(mdb_int_t *db, uint32_t old_bucket,
+                                uint32_t new_bucket);
+static mdb_status_t mdb_save_layout(mdb_int_t *db);
+static mdb_status_t mdb_save_pending_layout(mdb_int_t *db);
+static mdb_status_t mdb_read_superblock(mdb_int_t *db,
+                                        mdb_summary_t *summary);
+static mdb_status_t mdb_read_text_superblock(mdb_int_t *db);
+static mdb_status_t mdb_write_superblock(mdb_int_t *db,
+                                         const mdb_summary_t *summary);
+static mdb_status_t mdb_format_superblock(mdb_int_t *db, FILE *fp,
+                                          uint32_t level, uint32_t split,
+                                          const mdb_ptr_t *segments,
+                                          const mdb_summary_t *summary);
+static mdb_status_t mdb_close_clean(mdb_int_t *db);
+static size_t mdb_extent_count(const mdb_extent_t *node);
+static mdb_ptr_t *mdb_extent_collect(const mdb_extent_t *node,
+                                     mdb_ptr_t *out, uint64_t *bytes);
+static mdb_status_t mdb_load_summary(mdb_int_t *db,
+                                     const mdb_summary_t *summary,
+                                     bool *loaded);
+static uint32_t mdb_crc32(const void *buf, size_t len);
+static void mdb_put_le(uint8_t *p, uint64_t value, size_t size);
+static uint64_t mdb_get_le(const uint8_t *p, size_t size);
+static int mdb_flush_file(mdb_int_t *db, FILE *fp);
+static int mdb_fflush(mdb_int_t *db, FILE *fp);
+static mdb_status_t mdb_end_batch(mdb_int_t *db);
+static void mdb_begin(mdb_int_t *db);
+static mdb_status_t mdb_commit(mdb_int_t *db);
+static mdb_status_t mdb_sync_files(mdb_int_t *db);
+static mdb_status_t mdb_flusher_start(mdb_int_t *db);
+static void mdb_flusher_stop(mdb_int_t *db);
+static void *mdb_flusher_run(void *arg);
+static mdb_status_t mdb_find_key(mdb_int_t *db, const char *key,
+                                 uint32_t hash, mdb_index_t *index,
+                                 mdb_ptr_t *ptr, mdb_ptr_t *save_ptr);
+static mdb_status_t mdb_lookup_key(mdb_int_t *db, const char *key,
+                                   uint32_t hash, mdb_index_t *index,
+                                   mdb_ptr_t *ptr, mdb_ptr_t *save_ptr);
 
+static mdb_ptr_t mdb_index_end(mdb_int_t *db);
+static mdb_ptr_t mdb_data_end(mdb_int_t *db);
 static mdb_status_t mdb_read_bucket(mdb_int_t *db, uint32_t bucket,
                                     mdb_ptr_t *ptr);
 static mdb_status_t mdb_read_index(mdb_int_t *db, mdb_ptr_t idxptr,
                                    mdb_index_t *index);
+static mdb_status_t mdb_read_index_head(mdb_int_t *db, mdb_ptr_t idxptr,
+                                        mdb_ptr_t *nextptr, uint32_t *hash);
 static mdb_status_t mdb_write_bucket(mdb_int_t *db, mdb_ptr_t bucket,
                                      mdb_ptr_t value);
 static mdb_status_t mdb_write_index(mdb_int_t *db, mdb_ptr_t idxptr,
@@ -57,66 +556,330 @@ static mdb_status_t mdb_read_nextptr(mdb_int_t *db, mdb_ptr_t idxptr,
                                      mdb_ptr_t *nextptr);
 static mdb_status_t mdb_write_nextptr(mdb_int_t *db, mdb_ptr_t ptr,
                                       mdb_ptr_t nextptr);
+static size_t mdb_grow_chunk(mdb_int_t *db);
+static mdb_status_t mdb_file_reserve(mdb_int_t *db, int fd, uint64_t end,
+                                     mdb_ptr_t *cap);
+static void mdb_file_release(mdb_int_t *db, FILE *fp, mdb_ptr_t end,
+                             mdb_ptr_t *cap);
 static mdb_status_t mdb_stretch_index_file(mdb_int_t *db, mdb_ptr_t *ptr);
+static mdb_status_t mdb_stretch_index_by(mdb_int_t *db, size_t size,
+                                         mdb_ptr_t *ptr);
 static mdb_status_t mdb_index_alloc(mdb_int_t *db, mdb_ptr_t *ptr);
 static mdb_status_t mdb_data_alloc(mdb_int_t *db, mdb_size_t valsize,
                                    mdb_ptr_t *ptr);
+static mdb_status_t mdb_data_alloc_unlocked(mdb_int_t *db, mdb_size_t valsize,
+                                            mdb_ptr_t *ptr);
+static mdb_status_t mdb_data_append(mdb_int_t *db, mdb_size_t valsize,
+                                    mdb_ptr_t *ptr);
 static mdb_status_t mdb_index_free(mdb_int_t *db, mdb_ptr_t ptr);
+static mdb_status_t mdb_index_free_unlocked(mdb_int_t *db, mdb_ptr_t ptr);
+static mdb_status_t mdb_index_clear(mdb_int_t *db, mdb_ptr_t ptr,
+                                    mdb_ptr_t nextptr);
 static mdb_status_t mdb_data_free(mdb_int_t *db, mdb_ptr_t valptr,
                                   mdb_size_t valsize);
+static bool mdb_punch_hole(mdb_int_t *db, mdb_ptr_t offset, size_t size);
+static mdb_status_t mdb_scan_index(mdb_int_t *db);
+static mdb_status_t mdb_map_index(mdb_int_t *db);
+static mdb_status_t mdb_map_data(mdb_int_t *db);
+static mdb_status_t mdb_map_file(mdb_int_t *db, int fd, size_t end,
+                                 uint8_t **map, size_t *map_size);
+static mdb_status_t mdb_load_heads(mdb_int_t *db);
+static mdb_status_t mdb_sync_index(mdb_int_t *db, mdb_ptr_t offset,
+                                   size_t len);
+static mdb_status_t mdb_sync_data(mdb_int_t *db, mdb_ptr_t offset,
+                                  size_t len);
+static mdb_status_t mdb_sync_range(mdb_int_t *db, uint8_t *map,
+                                   mdb_ptr_t offset, size_t len);
+static void mdb_apply_runtime_options(mdb_int_t *db,
+                                      const mdb_options_t *options);
+static FILE *mdb_fopen(const char *path, const char *suffix,
+                       const char *mode);
+static bool mdb_make_path(char *buf, size_t bufsiz, const char *path,
+                          const char *suffix);
+static bool mdb_rename(const char *path, const char *from, const char *to);
+static void mdb_remove(const char *path, const char *suffix);
+static bool mdb_sync_dir(const char *path);
+static mdb_status_t mdb_init_concurrency(mdb_int_t *db);
+static void mdb_lock_table(mdb_int_t *db, bool exclusive);
+static void mdb_unlock_table(mdb_int_t *db);
+static void mdb_lock_bucket(mdb_int_t *db, uint32_t bucket, bool exclusive);
+static void mdb_unlock_bucket(mdb_int_t *db, uint32_t bucket);
+static void mdb_lock_alloc(mdb_int_t *db);
+static void mdb_unlock_alloc(mdb_int_t *db);
+static mdb_status_t mdb_lock_range(int fd, short type, mdb_ptr_t offset,
+                                   mdb_ptr_t len);
+static void mdb_unlock_range(int fd, mdb_ptr_t offset, mdb_ptr_t len);
+static mdb_status_t mdb_lock_chain(mdb_int_t *db, uint32_t bucket,
+                                   bool exclusive);
+static void mdb_unlock_chain(mdb_int_t *db, uint32_t bucket);
+static mdb_status_t mdb_lock_index(mdb_int_t *db);
+static void mdb_unlock_index(mdb_int_t *db);
+static mdb_status_t mdb_lock_freelist(mdb_int_t *db);
+static void mdb_unlock_freelist(mdb_int_t *db);
+static void mdb_count_items(mdb_int_t *db, int delta);
+static bool mdb_over_load(mdb_int_t *db);
+static bool mdb_pread_all(int fd, void *buf, size_t len, mdb_ptr_t offset);
+static bool mdb_pwrite_all(int fd, const void *buf, size_t len,
+                           mdb_ptr_t offset);
+static bool mdb_preadv_all(int fd, struct iovec *iov, int iovcnt,
+                           mdb_ptr_t offset);
+static bool mdb_pwritev_all(int fd, struct iovec *iov, int iovcnt,
+                            mdb_ptr_t offset);
+static void mdb_decode_index(mdb_int_t *db, const uint8_t *record,
+                             mdb_index_t *index);
+static void mdb_encode_index(mdb_int_t *db, const mdb_index_t *index,
+                             uint8_t *record);
+static mdb_status_t mdb_write_unlocked(mdb_int_t *db, const char *key,
+                                       uint32_t hash, const char *value,
+                                       mdb_size_t value_size,
+                                       mdb_index_t *index);
+static mdb_status_t mdb_delete_unlocked(mdb_int_t *db, const char *key,
+                                        uint32_t hash);
+
+static bool mdb_read_raw(mdb_int_t *db, FILE *fp, int fd, mdb_ptr_t offset,
+                         void *buf, size_t len);
+static mdb_status_t mdb_lock_all(mdb_int_t *db);
+static void mdb_unlock_all(mdb_int_t *db);
+
+static mdb_status_t mdb_recover_compact(const char *path);
+static mdb_status_t mdb_compact_rewrite(mdb_int_t *db);
+static mdb_status_t mdb_compact_reopen(mdb_int_t *db, mdb_ptr_t *heads,
+                                       const mdb_ptr_t *segments,
+                                       mdb_ptr_t index_end,
+                                       mdb_ptr_t data_end, mdb_slab_t *slab);
+static mdb_status_t mdb_compact_chain(mdb_int_t *db, uint32_t bucket,
+                                      size_t *visited);
+static mdb_status_t mdb_compact_trim(mdb_int_t *db);
+
+static void mdb_extent_insert(mdb_extent_map_t *map, mdb_ptr_t offset,
+                              mdb_size_t size);
+static bool mdb_extent_take(mdb_extent_map_t *map, mdb_size_t size,
+                            mdb_ptr_t *offset);
+static bool mdb_extent_take_tail(mdb_extent_map_t *map, mdb_ptr_t end,
+                                 mdb_ptr_t *offset);
+static void mdb_extent_clear(mdb_extent_map_t *map);
+static int mdb_extent_cmp(const void *lhs, const void *rhs);
 
-static char pathbuf[4096];
+static bool mdb_slab_init(mdb_slab_t *slab, uint32_t page_size);
+static void mdb_slab_destroy(mdb_slab_t *slab);
+static mdb_status_t mdb_slab_place(mdb_slab_t *slab, mdb_size_t size,
+                                   mdb_page_source_t source, void *ctx,
+                                   mdb_ptr_t *ptr, uint32_t *page,
+                                   bool *fresh);
+static uint32_t mdb_slab_encode_header(mdb_slab_t *slab, uint32_t page,
+                                       uint8_t *header);
+static mdb_status_t mdb_slab_alloc(mdb_int_t *db, mdb_size_t valsize,
+                                   mdb_ptr_t *ptr);
+static mdb_status_t mdb_slab_persist(mdb_int_t *db, uint32_t page,
+                                     mdb_ptr_t ptr);
+static mdb_status_t mdb_slab_release(mdb_int_t *db, mdb_ptr_t valptr,
+                                     mdb_size_t valsize);
+static mdb_status_t mdb_slab_clear_pages(mdb_int_t *db, uint32_t page,
+                                         uint32_t pages);
+static bool mdb_slab_take_below(mdb_int_t *db, mdb_size_t valsize,
+                                mdb_ptr_t limit, mdb_ptr_t *ptr);
+static mdb_status_t mdb_slab_load(mdb_int_t *db, const mdb_ptr_t *live,
+                                  size_t live_count);
+
+static mdb_status_t mdb_cache_init(mdb_cache_t *cache, uint64_t size,
+                                   bool locked);
+static void mdb_cache_destroy(mdb_cache_t *cache);
+static bool mdb_cache_get(mdb_cache_t *cache, const char *key, uint32_t hash,
+                          char *buf, size_t bufsiz, mdb_status_t *status);
+static void mdb_cache_put(mdb_cache_t *cache, const char *key, uint32_t hash,
+                          const char *value, mdb_size_t value_size);
+static void mdb_cache_drop(mdb_cache_t *cache, const char *key,
+                           uint32_t hash);
+
+static bool mdb_bloom_alloc(mdb_bloom_t *bloom, uint64_t keys);
+static void mdb_bloom_saturate(mdb_bloom_t *bloom);
+static void mdb_bloom_add(mdb_bloom_t *bloom, uint32_t hash);
+static bool mdb_bloom_check(mdb_bloom_t *bloom, uint32_t hash);
+static void mdb_bloom_miss(mdb_bloom_t *bloom, uint64_t count);
+static bool mdb_bloom_full(mdb_bloom_t *bloom);
+static mdb_status_t mdb_bloom_rebuild(mdb_int_t *db);
+
+static void *mdb_inspect_range(void *arg);
+
+static mdb_status_t mdb_wal_replay(mdb_int_t *db, bool *replayed);
+static mdb_status_t mdb_wal_redo(mdb_int_t *db, const uint8_t *body,
+                                 size_t size, bool *layout_changed);
+static mdb_status_t mdb_wal_init(mdb_int_t *db);
+static void mdb_wal_destroy(mdb_wal_t *wal);
+static void mdb_wal_begin(mdb_int_t *db);
+static mdb_status_t mdb_wal_commit(mdb_int_t *db);
+static mdb_status_t mdb_wal_append(mdb_int_t *db, uint64_t *lsn);
+static mdb_status_t mdb_wal_sync(mdb_int_t *db, uint64_t lsn);
+static mdb_status_t mdb_wal_checkpoint(mdb_int_t *db);
+static mdb_status_t mdb_wal_flush_pages(mdb_int_t *db);
+static bool mdb_wal_log(mdb_wal_t *wal, uint8_t kind, mdb_ptr_t offset,
+                        const void *buf, size_t len);
+static mdb_status_t mdb_wal_write(mdb_int_t *db, uint8_t file,
+                                  mdb_ptr_t offset, const void *buf,
+                                  size_t len);
+static mdb_status_t mdb_wal_punch(mdb_int_t *db, mdb_ptr_t offset,
+                                  size_t len);
+static mdb_status_t mdb_wal_layout(mdb_int_t *db);
+static bool mdb_wal_read(mdb_int_t *db, uint8_t file, mdb_ptr_t offset,
+                         void *buf, size_t len);
+static mdb_wal_page_t *mdb_wal_slot(mdb_wal_t *wal, uint64_t key);
+static mdb_wal_page_t *mdb_wal_page(mdb_int_t *db, uint8_t file,
+                                    uint32_t page, bool whole);
+static void mdb_wal_drop_pages(mdb_wal_t *wal);
+static int mdb_wal_page_cmp(const void *lhs, const void *rhs);
+static bool mdb_wal_zero(int fd, uint64_t offset, uint64_t len);
+static void mdb_wal_lock_pages(mdb_wal_t *wal, bool exclusive);
+static void mdb_wal_unlock_pages(mdb_wal_t *wal);
+static void mdb_wal_lock_sync(mdb_wal_t *wal);
+static void mdb_wal_unlock_sync(mdb_wal_t *wal);
+
+static void mdb_stat_add(uint64_t *counter, uint64_t n);
+static void mdb_stat_max(uint64_t *counter, uint64_t value);
+static void mdb_stat_chain(mdb_int_t *db, uint64_t hops);
+static void mdb_stat_io(mdb_int_t *db, bool write, size_t bytes);
 
 mdb_status_t mdb_open(mdb_t *handle, const char *path) {
+  return mdb_open_ex(handle, path, NULL);
+}
+
+mdb_status_t mdb_open_ex(mdb_t *handle, const char *path,
+                         const mdb_options_t *options) {
   mdb_int_t *db = mdb_alloc();
   if (db == NULL) {
     return mdb_status(MDB_ERR_ALLOC,
                       "failed allocating memory buffer for database");
   }
+  db->path = strdup(path);
+  if (db->path == NULL) {
+    mdb_free(db);
+    return mdb_status(MDB_ERR_ALLOC,
+                      "failed allocating memory buffer for database");
+  }
 
-  strcpy(pathbuf, path);
-  strcat(pathbuf, ".db.super");
-  db->fp_superblock = fopen(pathbuf, "r");
+  mdb_status_t recover_status = mdb_recover_compact(path);
+  STAT_CHECK_RET(recover_status, { mdb_free(db); });
+
+  db->fp_superblock = mdb_fopen(path, ".db.super", "r+");
   if (db->fp_superblock == NULL) {
     mdb_free(db);
-    return mdb_status(MDB_ERR_OPEN_FILE, "cannot open superblock file as read");
+    return mdb_status(MDB_ERR_OPEN_FILE,
+                      "cannot open superblock file as readwrite");
   }
 
-  fscanf(db->fp_superblock, "%s", db->db_name);
-  fscanf(db->fp_superblock, "%hu", &(db->options.key_size_max));
-  fscanf(db->fp_superblock, "%u", &(db->options.data_size_max));
-  fscanf(db->fp_superblock, "%u", &(db->options.hash_buckets));
-  fscanf(db->fp_superblock, "%u", &(db->options.items_max));
+  mdb_summary_t summary;
+  mdb_status_t super_status = mdb_read_superblock(db, &summary);
+  STAT_CHECK_RET(super_status, { free(summary.extents); mdb_free(db); });
 
   db->index_record_size = db->options.key_size_max
                           + MDB_PTR_SIZE * 2
+                          + MDB_HASH_SIZE
                           + MDB_DATALEN_SIZE;
 
-  if (ferror(db->fp_superblock)) {
-    mdb_free(db);
-    return mdb_status(MDB_ERR_READ, "read error when parsing superblock");
-  }
-
-  strcpy(pathbuf, path);
-  strcat(pathbuf, ".db.index");
-  db->fp_index = fopen(pathbuf, "rb+");
+  db->fp_index = mdb_fopen(path, ".db.index", "rb+");
   if (db->fp_index == NULL) {
+    free(summary.extents);
     mdb_free(db);
     return mdb_status(MDB_ERR_OPEN_FILE, "cannot open index file as readwrite");
   }
+  if (fseek(db->fp_index, 0, SEEK_END) != 0) {
+    free(summary.extents);
+    mdb_free(db);
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to end of index file");
+  }
+  db->index_end = (mdb_ptr_t)ftell(db->fp_index);
+  db->index_cap = db->index_end;
 
-  strcpy(pathbuf, path);
-  strcat(pathbuf, ".db.data");
-  db->fp_data = fopen(pathbuf, "rb+");
+  db->fp_data = mdb_fopen(path, ".db.data", "rb+");
   if (db->fp_data == NULL) {
+    free(summary.extents);
     mdb_free(db);
     return mdb_status(MDB_ERR_OPEN_FILE, "cannot open data file as readwrite");
   }
 
-  if (fflush(NULL) != 0) {
+  mdb_apply_runtime_options(db, options);
+  mdb_status_t concurrency_status = mdb_init_concurrency(db);
+  STAT_CHECK_RET(concurrency_status, { free(summary.extents); mdb_free(db); });
+  /// a log is replayed whether or not this open goes on using one
+  bool replayed;
+  mdb_status_t replay_status = mdb_wal_replay(db, &replayed);
+  STAT_CHECK_RET(replay_status, { free(summary.extents); mdb_free(db); });
+  if (replayed) {
+    struct stat st;
+    if (fstat(fileno(db->fp_index), &st) != 0) {
+      free(summary.extents);
+      mdb_free(db);
+      return mdb_status(MDB_ERR_READ, "cannot stat index file");
+    }
+    db->index_end = (mdb_ptr_t)st.st_size;
+    db->index_cap = db->index_end;
+    summary.clean = false;
+  }
+  /// other processes write behind the back of any cache
+  mdb_status_t cache_status =
+      mdb_cache_init(&db->cache, db->shared ? 0 : db->options.cache_size,
+                     db->thread_safe);
+  STAT_CHECK_RET(cache_status, { free(summary.extents); mdb_free(db); });
+  if (db->options.flags & MDB_FLAG_MMAP_INDEX) {
+    mdb_status_t map_status = mdb_map_index(db);
+    STAT_CHECK_RET(map_status, { free(summary.extents); mdb_free(db); });
+  }
+
+  mdb_status_t heads_status = mdb_load_heads(db);
+  STAT_CHECK_RET(heads_status, { free(summary.extents); mdb_free(db); });
+  /// a process that died in the middle of a split left records on the chain
+  /// of a bucket lookups do not use yet
+  mdb_status_t undo_status = mdb_lock_index(db);
+  if (undo_status.code == MDB_OK) {
+    undo_status = mdb_split_undo(db);
+    mdb_unlock_index(db);
+  }
+  STAT_CHECK_RET(undo_status, { free(summary.extents); mdb_free(db); });
+
+  /// the free map and item count are not used in shared mode, and the
+  /// chains could not be walked safely without locking them all. After a
+  /// clean close they are taken from the superblock instead.
+  if (!db->shared) {
+    bool loaded = false;
+    mdb_status_t load_status = mdb_load_summary(db, &summary, &loaded);
+    if (load_status.code == MDB_OK && !loaded) {
+      load_status = mdb_scan_index(db);
+    }
+    STAT_CHECK_RET(load_status, { free(summary.extents); mdb_free(db); });
+  }
+  free(summary.extents);
+  if (db->options.flags & MDB_FLAG_MMAP_DATA) {
+    mdb_status_t map_status = mdb_map_data(db);
+    STAT_CHECK_RET(map_status, { mdb_free(db); });
+  }
+
+  /// from here on the files change, so the summary must not be trusted
+  /// again should the process die; that has to be on disk first
+  if (summary.marked_clean || summary.legacy) {
+    mdb_status_t mark_status = mdb_write_superblock(db, NULL);
+    STAT_CHECK_RET(mark_status, { mdb_free(db); });
+    if (summary.marked_clean
+        && fdatasync(fileno(db->fp_superblock)) != 0) {
+      mdb_free(db);
+      return mdb_status(MDB_ERR_FLUSH, "cannot sync superblock");
+    }
+  }
+
+  if (mdb_flush_file(db, db->fp_index) != 0
+      || mdb_flush_file(db, db->fp_data) != 0) {
     mdb_free(db);
     return mdb_status(MDB_ERR_FLUSH, "fflush failed");
   }
+  if (db->options.flags & MDB_FLAG_WAL) {
+    mdb_status_t wal_status = mdb_wal_init(db);
+    STAT_CHECK_RET(wal_status, { mdb_free(db); });
+  } else {
+    mdb_remove(path, ".db.wal");
+  }
+  if (db->options.durability == MDB_DURABILITY_PERIODIC
+      && !db->wal.enabled) {
+    mdb_status_t flusher_status = mdb_flusher_start(db);
+    STAT_CHECK_RET(flusher_status, { mdb_free(db); });
+  }
 
   *handle = (mdb_t)db;
   return mdb_status(MDB_OK, NULL);
@@ -134,34 +897,51 @@ mdb_status_t mdb_create(mdb_t *handle, mdb_options_t options) {
   db->options.hash_buckets = options.hash_buckets;
   db->options.key_size_max = options.key_size_max;
   db->options.data_size_max = options.data_size_max;
+  db->options.hash_seed = options.hash_seed;
+  db->options.slab_page_size = options.slab_page_size;
+  if (db->options.slab_page_size != 0
+      && !mdb_slab_init(&db->slab, db->options.slab_page_size)) {
+    mdb_free(db);
+    return mdb_status(MDB_ERR_LOGIC,
+                      "slab page size must be a power of two "
+                      "from 4 KiB to 16 MiB");
+  }
+  if (db->options.hash_seed == 0) {
+    db->options.hash_seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)db;
+  }
+  mdb_apply_runtime_options(db, &options);
 
   db->index_record_size = db->options.key_size_max
                           + MDB_PTR_SIZE * 2
+                          + MDB_HASH_SIZE
                           + MDB_DATALEN_SIZE;
 
-  strcpy(pathbuf, options.db_name);
-  strcat(pathbuf, ".db.super");
-  db->fp_superblock = fopen(pathbuf, "w");
-  if (db->fp_superblock == NULL) {
+  db->path = strdup(options.db_name);
+  if (db->path == NULL) {
     mdb_free(db);
-    return mdb_status(MDB_ERR_OPEN_FILE,
-                      "cannot open superblock file as write");
+    return mdb_status(MDB_ERR_ALLOC,
+                      "failed allocating memory buffer for database");
   }
 
-  fprintf(db->fp_superblock, "%s\n", db->db_name);
-  fprintf(db->fp_superblock, "%hu\n", db->options.key_size_max);
-  fprintf(db->fp_superblock, "%u\n", db->options.data_size_max);
-  fprintf(db->fp_superblock, "%u\n", db->options.hash_buckets);
-  fprintf(db->fp_superblock, "%u\n", db->options.items_max);
+  /// leftovers of a compaction of an earlier database by the same name
+  /// must not be rolled forward over this one
+  mdb_remove(options.db_name, ".db.super.compact");
+  mdb_remove(options.db_name, ".db.super.new");
+  mdb_remove(options.db_name, ".db.index.compact");
+  mdb_remove(options.db_name, ".db.data.compact");
+  mdb_remove(options.db_name, ".db.wal");
 
-  if (ferror(db->fp_superblock)) {
+  db->fp_superblock = mdb_fopen(options.db_name, ".db.super", "w");
+  if (db->fp_superblock == NULL) {
     mdb_free(db);
-    return mdb_status(MDB_ERR_WRITE, "write error when writing superblock");
+    return mdb_status(MDB_ERR_OPEN_FILE,
+                      "cannot open superblock file as write");
   }
 
-  strcpy(pathbuf, options.db_name);
-  strcat(pathbuf, ".db.index");
-  db->fp_index = fopen(pathbuf, "wb+");
+  mdb_status_t superblock_status = mdb_write_superblock(db, NULL);
+  STAT_CHECK_RET(superblock_status, { mdb_free(db); });
+
+  db->fp_index = mdb_fopen(options.db_name, ".db.index", "wb+");
   if (db->fp_index == NULL) {
     mdb_free(db);
     return mdb_status(MDB_ERR_OPEN_FILE, "cannot open index file as readwrite");
@@ -178,76 +958,384 @@ mdb_status_t mdb_create(mdb_t *handle, mdb_options_t options) {
       return mdb_status(MDB_ERR_WRITE, "write error when writing hash buckets");
     }
   }
+  db->index_end = MDB_PTR_SIZE * (options.hash_buckets + 1);
+  db->index_cap = db->index_end;
+  db->heads = (mdb_ptr_t*)calloc(options.hash_buckets + 1, MDB_PTR_SIZE);
+  if (db->heads == NULL) {
+    mdb_free(db);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate bucket table");
+  }
 
-  strcpy(pathbuf, options.db_name);
-  strcat(pathbuf, ".db.data");
-  db->fp_data = fopen(pathbuf, "wb+");
+  db->fp_data = mdb_fopen(options.db_name, ".db.data", "wb+");
   if (db->fp_data == NULL) {
     mdb_free(db);
     return mdb_status(MDB_ERR_OPEN_FILE, "cannot open data file as readwrite");
   }
 
-  if (fflush(NULL) != 0) {
+  if (mdb_flush_file(db, db->fp_index) != 0
+      || mdb_flush_file(db, db->fp_data) != 0) {
     mdb_free(db);
     return mdb_status(MDB_ERR_FLUSH, "fflush failed");
   }
 
+  mdb_status_t concurrency_status = mdb_init_concurrency(db);
+  STAT_CHECK_RET(concurrency_status, { mdb_free(db); });
+  /// other processes write behind the back of any cache
+  mdb_status_t cache_status =
+      mdb_cache_init(&db->cache, db->shared ? 0 : db->options.cache_size,
+                     db->thread_safe);
+  STAT_CHECK_RET(cache_status, { mdb_free(db); });
+  if ((db->options.flags & MDB_FLAG_BLOOM) && !db->shared
+      && !mdb_bloom_alloc(&db->bloom, 0)) {
+    mdb_free(db);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate filter");
+  }
+  if (db->options.flags & MDB_FLAG_MMAP_INDEX) {
+    mdb_status_t map_status = mdb_map_index(db);
+    STAT_CHECK_RET(map_status, { mdb_free(db); });
+  }
+  if (db->options.flags & MDB_FLAG_MMAP_DATA) {
+    mdb_status_t map_status = mdb_map_data(db);
+    STAT_CHECK_RET(map_status, { mdb_free(db); });
+  }
+  if (db->options.flags & MDB_FLAG_WAL) {
+    mdb_status_t wal_status = mdb_wal_init(db);
+    STAT_CHECK_RET(wal_status, { mdb_free(db); });
+  }
+  if (db->options.durability == MDB_DURABILITY_PERIODIC
+      && !db->wal.enabled) {
+    mdb_status_t flusher_status = mdb_flusher_start(db);
+    STAT_CHECK_RET(flusher_status, { mdb_free(db); });
+  }
+
   *handle = (mdb_t)db;
   return mdb_status(MDB_OK, NULL);
 }
 
 mdb_status_t mdb_read(mdb_t handle, const char *key, char *buf, size_t bufsiz) {
   mdb_int_t *db = (mdb_int_t*)handle;
-  mdb_size_t bucket = mdb_hash(key) % db->options.hash_buckets;
-
-  mdb_ptr_t ptr;
-  mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, &ptr);
-  STAT_CHECK_RET(bucket_read_status, {;});
 
+  mdb_stat_add(&db->stats.reads, 1);
   mdb_index_t *index =
       alloca(sizeof(mdb_index_t) + db->options.key_size_max + 1);
+  uint32_t hash = mdb_hash(db, key);
+  mdb_status_t cache_status;
+  if (mdb_cache_get(&db->cache, key, hash, buf, bufsiz, &cache_status)) {
+    return cache_status;
+  }
+  mdb_lock_table(db, false);
+  uint32_t bucket = mdb_bucket_of(db, hash);
+  mdb_lock_bucket(db, bucket, false);
+  mdb_status_t status = mdb_lock_chain(db, bucket, false);
+  if (status.code != MDB_OK) {
+    mdb_unlock_bucket(db, bucket);
+    mdb_unlock_table(db);
+    return status;
+  }
 
-  while (ptr != 0) {
-    mdb_status_t read_status = mdb_read_index(db, ptr, index);
-    STAT_CHECK_RET(read_status, {;});
-    if (strcmp(index->key, key) == 0) {
-      return mdb_read_data(db, index->value_ptr, index->value_size, buf,
+  mdb_ptr_t ptr, save_ptr;
+  status = mdb_lookup_key(db, key, hash, index, &ptr, &save_ptr);
+  if (status.code == MDB_OK && ptr == 0) {
+    status = mdb_status(MDB_NO_KEY, "Key not found");
+  } else if (status.code == MDB_OK) {
+    status = mdb_read_data(db, index->value_ptr, index->value_size, buf,
                            bufsiz);
+    if (status.code == MDB_OK) {
+      mdb_cache_put(&db->cache, key, hash, buf, index->value_size);
     }
-    ptr = index->next_ptr;
   }
 
-  return mdb_status(MDB_NO_KEY, "Key not found");
+  mdb_unlock_chain(db, bucket);
+  mdb_unlock_bucket(db, bucket);
+  mdb_unlock_table(db);
+  return status;
+}
+
+mdb_status_t mdb_read_view(mdb_t handle, const char *key, const void **value,
+                           size_t *size) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (db->thread_safe && db->data_map == NULL) {
+    return mdb_status(MDB_ERR_LOGIC,
+                      "views need MDB_FLAG_MMAP_DATA in thread safe mode");
+  }
+  mdb_stat_add(&db->stats.reads, 1);
+
+  mdb_index_t *index =
+      alloca(sizeof(mdb_index_t) + db->options.key_size_max + 1);
+  uint32_t hash = mdb_hash(db, key);
+  mdb_lock_table(db, false);
+  uint32_t bucket = mdb_bucket_of(db, hash);
+  mdb_lock_bucket(db, bucket, false);
+  mdb_status_t status = mdb_lock_chain(db, bucket, false);
+  if (status.code != MDB_OK) {
+    mdb_unlock_bucket(db, bucket);
+    mdb_unlock_table(db);
+    return status;
+  }
+
+  mdb_ptr_t ptr, save_ptr;
+  status = mdb_lookup_key(db, key, hash, index, &ptr, &save_ptr);
+  if (status.code == MDB_OK && ptr == 0) {
+    status = mdb_status(MDB_NO_KEY, "Key not found");
+  } else if (status.code == MDB_OK && db->data_map != NULL) {
+    /// a true view into the mapped data file
+    if ((size_t)index->value_ptr + index->value_size > mdb_data_end(db)) {
+      status = mdb_status(MDB_ERR_READ, "data ptr out of range");
+    } else {
+      *value = index->value_size != 0 ? db->data_map + index->value_ptr
+                                      : (const void*)"";
+      *size = index->value_size;
+    }
+  } else if (status.code == MDB_OK) {
+    size_t needed = (size_t)index->value_size + 1;
+    if (db->view_buf_size < needed) {
+      char *view_buf = (char*)realloc(db->view_buf, needed);
+      if (view_buf == NULL) {
+        status = mdb_status(MDB_ERR_ALLOC, "cannot allocate view buffer");
+      } else {
+        db->view_buf = view_buf;
+        db->view_buf_size = needed;
+      }
+    }
+    if (status.code == MDB_OK) {
+      status = mdb_read_data(db, index->value_ptr, index->value_size,
+                             db->view_buf, (mdb_size_t)needed);
+    }
+    if (status.code == MDB_OK) {
+      *value = db->view_buf;
+      *size = index->value_size;
+    }
+  }
+
+  mdb_unlock_chain(db, bucket);
+  mdb_unlock_bucket(db, bucket);
+  mdb_unlock_table(db);
+  return status;
+}
+
+typedef struct {
+  size_t idx;
+  uint32_t hash;
+  uint32_t hops;
+  mdb_ptr_t ptr;
+  mdb_size_t value_size;
+} mdb_multi_entry_t;
+
+static int mdb_bucket_cmp(const void *lhs, const void *rhs) {
+  uint32_t l = *(const uint32_t*)lhs;
+  uint32_t r = *(const uint32_t*)rhs;
+  return (l > r) - (l < r);
+}
+
+static int mdb_multi_entry_cmp(const void *lhs, const void *rhs) {
+  mdb_ptr_t l = ((const mdb_multi_entry_t*)lhs)->ptr;
+  mdb_ptr_t r = ((const mdb_multi_entry_t*)rhs)->ptr;
+  return (l > r) - (l < r);
+}
+
+mdb_status_t mdb_read_multi(mdb_t handle, const char *keys[], char *bufs[],
+                            size_t bufsizes[], mdb_status_t statuses[],
+                            size_t count) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  mdb_stat_add(&db->stats.reads, count);
+  mdb_multi_entry_t *entries =
+      (mdb_multi_entry_t*)malloc(sizeof(mdb_multi_entry_t) * (count * 2 + 1));
+  if (entries == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate lookup buffer");
+  }
+
+  /// the stripes and chains of all buckets involved are taken up front, in
+  /// ascending order, and held until the values have been read
+  uint32_t *hashes = (uint32_t*)malloc(sizeof(uint32_t) * (count * 2 + 1));
+  if (hashes == NULL) {
+    free(entries);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate lookup buffer");
+  }
+  uint32_t *buckets = hashes + count;
+  for (size_t i = 0; i < count; i++) {
+    hashes[i] = mdb_hash(db, keys[i]);
+  }
+  mdb_lock_table(db, false);
+  uint64_t stripe_mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    buckets[i] = mdb_bucket_of(db, hashes[i]);
+    stripe_mask |= (uint64_t)1 << (buckets[i] % MDB_LOCK_STRIPES);
+  }
+  for (uint32_t stripe = 0; stripe < MDB_LOCK_STRIPES; stripe++) {
+    if (stripe_mask & ((uint64_t)1 << stripe)) {
+      mdb_lock_bucket(db, stripe, false);
+    }
+  }
+  size_t bucket_count = 0, chains_locked = 0;
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  if (db->shared) {
+    qsort(buckets, count, sizeof(uint32_t), mdb_bucket_cmp);
+    for (size_t i = 0; i < count; i++) {
+      if (i == 0 || buckets[i] != buckets[bucket_count - 1]) {
+        buckets[bucket_count++] = buckets[i];
+      }
+    }
+    for (; chains_locked < bucket_count && status.code == MDB_OK;
+         chains_locked++) {
+      status = mdb_lock_chain(db, buckets[chains_locked], false);
+    }
+    if (status.code != MDB_OK) {
+      chains_locked--;
+    }
+  }
+
+  /// entries [0, active) are still walking their chain, entries
+  /// [count, found_end) have been resolved to a value
+  size_t active = 0, found_end = count, passed = 0;
+  for (size_t i = 0; i < count && status.code == MDB_OK; i++) {
+    statuses[i] = mdb_status(MDB_NO_KEY, "Key not found");
+    uint32_t hash = hashes[i];
+    if (!mdb_bloom_check(&db->bloom, hash)) {
+      continue;
+    }
+    passed++;
+    mdb_ptr_t ptr;
+    status = mdb_read_bucket(db, mdb_bucket_of(db, hash), &ptr);
+    if (status.code != MDB_OK) {
+      statuses[i] = status;
+      break;
+    }
+    if (ptr != 0) {
+      entries[active].idx = i;
+      entries[active].hash = hash;
+      entries[active].hops = 0;
+      entries[active].ptr = ptr;
+      active++;
+    } else {
+      mdb_stat_chain(db, 0);
+    }
+  }
+
+  /// chains are walked one hop at a time for all keys together, visiting
+  /// the records of each hop in file order
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  while (active != 0 && status.code == MDB_OK) {
+    qsort(entries, active, sizeof(mdb_multi_entry_t), mdb_multi_entry_cmp);
+    size_t still_active = 0;
+    for (size_t i = 0; i < active; i++) {
+      mdb_multi_entry_t entry = entries[i];
+      mdb_ptr_t next_ptr;
+      uint32_t hash;
+      status = mdb_read_index_head(db, entry.ptr, &next_ptr, &hash);
+      if (status.code != MDB_OK) {
+        break;
+      }
+      entry.hops++;
+      if (hash == entry.hash) {
+        status = mdb_read_index(db, entry.ptr, index);
+        if (status.code != MDB_OK) {
+          break;
+        }
+        if (strcmp(index->key, keys[entry.idx]) == 0) {
+          mdb_stat_chain(db, entry.hops);
+          entries[found_end].idx = entry.idx;
+          entries[found_end].ptr = index->value_ptr;
+          entries[found_end].value_size = index->value_size;
+          found_end++;
+          continue;
+        }
+      }
+      if (next_ptr != 0) {
+        entry.ptr = next_ptr;
+        entries[still_active++] = entry;
+      } else {
+        mdb_stat_chain(db, entry.hops);
+      }
+    }
+    active = still_active;
+  }
+
+  /// values are read in ascending file order
+  if (status.code == MDB_OK) {
+    mdb_bloom_miss(&db->bloom, passed - (found_end - count));
+    qsort(entries + count, found_end - count, sizeof(mdb_multi_entry_t),
+          mdb_multi_entry_cmp);
+    for (size_t i = count; i < found_end; i++) {
+      size_t idx = entries[i].idx;
+      statuses[idx] = mdb_read_data(db, entries[i].ptr,
+                                    entries[i].value_size, bufs[idx],
+                                    bufsizes[idx]);
+    }
+  }
+
+  for (size_t i = 0; i < chains_locked; i++) {
+    mdb_unlock_chain(db, buckets[i]);
+  }
+  for (uint32_t stripe = 0; stripe < MDB_LOCK_STRIPES; stripe++) {
+    if (stripe_mask & ((uint64_t)1 << stripe)) {
+      mdb_unlock_bucket(db, stripe);
+    }
+  }
+  mdb_unlock_table(db);
+  free(hashes);
+  free(entries);
+  return status;
 }
 
 mdb_status_t mdb_write(mdb_t handle, const char *key, const char *value) {
+  return mdb_write_n(handle, key, value, strlen(value));
+}
+
+mdb_status_t mdb_write_n(mdb_t handle, const char *key, const void *value,
+                         size_t size) {
   mdb_int_t *db = (mdb_int_t*)handle;
-  mdb_size_t bucket = mdb_hash(key) % db->options.hash_buckets;
   mdb_size_t key_size = strlen(key);
   if (key_size > db->options.key_size_max) {
     return mdb_status(MDB_ERR_KEY_SIZE, "key size too large");
   }
-  mdb_size_t value_size = strlen(value);
-  if (value_size > db->options.data_size_max) {
+  if (size > db->options.data_size_max) {
     return mdb_status(MDB_ERR_VALUE_SIZE, "value size too large");
   }
-
-  mdb_ptr_t save_ptr = MDB_PTR_SIZE * (bucket + 1);
-  mdb_ptr_t ptr;
-  mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, &ptr);
-  STAT_CHECK_RET(bucket_read_status, {;});
+  mdb_size_t value_size = (mdb_size_t)size;
+  mdb_stat_add(&db->stats.writes, 1);
 
   mdb_index_t *index = alloca(sizeof(mdb_index_t)
                               + db->options.key_size_max + 1);
-  while (ptr != 0) {
-    mdb_status_t index_read_status = mdb_read_index(db, ptr, index);
-    STAT_CHECK_RET(index_read_status, {;});
-    if (strcmp(index->key, key) == 0) {
-      break;
+  uint32_t hash = mdb_hash(db, key);
+  mdb_begin(db);
+  mdb_lock_table(db, false);
+  uint32_t bucket = mdb_bucket_of(db, hash);
+  mdb_lock_bucket(db, bucket, true);
+  mdb_status_t status = mdb_lock_chain(db, bucket, true);
+  if (status.code == MDB_OK) {
+    status = mdb_write_unlocked(db, key, hash, (const char*)value, value_size,
+                                index);
+    mdb_unlock_chain(db, bucket);
+  }
+  bool grow = status.code == MDB_OK
+              && (mdb_over_load(db) || mdb_bloom_full(&db->bloom));
+  mdb_unlock_bucket(db, bucket);
+  mdb_unlock_table(db);
+
+  /// the key is written by now; a table that could not grow is grown again
+  /// by a later write
+  if (grow) {
+    mdb_lock_table(db, true);
+    if (mdb_maybe_split(db).code == MDB_OK && mdb_bloom_full(&db->bloom)) {
+      (void)mdb_bloom_rebuild(db);
     }
-    save_ptr = ptr;
-    ptr = index->next_ptr;
+    mdb_unlock_table(db);
   }
+  mdb_status_t commit_status = mdb_commit(db);
+  STAT_CHECK_RET(status, {;});
+  return commit_status;
+}
+
+static mdb_status_t mdb_write_unlocked(mdb_int_t *db, const char *key,
+                                       uint32_t hash, const char *value,
+                                       mdb_size_t value_size,
+                                       mdb_index_t *index) {
+  mdb_cache_drop(&db->cache, key, hash);
+  mdb_ptr_t ptr, save_ptr;
+  mdb_status_t find_status = mdb_find_key(db, key, hash, index, &ptr,
+                                          &save_ptr);
+  STAT_CHECK_RET(find_status, {;});
 
   if (ptr == 0) {
     mdb_ptr_t index_ptr;
@@ -270,350 +1358,6086 @@ mdb_status_t mdb_write(mdb_t handle, const char *key, const char *value) {
                      (void)mdb_data_free(db, value_ptr, value_size);
                      (void)mdb_index_free(db, index_ptr);
                    });
+    /// the key is added before it can be found, so the filter never
+    /// rules out a key that is there
+    mdb_bloom_add(&db->bloom, hash);
     mdb_status_t ptr_update_status = mdb_write_nextptr(db, save_ptr, index_ptr);
     STAT_CHECK_RET(ptr_update_status, {
                      (void)mdb_data_free(db, value_ptr, value_size);
                      (void)mdb_index_free(db, index_ptr);
                    });
+    mdb_count_items(db, 1);
     return mdb_status(MDB_OK, NULL);
   } else {
-    /// @todo errors are only handled roughly here, needs refinement
-    mdb_status_t data_free_status = mdb_data_free(db, index->value_ptr,
-                                                  index->value_size);
-    STAT_CHECK_RET(data_free_status, {;});
+    /// the old value is freed only once the record points at the new one;
+    /// freeing it first could clear the page the record still points into
     mdb_ptr_t value_ptr;
     mdb_status_t data_alloc_status = mdb_data_alloc(db, value_size, &value_ptr);
     STAT_CHECK_RET(data_alloc_status, {;});
     mdb_status_t data_write_status = mdb_write_data(db, value_ptr, value,
                                                     value_size);
-    STAT_CHECK_RET(data_write_status, {;});
+    STAT_CHECK_RET(data_write_status, {
+                     (void)mdb_data_free(db, value_ptr, value_size);
+                   });
     mdb_status_t index_write_status = mdb_write_index(db, ptr, key, value_ptr,
                                                       value_size);
-    STAT_CHECK_RET(index_write_status, {;});
-    return mdb_status(MDB_OK, NULL);
+    STAT_CHECK_RET(index_write_status, {
+                     (void)mdb_data_free(db, value_ptr, value_size);
+                   });
+    return mdb_data_free(db, index->value_ptr, index->value_size);
   }
 }
 
 mdb_status_t mdb_delete(mdb_t handle, const char *key) {
   mdb_int_t *db = (mdb_int_t*)handle;
-  mdb_size_t bucket = mdb_hash(key) % db->options.hash_buckets;
-
-  mdb_ptr_t save_ptr = MDB_PTR_SIZE * (bucket + 1);
-  mdb_ptr_t ptr;
-  mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, &ptr);
-  STAT_CHECK_RET(bucket_read_status, {;});
+  mdb_stat_add(&db->stats.deletes, 1);
+  uint32_t hash = mdb_hash(db, key);
+  mdb_begin(db);
+  mdb_lock_table(db, false);
+  uint32_t bucket = mdb_bucket_of(db, hash);
+  mdb_lock_bucket(db, bucket, true);
+  mdb_status_t status = mdb_lock_chain(db, bucket, true);
+  if (status.code == MDB_OK) {
+    status = mdb_delete_unlocked(db, key, hash);
+    mdb_unlock_chain(db, bucket);
+  }
+  mdb_unlock_bucket(db, bucket);
+  mdb_unlock_table(db);
+  mdb_status_t commit_status = mdb_commit(db);
+  STAT_CHECK_RET(status, {;});
+  return commit_status;
+}
 
+static mdb_status_t mdb_delete_unlocked(mdb_int_t *db, const char *key,
+                                        uint32_t hash) {
+  mdb_cache_drop(&db->cache, key, hash);
   mdb_index_t *index = alloca(sizeof(mdb_index_t)
                               + db->options.key_size_max + 1);
-  while (ptr != 0) {
-    mdb_status_t index_read_status = mdb_read_index(db, ptr, index);
-    STAT_CHECK_RET(index_read_status, {;});
-    if (strcmp(index->key, key) == 0) {
-      break;
-    }
-    save_ptr = ptr;
-    ptr = index->next_ptr;
-  }
+  mdb_ptr_t ptr, save_ptr;
+  mdb_status_t find_status = mdb_lookup_key(db, key, hash, index, &ptr,
+                                            &save_ptr);
+  STAT_CHECK_RET(find_status, {;});
 
   if (ptr == 0) {
     return mdb_status(MDB_NO_KEY, NULL);
   }
 
+  /// the record is unlinked before it is freed, so it is never on the
+  /// freelist and in a chain at the same time
+  mdb_status_t nextptr_update_status = mdb_write_nextptr(db, save_ptr,
+                                                         index->next_ptr);
+  STAT_CHECK_RET(nextptr_update_status, {;});
   mdb_status_t data_free_status = mdb_data_free(db, index->value_ptr,
                                                 index->value_size);
   STAT_CHECK_RET(data_free_status, {;});
   mdb_status_t index_free_status = mdb_index_free(db, ptr);
   STAT_CHECK_RET(index_free_status, {;});
-  mdb_status_t nextptr_update_status = mdb_write_nextptr(db, save_ptr,
-                                                         index->next_ptr);
-  STAT_CHECK_RET(nextptr_update_status, {;});
+  mdb_count_items(db, -1);
 
   return mdb_status(MDB_OK, NULL);
 }
 
-mdb_options_t mdb_get_options(mdb_t handle) {
+typedef struct {
+  size_t idx;
+  const char *key;
+  uint32_t hash;
+  uint32_t bucket;
+  mdb_size_t value_size;
+  mdb_ptr_t index_ptr;
+  mdb_ptr_t save_ptr;
+  mdb_ptr_t value_ptr;
+  mdb_ptr_t old_ptr;
+  mdb_size_t old_size;
+  bool found;
+  bool superseded;
+  bool replaced;
+} mdb_batch_entry_t;
+
+static int mdb_batch_entry_cmp(const void *lhs, const void *rhs) {
+  const mdb_batch_entry_t *l = (const mdb_batch_entry_t*)lhs;
+  const mdb_batch_entry_t *r = (const mdb_batch_entry_t*)rhs;
+  if (l->bucket != r->bucket) {
+    return l->bucket < r->bucket ? -1 : 1;
+  }
+  if (l->hash != r->hash) {
+    return l->hash < r->hash ? -1 : 1;
+  }
+  int key_cmp = strcmp(l->key, r->key);
+  if (key_cmp != 0) {
+    return key_cmp;
+  }
+  return (l->idx > r->idx) - (l->idx < r->idx);
+}
+
+mdb_status_t mdb_write_batch(mdb_t handle, const char *keys[],
+                             const char *values[], size_t count) {
   mdb_int_t *db = (mdb_int_t*)handle;
-  return db->options;
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(keys[i]) > db->options.key_size_max) {
+      return mdb_status(MDB_ERR_KEY_SIZE, "key size too large");
+    }
+    if (strlen(values[i]) > db->options.data_size_max) {
+      return mdb_status(MDB_ERR_VALUE_SIZE, "value size too large");
+    }
+  }
+  mdb_stat_add(&db->stats.writes, count);
+  mdb_stat_add(&db->stats.batches, 1);
+
+  mdb_batch_entry_t *entries =
+      (mdb_batch_entry_t*)calloc(count, sizeof(mdb_batch_entry_t));
+  char *chunk = (char*)malloc(MDB_BATCH_DATA_CHUNK);
+  if ((entries == NULL && count != 0) || chunk == NULL) {
+    free(entries);
+    free(chunk);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate batch buffer");
+  }
+
+  mdb_begin(db);
+  mdb_lock_table(db, true);
+  mdb_status_t lock_status = mdb_lock_index(db);
+  STAT_CHECK_RET(lock_status, {
+                   mdb_unlock_table(db);
+                   (void)mdb_commit(db);
+                   free(entries);
+                   free(chunk);
+                 });
+
+  /// sorting by bucket groups chain walks and puts duplicate keys next to
+  /// each other, where the one given last wins
+  for (size_t i = 0; i < count; i++) {
+    entries[i].idx = i;
+    entries[i].key = keys[i];
+    entries[i].hash = mdb_hash(db, keys[i]);
+    entries[i].bucket = mdb_bucket_of(db, entries[i].hash);
+    entries[i].value_size = (mdb_size_t)strlen(values[i]);
+    mdb_cache_drop(&db->cache, keys[i], entries[i].hash);
+  }
+  qsort(entries, count, sizeof(mdb_batch_entry_t), mdb_batch_entry_cmp);
+  for (size_t i = 0; i + 1 < count; i++) {
+    entries[i].superseded =
+        entries[i].hash == entries[i + 1].hash
+        && strcmp(keys[entries[i].idx], keys[entries[i + 1].idx]) == 0;
+  }
+
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  size_t new_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    mdb_batch_entry_t *entry = entries + i;
+    if (entry->superseded) {
+      continue;
+    }
+    mdb_status_t find_status = mdb_find_key(db, keys[entry->idx], entry->hash,
+                                            index, &(entry->index_ptr),
+                                            &(entry->save_ptr));
+    STAT_CHECK_RET(find_status, {
+                     mdb_unlock_index(db);
+                     mdb_unlock_table(db);
+                     (void)mdb_commit(db);
+                     free(entries);
+                     free(chunk);
+                   });
+    entry->found = entry->index_ptr != 0;
+    if (entry->found) {
+      entry->value_ptr = index->value_ptr;
+      entry->value_size = index->value_size;
+    } else {
+      new_count++;
+    }
+  }
+
+  db->batching = true;
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+
+  /// values are written in chunks, each one allocated as a single extent
+  for (size_t i = 0; i < count && status.code == MDB_OK; ) {
+    size_t chunk_end = i, chunk_size = 0;
+    for (; chunk_end < count; chunk_end++) {
+      mdb_batch_entry_t *entry = entries + chunk_end;
+      if (entry->superseded) {
+        continue;
+      }
+      mdb_size_t value_size = (mdb_size_t)strlen(values[entry->idx]);
+      /// in slab mode every value takes a slot of its own size class
+      if ((chunk_size + value_size > MDB_BATCH_DATA_CHUNK
+           || db->slab.page_size != 0)
+          && chunk_size != 0) {
+        break;
+      }
+      if (entry->found) {
+        entry->old_ptr = entry->value_ptr;
+        entry->old_size = entry->value_size;
+      }
+      entry->value_size = value_size;
+      chunk_size += value_size;
+    }
+    if (status.code != MDB_OK) {
+      break;
+    }
+
+    mdb_ptr_t chunk_ptr;
+    status = mdb_data_alloc(db, (mdb_size_t)chunk_size, &chunk_ptr);
+    if (status.code != MDB_OK) {
+      break;
+    }
+    char *buf = chunk_size <= MDB_BATCH_DATA_CHUNK
+                ? chunk : (char*)malloc(chunk_size);
+    if (buf == NULL) {
+      status = mdb_status(MDB_ERR_ALLOC, "cannot allocate batch buffer");
+      break;
+    }
+    size_t offset = 0;
+    for (; i < chunk_end; i++) {
+      mdb_batch_entry_t *entry = entries + i;
+      if (entry->superseded) {
+        continue;
+      }
+      memcpy(buf + offset, values[entry->idx], entry->value_size);
+      entry->value_ptr = chunk_ptr + (mdb_ptr_t)offset;
+      offset += entry->value_size;
+    }
+    status = mdb_write_data(db, chunk_ptr, buf, (mdb_size_t)chunk_size);
+    if (buf != chunk) {
+      free(buf);
+    }
+  }
+
+  /// new records reuse freed slots first; the rest are taken from the end
+  /// of the index file with a single stretch
+  mdb_ptr_t stretch_ptr = 0;
+  size_t reused = 0;
+  for (size_t i = 0; i < count && status.code == MDB_OK; i++) {
+    mdb_batch_entry_t *entry = entries + i;
+    if (entry->superseded || entry->found) {
+      continue;
+    }
+    mdb_ptr_t freeptr;
+    status = mdb_read_nextptr(db, 0, &freeptr);
+    if (status.code != MDB_OK || freeptr == 0) {
+      break;
+    }
+    status = mdb_index_alloc(db, &(entry->index_ptr));
+    reused++;
+  }
+  if (status.code == MDB_OK && reused < new_count) {
+    status = mdb_stretch_index_by(db, (new_count - reused)
+                                      * db->index_record_size, &stretch_ptr);
+  }
+
+  /// new records of one bucket are chained to each other and then hung off
+  /// the old tail of the chain
+  mdb_ptr_t prev_ptr = 0;
+  uint32_t prev_bucket = 0;
+  for (size_t i = 0; i < count && status.code == MDB_OK; i++) {
+    mdb_batch_entry_t *entry = entries + i;
+    if (entry->superseded) {
+      continue;
+    }
+    if (!entry->found && entry->index_ptr == 0) {
+      entry->index_ptr = stretch_ptr;
+      stretch_ptr += db->index_record_size;
+    }
+    status = mdb_write_index(db, entry->index_ptr, entry->key,
+                             entry->value_ptr, entry->value_size);
+    entry->replaced = status.code == MDB_OK && entry->found;
+    if (status.code != MDB_OK || entry->found) {
+      continue;
+    }
+    mdb_bloom_add(&db->bloom, entry->hash);
+    bool chained = prev_ptr != 0 && prev_bucket == entry->bucket;
+    status = mdb_write_nextptr(db, chained ? prev_ptr : entry->save_ptr,
+                               entry->index_ptr);
+    prev_ptr = entry->index_ptr;
+    prev_bucket = entry->bucket;
+    if (status.code == MDB_OK) {
+      mdb_count_items(db, 1);
+    }
+  }
+
+  /// old values are only freed once no record points at them, so a process
+  /// that dies half way never leaves a record on a freed page
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].replaced) {
+      mdb_status_t free_status = mdb_data_free(db, entries[i].old_ptr,
+                                               entries[i].old_size);
+      if (status.code == MDB_OK) {
+        status = free_status;
+      }
+    }
+  }
+
+  free(entries);
+  free(chunk);
+  mdb_status_t end_status = mdb_end_batch(db);
+  mdb_status_t split_status = mdb_status(MDB_OK, NULL);
+  for (size_t i = 0; i < new_count && status.code == MDB_OK
+                     && split_status.code == MDB_OK
+                     && end_status.code == MDB_OK; i++) {
+    split_status = mdb_maybe_split(db);
+  }
+  /// as in mdb_write_n, a table that could not grow does not fail the batch
+  if (split_status.code == MDB_OK && mdb_bloom_full(&db->bloom)) {
+    (void)mdb_bloom_rebuild(db);
+  }
+  mdb_unlock_index(db);
+  mdb_unlock_table(db);
+  mdb_status_t commit_status = mdb_commit(db);
+  STAT_CHECK_RET(status, {;});
+  STAT_CHECK_RET(end_status, {;});
+  return commit_status;
+}
+
+mdb_status_t mdb_delete_batch(mdb_t handle, const char *keys[], size_t count,
+                              size_t *deleted) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  size_t deleted_count = 0;
+  mdb_stat_add(&db->stats.deletes, count);
+  mdb_stat_add(&db->stats.batches, 1);
+
+  mdb_begin(db);
+  mdb_lock_table(db, true);
+  mdb_status_t status = mdb_lock_index(db);
+  STAT_CHECK_RET(status, {
+                   mdb_unlock_table(db);
+                   (void)mdb_commit(db);
+                 });
+  db->batching = true;
+  for (size_t i = 0; i < count; i++) {
+    status = mdb_delete_unlocked(db, keys[i], mdb_hash(db, keys[i]));
+    if (status.code == MDB_OK) {
+      deleted_count++;
+    } else if (status.code != MDB_NO_KEY) {
+      break;
+    }
+    status = mdb_status(MDB_OK, NULL);
+  }
+  mdb_status_t end_status = mdb_end_batch(db);
+  mdb_unlock_index(db);
+  mdb_unlock_table(db);
+  mdb_status_t commit_status = mdb_commit(db);
+
+  if (deleted != NULL) {
+    *deleted = deleted_count;
+  }
+  STAT_CHECK_RET(status, {;});
+  STAT_CHECK_RET(end_status, {;});
+  return commit_status;
+}
+
+typedef struct {
+  mdb_ptr_t value_ptr;
+  mdb_size_t value_size;
+  size_t value_offset;
+} mdb_cursor_entry_t;
+
+/// a cursor walks the index file in record order. Each batch of records is
+/// read ahead in one go, and their values are then fetched in file order
+/// with nearby values coalesced into a single read.
+typedef struct {
+  mdb_int_t *db;
+  mdb_ptr_t next_ptr;
+  bool done;
+
+  uint8_t *index_buf;
+  mdb_cursor_entry_t *entries;
+  char *keys;
+  size_t entry_count;
+  size_t entry_cap;
+  size_t pos;
+
+  mdb_multi_entry_t *order;
+  char *values;
+  size_t values_cap;
+} mdb_cursor_int_t;
+
+static mdb_status_t mdb_cursor_fill(mdb_cursor_int_t *cursor);
+static mdb_status_t mdb_cursor_read_values(mdb_cursor_int_t *cursor);
+
+mdb_status_t mdb_cursor_open(mdb_t handle, mdb_cursor_t *cursor) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  mdb_cursor_int_t *c =
+      (mdb_cursor_int_t*)calloc(1, sizeof(mdb_cursor_int_t));
+  if (c == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate cursor");
+  }
+  c->db = db;
+  c->next_ptr = MDB_PTR_SIZE * (db->options.hash_buckets + 1);
+  c->entry_cap = MDB_CURSOR_INDEX_CHUNK / db->index_record_size + 1;
+  c->index_buf = (uint8_t*)malloc(c->entry_cap * db->index_record_size);
+  c->entries = (mdb_cursor_entry_t*)malloc(c->entry_cap
+                                           * sizeof(mdb_cursor_entry_t));
+  c->keys = (char*)malloc(c->entry_cap * (db->options.key_size_max + 1));
+  c->order = (mdb_multi_entry_t*)malloc(c->entry_cap
+                                        * sizeof(mdb_multi_entry_t));
+  if (c->index_buf == NULL || c->entries == NULL || c->keys == NULL
+      || c->order == NULL) {
+    mdb_cursor_close((mdb_cursor_t)c);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate cursor");
+  }
+  *cursor = (mdb_cursor_t)c;
+  return mdb_status(MDB_OK, NULL);
+}
+
+mdb_status_t mdb_cursor_next(mdb_cursor_t cursor, const char **key,
+                             const void **value, size_t *size) {
+  mdb_cursor_int_t *c = (mdb_cursor_int_t*)cursor;
+  while (c->pos == c->entry_count) {
+    if (c->done) {
+      return mdb_status(MDB_NO_KEY, "end of database");
+    }
+    mdb_status_t fill_status = mdb_cursor_fill(c);
+    STAT_CHECK_RET(fill_status, {;});
+  }
+
+  mdb_cursor_entry_t *entry = c->entries + c->pos;
+  *key = c->keys + c->pos * (c->db->options.key_size_max + 1);
+  if (c->db->data_map != NULL) {
+    *value = entry->value_size != 0 ? c->db->data_map + entry->value_ptr
+                                    : (const void*)"";
+  } else {
+    *value = c->values + entry->value_offset;
+  }
+  *size = entry->value_size;
+  c->pos++;
+  return mdb_status(MDB_OK, NULL);
+}
+
+void mdb_cursor_close(mdb_cursor_t cursor) {
+  mdb_cursor_int_t *c = (mdb_cursor_int_t*)cursor;
+  free(c->index_buf);
+  free(c->entries);
+  free(c->keys);
+  free(c->order);
+  free(c->values);
+  free(c);
+}
+
+/// moves @p ptr past the bucket segment it points into, if any
+static mdb_ptr_t mdb_cursor_skip_segment(mdb_int_t *db, mdb_ptr_t ptr,
+                                         mdb_ptr_t *limit) {
+  size_t buckets = db->options.hash_buckets;
+  for (uint32_t k = 1; k < MDB_SEGMENTS_MAX && db->segments[k] != 0; k++) {
+    mdb_ptr_t begin = db->segments[k];
+    size_t size = buckets * MDB_PTR_SIZE;
+    size = (size + db->index_record_size - 1) / db->index_record_size
+           * db->index_record_size;
+    if (ptr >= begin && ptr < begin + size) {
+      ptr = begin + (mdb_ptr_t)size;
+    } else if (begin > ptr && begin < *limit) {
+      *limit = begin;
+    }
+    buckets *= 2;
+  }
+  return ptr;
+}
+
+static mdb_status_t mdb_cursor_fill(mdb_cursor_int_t *c) {
+  mdb_int_t *db = c->db;
+  c->entry_count = 0;
+  c->pos = 0;
+
+  mdb_status_t lock_status = mdb_lock_all(db);
+  STAT_CHECK_RET(lock_status, {;});
+  mdb_ptr_t end = mdb_index_end(db);
+  if (db->shared) {
+    struct stat st;
+    end = fstat(db->fd_index, &st) == 0 ? (mdb_ptr_t)st.st_size : 0;
+  }
+
+  mdb_ptr_t limit = end;
+  mdb_ptr_t ptr = mdb_cursor_skip_segment(db, c->next_ptr, &limit);
+  size_t count = (limit > ptr ? limit - ptr : 0) / db->index_record_size;
+  if (count > c->entry_cap) {
+    count = c->entry_cap;
+  }
+  size_t span = count * db->index_record_size;
+
+  const uint8_t *records = c->index_buf;
+  if (db->index_map != NULL) {
+    records = db->index_map + ptr;
+  } else if (span != 0 && !mdb_read_raw(db, db->fp_index, db->fd_index, ptr,
+                                        c->index_buf, span)) {
+    mdb_unlock_all(db);
+    return mdb_status(MDB_ERR_READ, "cannot read index records");
+  }
+
+  /// freed records have their hash and key cleared; a live record with the
+  /// empty key still carries the hash of it
+  uint32_t empty_hash = mdb_hash(db, "");
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  size_t value_bytes = 0, used = 0;
+  while (used < count && value_bytes < MDB_CURSOR_DATA_CHUNK) {
+    mdb_decode_index(db, records + used * db->index_record_size, index);
+    used++;
+    if (index->key[0] == '\0' && index->hash != empty_hash) {
+      continue;
+    }
+    mdb_cursor_entry_t *entry = c->entries + c->entry_count;
+    entry->value_ptr = index->value_ptr;
+    entry->value_size = index->value_size;
+    memcpy(c->keys + c->entry_count * (db->options.key_size_max + 1),
+           index->key, db->options.key_size_max + 1);
+    c->entry_count++;
+    value_bytes += index->value_size;
+  }
+  c->next_ptr = ptr + (mdb_ptr_t)(used * db->index_record_size);
+  c->done = c->next_ptr >= end;
+
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  if (db->data_map == NULL) {
+    status = mdb_cursor_read_values(c);
+  }
+  mdb_unlock_all(db);
+  return status;
+}
+
+static mdb_status_t mdb_cursor_read_values(mdb_cursor_int_t *c) {
+  mdb_int_t *db = c->db;
+  if (c->entry_count == 0) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  for (size_t i = 0; i < c->entry_count; i++) {
+    c->order[i].idx = i;
+    c->order[i].ptr = c->entries[i].value_ptr;
+  }
+  qsort(c->order, c->entry_count, sizeof(mdb_multi_entry_t),
+        mdb_multi_entry_cmp);
+
+  /// first pass sizes the runs, second pass reads them
+  for (int pass = 0; pass < 2; pass++) {
+    size_t offset = 0;
+    for (size_t i = 0; i < c->entry_count; ) {
+      mdb_ptr_t run_begin = c->entries[c->order[i].idx].value_ptr;
+      mdb_ptr_t run_end = run_begin + c->entries[c->order[i].idx].value_size;
+      size_t j = i + 1;
+      for (; j < c->entry_count; j++) {
+        mdb_cursor_entry_t *next = c->entries + c->order[j].idx;
+        if (next->value_ptr > run_end + MDB_CURSOR_DATA_GAP) {
+          break;
+        }
+        if (next->value_ptr + next->value_size > run_end) {
+          run_end = next->value_ptr + next->value_size;
+        }
+      }
+      if (pass == 1) {
+        if (run_end > run_begin
+            && !mdb_read_raw(db, db->fp_data, db->fd_data, run_begin,
+                             c->values + offset, run_end - run_begin)) {
+          return mdb_status(MDB_ERR_READ, "cannot read values");
+        }
+        for (size_t k = i; k < j; k++) {
+          mdb_cursor_entry_t *entry = c->entries + c->order[k].idx;
+          entry->value_offset = offset + (entry->value_ptr - run_begin);
+        }
+      }
+      offset += run_end - run_begin;
+      i = j;
+    }
+    if (pass == 0 && offset + 1 > c->values_cap) {
+      char *values = (char*)realloc(c->values, offset + 1);
+      if (values == NULL) {
+        return mdb_status(MDB_ERR_ALLOC, "cannot allocate value buffer");
+      }
+      c->values = values;
+      c->values_cap = offset + 1;
+    }
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// one request of an async context. On the ring, a lookup reads one index
+/// record per submission into @p index, and submits the next one, or the
+/// value, when it completes; writes walk their chain the same way before
+/// they are applied.
+typedef struct mdb_async_req_s {
+  struct mdb_async_req_s *next;
+  bool write;
+  mdb_async_cb_t callback;
+  void *arg;
+  mdb_status_t status;
+
+  char *buf;
+  size_t bufsiz;
+  const void *value;
+  size_t size;
+
+  uint32_t hash;
+  uint32_t bucket;
+  uint64_t table_seq;
+  uint64_t stripe_seq;
+  uint32_t restarts;
+  uint64_t hops;
+  mdb_ptr_t ptr;
+  bool reading_value;
+  int fd_index;
+  int fd_data;
+  int fd;
+  mdb_ptr_t offset;
+  int iov_count;
+  struct iovec iov[5];
+
+  mdb_index_t *index;
+  char *key;
+} mdb_async_req_t;
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  /// SQEs filled in but not yet handed to the kernel, and reads in flight
+  unsigned queued;
+  unsigned inflight;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} mdb_ring_t;
+
+/// an async context belongs to one thread, which alone submits and polls.
+/// Requests that find the ring full wait in line for a free entry; pool
+/// threads take theirs from the work queue. Finished requests wait for
+/// their callback in the done queue, which is shared with the pool under
+/// the lock.
+typedef struct {
+  mdb_int_t *db;
+  uint8_t engine;
+  size_t outstanding;
+  mdb_async_req_t *spare;
+
+  mdb_ring_t ring;
+  mdb_async_req_t *waiting;
+  mdb_async_req_t *waiting_tail;
+
+  pthread_t *threads;
+  size_t thread_count;
+  bool stop;
+  mdb_async_req_t *work;
+  mdb_async_req_t *work_tail;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  mdb_async_req_t *done;
+  mdb_async_req_t *done_tail;
+  size_t done_count;
+} mdb_async_int_t;
+
+static mdb_status_t mdb_async_submit(mdb_async_int_t *ctx, bool write,
+                                     const char *key, char *buf,
+                                     size_t bufsiz, const void *value,
+                                     size_t size, mdb_async_cb_t callback,
+                                     void *arg);
+static void mdb_async_finish(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                             mdb_status_t status);
+static void mdb_async_run(mdb_async_int_t *ctx, mdb_async_req_t *req);
+static void *mdb_async_worker(void *arg);
+static bool mdb_ring_init(mdb_ring_t *ring, unsigned entries);
+static void mdb_ring_destroy(mdb_ring_t *ring);
+static mdb_status_t mdb_ring_enter(mdb_async_int_t *ctx, bool wait);
+static long mdb_ring_submit(mdb_ring_t *ring, bool wait);
+static bool mdb_ring_reap(mdb_ring_t *ring, mdb_async_req_t **req,
+                          int *res);
+static void mdb_ring_start(mdb_async_int_t *ctx, mdb_async_req_t *req);
+static void mdb_ring_restart(mdb_async_int_t *ctx, mdb_async_req_t *req);
+static void mdb_ring_read(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                          int fd, mdb_ptr_t offset, int iov_count);
+static void mdb_ring_read_index(mdb_async_int_t *ctx, mdb_async_req_t *req);
+static void mdb_ring_complete(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                              int res);
+static void mdb_ring_walked(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                            bool found);
+static bool mdb_ring_stale(mdb_int_t *db, mdb_async_req_t *req);
+
+mdb_status_t mdb_async_open(mdb_t handle, unsigned depth,
+                            mdb_async_t *async) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (depth == 0) {
+    depth = MDB_ASYNC_DEPTH_DEFAULT;
+  } else if (depth > MDB_ASYNC_DEPTH_MAX) {
+    depth = MDB_ASYNC_DEPTH_MAX;
+  }
+  mdb_async_int_t *ctx = (mdb_async_int_t*)calloc(1, sizeof(mdb_async_int_t));
+  if (ctx == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate async context");
+  }
+  ctx->db = db;
+  ctx->ring.fd = -1;
+  if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
+    free(ctx);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise async lock");
+  }
+  if (pthread_cond_init(&ctx->wake, NULL) != 0) {
+    (void)pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise async lock");
+  }
+  if (pthread_cond_init(&ctx->finished, NULL) != 0) {
+    (void)pthread_cond_destroy(&ctx->wake);
+    (void)pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise async lock");
+  }
+
+  /// the ring reads the files behind the back of everything but the bucket
+  /// heads, so it needs them unmapped, unlogged and not shared
+  bool ring_ok = db->pio && db->index_map == NULL && db->data_map == NULL
+                 && !db->wal.enabled && !db->shared;
+  if (ring_ok && mdb_ring_init(&ctx->ring, depth)) {
+    ctx->engine = MDB_ASYNC_URING;
+  } else if (db->thread_safe) {
+    ctx->engine = MDB_ASYNC_THREADS;
+    size_t count = depth < MDB_ASYNC_THREADS_MAX ? depth
+                                                 : MDB_ASYNC_THREADS_MAX;
+    ctx->threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+    if (ctx->threads == NULL) {
+      mdb_async_close((mdb_async_t)ctx);
+      return mdb_status(MDB_ERR_ALLOC, "cannot allocate async threads");
+    }
+    for (; ctx->thread_count < count; ctx->thread_count++) {
+      if (pthread_create(&ctx->threads[ctx->thread_count], NULL,
+                         mdb_async_worker, ctx) != 0) {
+        break;
+      }
+    }
+    if (ctx->thread_count == 0) {
+      mdb_async_close((mdb_async_t)ctx);
+      return mdb_status(MDB_ERR_ALLOC, "cannot start async threads");
+    }
+  } else {
+    ctx->engine = MDB_ASYNC_INLINE;
+  }
+  *async = (mdb_async_t)ctx;
+  return mdb_status(MDB_OK, NULL);
+}
+
+mdb_status_t mdb_read_async(mdb_async_t async, const char *key, char *buf,
+                            size_t bufsiz, mdb_async_cb_t callback,
+                            void *arg) {
+  return mdb_async_submit((mdb_async_int_t*)async, false, key, buf, bufsiz,
+                          NULL, 0, callback, arg);
+}
+
+mdb_status_t mdb_write_async(mdb_async_t async, const char *key,
+                             const void *value, size_t size,
+                             mdb_async_cb_t callback, void *arg) {
+  return mdb_async_submit((mdb_async_int_t*)async, true, key, NULL, 0,
+                          value, size, callback, arg);
+}
+
+mdb_status_t mdb_async_poll(mdb_async_t async, size_t min_complete,
+                            size_t *completed) {
+  mdb_async_int_t *ctx = (mdb_async_int_t*)async;
+  if (min_complete > ctx->outstanding) {
+    min_complete = ctx->outstanding;
+  }
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  if (ctx->engine == MDB_ASYNC_URING) {
+    status = mdb_ring_enter(ctx, false);
+    while (status.code == MDB_OK && ctx->done_count < min_complete) {
+      status = mdb_ring_enter(ctx, true);
+    }
+  }
+
+  (void)pthread_mutex_lock(&ctx->lock);
+  while (status.code == MDB_OK && ctx->done_count < min_complete) {
+    (void)pthread_cond_wait(&ctx->finished, &ctx->lock);
+  }
+  mdb_async_req_t *done = ctx->done;
+  ctx->done = ctx->done_tail = NULL;
+  ctx->done_count = 0;
+  (void)pthread_mutex_unlock(&ctx->lock);
+
+  /// callbacks may submit more requests, which wait for the next poll
+  size_t count = 0;
+  while (done != NULL) {
+    mdb_async_req_t *req = done;
+    done = req->next;
+    ctx->outstanding--;
+    count++;
+    req->callback(req->arg, req->status);
+    req->next = ctx->spare;
+    ctx->spare = req;
+  }
+  if (completed != NULL) {
+    *completed = count;
+  }
+  return status;
+}
+
+uint8_t mdb_async_engine(mdb_async_t async) {
+  return ((mdb_async_int_t*)async)->engine;
+}
+
+void mdb_async_close(mdb_async_t async) {
+  mdb_async_int_t *ctx = (mdb_async_int_t*)async;
+  while (ctx->outstanding != 0) {
+    if (mdb_async_poll(async, ctx->outstanding, NULL).code != MDB_OK) {
+      break;
+    }
+  }
+  if (ctx->thread_count != 0) {
+    (void)pthread_mutex_lock(&ctx->lock);
+    ctx->stop = true;
+    (void)pthread_cond_broadcast(&ctx->wake);
+    (void)pthread_mutex_unlock(&ctx->lock);
+    for (size_t i = 0; i < ctx->thread_count; i++) {
+      (void)pthread_join(ctx->threads[i], NULL);
+    }
+  }
+  free(ctx->threads);
+  mdb_ring_destroy(&ctx->ring);
+  while (ctx->spare != NULL) {
+    mdb_async_req_t *req = ctx->spare;
+    ctx->spare = req->next;
+    free(req);
+  }
+  (void)pthread_cond_destroy(&ctx->finished);
+  (void)pthread_cond_destroy(&ctx->wake);
+  (void)pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+static mdb_status_t mdb_async_submit(mdb_async_int_t *ctx, bool write,
+                                     const char *key, char *buf,
+                                     size_t bufsiz, const void *value,
+                                     size_t size, mdb_async_cb_t callback,
+                                     void *arg) {
+  mdb_int_t *db = ctx->db;
+  size_t key_size = strlen(key);
+  if (key_size > db->options.key_size_max) {
+    return mdb_status(MDB_ERR_KEY_SIZE, "key size too large");
+  }
+  mdb_async_req_t *req = ctx->spare;
+  if (req != NULL) {
+    ctx->spare = req->next;
+  } else {
+    size_t index_size = sizeof(mdb_index_t) + db->options.key_size_max + 1;
+    req = (mdb_async_req_t*)malloc(sizeof(mdb_async_req_t) + index_size
+                                   + db->options.key_size_max + 1);
+    if (req == NULL) {
+      return mdb_status(MDB_ERR_ALLOC, "cannot allocate async request");
+    }
+    req->index = (mdb_index_t*)(req + 1);
+    req->key = (char*)req->index + index_size;
+  }
+  req->next = NULL;
+  req->write = write;
+  req->callback = callback;
+  req->arg = arg;
+  req->buf = buf;
+  req->bufsiz = bufsiz;
+  req->value = value;
+  req->size = size;
+  req->restarts = 0;
+  memcpy(req->key, key, key_size + 1);
+  ctx->outstanding++;
+
+  switch (ctx->engine) {
+  case MDB_ASYNC_URING:
+    req->hash = mdb_hash(db, key);
+    if (!write) {
+      mdb_stat_add(&db->stats.reads, 1);
+      mdb_status_t cache_status;
+      if (mdb_cache_get(&db->cache, key, req->hash, buf, bufsiz,
+                        &cache_status)) {
+        mdb_async_finish(ctx, req, cache_status);
+        break;
+      }
+    }
+    mdb_ring_start(ctx, req);
+    break;
+  case MDB_ASYNC_THREADS:
+    (void)pthread_mutex_lock(&ctx->lock);
+    if (ctx->work_tail != NULL) {
+      ctx->work_tail->next = req;
+    } else {
+      ctx->work = req;
+    }
+    ctx->work_tail = req;
+    (void)pthread_cond_signal(&ctx->wake);
+    (void)pthread_mutex_unlock(&ctx->lock);
+    break;
+  default:
+    mdb_async_run(ctx, req);
+    break;
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_async_finish(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                             mdb_status_t status) {
+  req->status = status;
+  req->next = NULL;
+  (void)pthread_mutex_lock(&ctx->lock);
+  if (ctx->done_tail != NULL) {
+    ctx->done_tail->next = req;
+  } else {
+    ctx->done = req;
+  }
+  ctx->done_tail = req;
+  ctx->done_count++;
+  (void)pthread_cond_signal(&ctx->finished);
+  (void)pthread_mutex_unlock(&ctx->lock);
+}
+
+/// the synchronous call a request stands for
+static void mdb_async_run(mdb_async_int_t *ctx, mdb_async_req_t *req) {
+  mdb_t handle = (mdb_t)ctx->db;
+  mdb_status_t status =
+      req->write ? mdb_write_n(handle, req->key, req->value, req->size)
+                 : mdb_read(handle, req->key, req->buf, req->bufsiz);
+  mdb_async_finish(ctx, req, status);
+}
+
+static void *mdb_async_worker(void *arg) {
+  mdb_async_int_t *ctx = (mdb_async_int_t*)arg;
+  (void)pthread_mutex_lock(&ctx->lock);
+  for (;;) {
+    while (ctx->work == NULL && !ctx->stop) {
+      (void)pthread_cond_wait(&ctx->wake, &ctx->lock);
+    }
+    mdb_async_req_t *req = ctx->work;
+    if (req == NULL) {
+      break;
+    }
+    ctx->work = req->next;
+    if (ctx->work == NULL) {
+      ctx->work_tail = NULL;
+    }
+    (void)pthread_mutex_unlock(&ctx->lock);
+    mdb_async_run(ctx, req);
+    (void)pthread_mutex_lock(&ctx->lock);
+  }
+  (void)pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+/// a lookup takes the table and its stripe just long enough to find the
+/// head of its chain, and notes the sequence numbers it saw
+static void mdb_ring_start(mdb_async_int_t *ctx, mdb_async_req_t *req) {
+  mdb_int_t *db = ctx->db;
+  mdb_lock_table(db, false);
+  if (!req->write && !mdb_bloom_check(&db->bloom, req->hash)) {
+    mdb_unlock_table(db);
+    mdb_async_finish(ctx, req, mdb_status(MDB_NO_KEY, "Key not found"));
+    return;
+  }
+  req->bucket = mdb_bucket_of(db, req->hash);
+  mdb_lock_bucket(db, req->bucket, false);
+  req->table_seq = __atomic_load_n(&db->table_seq, __ATOMIC_SEQ_CST);
+  req->stripe_seq = __atomic_load_n(
+      &db->stripe_seq[req->bucket % MDB_LOCK_STRIPES], __ATOMIC_SEQ_CST);
+  req->fd_index = db->fd_index;
+  req->fd_data = db->fd_data;
+  mdb_status_t status = mdb_read_bucket(db, req->bucket, &req->ptr);
+  mdb_unlock_bucket(db, req->bucket);
+  mdb_unlock_table(db);
+  if (status.code != MDB_OK) {
+    mdb_async_finish(ctx, req, status);
+    return;
+  }
+
+  req->hops = 0;
+  req->reading_value = false;
+  if (req->ptr == 0) {
+    mdb_ring_walked(ctx, req, false);
+  } else {
+    mdb_ring_read_index(ctx, req);
+  }
+}
+
+/// a lookup that keeps losing to writers is done the blocking way
+static void mdb_ring_restart(mdb_async_int_t *ctx, mdb_async_req_t *req) {
+  if (++req->restarts > MDB_ASYNC_RESTARTS_MAX) {
+    mdb_async_run(ctx, req);
+  } else {
+    mdb_ring_start(ctx, req);
+  }
+}
+
+static bool mdb_ring_stale(mdb_int_t *db, mdb_async_req_t *req) {
+  uint64_t stripe_seq = __atomic_load_n(
+      &db->stripe_seq[req->bucket % MDB_LOCK_STRIPES], __ATOMIC_SEQ_CST);
+  return stripe_seq != req->stripe_seq
+         || __atomic_load_n(&db->table_seq, __ATOMIC_SEQ_CST)
+            != req->table_seq;
+}
+
+static void mdb_ring_read_index(mdb_async_int_t *ctx, mdb_async_req_t *req) {
+  mdb_int_t *db = ctx->db;
+  if (req->ptr + db->index_record_size > mdb_index_end(db)) {
+    if (req->write) {
+      mdb_ring_walked(ctx, req, false);
+    } else if (mdb_ring_stale(db, req)) {
+      mdb_ring_restart(ctx, req);
+    } else {
+      mdb_async_finish(ctx, req, mdb_status(MDB_ERR_READ,
+                                            "index ptr out of range"));
+    }
+    return;
+  }
+  mdb_index_t *index = req->index;
+  req->iov[0].iov_base = &(index->next_ptr);
+  req->iov[0].iov_len = MDB_PTR_SIZE;
+  req->iov[1].iov_base = &(index->hash);
+  req->iov[1].iov_len = MDB_HASH_SIZE;
+  req->iov[2].iov_base = index->key;
+  req->iov[2].iov_len = db->options.key_size_max;
+  req->iov[3].iov_base = &(index->value_ptr);
+  req->iov[3].iov_len = MDB_PTR_SIZE;
+  req->iov[4].iov_base = &(index->value_size);
+  req->iov[4].iov_len = MDB_DATALEN_SIZE;
+  mdb_stat_io(db, false, db->index_record_size);
+  mdb_ring_read(ctx, req, req->fd_index, req->ptr, 5);
+}
+
+/// queues a read for the next io_uring_enter, or in line behind the others
+/// when every ring entry is taken
+static void mdb_ring_read(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                          int fd, mdb_ptr_t offset, int iov_count) {
+  req->fd = fd;
+  req->offset = offset;
+  req->iov_count = iov_count;
+  mdb_ring_t *ring = &ctx->ring;
+  if (ring->queued + ring->inflight == ring->entries) {
+    req->next = NULL;
+    if (ctx->waiting_tail != NULL) {
+      ctx->waiting_tail->next = req;
+    } else {
+      ctx->waiting = req;
+    }
+    ctx->waiting_tail = req;
+    return;
+  }
+#ifdef MDB_HAVE_URING
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + slot;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)req->iov;
+  sqe->len = (uint32_t)iov_count;
+  sqe->off = offset;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+#endif
+}
+
+/// hands the queued reads to the kernel, waiting for one to complete if
+/// asked, then moves every completed request on to its next step
+static mdb_status_t mdb_ring_enter(mdb_async_int_t *ctx, bool wait) {
+  mdb_ring_t *ring = &ctx->ring;
+  if (ring->queued + ring->inflight == 0) {
+    wait = false;
+  }
+  if (ring->queued != 0 || wait) {
+    long submitted = mdb_ring_submit(ring, wait);
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN
+        && errno != EBUSY) {
+      return mdb_status(MDB_ERR_READ, "io_uring_enter failed");
+    }
+    if (submitted > 0) {
+      ring->queued -= (unsigned)submitted;
+      ring->inflight += (unsigned)submitted;
+    }
+  }
+
+  mdb_async_req_t *req;
+  int res;
+  while (mdb_ring_reap(ring, &req, &res)) {
+    ring->inflight--;
+    mdb_ring_complete(ctx, req, res);
+    while (ctx->waiting != NULL
+           && ring->queued + ring->inflight < ring->entries) {
+      mdb_async_req_t *next = ctx->waiting;
+      ctx->waiting = next->next;
+      if (ctx->waiting == NULL) {
+        ctx->waiting_tail = NULL;
+      }
+      mdb_ring_read(ctx, next, next->fd, next->offset, next->iov_count);
+    }
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static long mdb_ring_submit(mdb_ring_t *ring, bool wait) {
+#ifdef MDB_HAVE_URING
+  return syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+#else
+  (void)ring;
+  (void)wait;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/// takes the next completion off the ring, if there is one
+static bool mdb_ring_reap(mdb_ring_t *ring, mdb_async_req_t **req,
+                          int *res) {
+#ifdef MDB_HAVE_URING
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+  *req = (mdb_async_req_t*)(uintptr_t)cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+#else
+  (void)ring;
+  (void)req;
+  (void)res;
+  return false;
+#endif
+}
+
+/// the read of an index record or value on behalf of @p req is done. Reads
+/// check the sequence numbers after every step and start over from the
+/// bucket head when a writer has been at the chain since it began.
+static void mdb_ring_complete(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                              int res) {
+  mdb_int_t *db = ctx->db;
+  if (req->reading_value) {
+    if (res < 0 || (size_t)res != req->iov[0].iov_len) {
+      if (mdb_ring_stale(db, req)) {
+        mdb_ring_restart(ctx, req);
+      } else {
+        mdb_async_finish(ctx, req, mdb_status(MDB_ERR_READ,
+                                              "cannot read data"));
+      }
+      return;
+    }
+    mdb_ring_walked(ctx, req, true);
+    return;
+  }
+
+  if (res < 0 || (size_t)res != db->index_record_size) {
+    if (req->write) {
+      mdb_ring_walked(ctx, req, false);
+    } else if (mdb_ring_stale(db, req)) {
+      mdb_ring_restart(ctx, req);
+    } else {
+      mdb_async_finish(ctx, req, mdb_status(MDB_ERR_READ,
+                                            "cannot read index record"));
+    }
+    return;
+  }
+  if (!req->write && mdb_ring_stale(db, req)) {
+    mdb_ring_restart(ctx, req);
+    return;
+  }
+  req->hops++;
+  mdb_index_t *index = req->index;
+  index->key[db->options.key_size_max] = '\0';
+  if (index->hash != req->hash || strcmp(index->key, req->key) != 0) {
+    if (index->next_ptr == 0) {
+      mdb_ring_walked(ctx, req, false);
+    } else {
+      req->ptr = index->next_ptr;
+      mdb_ring_read_index(ctx, req);
+    }
+    return;
+  }
+
+  if (req->write) {
+    mdb_ring_walked(ctx, req, true);
+    return;
+  }
+  if (req->bufsiz < (size_t)index->value_size + 1) {
+    mdb_async_finish(ctx, req, mdb_status(MDB_ERR_BUFSIZ,
+                                          "value buffer size too small"));
+    return;
+  }
+  if ((size_t)index->value_ptr + index->value_size > mdb_data_end(db)) {
+    mdb_async_finish(ctx, req, mdb_status(MDB_ERR_READ,
+                                          "data ptr out of range"));
+    return;
+  }
+  req->reading_value = true;
+  req->iov[0].iov_base = req->buf;
+  req->iov[0].iov_len = index->value_size;
+  if (index->value_size == 0) {
+    mdb_ring_walked(ctx, req, true);
+    return;
+  }
+  mdb_stat_io(db, false, index->value_size);
+  mdb_ring_read(ctx, req, req->fd_data, index->value_ptr, 1);
+}
+
+/// the end of a walk. A write only read the chain to have it in the page
+/// cache and is applied now; a lookup checks, under the locks a
+/// synchronous one would hold, that no writer got in since it began.
+static void mdb_ring_walked(mdb_async_int_t *ctx, mdb_async_req_t *req,
+                            bool found) {
+  mdb_int_t *db = ctx->db;
+  if (req->write) {
+    mdb_async_run(ctx, req);
+    return;
+  }
+  mdb_lock_table(db, false);
+  mdb_lock_bucket(db, req->bucket, false);
+  bool stale = mdb_ring_stale(db, req);
+  if (!stale) {
+    mdb_stat_chain(db, req->hops);
+    if (found) {
+      req->buf[req->index->value_size] = '\0';
+      mdb_cache_put(&db->cache, req->key, req->hash, req->buf,
+                    req->index->value_size);
+    } else {
+      mdb_bloom_miss(&db->bloom, 1);
+    }
+  }
+  mdb_unlock_bucket(db, req->bucket);
+  mdb_unlock_table(db);
+
+  if (stale) {
+    mdb_ring_restart(ctx, req);
+  } else if (found) {
+    mdb_async_finish(ctx, req, mdb_status(MDB_OK, NULL));
+  } else {
+    mdb_async_finish(ctx, req, mdb_status(MDB_NO_KEY, "Key not found"));
+  }
+}
+
+static bool mdb_ring_init(mdb_ring_t *ring, unsigned entries) {
+#ifdef MDB_HAVE_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+  ring->sq_map_size = params.sq_off.array
+                      + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = params.cq_off.cqes
+                      + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring->cq_map_size > ring->sq_map_size) {
+    ring->sq_map_size = ring->cq_map_size;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    mdb_ring_destroy(ring);
+    return false;
+  }
+  if (single) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      mdb_ring_destroy(ring);
+      return false;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd,
+                                          IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    mdb_ring_destroy(ring);
+    return false;
+  }
+
+  uint8_t *sq = (uint8_t*)ring->sq_map;
+  uint8_t *cq = (uint8_t*)ring->cq_map;
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return true;
+#else
+  (void)ring;
+  (void)entries;
+  return false;
+#endif
+}
+
+static void mdb_ring_destroy(mdb_ring_t *ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  if (ring->sq_map != NULL) {
+    munmap(ring->sq_map, ring->sq_map_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+}
+
+mdb_status_t mdb_compact(mdb_t handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (db->shared) {
+    return mdb_status(MDB_ERR_LOGIC,
+                      "compaction is not supported in shared mode");
+  }
+  /// the rewrite reads the files directly, so the log is emptied first
+  mdb_begin(db);
+  mdb_lock_table(db, true);
+  mdb_status_t status = db->wal.enabled ? mdb_wal_checkpoint(db)
+                                        : mdb_status(MDB_OK, NULL);
+  if (status.code == MDB_OK) {
+    status = mdb_compact_rewrite(db);
+  }
+  mdb_unlock_table(db);
+  mdb_status_t commit_status = mdb_commit(db);
+  STAT_CHECK_RET(status, {;});
+  return commit_status;
+}
+
+mdb_status_t mdb_compact_step(mdb_t handle, size_t budget, bool *done) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (db->shared) {
+    return mdb_status(MDB_ERR_LOGIC,
+                      "compaction is not supported in shared mode");
+  }
+
+  mdb_begin(db);
+  mdb_lock_table(db, true);
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  if (!db->compacting) {
+    /// a pass starts from a freelist in address order, so that records are
+    /// moved into the lowest free slots first
+    status = mdb_compact_trim(db);
+    db->compacting = status.code == MDB_OK;
+    db->compact_bucket = 0;
+  }
+  size_t visited = 0;
+  while (status.code == MDB_OK && visited < budget
+         && db->compact_bucket < mdb_bucket_count(db)) {
+    status = mdb_compact_chain(db, db->compact_bucket, &visited);
+    if (status.code == MDB_OK) {
+      db->compact_bucket++;
+    }
+  }
+  bool finished = status.code == MDB_OK
+                  && db->compact_bucket >= mdb_bucket_count(db);
+  if (finished) {
+    status = mdb_compact_trim(db);
+    db->compacting = false;
+  }
+  mdb_unlock_table(db);
+  mdb_status_t commit_status = mdb_commit(db);
+
+  if (done != NULL) {
+    *done = finished && status.code == MDB_OK && commit_status.code == MDB_OK;
+  }
+  STAT_CHECK_RET(status, {;});
+  return commit_status;
+}
+
+mdb_options_t mdb_get_options(mdb_t handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  return db->options;
+}
+
+mdb_filter_stats_t mdb_get_filter_stats(mdb_t handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  mdb_filter_stats_t stats = { 0 };
+  mdb_bloom_t *bloom = &db->bloom;
+  stats.lookups = __atomic_load_n(&bloom->lookups, __ATOMIC_RELAXED);
+  stats.negatives = __atomic_load_n(&bloom->negatives, __ATOMIC_RELAXED);
+  stats.false_positives = __atomic_load_n(&bloom->false_positives,
+                                          __ATOMIC_RELAXED);
+  if (stats.negatives + stats.false_positives != 0) {
+    stats.false_positive_rate =
+        (double)stats.false_positives
+        / (double)(stats.negatives + stats.false_positives);
+  }
+  stats.bytes = (uint64_t)bloom->block_count * 8 * sizeof(uint32_t);
+  return stats;
+}
+
+mdb_cache_stats_t mdb_get_cache_stats(mdb_t handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  mdb_cache_stats_t stats = { 0 };
+  if (db->cache.shard_budget == 0) {
+    return stats;
+  }
+  for (size_t i = 0; i < MDB_CACHE_SHARDS; i++) {
+    mdb_cache_shard_t *shard = db->cache.shards + i;
+    if (db->cache.locked) {
+      (void)pthread_mutex_lock(&shard->lock);
+    }
+    stats.hits += shard->hits;
+    stats.misses += shard->misses;
+    stats.entries += shard->count;
+    stats.bytes += shard->bytes;
+    if (db->cache.locked) {
+      (void)pthread_mutex_unlock(&shard->lock);
+    }
+  }
+  return stats;
+}
+
+mdb_stats_t mdb_get_stats(mdb_t handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  mdb_stats_t stats = { 0 };
+  /// every field is a uint64_t counter
+  const uint64_t *from = (const uint64_t*)&db->stats;
+  uint64_t *to = (uint64_t*)&stats;
+  for (size_t i = 0; i < sizeof(mdb_stats_t) / sizeof(uint64_t); i++) {
+    to[i] = __atomic_load_n(from + i, __ATOMIC_RELAXED);
+  }
+  mdb_lock_alloc(db);
+  stats.alloc_steps = db->free_map.steps;
+  mdb_unlock_alloc(db);
+
+  mdb_cache_stats_t cache = mdb_get_cache_stats(handle);
+  stats.cache_hits = cache.hits;
+  stats.cache_misses = cache.misses;
+  mdb_filter_stats_t filter = mdb_get_filter_stats(handle);
+  stats.filter_negatives = filter.negatives;
+  stats.filter_false_positives = filter.false_positives;
+  return stats;
+}
+
+/// one inspection thread's share: the chains of buckets [begin, end), and
+/// what was found on them
+typedef struct {
+  mdb_int_t *db;
+  int fd;
+  uint32_t begin;
+  uint32_t end;
+  /// chains longer than the index file has records for can only be cycles
+  uint64_t records_max;
+  uint64_t items;
+  uint64_t chain_histogram[MDB_INSPECT_CHAIN_BINS];
+  uint64_t chain_max;
+  /// live values as (offset, size) pairs
+  mdb_ptr_t *live;
+  size_t live_count;
+  size_t live_cap;
+  mdb_status_t status;
+} mdb_inspect_part_t;
+
+mdb_status_t mdb_inspect(mdb_t handle, unsigned threads,
+                         mdb_inspect_t *report) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  memset(report, 0, sizeof(mdb_inspect_t));
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (unsigned)cpus : 1;
+  }
+
+  mdb_status_t status = mdb_lock_all(db);
+  STAT_CHECK_RET(status, {;});
+  /// the chains are read with pread from every thread at once, which only
+  /// sees what stdio has written out
+  if (!db->pio && db->index_map == NULL
+      && mdb_flush_file(db, db->fp_index) != 0) {
+    mdb_unlock_all(db);
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  int fd = db->pio ? db->fd_index : fileno(db->fp_index);
+  uint32_t bucket_count = mdb_bucket_count(db);
+  report->hash_buckets = db->options.hash_buckets;
+  report->buckets = bucket_count;
+  report->index_bytes = mdb_index_size((mdb_t*)db);
+  report->data_bytes = mdb_data_size((mdb_t*)db);
+
+  /// ranges of at least 1024 buckets, so small tables are not spread thin
+  uint32_t part_count = (bucket_count + 1023) / 1024;
+  if (part_count > threads) {
+    part_count = threads;
+  }
+  if (part_count == 0) {
+    part_count = 1;
+  }
+  mdb_inspect_part_t *parts =
+      (mdb_inspect_part_t*)calloc(part_count, sizeof(mdb_inspect_part_t));
+  pthread_t *tids = (pthread_t*)calloc(part_count, sizeof(pthread_t));
+  bool *started = (bool*)calloc(part_count, sizeof(bool));
+  if (parts == NULL || tids == NULL || started == NULL) {
+    free(parts);
+    free(tids);
+    free(started);
+    mdb_unlock_all(db);
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate inspection state");
+  }
+  for (uint32_t i = 0; i < part_count; i++) {
+    parts[i].db = db;
+    parts[i].fd = fd;
+    parts[i].records_max = report->index_bytes / db->index_record_size;
+    parts[i].begin = (uint32_t)((uint64_t)bucket_count * i / part_count);
+    parts[i].end = (uint32_t)((uint64_t)bucket_count * (i + 1) / part_count);
+    parts[i].status = mdb_status(MDB_OK, NULL);
+  }
+  /// the calling thread walks the last range, and any range no thread
+  /// could be started for, while the others run
+  for (uint32_t i = 0; i + 1 < part_count; i++) {
+    started[i] = pthread_create(tids + i, NULL, mdb_inspect_range,
+                                parts + i) == 0;
+  }
+  for (uint32_t i = 0; i < part_count; i++) {
+    if (!started[i]) {
+      (void)mdb_inspect_range(parts + i);
+    }
+  }
+  for (uint32_t i = 0; i < part_count; i++) {
+    if (started[i]) {
+      (void)pthread_join(tids[i], NULL);
+    }
+  }
+
+  size_t live_count = 0;
+  for (uint32_t i = 0; i < part_count; i++) {
+    if (status.code == MDB_OK) {
+      status = parts[i].status;
+    }
+    live_count += parts[i].live_count;
+  }
+  mdb_ptr_t *live = NULL;
+  if (status.code == MDB_OK && live_count != 0) {
+    live = (mdb_ptr_t*)malloc(sizeof(mdb_ptr_t) * 2 * live_count);
+    if (live == NULL) {
+      status = mdb_status(MDB_ERR_ALLOC, "cannot allocate extent buffer");
+    }
+  }
+  size_t live_at = 0;
+  for (uint32_t i = 0; i < part_count; i++) {
+    mdb_inspect_part_t *part = parts + i;
+    if (live != NULL) {
+      memcpy(live + live_at * 2, part->live,
+             sizeof(mdb_ptr_t) * 2 * part->live_count);
+      live_at += part->live_count;
+    }
+    report->items += part->items;
+    for (size_t bin = 0; bin < MDB_INSPECT_CHAIN_BINS; bin++) {
+      report->chain_histogram[bin] += part->chain_histogram[bin];
+    }
+    if (part->chain_max > report->chain_max) {
+      report->chain_max = part->chain_max;
+    }
+    free(part->live);
+  }
+  free(parts);
+  free(tids);
+  free(started);
+
+  /// the freelist is bounded by the records the index file holds, which
+  /// also stops a walk around a damaged, cyclic list
+  mdb_ptr_t ptr = 0;
+  if (status.code == MDB_OK) {
+    status = mdb_read_nextptr(db, 0, &ptr);
+  }
+  while (status.code == MDB_OK && ptr != 0) {
+    if (report->freelist_length
+        == report->index_bytes / db->index_record_size) {
+      status = mdb_status(MDB_ERR_FORMAT, "index freelist loops");
+      break;
+    }
+    report->freelist_length++;
+    status = mdb_read_nextptr(db, ptr, &ptr);
+  }
+  mdb_unlock_all(db);
+  if (status.code != MDB_OK) {
+    free(live);
+    return status;
+  }
+
+  if (live_count != 0) {
+    qsort(live, live_count, sizeof(mdb_ptr_t) * 2, mdb_extent_cmp);
+  }
+  uint64_t cursor = 0;
+  for (size_t i = 0; i <= live_count; i++) {
+    uint64_t begin = i < live_count ? live[i * 2] : report->data_bytes;
+    if (begin > cursor) {
+      report->free_bytes += begin - cursor;
+      report->free_extents++;
+      if (begin - cursor > report->largest_free_extent) {
+        report->largest_free_extent = begin - cursor;
+      }
+    }
+    if (i < live_count) {
+      report->live_bytes += live[i * 2 + 1];
+      if ((uint64_t)live[i * 2] + live[i * 2 + 1] > cursor) {
+        cursor = (uint64_t)live[i * 2] + live[i * 2 + 1];
+      }
+    }
+  }
+  free(live);
+
+  report->load_factor = (double)report->items / bucket_count;
+  report->base_load_factor = (double)report->items / report->hash_buckets;
+  report->suggested_buckets = 16;
+  while (report->suggested_buckets < report->items
+         && report->suggested_buckets < ((uint32_t)1 << 30)) {
+    report->suggested_buckets *= 2;
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void *mdb_inspect_range(void *arg) {
+  mdb_inspect_part_t *part = (mdb_inspect_part_t*)arg;
+  mdb_int_t *db = part->db;
+  uint8_t *record = (uint8_t*)malloc(db->index_record_size);
+  mdb_index_t *index = (mdb_index_t*)malloc(sizeof(mdb_index_t)
+                                            + db->options.key_size_max + 1);
+  if (record == NULL || index == NULL) {
+    part->status = mdb_status(MDB_ERR_ALLOC, "cannot allocate record buffer");
+  }
+
+  for (uint32_t bucket = part->begin;
+       bucket < part->end && part->status.code == MDB_OK; bucket++) {
+    mdb_ptr_t ptr;
+    part->status = mdb_read_bucket(db, bucket, &ptr);
+    uint64_t length = 0;
+    while (part->status.code == MDB_OK && ptr != 0) {
+      if (length == part->records_max) {
+        part->status = mdb_status(MDB_ERR_FORMAT, "index chain loops");
+      } else if (db->wal.enabled
+                 ? !mdb_wal_read(db, MDB_WAL_INDEX, ptr, record,
+                                 db->index_record_size)
+                 : !mdb_pread_all(part->fd, record, db->index_record_size,
+                                  ptr)) {
+        part->status = mdb_status(MDB_ERR_READ, "cannot read index record");
+      } else if (part->live_count == part->live_cap) {
+        size_t live_cap = part->live_cap != 0 ? part->live_cap * 2 : 64;
+        mdb_ptr_t *live = (mdb_ptr_t*)realloc(part->live,
+                                              sizeof(mdb_ptr_t) * 2
+                                              * live_cap);
+        if (live == NULL) {
+          part->status = mdb_status(MDB_ERR_ALLOC,
+                                    "cannot allocate extent buffer");
+        } else {
+          part->live = live;
+          part->live_cap = live_cap;
+        }
+      }
+      if (part->status.code != MDB_OK) {
+        break;
+      }
+      mdb_decode_index(db, record, index);
+      part->live[part->live_count * 2] = index->value_ptr;
+      part->live[part->live_count * 2 + 1] = index->value_size;
+      part->live_count += index->value_size != 0;
+      length++;
+      ptr = index->next_ptr;
+    }
+    part->items += length;
+    part->chain_histogram[length < MDB_INSPECT_CHAIN_BINS
+                          ? length : MDB_INSPECT_CHAIN_BINS - 1]++;
+    if (length > part->chain_max) {
+      part->chain_max = length;
+    }
+  }
+  free(record);
+  free(index);
+  return NULL;
+}
+
+/// the sizes in use, not counting preallocated space; in shared mode other
+/// processes may have grown the files, so those are asked for
+size_t mdb_index_size(mdb_t *handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (db->shared) {
+    struct stat st;
+    return fstat(db->fd_index, &st) == 0 ? (size_t)st.st_size : 0;
+  }
+  return mdb_index_end(db);
+}
+
+size_t mdb_data_size(mdb_t *handle) {
+  mdb_int_t *db = (mdb_int_t*)handle;
+  if (db->shared) {
+    struct stat st;
+    return fstat(db->fd_data, &st) == 0 ? (size_t)st.st_size : 0;
+  }
+  return mdb_data_end(db);
+}
+
+static mdb_status_t mdb_find_key(mdb_int_t *db, const char *key,
+                                 uint32_t hash, mdb_index_t *index,
+                                 mdb_ptr_t *ptr, mdb_ptr_t *save_ptr) {
+  uint32_t bucket = mdb_bucket_of(db, hash);
+  *save_ptr = mdb_bucket_slot(db, bucket);
+  mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, ptr);
+  STAT_CHECK_RET(bucket_read_status, {;});
+
+  uint64_t hops = 0;
+  while (*ptr != 0) {
+    hops++;
+    mdb_ptr_t next_ptr;
+    uint32_t record_hash;
+    mdb_status_t head_read_status = mdb_read_index_head(db, *ptr, &next_ptr,
+                                                        &record_hash);
+    STAT_CHECK_RET(head_read_status, {;});
+    if (record_hash == hash) {
+      mdb_status_t index_read_status = mdb_read_index(db, *ptr, index);
+      STAT_CHECK_RET(index_read_status, {;});
+      if (strcmp(index->key, key) == 0) {
+        mdb_stat_chain(db, hops);
+        return mdb_status(MDB_OK, NULL);
+      }
+    }
+    *save_ptr = *ptr;
+    *ptr = next_ptr;
+  }
+  mdb_stat_chain(db, hops);
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// mdb_find_key for callers that only care about a record that is there:
+/// keys the filter rules out are reported missing without touching the
+/// index, and @p save_ptr is then left alone
+static mdb_status_t mdb_lookup_key(mdb_int_t *db, const char *key,
+                                   uint32_t hash, mdb_index_t *index,
+                                   mdb_ptr_t *ptr, mdb_ptr_t *save_ptr) {
+  if (!mdb_bloom_check(&db->bloom, hash)) {
+    *ptr = 0;
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_status_t find_status = mdb_find_key(db, key, hash, index, ptr,
+                                          save_ptr);
+  if (find_status.code == MDB_OK && *ptr == 0) {
+    mdb_bloom_miss(&db->bloom, 1);
+  }
+  return find_status;
+}
+
+/// in thread safe mode the files grow under the alloc lock while readers
+/// range check their pointers, so the ends are read atomically
+static mdb_ptr_t mdb_index_end(mdb_int_t *db) {
+  return __atomic_load_n(&db->index_end, __ATOMIC_ACQUIRE);
+}
+
+static mdb_ptr_t mdb_data_end(mdb_int_t *db) {
+  return __atomic_load_n(&db->data_end, __ATOMIC_ACQUIRE);
+}
+
+static mdb_status_t mdb_read_bucket(mdb_int_t *db, uint32_t bucket,
+                                    mdb_ptr_t *ptr) {
+  if (db->shared) {
+    return mdb_read_nextptr(db, mdb_bucket_slot(db, bucket), ptr);
+  }
+  *ptr = db->heads[bucket + 1];
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_read_index_head(mdb_int_t *db, mdb_ptr_t idxptr,
+                                        mdb_ptr_t *nextptr, uint32_t *hash) {
+  if (db->index_map != NULL) {
+    if (idxptr + db->index_record_size > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_READ, "index ptr out of range");
+    }
+    memcpy(nextptr, db->index_map + idxptr, MDB_PTR_SIZE);
+    memcpy(hash, db->index_map + idxptr + MDB_PTR_SIZE, MDB_HASH_SIZE);
+    return mdb_status(MDB_OK, NULL);
+  }
+  uint32_t head[2];
+  if (db->wal.enabled) {
+    if (!mdb_wal_read(db, MDB_WAL_INDEX, idxptr, head, sizeof(head))) {
+      return mdb_status(MDB_ERR_READ, "cannot read index head");
+    }
+    *nextptr = head[0];
+    *hash = head[1];
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_stat_io(db, false, sizeof(head));
+  if (db->pio) {
+    if (!mdb_pread_all(db->fd_index, head, sizeof(head), idxptr)) {
+      return mdb_status(MDB_ERR_READ, "cannot read index head");
+    }
+  } else {
+    if (fseek(db->fp_index, (long)idxptr, SEEK_SET) != 0) {
+      return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+    }
+    if (fread(head, sizeof(uint32_t), 2, db->fp_index) != 2) {
+      return mdb_status(MDB_ERR_READ, "cannot read index head");
+    }
+  }
+  *nextptr = head[0];
+  *hash = head[1];
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_decode_index(mdb_int_t *db, const uint8_t *record,
+                             mdb_index_t *index) {
+  memcpy(&(index->next_ptr), record, MDB_PTR_SIZE);
+  memcpy(&(index->hash), record + MDB_PTR_SIZE, MDB_HASH_SIZE);
+  record += MDB_PTR_SIZE + MDB_HASH_SIZE;
+  memcpy(index->key, record, db->options.key_size_max);
+  index->key[db->options.key_size_max] = '\0';
+  record += db->options.key_size_max;
+  memcpy(&(index->value_ptr), record, MDB_PTR_SIZE);
+  memcpy(&(index->value_size), record + MDB_PTR_SIZE, MDB_DATALEN_SIZE);
+}
+
+static void mdb_encode_index(mdb_int_t *db, const mdb_index_t *index,
+                             uint8_t *record) {
+  memset(record, 0, db->index_record_size);
+  memcpy(record, &(index->next_ptr), MDB_PTR_SIZE);
+  memcpy(record + MDB_PTR_SIZE, &(index->hash), MDB_HASH_SIZE);
+  record += MDB_PTR_SIZE + MDB_HASH_SIZE;
+  memcpy(record, index->key, strlen(index->key));
+  record += db->options.key_size_max;
+  memcpy(record, &(index->value_ptr), MDB_PTR_SIZE);
+  memcpy(record + MDB_PTR_SIZE, &(index->value_size), MDB_DATALEN_SIZE);
+}
+
+static mdb_status_t mdb_read_index(mdb_int_t *db, mdb_ptr_t idxptr,
+                                   mdb_index_t *index) {
+  if (db->index_map != NULL) {
+    if (idxptr + db->index_record_size > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_READ, "index ptr out of range");
+    }
+    mdb_decode_index(db, db->index_map + idxptr, index);
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (db->wal.enabled) {
+    uint8_t *record = alloca(db->index_record_size);
+    if (!mdb_wal_read(db, MDB_WAL_INDEX, idxptr, record,
+                      db->index_record_size)) {
+      return mdb_status(MDB_ERR_READ, "cannot read index record");
+    }
+    mdb_decode_index(db, record, index);
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_stat_io(db, false, db->index_record_size);
+  if (db->pio) {
+    /// the fields are scattered straight into place by a single call
+    struct iovec iov[5] = {
+      { &(index->next_ptr), MDB_PTR_SIZE },
+      { &(index->hash), MDB_HASH_SIZE },
+      { index->key, db->options.key_size_max },
+      { &(index->value_ptr), MDB_PTR_SIZE },
+      { &(index->value_size), MDB_DATALEN_SIZE }
+    };
+    if (!mdb_preadv_all(db->fd_index, iov, 5, idxptr)) {
+      return mdb_status(MDB_ERR_READ, "cannot read index record");
+    }
+    index->key[db->options.key_size_max] = '\0';
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_index, (long)idxptr, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+  }
+  if (fread(&(index->next_ptr), MDB_PTR_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+  }
+  if (fread(&(index->hash), MDB_HASH_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_READ, "cannot read key hash");
+  }
+  if (fread(index->key, 1, db->options.key_size_max, db->fp_index)
+      != db->options.key_size_max) {
+    return mdb_status(MDB_ERR_READ, "cannot read key");
+  }
+  index->key[db->options.key_size_max] = '\0';
+  if (fread(&(index->value_ptr), MDB_PTR_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_READ, "cannot read value ptr");
+  }
+  if (fread(&(index->value_size), MDB_DATALEN_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_READ, "cannot read value length");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_write_bucket(mdb_int_t *db, mdb_ptr_t bucket,
+                                     mdb_ptr_t value) {
+  db->heads[bucket + 1] = value;
+  mdb_ptr_t offset = MDB_PTR_SIZE * (bucket + 1);
+  if (db->index_map != NULL) {
+    memcpy(db->index_map + offset, &value, MDB_PTR_SIZE);
+    return mdb_sync_index(db, offset, MDB_PTR_SIZE);
+  }
+  if (db->wal.enabled) {
+    return mdb_wal_write(db, MDB_WAL_INDEX, offset, &value, MDB_PTR_SIZE);
+  }
+  mdb_stat_io(db, true, MDB_PTR_SIZE);
+  if (db->pio) {
+    if (!mdb_pwrite_all(db->fd_index, &value, MDB_PTR_SIZE, offset)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot write bucket");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_index, (long)offset, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to bucket");
+  }
+  if (fwrite(&value, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write bucket");
+  }
+  if (mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_write_index(mdb_int_t *db, mdb_ptr_t idxptr,
+                                    const char *keybuf, mdb_ptr_t valptr,
+                                    mdb_size_t valsize) {
+  /// a slab value and the header of its page reach the file before the
+  /// record that points at them. Inside a mutation or a batch this is left
+  /// to its end, which flushes the data file before the index.
+  if (db->slab.page_size != 0 && !db->pio && db->data_map == NULL
+      && mdb_fflush(db, db->fp_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  if (db->index_map != NULL) {
+    if (idxptr + db->index_record_size > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_WRITE, "index ptr out of range");
+    }
+    uint32_t hash = mdb_hash(db, keybuf);
+    uint8_t *record = db->index_map + idxptr + MDB_PTR_SIZE;
+    memcpy(record, &hash, MDB_HASH_SIZE);
+    record += MDB_HASH_SIZE;
+    size_t key_len = strlen(keybuf);
+    memcpy(record, keybuf, key_len);
+    memset(record + key_len, 0, db->options.key_size_max - key_len);
+    record += db->options.key_size_max;
+    memcpy(record, &valptr, MDB_PTR_SIZE);
+    memcpy(record + MDB_PTR_SIZE, &valsize, MDB_DATALEN_SIZE);
+    return mdb_sync_index(db, idxptr, db->index_record_size);
+  }
+  /// the key is padded to its full width, since a freed record being
+  /// reused still has the rest of the old one
+  static const char zeros[KEY_SIZE_MAX_LIMIT + 1];
+  if (db->wal.enabled) {
+    size_t size = db->index_record_size - MDB_PTR_SIZE;
+    uint8_t *record = alloca(size);
+    uint32_t hash = mdb_hash(db, keybuf);
+    memcpy(record, &hash, MDB_HASH_SIZE);
+    size_t key_len = strlen(keybuf);
+    memcpy(record + MDB_HASH_SIZE, keybuf, key_len);
+    memset(record + MDB_HASH_SIZE + key_len, 0,
+           db->options.key_size_max - key_len);
+    uint8_t *tail = record + MDB_HASH_SIZE + db->options.key_size_max;
+    memcpy(tail, &valptr, MDB_PTR_SIZE);
+    memcpy(tail + MDB_PTR_SIZE, &valsize, MDB_DATALEN_SIZE);
+    return mdb_wal_write(db, MDB_WAL_INDEX, idxptr + MDB_PTR_SIZE, record,
+                         size);
+  }
+  mdb_stat_io(db, true, db->index_record_size - MDB_PTR_SIZE);
+  if (db->pio) {
+    /// everything but the next pointer goes out in one write
+    uint32_t hash = mdb_hash(db, keybuf);
+    size_t key_len = strlen(keybuf);
+    struct iovec iov[5] = {
+      { &hash, MDB_HASH_SIZE },
+      { (void*)keybuf, key_len },
+      { (void*)zeros, db->options.key_size_max - key_len },
+      { &valptr, MDB_PTR_SIZE },
+      { &valsize, MDB_DATALEN_SIZE }
+    };
+    if (!mdb_pwritev_all(db->fd_index, iov, 5, idxptr + MDB_PTR_SIZE)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot write index record");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_index, (long)(idxptr + MDB_PTR_SIZE), SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+  }
+  uint32_t hash = mdb_hash(db, keybuf);
+  if (fwrite(&hash, MDB_HASH_SIZE, 1, db->fp_index) < 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write hash part of index");
+  }
+  size_t key_len = strlen(keybuf);
+  if (fwrite(keybuf, 1, key_len, db->fp_index) < key_len
+      || fwrite(zeros, 1, db->options.key_size_max - key_len, db->fp_index)
+         < db->options.key_size_max - key_len) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write key part of index");
+  }
+  if (fwrite(&valptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write to value part of index");
+  }
+  if (fwrite(&valsize, MDB_DATALEN_SIZE, 1, db->fp_index) < 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write to value part of index");
+  }
+  if (mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_read_nextptr(mdb_int_t *db, mdb_ptr_t idxptr,
+                                     mdb_ptr_t *nextptr) {
+  size_t slot;
+  if (!db->shared && mdb_head_slot(db, idxptr, &slot)) {
+    *nextptr = db->heads[slot];
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (db->index_map != NULL) {
+    if (idxptr + MDB_PTR_SIZE > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_READ, "index ptr out of range");
+    }
+    memcpy(nextptr, db->index_map + idxptr, MDB_PTR_SIZE);
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (db->wal.enabled) {
+    if (!mdb_wal_read(db, MDB_WAL_INDEX, idxptr, nextptr, MDB_PTR_SIZE)) {
+      return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_stat_io(db, false, MDB_PTR_SIZE);
+  if (db->pio) {
+    if (!mdb_pread_all(db->fd_index, nextptr, MDB_PTR_SIZE, idxptr)) {
+      return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_index, (long)idxptr, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+  }
+  if (fread(nextptr, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
+    return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_read_data(mdb_int_t *db, mdb_ptr_t valptr,
+                                  mdb_size_t valsize, char *valbuf,
+                                  mdb_size_t bufsiz) {
+  if (bufsiz < valsize + 1) {
+    return mdb_status(MDB_ERR_BUFSIZ, "value buffer size too small");
+  }
+  if (db->data_map != NULL) {
+    if ((size_t)valptr + valsize > mdb_data_end(db)) {
+      return mdb_status(MDB_ERR_READ, "data ptr out of range");
+    }
+    memcpy(valbuf, db->data_map + valptr, valsize);
+  } else if (db->wal.enabled) {
+    if (!mdb_wal_read(db, MDB_WAL_DATA, valptr, valbuf, valsize)) {
+      return mdb_status(MDB_ERR_READ, "cannot read data");
+    }
+  } else if (db->pio) {
+    mdb_stat_io(db, false, valsize);
+    if (!mdb_pread_all(db->fd_data, valbuf, valsize, valptr)) {
+      return mdb_status(MDB_ERR_READ, "cannot read data");
+    }
+  } else {
+    mdb_stat_io(db, false, valsize);
+    if (fseek(db->fp_data, (long)valptr, SEEK_SET) != 0) {
+      return mdb_status(MDB_ERR_SEEK, "cannot seek to value");
+    }
+    if (fread(valbuf, 1, valsize, db->fp_data) != valsize) {
+      return mdb_status(MDB_ERR_READ, "cannot read data");
+    }
+  }
+  valbuf[valsize] = '\0';
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_write_nextptr(mdb_int_t *db, mdb_ptr_t ptr,
+                                      mdb_ptr_t nextptr) {
+  size_t slot;
+  if (!db->shared && mdb_head_slot(db, ptr, &slot)) {
+    db->heads[slot] = nextptr;
+  }
+  if (db->index_map != NULL) {
+    if (ptr + MDB_PTR_SIZE > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_WRITE, "index ptr out of range");
+    }
+    memcpy(db->index_map + ptr, &nextptr, MDB_PTR_SIZE);
+    return mdb_sync_index(db, ptr, MDB_PTR_SIZE);
+  }
+  if (db->wal.enabled) {
+    return mdb_wal_write(db, MDB_WAL_INDEX, ptr, &nextptr, MDB_PTR_SIZE);
+  }
+  mdb_stat_io(db, true, MDB_PTR_SIZE);
+  if (db->pio) {
+    if (!mdb_pwrite_all(db->fd_index, &nextptr, MDB_PTR_SIZE, ptr)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot write next ptr");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_index, (long)ptr, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to head of index file");
+  }
+  if (fwrite(&nextptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write to head of index file");
+  }
+  if (mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_write_data(mdb_int_t *db, mdb_ptr_t valptr,
+                                   const char *valbuf, mdb_size_t valsize) {
+  if (db->data_map != NULL) {
+    memcpy(db->data_map + valptr, valbuf, valsize);
+    return mdb_sync_data(db, valptr, valsize);
+  }
+  if (db->wal.enabled) {
+    return mdb_wal_write(db, MDB_WAL_DATA, valptr, valbuf, valsize);
+  }
+  mdb_stat_io(db, true, valsize);
+  if (db->pio) {
+    if (!mdb_pwrite_all(db->fd_data, valbuf, valsize, valptr)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot write data");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_data, (long)valptr, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to value");
+  }
+  if (fwrite(valbuf, 1, valsize, db->fp_data) < valsize) {
+    return mdb_status(MDB_ERR_WRITE, "cannot write data");
+  }
+  if (mdb_fflush(db, db->fp_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// in slab mode the chunk is a whole number of pages, so that whatever a
+/// crash leaves of it still reads as free pages
+static size_t mdb_grow_chunk(mdb_int_t *db) {
+  size_t chunk = db->options.grow_chunk != 0 ? db->options.grow_chunk
+                                             : MDB_DEFAULT_GROW_CHUNK;
+  size_t page_size = db->slab.page_size;
+  if (page_size != 0) {
+    chunk = (chunk + page_size - 1) / page_size * page_size;
+  }
+  return chunk;
+}
+
+/// makes sure the file behind @p fd holds at least @p end bytes, growing it
+/// to the next multiple of the chunk size when it does not. The blocks are
+/// allocated up front where the file system supports it, so that running
+/// out of space shows up here and not as a fault on a mapped page.
+static mdb_status_t mdb_file_reserve(mdb_int_t *db, int fd, uint64_t end,
+                                     mdb_ptr_t *cap) {
+  if (end <= *cap) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (end > UINT32_MAX) {
+    return mdb_status(MDB_ERR_WRITE, "database file full");
+  }
+  uint64_t chunk = mdb_grow_chunk(db);
+  uint64_t new_cap = (end + chunk - 1) / chunk * chunk;
+  if (new_cap > UINT32_MAX) {
+    new_cap = end;
+  }
+  int rc = fallocate(fd, 0, (off_t)*cap, (off_t)(new_cap - *cap));
+  if (rc != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+    rc = ftruncate(fd, (off_t)new_cap);
+  }
+  if (rc != 0) {
+    return mdb_status(MDB_ERR_WRITE, "cannot stretch database file");
+  }
+  *cap = (mdb_ptr_t)new_cap;
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// cuts the preallocated tail off a file
+static void mdb_file_release(mdb_int_t *db, FILE *fp, mdb_ptr_t end,
+                             mdb_ptr_t *cap) {
+  if (*cap <= end) {
+    return;
+  }
+  (void)mdb_flush_file(db, fp);
+  if (ftruncate(fileno(fp), (off_t)end) == 0) {
+    *cap = end;
+  }
+}
+
+static mdb_status_t mdb_stretch_index_file(mdb_int_t *db, mdb_ptr_t *ptr) {
+  return mdb_stretch_index_by(db, db->index_record_size, ptr);
+}
+
+static mdb_status_t mdb_stretch_index_by(mdb_int_t *db, size_t size,
+                                         mdb_ptr_t *ptr) {
+  int fd = db->pio ? db->fd_index : fileno(db->fp_index);
+  if (db->shared) {
+    /// other processes may have stretched the file since, and they learn
+    /// about the new end from its size, so it grows exactly
+    struct stat st;
+    if (fstat(db->fd_index, &st) != 0) {
+      return mdb_status(MDB_ERR_READ, "cannot stat index file");
+    }
+    db->index_end = (mdb_ptr_t)st.st_size;
+    if (ftruncate(fd, (off_t)(db->index_end + size)) != 0) {
+      return mdb_status(MDB_ERR_WRITE, "cannot stretch index file");
+    }
+    db->index_cap = db->index_end + size;
+  } else {
+    mdb_status_t reserve_status =
+        mdb_file_reserve(db, fd, (uint64_t)db->index_end + size,
+                         &db->index_cap);
+    STAT_CHECK_RET(reserve_status, {;});
+  }
+  *ptr = db->index_end;
+  __atomic_store_n(&db->index_end, db->index_end + size, __ATOMIC_RELEASE);
+  return db->index_map != NULL ? mdb_map_index(db)
+                               : mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_index_alloc(mdb_int_t *db, mdb_ptr_t *ptr) {
+  mdb_lock_alloc(db);
+  mdb_status_t status = mdb_lock_freelist(db);
+  if (status.code != MDB_OK) {
+    mdb_unlock_alloc(db);
+    return status;
+  }
+  mdb_ptr_t freeptr;
+  status = mdb_read_nextptr(db, 0, &freeptr);
+  if (status.code != MDB_OK) {
+    /// nothing to do, the status is returned below
+  } else if (freeptr != 0) {
+    mdb_ptr_t new_freeptr;
+    status = mdb_read_nextptr(db, freeptr, &new_freeptr);
+    if (status.code == MDB_OK) {
+      status = mdb_write_nextptr(db, 0, new_freeptr);
+    }
+    if (status.code == MDB_OK) {
+      status = mdb_write_nextptr(db, freeptr, 0);
+    }
+    *ptr = freeptr;
+  } else {
+    status = mdb_stretch_index_file(db, ptr);
+  }
+  mdb_unlock_freelist(db);
+  mdb_unlock_alloc(db);
+  return status;
+}
+
+static mdb_status_t mdb_data_alloc(mdb_int_t *db, mdb_size_t valsize,
+                                   mdb_ptr_t *ptr) {
+  mdb_stat_add(&db->stats.allocs, 1);
+  mdb_lock_alloc(db);
+  mdb_status_t status;
+  if (db->shared) {
+    status = mdb_data_append(db, valsize, ptr);
+  } else if (db->slab.page_size != 0) {
+    status = mdb_slab_alloc(db, valsize, ptr);
+  } else {
+    status = mdb_data_alloc_unlocked(db, valsize, ptr);
+  }
+  mdb_unlock_alloc(db);
+  return status;
+}
+
+/// shared mode allocates all data at the end of the file, under a lock on
+/// the whole data file
+static mdb_status_t mdb_data_append(mdb_int_t *db, mdb_size_t valsize,
+                                    mdb_ptr_t *ptr) {
+  mdb_status_t lock_status = mdb_lock_range(db->fd_data, F_WRLCK, 0, 0);
+  STAT_CHECK_RET(lock_status, {;});
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  struct stat st;
+  if (fstat(db->fd_data, &st) != 0) {
+    status = mdb_status(MDB_ERR_READ, "cannot stat data file");
+  } else if ((uint64_t)st.st_size + valsize > UINT32_MAX) {
+    status = mdb_status(MDB_ERR_WRITE, "data file full");
+  } else if (valsize != 0
+             && ftruncate(db->fd_data, st.st_size + valsize) != 0) {
+    status = mdb_status(MDB_ERR_WRITE, "cannot stretch data file");
+  } else {
+    *ptr = (mdb_ptr_t)st.st_size;
+    db->data_end = *ptr + valsize;
+  }
+  mdb_unlock_range(db->fd_data, 0, 0);
+  return status;
+}
+
+static mdb_status_t mdb_data_alloc_unlocked(mdb_int_t *db, mdb_size_t valsize,
+                                            mdb_ptr_t *ptr) {
+  if (valsize == 0) {
+    *ptr = db->data_end;
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (mdb_extent_take(&db->free_map, valsize, ptr)) {
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  mdb_ptr_t start_ptr = db->data_end;
+  (void)mdb_extent_take_tail(&db->free_map, db->data_end, &start_ptr);
+  mdb_size_t stretch = valsize - (db->data_end - start_ptr);
+
+  int fd = db->pio ? db->fd_data : fileno(db->fp_data);
+  mdb_status_t reserve_status =
+      mdb_file_reserve(db, fd, (uint64_t)db->data_end + stretch,
+                       &db->data_cap);
+  STAT_CHECK_RET(reserve_status, {;});
+  __atomic_store_n(&db->data_end, db->data_end + stretch, __ATOMIC_RELEASE);
+  *ptr = start_ptr;
+  return db->data_map != NULL ? mdb_map_data(db)
+                              : mdb_status(MDB_OK, NULL);
+}
+
+/// deallocates the whole blocks in [@p offset, @p offset + @p size), which
+/// read back as zeros from then on. Returns false if nothing could be
+/// punched, for instance because the file system does not support it.
+static bool mdb_punch_hole(mdb_int_t *db, mdb_ptr_t offset, size_t size) {
+  uint64_t begin = ((uint64_t)offset + MDB_PUNCH_BLOCK - 1)
+                   / MDB_PUNCH_BLOCK * MDB_PUNCH_BLOCK;
+  uint64_t end = ((uint64_t)offset + size) / MDB_PUNCH_BLOCK
+                 * MDB_PUNCH_BLOCK;
+  if (begin >= end) {
+    return false;
+  }
+  if (db->wal.enabled) {
+    return mdb_wal_punch(db, (mdb_ptr_t)begin, (size_t)(end - begin)).code
+           == MDB_OK;
+  }
+  if (!db->pio) {
+    /// buffered writes must not land in the hole afterwards, and the
+    /// records that pointed into it must not be older than the hole
+    (void)mdb_flush_file(db, db->fp_data);
+    if (db->index_map == NULL) {
+      (void)mdb_flush_file(db, db->fp_index);
+    }
+  }
+  int fd = db->pio ? db->fd_data : fileno(db->fp_data);
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   (off_t)begin, (off_t)(end - begin)) == 0;
+}
+
+/// a freed record is a tombstone with its hash and the first byte of its
+/// key cleared, which is how a sequential scan of the index file tells it
+/// apart from live ones
+static mdb_status_t mdb_index_free(mdb_int_t *db, mdb_ptr_t ptr) {
+  mdb_lock_alloc(db);
+  mdb_status_t status = mdb_lock_freelist(db);
+  if (status.code == MDB_OK) {
+    status = mdb_index_free_unlocked(db, ptr);
+    mdb_unlock_freelist(db);
+  }
+  mdb_unlock_alloc(db);
+  return status;
+}
+
+static mdb_status_t mdb_index_free_unlocked(mdb_int_t *db, mdb_ptr_t ptr) {
+  mdb_ptr_t freeptr;
+  mdb_status_t freeptr_read_status = mdb_read_nextptr(db, 0, &freeptr);
+  STAT_CHECK_RET(freeptr_read_status, {;});
+  mdb_status_t clear_status = mdb_index_clear(db, ptr, freeptr);
+  STAT_CHECK_RET(clear_status, {;});
+  return mdb_write_nextptr(db, 0, ptr);
+}
+
+/// points the record at @p ptr to @p nextptr and clears its hash and key
+static mdb_status_t mdb_index_clear(mdb_int_t *db, mdb_ptr_t ptr,
+                                    mdb_ptr_t nextptr) {
+  uint8_t record[MDB_PTR_SIZE + MDB_HASH_SIZE + 1] = { 0 };
+  memcpy(record, &nextptr, MDB_PTR_SIZE);
+  if (db->index_map != NULL) {
+    if (ptr + db->index_record_size > mdb_index_end(db)) {
+      return mdb_status(MDB_ERR_WRITE, "index ptr out of range");
+    }
+    memcpy(db->index_map + ptr, record, sizeof(record));
+    return mdb_sync_index(db, ptr, sizeof(record));
+  }
+  if (db->wal.enabled) {
+    return mdb_wal_write(db, MDB_WAL_INDEX, ptr, record, sizeof(record));
+  }
+
+  mdb_stat_io(db, true, sizeof(record));
+  if (db->pio) {
+    if (!mdb_pwrite_all(db->fd_index, record, sizeof(record), ptr)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot clean index record");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  if (fseek(db->fp_index, (long)ptr, SEEK_SET) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+  }
+  if (fwrite(record, sizeof(record), 1, db->fp_index) < 1) {
+    return mdb_status(MDB_ERR_WRITE, "cannot clean index record");
+  }
+  if (mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// the free map is rebuilt from the live records at open, so freed bytes
+/// are left as they are; only large extents are given back to the file
+/// system. Slab mode punches whole pages as they fall empty instead.
+static mdb_status_t mdb_data_free(mdb_int_t *db, mdb_ptr_t valptr,
+                                  mdb_size_t valsize) {
+  /// the record that pointed at a slab value reaches the file before the
+  /// slot can be handed out again; mdb_punch_hole sees to it for holes
+  if (db->slab.page_size != 0 && !db->pio && db->index_map == NULL
+      && mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  if (db->slab.page_size == 0 && valsize >= MDB_PUNCH_MIN_SIZE) {
+    /// the extent still belongs to the caller here, so only handing it
+    /// back to the free map needs the alloc lock
+    (void)mdb_punch_hole(db, valptr, valsize);
+  }
+  if (db->shared) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  mdb_lock_alloc(db);
+  if (db->slab.page_size != 0) {
+    status = mdb_slab_release(db, valptr, valsize);
+  } else {
+    mdb_extent_insert(&db->free_map, valptr, valsize);
+  }
+  mdb_unlock_alloc(db);
+  return status;
+}
+
+static bool mdb_read_raw(mdb_int_t *db, FILE *fp, int fd, mdb_ptr_t offset,
+                         void *buf, size_t len) {
+  if (db->wal.enabled) {
+    return mdb_wal_read(db, fd == db->fd_index ? MDB_WAL_INDEX : MDB_WAL_DATA,
+                        offset, buf, len);
+  }
+  mdb_stat_io(db, false, len);
+  if (db->pio) {
+    return mdb_pread_all(fd, buf, len, offset);
+  }
+  return fseek(fp, (long)offset, SEEK_SET) == 0
+         && fread(buf, 1, len, fp) == len;
+}
+
+static bool mdb_pread_all(int fd, void *buf, size_t len, mdb_ptr_t offset) {
+  uint8_t *p = (uint8_t*)buf;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, (off_t)offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    offset += (mdb_ptr_t)n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool mdb_pwrite_all(int fd, const void *buf, size_t len,
+                           mdb_ptr_t offset) {
+  const uint8_t *p = (const uint8_t*)buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, (off_t)offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    offset += (mdb_ptr_t)n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+/// drops the first @p len bytes from an I/O vector after a short transfer
+static void mdb_iov_advance(struct iovec **iov, int *iovcnt, size_t len) {
+  while (*iovcnt > 0 && len >= (*iov)->iov_len) {
+    len -= (*iov)->iov_len;
+    (*iov)++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt > 0) {
+    (*iov)->iov_base = (uint8_t*)(*iov)->iov_base + len;
+    (*iov)->iov_len -= len;
+  }
+}
+
+/// the vector is consumed in the process
+static bool mdb_preadv_all(int fd, struct iovec *iov, int iovcnt,
+                           mdb_ptr_t offset) {
+  while (iovcnt > 0) {
+    ssize_t n = preadv(fd, iov, iovcnt, (off_t)offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset += (mdb_ptr_t)n;
+    mdb_iov_advance(&iov, &iovcnt, (size_t)n);
+  }
+  return true;
+}
+
+static bool mdb_pwritev_all(int fd, struct iovec *iov, int iovcnt,
+                            mdb_ptr_t offset) {
+  while (iovcnt > 0) {
+    ssize_t n = pwritev(fd, iov, iovcnt, (off_t)offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset += (mdb_ptr_t)n;
+    mdb_iov_advance(&iov, &iovcnt, (size_t)n);
+  }
+  return true;
+}
+
+static void mdb_apply_runtime_options(mdb_int_t *db,
+                                      const mdb_options_t *options) {
+  if (options == NULL) {
+    db->options.flags = 0;
+    db->options.msync_policy = MDB_MSYNC_NONE;
+    db->options.max_load_factor = 0;
+    db->options.grow_chunk = 0;
+    db->options.cache_size = 0;
+    db->options.durability = MDB_DURABILITY_NONE;
+    db->options.sync_interval_ms = 0;
+    return;
+  }
+  db->options.flags = options->flags;
+  if (db->options.flags & MDB_FLAG_SHARED) {
+    /// another process may grow the files past any mapping made here, and
+    /// would not see the pages the log holds back
+    db->options.flags &= ~(uint32_t)(MDB_FLAG_MMAP_INDEX
+                                     | MDB_FLAG_MMAP_DATA
+                                     | MDB_FLAG_WAL);
+  }
+  if (db->options.flags & MDB_FLAG_WAL) {
+    /// writes must reach the file only at checkpoints, so they cannot go
+    /// through a shared mapping
+    db->options.flags &= ~(uint32_t)(MDB_FLAG_MMAP_INDEX
+                                     | MDB_FLAG_MMAP_DATA);
+    db->options.flags |= MDB_FLAG_PIO;
+  }
+  db->options.msync_policy = options->msync_policy;
+  db->options.max_load_factor = options->max_load_factor;
+  db->options.grow_chunk = options->grow_chunk;
+  db->options.cache_size = options->cache_size;
+  db->options.durability = options->durability;
+  db->options.sync_interval_ms = options->sync_interval_ms;
+  if ((db->options.flags & MDB_FLAG_SHARED)
+      && db->options.durability == MDB_DURABILITY_ON_CLOSE) {
+    /// other processes read what has reached the kernel
+    db->options.durability = MDB_DURABILITY_NONE;
+  }
+}
+
+static mdb_status_t mdb_map_index(mdb_int_t *db) {
+  return mdb_map_file(db, fileno(db->fp_index), db->index_end,
+                      &db->index_map, &db->index_map_size);
+}
+
+static mdb_status_t mdb_map_data(mdb_int_t *db) {
+  return mdb_map_file(db, fileno(db->fp_data), db->data_end,
+                      &db->data_map, &db->data_map_size);
+}
+
+static mdb_status_t mdb_map_file(mdb_int_t *db, int fd, size_t end,
+                                 uint8_t **map, size_t *map_size) {
+  if (*map != NULL && end <= *map_size) {
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  size_t new_size = *map_size != 0 ? *map_size : MDB_MMAP_MIN_SIZE;
+  while (new_size < end) {
+    new_size *= 2;
+  }
+  if (db->thread_safe) {
+    new_size = MDB_MMAP_FULL_SIZE;
+  }
+
+  /// pages past the end of file are never touched; they become valid once
+  /// the file is stretched over them, which is what the headroom is for
+  void *new_map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+  if (new_map == MAP_FAILED) {
+    return mdb_status(MDB_ERR_MMAP, "cannot map database file");
+  }
+  if (*map != NULL) {
+    (void)munmap(*map, *map_size);
+  }
+  *map = (uint8_t*)new_map;
+  *map_size = new_size;
+  return mdb_status(MDB_OK, NULL);
+}
+
+static FILE *mdb_fopen(const char *path, const char *suffix,
+                       const char *mode) {
+  char pathbuf[4096];
+  if (!mdb_make_path(pathbuf, sizeof(pathbuf), path, suffix)) {
+    return NULL;
+  }
+  return fopen(pathbuf, mode);
+}
+
+static bool mdb_make_path(char *buf, size_t bufsiz, const char *path,
+                          const char *suffix) {
+  if (snprintf(buf, bufsiz, "%s%s", path, suffix) >= (int)bufsiz) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  return true;
+}
+
+/// a missing source counts as renamed already, so that an interrupted swap
+/// can simply be run again
+static bool mdb_rename(const char *path, const char *from, const char *to) {
+  char from_path[4096], to_path[4096];
+  if (!mdb_make_path(from_path, sizeof(from_path), path, from)
+      || !mdb_make_path(to_path, sizeof(to_path), path, to)) {
+    return false;
+  }
+  return rename(from_path, to_path) == 0 || errno == ENOENT;
+}
+
+static void mdb_remove(const char *path, const char *suffix) {
+  char pathbuf[4096];
+  if (mdb_make_path(pathbuf, sizeof(pathbuf), path, suffix)) {
+    (void)remove(pathbuf);
+  }
+}
+
+/// makes renames in the directory of the database durable
+static bool mdb_sync_dir(const char *path) {
+  char dir[4096];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if ((size_t)(slash - path) + 2 > sizeof(dir)) {
+    return false;
+  } else {
+    memcpy(dir, path, (size_t)(slash - path) + 1);
+    dir[slash - path + 1] = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  (void)close(fd);
+  return synced;
+}
+
+static mdb_status_t mdb_init_concurrency(mdb_int_t *db) {
+  if (!(db->options.flags & (MDB_FLAG_THREAD_SAFE | MDB_FLAG_SHARED
+                              | MDB_FLAG_PIO))) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (mdb_flush_file(db, db->fp_index) != 0
+      || mdb_flush_file(db, db->fp_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  db->pio = true;
+  db->fd_index = fileno(db->fp_index);
+  db->fd_data = fileno(db->fp_data);
+  db->shared = (db->options.flags & MDB_FLAG_SHARED) != 0;
+  if (db->shared && db->slab.page_size != 0) {
+    /// slab pages are handed out from memory, which other processes do
+    /// not see
+    return mdb_status(MDB_ERR_LOGIC, "slab databases cannot be shared");
+  }
+  if (!(db->options.flags & MDB_FLAG_THREAD_SAFE)) {
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  /// splits wait for the table lock exclusively; preferring writers keeps a
+  /// steady stream of readers from starving them
+  pthread_rwlockattr_t attr;
+  if (pthread_rwlockattr_init(&attr) != 0) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise locks");
+  }
+  (void)pthread_rwlockattr_setkind_np(
+      &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  int ret = pthread_rwlock_init(&db->table_lock, &attr);
+  (void)pthread_rwlockattr_destroy(&attr);
+  if (ret != 0) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise locks");
+  }
+  for (size_t i = 0; i < MDB_LOCK_STRIPES; i++) {
+    if (pthread_rwlock_init(&db->stripes[i], NULL) != 0) {
+      while (i-- > 0) {
+        (void)pthread_rwlock_destroy(&db->stripes[i]);
+      }
+      (void)pthread_rwlock_destroy(&db->table_lock);
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise locks");
+    }
+  }
+  if (pthread_mutex_init(&db->alloc_lock, NULL) != 0) {
+    for (size_t i = 0; i < MDB_LOCK_STRIPES; i++) {
+      (void)pthread_rwlock_destroy(&db->stripes[i]);
+    }
+    (void)pthread_rwlock_destroy(&db->table_lock);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise locks");
+  }
+  db->thread_safe = true;
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_lock_table(mdb_int_t *db, bool exclusive) {
+  if (db->thread_safe) {
+    if (exclusive) {
+      (void)pthread_rwlock_wrlock(&db->table_lock);
+    } else {
+      (void)pthread_rwlock_rdlock(&db->table_lock);
+    }
+  }
+  if (exclusive) {
+    __atomic_add_fetch(&db->table_seq, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void mdb_unlock_table(mdb_int_t *db) {
+  if (__atomic_load_n(&db->table_seq, __ATOMIC_RELAXED) & 1) {
+    __atomic_add_fetch(&db->table_seq, 1, __ATOMIC_SEQ_CST);
+  }
+  if (db->thread_safe) {
+    (void)pthread_rwlock_unlock(&db->table_lock);
+  }
+}
+
+static void mdb_lock_bucket(mdb_int_t *db, uint32_t bucket, bool exclusive) {
+  if (db->thread_safe) {
+    /// fcntl locks belong to the process, so threads sharing a handle in
+    /// shared mode must not hold a chain lock side by side
+    pthread_rwlock_t *stripe = &db->stripes[bucket % MDB_LOCK_STRIPES];
+    if (exclusive || db->shared) {
+      (void)pthread_rwlock_wrlock(stripe);
+    } else {
+      (void)pthread_rwlock_rdlock(stripe);
+    }
+  }
+  if (exclusive) {
+    __atomic_add_fetch(&db->stripe_seq[bucket % MDB_LOCK_STRIPES], 1,
+                       __ATOMIC_SEQ_CST);
+  }
+}
+
+static void mdb_unlock_bucket(mdb_int_t *db, uint32_t bucket) {
+  uint64_t *seq = &db->stripe_seq[bucket % MDB_LOCK_STRIPES];
+  if (__atomic_load_n(seq, __ATOMIC_RELAXED) & 1) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+  }
+  if (db->thread_safe) {
+    (void)pthread_rwlock_unlock(&db->stripes[bucket % MDB_LOCK_STRIPES]);
+  }
+}
+
+static void mdb_lock_alloc(mdb_int_t *db) {
+  if (db->thread_safe) {
+    (void)pthread_mutex_lock(&db->alloc_lock);
+  }
+}
+
+static void mdb_unlock_alloc(mdb_int_t *db) {
+  if (db->thread_safe) {
+    (void)pthread_mutex_unlock(&db->alloc_lock);
+  }
+}
+
+static mdb_status_t mdb_lock_range(int fd, short type, mdb_ptr_t offset,
+                                   mdb_ptr_t len) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = (off_t)offset;
+  lock.l_len = (off_t)len;
+  while (fcntl(fd, F_SETLKW, &lock) != 0) {
+    if (errno == EDEADLK) {
+      return mdb_status(MDB_ERR_LOCK, "deadlock on record lock");
+    }
+    if (errno != EINTR) {
+      return mdb_status(MDB_ERR_LOCK, "cannot take record lock");
+    }
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_unlock_range(int fd, mdb_ptr_t offset, mdb_ptr_t len) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = (off_t)offset;
+  lock.l_len = (off_t)len;
+  (void)fcntl(fd, F_SETLK, &lock);
+}
+
+static mdb_status_t mdb_lock_chain(mdb_int_t *db, uint32_t bucket,
+                                   bool exclusive) {
+  if (!db->shared) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  return mdb_lock_range(db->fd_index, exclusive ? F_WRLCK : F_RDLCK,
+                        mdb_bucket_slot(db, bucket), MDB_PTR_SIZE);
+}
+
+static void mdb_unlock_chain(mdb_int_t *db, uint32_t bucket) {
+  if (db->shared) {
+    mdb_unlock_range(db->fd_index, mdb_bucket_slot(db, bucket), MDB_PTR_SIZE);
+  }
+}
+
+/// batches lock the whole index file in shared mode
+static mdb_status_t mdb_lock_index(mdb_int_t *db) {
+  if (!db->shared) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  return mdb_lock_range(db->fd_index, F_WRLCK, 0, 0);
+}
+
+static void mdb_unlock_index(mdb_int_t *db) {
+  if (db->shared) {
+    mdb_unlock_range(db->fd_index, 0, 0);
+  }
+}
+
+/// a batch holds the whole index file already; taking and dropping the
+/// freelist range inside it would punch a hole in that lock
+static mdb_status_t mdb_lock_freelist(mdb_int_t *db) {
+  if (!db->shared || db->batching) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  return mdb_lock_range(db->fd_index, F_WRLCK, 0, MDB_PTR_SIZE);
+}
+
+static void mdb_unlock_freelist(mdb_int_t *db) {
+  if (db->shared && !db->batching) {
+    mdb_unlock_range(db->fd_index, 0, MDB_PTR_SIZE);
+  }
+}
+
+/// blocks all writers while readers carry on; in shared mode this includes
+/// writers in other processes
+static mdb_status_t mdb_lock_all(mdb_int_t *db) {
+  mdb_lock_table(db, false);
+  for (uint32_t stripe = 0; stripe < MDB_LOCK_STRIPES; stripe++) {
+    mdb_lock_bucket(db, stripe, false);
+  }
+  if (!db->shared) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  mdb_status_t lock_status = mdb_lock_range(db->fd_index, F_RDLCK, 0, 0);
+  if (lock_status.code != MDB_OK) {
+    for (uint32_t stripe = MDB_LOCK_STRIPES; stripe-- > 0; ) {
+      mdb_unlock_bucket(db, stripe);
+    }
+    mdb_unlock_table(db);
+  }
+  return lock_status;
+}
+
+static void mdb_unlock_all(mdb_int_t *db) {
+  if (db->shared) {
+    mdb_unlock_range(db->fd_index, 0, 0);
+  }
+  for (uint32_t stripe = MDB_LOCK_STRIPES; stripe-- > 0; ) {
+    mdb_unlock_bucket(db, stripe);
+  }
+  mdb_unlock_table(db);
+}
+
+static mdb_status_t mdb_load_heads(mdb_int_t *db) {
+  uint32_t segment_count = 0;
+  while (segment_count + 1 < MDB_SEGMENTS_MAX
+         && db->segments[segment_count + 1] != 0) {
+    segment_count++;
+  }
+  size_t count = ((size_t)db->options.hash_buckets << segment_count) + 1;
+  db->heads = (mdb_ptr_t*)malloc(count * MDB_PTR_SIZE);
+  if (db->heads == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate bucket table");
+  }
+
+  /// the initial buckets follow the freelist head, the rest are segments
+  size_t slot = 0;
+  for (uint32_t k = 0; k <= segment_count; k++) {
+    mdb_ptr_t offset = k == 0 ? 0 : db->segments[k];
+    size_t length = k == 0 ? db->options.hash_buckets + 1
+                           : (size_t)db->options.hash_buckets << (k - 1);
+    if (offset + length * MDB_PTR_SIZE > db->index_end) {
+      return mdb_status(MDB_ERR_READ, "index file too short for bucket table");
+    }
+    if (db->index_map != NULL) {
+      memcpy(db->heads + slot, db->index_map + offset, length * MDB_PTR_SIZE);
+    } else {
+      if (fseek(db->fp_index, (long)offset, SEEK_SET) != 0) {
+        return mdb_status(MDB_ERR_SEEK, "cannot seek to bucket table");
+      }
+      if (fread(db->heads + slot, MDB_PTR_SIZE, length, db->fp_index)
+          != length) {
+        return mdb_status(MDB_ERR_READ, "cannot read bucket table");
+      }
+    }
+    slot += length;
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static bool mdb_head_slot(mdb_int_t *db, mdb_ptr_t ptr, size_t *slot) {
+  uint32_t buckets = db->options.hash_buckets;
+  if (ptr < MDB_PTR_SIZE * (buckets + 1)) {
+    *slot = ptr / MDB_PTR_SIZE;
+    return true;
+  }
+  for (uint32_t k = 1; k < MDB_SEGMENTS_MAX && db->segments[k] != 0; k++) {
+    mdb_ptr_t begin = db->segments[k];
+    if (ptr >= begin && ptr < begin + MDB_PTR_SIZE * buckets) {
+      *slot = buckets + (ptr - begin) / MDB_PTR_SIZE + 1;
+      return true;
+    }
+    buckets *= 2;
+  }
+  return false;
+}
+
+static mdb_ptr_t mdb_bucket_slot(mdb_int_t *db, uint32_t bucket) {
+  uint32_t first = db->options.hash_buckets;
+  if (bucket < first) {
+    return MDB_PTR_SIZE * (bucket + 1);
+  }
+  uint32_t k = 1;
+  while (bucket - first >= first) {
+    first *= 2;
+    k++;
+  }
+  return db->segments[k] + MDB_PTR_SIZE * (bucket - first);
+}
+
+static mdb_status_t mdb_read_superblock(mdb_int_t *db,
+                                        mdb_summary_t *summary) {
+  memset(summary, 0, sizeof(mdb_summary_t));
+  FILE *fp = db->fp_superblock;
+  uint8_t header[MDB_SUPER_SIZE];
+  size_t header_size = fread(header, 1, MDB_SUPER_SIZE, fp);
+  uint32_t magic = 0;
+  if (header_size >= sizeof(magic)) {
+    magic = (uint32_t)mdb_get_le(header + MDB_SUPER_MAGIC_AT, 4);
+  }
+  if (magic != MDB_SUPER_MAGIC) {
+    summary->legacy = true;
+    rewind(fp);
+    return mdb_read_text_superblock(db);
+  }
+
+  if (header_size != MDB_SUPER_SIZE
+      || mdb_get_le(header + MDB_SUPER_CRC_AT, 4)
+         != mdb_crc32(header, MDB_SUPER_CRC_AT)) {
+    return mdb_status(MDB_ERR_FORMAT, "superblock checksum mismatch");
+  }
+  if (mdb_get_le(header + MDB_SUPER_VERSION_AT, 4) != MDB_SUPER_VERSION) {
+    return mdb_status(MDB_ERR_FORMAT, "unsupported superblock version");
+  }
+
+  memcpy(db->db_name, header + MDB_SUPER_NAME_AT, DB_NAME_MAX + 1);
+  db->db_name[DB_NAME_MAX] = '\0';
+  db->options.key_size_max =
+      (uint16_t)mdb_get_le(header + MDB_SUPER_KEY_SIZE_AT, 2);
+  db->options.data_size_max =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_DATA_SIZE_AT, 4);
+  db->options.hash_buckets =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_BUCKETS_AT, 4);
+  db->options.items_max =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_ITEMS_MAX_AT, 4);
+  uint64_t hash_algo = mdb_get_le(header + MDB_SUPER_HASH_AT, 4);
+  db->options.hash_seed = mdb_get_le(header + MDB_SUPER_SEED_AT, 8);
+  db->options.slab_page_size =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_SLAB_AT, 4);
+  db->level = (uint32_t)mdb_get_le(header + MDB_SUPER_LEVEL_AT, 4);
+  db->split = (uint32_t)mdb_get_le(header + MDB_SUPER_SPLIT_AT, 4);
+  db->super_level = db->level;
+  db->super_split = db->split;
+  for (uint32_t k = 0; k < MDB_SEGMENTS_MAX; k++) {
+    db->segments[k] = (mdb_ptr_t)mdb_get_le(header + MDB_SUPER_SEGMENTS_AT
+                                            + MDB_PTR_SIZE * k,
+                                            MDB_PTR_SIZE);
+  }
+  if (hash_algo != MDB_HASH_WY) {
+    return mdb_status(MDB_ERR_FORMAT,
+                      "unsupported hash function in superblock");
+  }
+  if (db->options.key_size_max > KEY_SIZE_MAX_LIMIT
+      || db->options.hash_buckets == 0
+      || db->level + 1 >= MDB_SEGMENTS_MAX || db->segments[0] != 0) {
+    return mdb_status(MDB_ERR_FORMAT, "bad table layout in superblock");
+  }
+  if (db->options.slab_page_size != 0
+      && !mdb_slab_init(&db->slab, db->options.slab_page_size)) {
+    return mdb_status(MDB_ERR_FORMAT, "unsupported slab page size");
+  }
+
+  uint64_t flags = mdb_get_le(header + MDB_SUPER_FLAGS_AT, 4);
+  if (!(flags & MDB_SUPER_CLEAN)) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  summary->marked_clean = true;
+  summary->item_count = (uint32_t)mdb_get_le(header + MDB_SUPER_ITEMS_AT, 4);
+  summary->index_end =
+      (mdb_ptr_t)mdb_get_le(header + MDB_SUPER_INDEX_END_AT, MDB_PTR_SIZE);
+  summary->data_end =
+      (mdb_ptr_t)mdb_get_le(header + MDB_SUPER_DATA_END_AT, MDB_PTR_SIZE);
+  summary->freelist =
+      (mdb_ptr_t)mdb_get_le(header + MDB_SUPER_FREELIST_AT, MDB_PTR_SIZE);
+  summary->freelist_length =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_FREELIST_LENGTH_AT, 4);
+  summary->free_bytes = mdb_get_le(header + MDB_SUPER_FREE_BYTES_AT, 8);
+  summary->extent_count =
+      (uint32_t)mdb_get_le(header + MDB_SUPER_EXTENTS_AT, 4);
+
+  /// extents that cannot be read back only cost a scan. They are decoded
+  /// in place, each one no wider than its bytes on disk.
+  size_t extents_size = sizeof(mdb_ptr_t) * 2 * summary->extent_count;
+  if (summary->extent_count != 0) {
+    summary->extents = (mdb_ptr_t*)malloc(extents_size);
+    if (summary->extents == NULL
+        || fread(summary->extents, 1, extents_size, fp) != extents_size) {
+      return mdb_status(MDB_OK, NULL);
+    }
+  }
+  summary->clean = mdb_get_le(header + MDB_SUPER_EXTENTS_CRC_AT, 4)
+                   == mdb_crc32(summary->extents, extents_size);
+  for (uint32_t i = 0; i < summary->extent_count * 2; i++) {
+    summary->extents[i] =
+        (mdb_ptr_t)mdb_get_le((const uint8_t*)summary->extents
+                              + MDB_PTR_SIZE * i, MDB_PTR_SIZE);
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// the format before the binary superblock: one field or group of fields
+/// per line
+static mdb_status_t mdb_read_text_superblock(mdb_int_t *db) {
+  FILE *fp = db->fp_superblock;
+  unsigned hash_algo = 0;
+  if (fscanf(fp, "%255s", db->db_name) != 1
+      || fscanf(fp, "%hu", &(db->options.key_size_max)) != 1
+      || fscanf(fp, "%u", &(db->options.data_size_max)) != 1
+      || fscanf(fp, "%u", &(db->options.hash_buckets)) != 1
+      || fscanf(fp, "%u", &(db->options.items_max)) != 1) {
+    return mdb_status(MDB_ERR_FORMAT, "cannot parse superblock");
+  }
+  if (fscanf(fp, "%u %" SCNu64, &hash_algo, &(db->options.hash_seed)) != 2
+      || hash_algo != MDB_HASH_WY) {
+    return mdb_status(MDB_ERR_FORMAT,
+                      "unsupported hash function in superblock");
+  }
+  if (db->options.key_size_max > KEY_SIZE_MAX_LIMIT
+      || db->options.hash_buckets == 0) {
+    return mdb_status(MDB_ERR_FORMAT, "bad table layout in superblock");
+  }
+  unsigned segment_count = 0;
+  if (fscanf(fp, "%u %u %u", &(db->level), &(db->split),
+             &segment_count) == 3) {
+    if (segment_count >= MDB_SEGMENTS_MAX
+        || db->level + 1 >= MDB_SEGMENTS_MAX) {
+      return mdb_status(MDB_ERR_FORMAT, "too many bucket segments");
+    }
+    for (unsigned k = 1; k <= segment_count; k++) {
+      if (fscanf(fp, "%u", &(db->segments[k])) != 1) {
+        return mdb_status(MDB_ERR_FORMAT, "cannot parse superblock");
+      }
+    }
+  }
+  if (fscanf(fp, "%u", &(db->options.slab_page_size)) == 1
+      && db->options.slab_page_size != 0
+      && !mdb_slab_init(&db->slab, db->options.slab_page_size)) {
+    return mdb_status(MDB_ERR_FORMAT, "unsupported slab page size");
+  }
+  if (ferror(fp)) {
+    return mdb_status(MDB_ERR_READ, "read error when parsing superblock");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_write_superblock(mdb_int_t *db,
+                                         const mdb_summary_t *summary) {
+  if (!db->layout_pending) {
+    db->super_level = db->level;
+    db->super_split = db->split;
+  }
+  FILE *fp = db->fp_superblock;
+  rewind(fp);
+  mdb_status_t format_status = mdb_format_superblock(db, fp, db->super_level,
+                                                     db->super_split,
+                                                     db->segments, summary);
+  STAT_CHECK_RET(format_status, {;});
+  if (ftruncate(fileno(fp), ftell(fp)) != 0) {
+    return mdb_status(MDB_ERR_WRITE, "cannot truncate superblock");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// without a @p summary the superblock says the database is in use, and
+/// the next open scans the index
+static mdb_status_t mdb_format_superblock(mdb_int_t *db, FILE *fp,
+                                          uint32_t level, uint32_t split,
+                                          const mdb_ptr_t *segments,
+                                          const mdb_summary_t *summary) {
+  uint8_t header[MDB_SUPER_SIZE] = { 0 };
+  mdb_put_le(header + MDB_SUPER_MAGIC_AT, MDB_SUPER_MAGIC, 4);
+  mdb_put_le(header + MDB_SUPER_VERSION_AT, MDB_SUPER_VERSION, 4);
+  memcpy(header + MDB_SUPER_NAME_AT, db->db_name,
+         strnlen(db->db_name, DB_NAME_MAX));
+  mdb_put_le(header + MDB_SUPER_KEY_SIZE_AT, db->options.key_size_max, 2);
+  mdb_put_le(header + MDB_SUPER_DATA_SIZE_AT, db->options.data_size_max, 4);
+  mdb_put_le(header + MDB_SUPER_BUCKETS_AT, db->options.hash_buckets, 4);
+  mdb_put_le(header + MDB_SUPER_ITEMS_MAX_AT, db->options.items_max, 4);
+  mdb_put_le(header + MDB_SUPER_HASH_AT, MDB_HASH_WY, 4);
+  mdb_put_le(header + MDB_SUPER_SEED_AT, db->options.hash_seed, 8);
+  mdb_put_le(header + MDB_SUPER_SLAB_AT, db->options.slab_page_size, 4);
+  mdb_put_le(header + MDB_SUPER_LEVEL_AT, level, 4);
+  mdb_put_le(header + MDB_SUPER_SPLIT_AT, split, 4);
+  for (uint32_t k = 0; k < MDB_SEGMENTS_MAX; k++) {
+    mdb_put_le(header + MDB_SUPER_SEGMENTS_AT + MDB_PTR_SIZE * k,
+               segments[k], MDB_PTR_SIZE);
+  }
+
+  size_t extents_size = 0;
+  uint8_t *extents = NULL;
+  if (summary != NULL) {
+    extents_size = sizeof(mdb_ptr_t) * 2 * summary->extent_count;
+    if (extents_size != 0) {
+      extents = (uint8_t*)malloc(extents_size);
+      if (extents == NULL) {
+        return mdb_status(MDB_ERR_ALLOC, "cannot allocate extent buffer");
+      }
+    }
+    for (uint32_t i = 0; i < summary->extent_count * 2; i++) {
+      mdb_put_le(extents + MDB_PTR_SIZE * i, summary->extents[i],
+                 MDB_PTR_SIZE);
+    }
+    mdb_put_le(header + MDB_SUPER_FLAGS_AT, MDB_SUPER_CLEAN, 4);
+    mdb_put_le(header + MDB_SUPER_ITEMS_AT, summary->item_count, 4);
+    mdb_put_le(header + MDB_SUPER_INDEX_END_AT, summary->index_end,
+               MDB_PTR_SIZE);
+    mdb_put_le(header + MDB_SUPER_DATA_END_AT, summary->data_end,
+               MDB_PTR_SIZE);
+    mdb_put_le(header + MDB_SUPER_FREELIST_AT, summary->freelist,
+               MDB_PTR_SIZE);
+    mdb_put_le(header + MDB_SUPER_FREELIST_LENGTH_AT,
+               summary->freelist_length, 4);
+    mdb_put_le(header + MDB_SUPER_FREE_BYTES_AT, summary->free_bytes, 8);
+    mdb_put_le(header + MDB_SUPER_EXTENTS_AT, summary->extent_count, 4);
+    mdb_put_le(header + MDB_SUPER_EXTENTS_CRC_AT,
+               mdb_crc32(extents, extents_size), 4);
+  }
+  mdb_put_le(header + MDB_SUPER_CRC_AT, mdb_crc32(header, MDB_SUPER_CRC_AT),
+             4);
+
+  bool written = fwrite(header, 1, MDB_SUPER_SIZE, fp) == MDB_SUPER_SIZE
+                 && (extents_size == 0
+                     || fwrite(extents, 1, extents_size, fp) == extents_size)
+                 && fflush(fp) == 0;
+  free(extents);
+  if (!written) {
+    return mdb_status(MDB_ERR_WRITE, "write error when writing superblock");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static size_t mdb_extent_count(const mdb_extent_t *node) {
+  return node == NULL ? 0 : 1 + mdb_extent_count(node->left)
+                                + mdb_extent_count(node->right);
+}
+
+/// appends the extents of a subtree in offset order
+static mdb_ptr_t *mdb_extent_collect(const mdb_extent_t *node,
+                                     mdb_ptr_t *out, uint64_t *bytes) {
+  if (node == NULL) {
+    return out;
+  }
+  out = mdb_extent_collect(node->left, out, bytes);
+  out[0] = node->offset;
+  out[1] = node->size;
+  *bytes += node->size;
+  return mdb_extent_collect(node->right, out + 2, bytes);
+}
+
+/// records what the next open would otherwise rebuild by a scan. The index
+/// and data files are synced first, so a clean superblock never describes
+/// more than is on disk.
+static mdb_status_t mdb_close_clean(mdb_int_t *db) {
+  if (!db->pio && (mdb_flush_file(db, db->fp_index) != 0
+                   || mdb_flush_file(db, db->fp_data) != 0)) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  mdb_status_t sync_status = mdb_sync_files(db);
+  STAT_CHECK_RET(sync_status, {;});
+  db->layout_pending = false;
+
+  mdb_summary_t summary;
+  memset(&summary, 0, sizeof(mdb_summary_t));
+  summary.item_count = db->item_count;
+  summary.index_end = db->index_end;
+  summary.data_end = db->data_end;
+  summary.freelist = db->heads[0];
+  mdb_ptr_t ptr = summary.freelist;
+  uint64_t records = db->index_end / db->index_record_size;
+  while (ptr != 0) {
+    if (summary.freelist_length == records) {
+      return mdb_status(MDB_ERR_FORMAT, "index freelist loops");
+    }
+    summary.freelist_length++;
+    mdb_status_t read_status = mdb_read_nextptr(db, ptr, &ptr);
+    STAT_CHECK_RET(read_status, {;});
+  }
+
+  if (db->slab.page_size == 0) {
+    summary.extent_count = (uint32_t)mdb_extent_count(db->free_map.root);
+  }
+  if (summary.extent_count != 0) {
+    summary.extents = (mdb_ptr_t*)malloc(sizeof(mdb_ptr_t) * 2
+                                         * summary.extent_count);
+    if (summary.extents == NULL) {
+      return mdb_status(MDB_ERR_ALLOC, "cannot allocate extent buffer");
+    }
+    (void)mdb_extent_collect(db->free_map.root, summary.extents,
+                             &summary.free_bytes);
+  }
+  mdb_status_t write_status = mdb_write_superblock(db, &summary);
+  free(summary.extents);
+  return write_status;
+}
+
+/// takes the state a scan would rebuild from a clean superblock. Files that
+/// changed size since, or a freelist that moved, mean it was closed by an
+/// older version or copied mid-way, and *loaded is left false.
+static mdb_status_t mdb_load_summary(mdb_int_t *db,
+                                     const mdb_summary_t *summary,
+                                     bool *loaded) {
+  *loaded = false;
+  if (!summary->clean) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (fseek(db->fp_data, 0, SEEK_END) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to end of data file");
+  }
+  mdb_ptr_t data_end = (mdb_ptr_t)ftell(db->fp_data);
+  if (summary->index_end != db->index_end || summary->data_end != data_end
+      || summary->freelist != db->heads[0]
+      || summary->item_count > db->options.items_max) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  for (uint32_t i = 0; i < summary->extent_count; i++) {
+    if ((uint64_t)summary->extents[i * 2] + summary->extents[i * 2 + 1]
+        > data_end) {
+      return mdb_status(MDB_OK, NULL);
+    }
+  }
+
+  db->data_end = data_end;
+  db->data_cap = data_end;
+  db->item_count = summary->item_count;
+  if (db->slab.page_size != 0) {
+    mdb_status_t load_status = mdb_slab_load(db, NULL, 0);
+    STAT_CHECK_RET(load_status, {;});
+  } else {
+    for (uint32_t i = 0; i < summary->extent_count; i++) {
+      mdb_extent_insert(&db->free_map, summary->extents[i * 2],
+                        summary->extents[i * 2 + 1]);
+    }
+  }
+  if (db->options.flags & MDB_FLAG_BLOOM) {
+    mdb_status_t bloom_status = mdb_bloom_rebuild(db);
+    STAT_CHECK_RET(bloom_status, {;});
+  }
+  *loaded = true;
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_maybe_split(mdb_int_t *db) {
+  if (!mdb_over_load(db)) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  uint32_t base = db->options.hash_buckets << db->level;
+
+  uint32_t segment = db->level + 1;
+  if (db->segments[segment] == 0) {
+    /// segments are sized in whole index records, which keeps the records
+    /// that follow them on the record grid
+    size_t segment_size = (size_t)base * MDB_PTR_SIZE;
+    segment_size = (segment_size + db->index_record_size - 1)
+                   / db->index_record_size * db->index_record_size;
+    size_t count = (size_t)base * 2 + 1;
+    mdb_ptr_t *heads = (mdb_ptr_t*)realloc(db->heads, count * MDB_PTR_SIZE);
+    if (heads == NULL) {
+      return mdb_status(MDB_ERR_ALLOC, "cannot grow bucket table");
+    }
+    memset(heads + base + 1, 0, (size_t)base * MDB_PTR_SIZE);
+    db->heads = heads;
+    mdb_ptr_t segment_ptr;
+    mdb_status_t stretch_status = mdb_stretch_index_by(db, segment_size,
+                                                       &segment_ptr);
+    STAT_CHECK_RET(stretch_status, {;});
+    db->segments[segment] = segment_ptr;
+    /// the new buckets must be found again at open, or an interrupted split
+    /// into them could not be undone. Nothing points into them yet, so the
+    /// split pointer written alongside needs no flush of the index.
+    mdb_status_t layout_status = db->wal.enabled
+                                 ? mdb_wal_layout(db)
+                                 : mdb_write_superblock(db, NULL);
+    STAT_CHECK_RET(layout_status, {;});
+  }
+
+  uint32_t old_bucket = db->split;
+  uint32_t new_bucket = base + old_bucket;
+  uint32_t modulus = base * 2;
+  mdb_status_t undo_status = mdb_unsplit(db, old_bucket, new_bucket);
+  STAT_CHECK_RET(undo_status, {;});
+
+  /// moved records are appended to the new chain before being unlinked from
+  /// the old one, so every record stays reachable from some chain. Lookups
+  /// only use the new bucket once the split pointer passes it, and a split
+  /// cut short before that is undone by mdb_unsplit.
+  mdb_ptr_t save_ptr = mdb_bucket_slot(db, old_bucket);
+  mdb_ptr_t tail_ptr = mdb_bucket_slot(db, new_bucket);
+  mdb_ptr_t ptr = db->heads[old_bucket + 1];
+  while (ptr != 0) {
+    mdb_ptr_t next_ptr;
+    uint32_t hash;
+    mdb_status_t head_read_status = mdb_read_index_head(db, ptr, &next_ptr,
+                                                        &hash);
+    STAT_CHECK_RET(head_read_status, {;});
+    if (hash % modulus == old_bucket) {
+      save_ptr = ptr;
+    } else {
+      mdb_status_t link_status = mdb_write_nextptr(db, tail_ptr, ptr);
+      STAT_CHECK_RET(link_status, {;});
+      mdb_status_t unlink_status = mdb_write_nextptr(db, save_ptr, next_ptr);
+      STAT_CHECK_RET(unlink_status, {;});
+      mdb_status_t cut_status = mdb_write_nextptr(db, ptr, 0);
+      STAT_CHECK_RET(cut_status, {;});
+      tail_ptr = ptr;
+    }
+    ptr = next_ptr;
+  }
+
+  db->split++;
+  mdb_stat_add(&db->stats.splits, 1);
+  if (db->split == base) {
+    db->level++;
+    db->split = 0;
+  }
+  return mdb_save_layout(db);
+}
+
+/// records the bucket layout. The index writes made before it reach the
+/// file first, so a layout on disk never runs ahead of the chains. In the
+/// middle of a stdio mutation or batch it waits for the flush that ends it.
+static mdb_status_t mdb_save_layout(mdb_int_t *db) {
+  if (db->wal.enabled) {
+    return mdb_wal_layout(db);
+  }
+  if (!db->pio && db->index_map == NULL) {
+    if (db->batching || db->deferring) {
+      db->layout_pending = true;
+      return mdb_status(MDB_OK, NULL);
+    }
+    if (mdb_flush_file(db, db->fp_index) != 0) {
+      return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+    }
+  }
+  db->layout_pending = false;
+  return mdb_write_superblock(db, NULL);
+}
+
+/// called once the index has been flushed
+static mdb_status_t mdb_save_pending_layout(mdb_int_t *db) {
+  if (!db->layout_pending) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  db->layout_pending = false;
+  return mdb_write_superblock(db, NULL);
+}
+
+/// puts back the records of splits the superblock does not know about: one
+/// that did not finish, and through stdio the ones whose split pointer had
+/// not been written yet. Every bucket past the ones in use is folded into
+/// the bucket it was split off, the newest first, so that buckets split
+/// off those in turn are folded before them.
+static mdb_status_t mdb_split_undo(mdb_int_t *db) {
+  uint32_t count = mdb_bucket_count(db);
+  uint32_t segment = 1;
+  while (segment < MDB_SEGMENTS_MAX && db->segments[segment] != 0) {
+    segment++;
+  }
+  while (--segment > db->level) {
+    uint32_t half = db->options.hash_buckets << (segment - 1);
+    for (uint32_t bucket = half * 2; bucket-- > half && bucket >= count; ) {
+      if (db->heads[bucket + 1] == 0) {
+        continue;
+      }
+      mdb_status_t status = mdb_unsplit(db, bucket - half, bucket);
+      STAT_CHECK_RET(status, {;});
+    }
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// moves the chain of @p new_bucket back onto @p old_bucket. It can run
+/// into the old chain: a record is linked to the new chain before it is
+/// unlinked from the old one and cut off from its successor. The new chain
+/// is cut where it first reaches a record of the old chain, what comes
+/// before that is appended to the old chain, and the new bucket is emptied
+/// last. Each step leaves a state this can be run on again.
+static mdb_status_t mdb_unsplit(mdb_int_t *db, uint32_t old_bucket,
+                                uint32_t new_bucket) {
+  mdb_ptr_t new_slot = mdb_bucket_slot(db, new_bucket);
+  mdb_ptr_t new_head;
+  mdb_status_t status = mdb_read_nextptr(db, new_slot, &new_head);
+  STAT_CHECK_RET(status, {;});
+  if (new_head == 0) {
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  size_t old_count = 0, old_cap = 16;
+  mdb_ptr_t *old_chain = (mdb_ptr_t*)malloc(old_cap * MDB_PTR_SIZE);
+  if (old_chain == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot undo split");
+  }
+  mdb_ptr_t old_tail = mdb_bucket_slot(db, old_bucket);
+  mdb_ptr_t ptr;
+  status = mdb_read_nextptr(db, old_tail, &ptr);
+  while (status.code == MDB_OK && ptr != 0) {
+    if (old_count == old_cap) {
+      old_cap *= 2;
+      mdb_ptr_t *grown = (mdb_ptr_t*)realloc(old_chain,
+                                             old_cap * MDB_PTR_SIZE);
+      if (grown == NULL) {
+        free(old_chain);
+        return mdb_status(MDB_ERR_ALLOC, "cannot undo split");
+      }
+      old_chain = grown;
+    }
+    old_chain[old_count++] = ptr;
+    old_tail = ptr;
+    status = mdb_read_nextptr(db, ptr, &ptr);
+  }
+  STAT_CHECK_RET(status, { free(old_chain); });
+
+  /// the records only the new chain reaches end at its last one before the
+  /// old chain, or at its end
+  mdb_ptr_t last = 0;
+  ptr = new_head;
+  while (status.code == MDB_OK && ptr != 0) {
+    bool shared_record = false;
+    for (size_t i = 0; i < old_count && !shared_record; i++) {
+      shared_record = old_chain[i] == ptr;
+    }
+    if (shared_record) {
+      break;
+    }
+    last = ptr;
+    status = mdb_read_nextptr(db, ptr, &ptr);
+  }
+  free(old_chain);
+  STAT_CHECK_RET(status, {;});
+
+  if (last != 0) {
+    if (ptr != 0) {
+      mdb_status_t cut_status = mdb_write_nextptr(db, last, 0);
+      STAT_CHECK_RET(cut_status, {;});
+    }
+    mdb_status_t link_status = mdb_write_nextptr(db, old_tail, new_head);
+    STAT_CHECK_RET(link_status, {;});
+  }
+  return mdb_write_nextptr(db, new_slot, 0);
+}
+
+/// whether the table is over its load factor and can still grow
+static bool mdb_over_load(mdb_int_t *db) {
+  uint32_t load = db->options.max_load_factor != 0
+                  ? db->options.max_load_factor
+                  : MDB_DEFAULT_LOAD_FACTOR;
+  uint32_t base = db->options.hash_buckets << db->level;
+  if (db->shared) {
+    return false;
+  }
+  mdb_lock_alloc(db);
+  uint32_t item_count = db->item_count;
+  mdb_unlock_alloc(db);
+  return (uint64_t)item_count > (uint64_t)load * mdb_bucket_count(db)
+         && db->level + 2 < MDB_SEGMENTS_MAX
+         && (uint64_t)base * 2 <= UINT32_MAX;
+}
+
+static void mdb_count_items(mdb_int_t *db, int delta) {
+  mdb_lock_alloc(db);
+  db->item_count += delta;
+  mdb_unlock_alloc(db);
+}
+
+/// every flush of the index and data files goes through here, so that
+/// stats.flushes counts them all
+static int mdb_flush_file(mdb_int_t *db, FILE *fp) {
+  mdb_stat_add(&db->stats.flushes, 1);
+  return fflush(fp);
+}
+
+/// a flush that a batch or stdio mutation leaves to its end
+static int mdb_fflush(mdb_int_t *db, FILE *fp) {
+  if (db->batching || db->deferring) {
+    return 0;
+  }
+  return mdb_flush_file(db, fp);
+}
+
+/// the data goes first, since the index refers to it. With pio nothing is
+/// left in the stdio buffers.
+static mdb_status_t mdb_end_batch(mdb_int_t *db) {
+  db->batching = false;
+  if (db->data_map != NULL) {
+    mdb_status_t sync_status = mdb_sync_data(db, 0, db->data_end);
+    STAT_CHECK_RET(sync_status, {;});
+  } else if (!db->pio && mdb_fflush(db, db->fp_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  if (db->index_map != NULL) {
+    return mdb_sync_index(db, 0, db->index_end);
+  }
+  if (db->pio) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (mdb_fflush(db, db->fp_index) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  }
+  /// inside a mutation the flush is left to mdb_commit
+  return db->deferring ? mdb_status(MDB_OK, NULL)
+                       : mdb_save_pending_layout(db);
+}
+
+/// starts a mutation, which ends with mdb_commit
+static void mdb_begin(mdb_int_t *db) {
+  mdb_wal_begin(db);
+  if (!db->pio) {
+    /// stdio is only used from a single thread
+    db->deferring = true;
+  }
+}
+
+/// makes the mutation as durable as the options ask for. Called whether or
+/// not it succeeded, since part of it may have been written.
+static mdb_status_t mdb_commit(mdb_int_t *db) {
+  if (db->wal.enabled) {
+    return mdb_wal_commit(db);
+  }
+  if (!db->pio) {
+    db->deferring = false;
+    if (db->options.durability != MDB_DURABILITY_ON_CLOSE) {
+      if (mdb_fflush(db, db->fp_data) != 0
+          || mdb_fflush(db, db->fp_index) != 0) {
+        return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+      }
+      mdb_status_t layout_status = mdb_save_pending_layout(db);
+      STAT_CHECK_RET(layout_status, {;});
+    }
+  }
+  switch (db->options.durability) {
+  case MDB_DURABILITY_PERIODIC:
+    __atomic_store_n(&db->flusher.dirty, true, __ATOMIC_RELEASE);
+    return mdb_status(MDB_OK, NULL);
+  case MDB_DURABILITY_COMMIT:
+    return mdb_sync_files(db);
+  default:
+    return mdb_status(MDB_OK, NULL);
+  }
+}
+
+/// what has reached the kernel; buffered stdio writes must be flushed first
+static mdb_status_t mdb_sync_files(mdb_int_t *db) {
+  int fd_index = db->pio ? db->fd_index : fileno(db->fp_index);
+  int fd_data = db->pio ? db->fd_data : fileno(db->fp_data);
+  mdb_stat_add(&db->stats.syncs, 2);
+  if (fdatasync(fd_index) != 0 || fdatasync(fd_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "cannot sync database files");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_flusher_start(mdb_int_t *db) {
+  mdb_flusher_t *flusher = &db->flusher;
+  flusher->fd_index = db->pio ? db->fd_index : fileno(db->fp_index);
+  flusher->fd_data = db->pio ? db->fd_data : fileno(db->fp_data);
+  if (pthread_mutex_init(&flusher->lock, NULL) != 0) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise flusher");
+  }
+  /// the interval is measured on the monotonic clock
+  pthread_condattr_t attr;
+  if (pthread_condattr_init(&attr) != 0) {
+    (void)pthread_mutex_destroy(&flusher->lock);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise flusher");
+  }
+  (void)pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  int ret = pthread_cond_init(&flusher->wake, &attr);
+  (void)pthread_condattr_destroy(&attr);
+  if (ret != 0) {
+    (void)pthread_mutex_destroy(&flusher->lock);
+    return mdb_status(MDB_ERR_ALLOC, "cannot initialise flusher");
+  }
+  if (pthread_create(&flusher->thread, NULL, mdb_flusher_run, db) != 0) {
+    (void)pthread_cond_destroy(&flusher->wake);
+    (void)pthread_mutex_destroy(&flusher->lock);
+    return mdb_status(MDB_ERR_ALLOC, "cannot start flusher thread");
+  }
+  flusher->running = true;
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// the thread syncs once more on its way out if it has to
+static void mdb_flusher_stop(mdb_int_t *db) {
+  mdb_flusher_t *flusher = &db->flusher;
+  if (!flusher->running) {
+    return;
+  }
+  (void)pthread_mutex_lock(&flusher->lock);
+  flusher->stop = true;
+  (void)pthread_cond_signal(&flusher->wake);
+  (void)pthread_mutex_unlock(&flusher->lock);
+  (void)pthread_join(flusher->thread, NULL);
+  (void)pthread_cond_destroy(&flusher->wake);
+  (void)pthread_mutex_destroy(&flusher->lock);
+  flusher->running = false;
+}
+
+static void *mdb_flusher_run(void *arg) {
+  mdb_int_t *db = (mdb_int_t*)arg;
+  mdb_flusher_t *flusher = &db->flusher;
+  uint32_t interval_ms = db->options.sync_interval_ms != 0
+                         ? db->options.sync_interval_ms : 1000;
+  struct timespec deadline;
+  (void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+  (void)pthread_mutex_lock(&flusher->lock);
+  for (bool stop = false; !stop; ) {
+    deadline.tv_sec += interval_ms / 1000;
+    deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    int ret = 0;
+    while (!flusher->stop && ret != ETIMEDOUT) {
+      ret = pthread_cond_timedwait(&flusher->wake, &flusher->lock,
+                                   &deadline);
+    }
+    stop = flusher->stop;
+    /// a failed sync is tried again at the next tick; the commits it would
+    /// have covered are still in the page cache
+    if (__atomic_exchange_n(&flusher->dirty, false, __ATOMIC_ACQ_REL)) {
+      mdb_stat_add(&db->stats.syncs, 2);
+      if (fdatasync(flusher->fd_index) != 0
+          || fdatasync(flusher->fd_data) != 0) {
+        __atomic_store_n(&flusher->dirty, true, __ATOMIC_RELEASE);
+      }
+    }
+  }
+  (void)pthread_mutex_unlock(&flusher->lock);
+  return NULL;
+}
+
+static mdb_status_t mdb_sync_index(mdb_int_t *db, mdb_ptr_t offset,
+                                   size_t len) {
+  return mdb_sync_range(db, db->index_map, offset, len);
+}
+
+static mdb_status_t mdb_sync_data(mdb_int_t *db, mdb_ptr_t offset,
+                                  size_t len) {
+  return mdb_sync_range(db, db->data_map, offset, len);
+}
+
+static mdb_status_t mdb_sync_range(mdb_int_t *db, uint8_t *map,
+                                   mdb_ptr_t offset, size_t len) {
+  int sync_flags;
+  switch (db->options.msync_policy) {
+  case MDB_MSYNC_ASYNC: sync_flags = MS_ASYNC; break;
+  case MDB_MSYNC_SYNC: sync_flags = MS_SYNC; break;
+  default: return mdb_status(MDB_OK, NULL);
+  }
+  if (db->batching) {
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  mdb_stat_add(&db->stats.syncs, 1);
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t begin = offset / page_size * page_size;
+  if (msync(map + begin, offset + len - begin, sync_flags) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "msync failed");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// finishes or rolls back a compaction that was interrupted. The new
+/// superblock is renamed to .db.super.compact only once the new index and
+/// data files are complete, so its presence decides which way to go.
+static mdb_status_t mdb_recover_compact(const char *path) {
+  char pathbuf[4096];
+  if (!mdb_make_path(pathbuf, sizeof(pathbuf), path, ".db.super.compact")) {
+    return mdb_status(MDB_ERR_OPEN_FILE, "database path too long");
+  }
+  if (access(pathbuf, F_OK) != 0) {
+    mdb_remove(path, ".db.super.new");
+    mdb_remove(path, ".db.index.compact");
+    mdb_remove(path, ".db.data.compact");
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (!mdb_rename(path, ".db.index.compact", ".db.index")
+      || !mdb_rename(path, ".db.data.compact", ".db.data")
+      || !mdb_rename(path, ".db.super.compact", ".db.super")
+      || !mdb_sync_dir(path)) {
+    return mdb_status(MDB_ERR_WRITE, "cannot swap in compacted files");
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// the new data file of a compaction in slab mode only ever grows
+typedef struct {
+  mdb_ptr_t end;
+  uint32_t page_size;
+} mdb_compact_pages_t;
+
+static mdb_status_t mdb_compact_grow(void *ctx, uint32_t pages,
+                                     mdb_ptr_t *ptr) {
+  mdb_compact_pages_t *file = (mdb_compact_pages_t*)ctx;
+  *ptr = file->end;
+  file->end += pages * file->page_size;
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// writes all live records to new files, bucket by bucket with each chain
+/// stored contiguously and the values in the same order, and swaps them in.
+/// The bucket table keeps its size and segment structure. In slab mode the
+/// values are packed into fresh pages instead.
+static mdb_status_t mdb_compact_rewrite(mdb_int_t *db) {
+  uint32_t segment_count = 0;
+  while (segment_count + 1 < MDB_SEGMENTS_MAX
+         && db->segments[segment_count + 1] != 0) {
+    segment_count++;
+  }
+  mdb_ptr_t segments[MDB_SEGMENTS_MAX] = { 0 };
+  size_t records_begin = MDB_PTR_SIZE * ((size_t)db->options.hash_buckets + 1);
+  for (uint32_t k = 1; k <= segment_count; k++) {
+    size_t segment_size = ((size_t)db->options.hash_buckets << (k - 1))
+                          * MDB_PTR_SIZE;
+    segment_size = (segment_size + db->index_record_size - 1)
+                   / db->index_record_size * db->index_record_size;
+    segments[k] = (mdb_ptr_t)records_begin;
+    records_begin += segment_size;
+  }
+
+  size_t slot_count = ((size_t)db->options.hash_buckets << segment_count) + 1;
+  mdb_ptr_t *heads = (mdb_ptr_t*)calloc(slot_count, MDB_PTR_SIZE);
+  uint8_t *record = (uint8_t*)malloc(db->index_record_size);
+  FILE *fp_index = mdb_fopen(db->path, ".db.index.compact", "wb");
+  FILE *fp_data = mdb_fopen(db->path, ".db.data.compact", "wb");
+  char *value = NULL;
+  size_t value_cap = 0;
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  if (heads == NULL || record == NULL) {
+    status = mdb_status(MDB_ERR_ALLOC, "cannot allocate compaction buffer");
+  } else if (fp_index == NULL || fp_data == NULL) {
+    status = mdb_status(MDB_ERR_OPEN_FILE, "cannot create compacted files");
+  } else if (fseek(fp_index, (long)records_begin, SEEK_SET) != 0) {
+    status = mdb_status(MDB_ERR_SEEK, "cannot seek in compacted index");
+  }
+
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  mdb_ptr_t index_end = (mdb_ptr_t)records_begin, data_end = 0;
+  bool slab_mode = db->slab.page_size != 0;
+  mdb_slab_t slab;
+  mdb_compact_pages_t pages = { 0, db->slab.page_size };
+  if (slab_mode) {
+    (void)mdb_slab_init(&slab, db->slab.page_size);
+  }
+  for (uint32_t bucket = 0;
+       bucket < mdb_bucket_count(db) && status.code == MDB_OK; bucket++) {
+    mdb_ptr_t ptr = db->heads[bucket + 1];
+    heads[bucket + 1] = ptr != 0 ? index_end : 0;
+    while (ptr != 0 && status.code == MDB_OK) {
+      status = mdb_read_index(db, ptr, index);
+      if (status.code != MDB_OK) {
+        break;
+      }
+      if (value_cap < (size_t)index->value_size + 1) {
+        char *new_value = (char*)realloc(value, index->value_size + 1);
+        if (new_value == NULL) {
+          status = mdb_status(MDB_ERR_ALLOC,
+                              "cannot allocate compaction buffer");
+          break;
+        }
+        value = new_value;
+        value_cap = (size_t)index->value_size + 1;
+      }
+      status = mdb_read_data(db, index->value_ptr, index->value_size, value,
+                             (mdb_size_t)value_cap);
+      if (status.code != MDB_OK) {
+        break;
+      }
+
+      ptr = index->next_ptr;
+      index->next_ptr = ptr != 0 ? index_end + db->index_record_size : 0;
+      index->value_ptr = slab_mode ? pages.end : data_end;
+      if (slab_mode && index->value_size != 0) {
+        uint32_t page;
+        bool fresh;
+        status = mdb_slab_place(&slab, index->value_size, mdb_compact_grow,
+                                &pages, &(index->value_ptr), &page, &fresh);
+        if (status.code == MDB_OK
+            && fseek(fp_data, (long)index->value_ptr, SEEK_SET) != 0) {
+          status = mdb_status(MDB_ERR_SEEK, "cannot seek in compacted data");
+        }
+        if (status.code != MDB_OK) {
+          break;
+        }
+      }
+      mdb_encode_index(db, index, record);
+      if (fwrite(record, db->index_record_size, 1, fp_index) != 1
+          || fwrite(value, 1, index->value_size, fp_data)
+             != index->value_size) {
+        status = mdb_status(MDB_ERR_WRITE, "cannot write compacted files");
+      }
+      index_end += db->index_record_size;
+      data_end += index->value_size;
+    }
+  }
+
+  /// the bucket heads go in last, laid out the way mdb_load_heads reads them
+  size_t slot = 0;
+  for (uint32_t k = 0; k <= segment_count && status.code == MDB_OK; k++) {
+    mdb_ptr_t offset = k == 0 ? 0 : segments[k];
+    size_t length = k == 0 ? db->options.hash_buckets + 1
+                           : (size_t)db->options.hash_buckets << (k - 1);
+    if (fseek(fp_index, (long)offset, SEEK_SET) != 0
+        || fwrite(heads + slot, MDB_PTR_SIZE, length, fp_index) != length) {
+      status = mdb_status(MDB_ERR_WRITE, "cannot write compacted index");
+    }
+    slot += length;
+  }
+  if (slab_mode) {
+    uint8_t *header = alloca(slab.header_size[0]);
+    for (uint32_t page = 0;
+         page < pages.end / slab.page_size && status.code == MDB_OK; page++) {
+      if (slab.pages[page].kind == MDB_PAGE_FREE) {
+        continue;
+      }
+      uint32_t size = mdb_slab_encode_header(&slab, page, header);
+      if (fseek(fp_data, (long)page * slab.page_size, SEEK_SET) != 0
+          || fwrite(header, 1, size, fp_data) != size) {
+        status = mdb_status(MDB_ERR_WRITE, "cannot write compacted data");
+      }
+    }
+    data_end = pages.end;
+  }
+  if (status.code == MDB_OK
+      && (mdb_flush_file(db, fp_index) != 0
+          || mdb_flush_file(db, fp_data) != 0
+          || ftruncate(fileno(fp_index), (off_t)index_end) != 0
+          || ftruncate(fileno(fp_data), (off_t)data_end) != 0
+          || fsync(fileno(fp_index)) != 0 || fsync(fileno(fp_data)) != 0)) {
+    status = mdb_status(MDB_ERR_FLUSH, "cannot sync compacted files");
+  }
+  if (fp_index != NULL) {
+    fclose(fp_index);
+  }
+  if (fp_data != NULL) {
+    fclose(fp_data);
+  }
+  free(record);
+  free(value);
+
+  if (status.code == MDB_OK) {
+    FILE *fp_superblock = mdb_fopen(db->path, ".db.super.new", "w");
+    if (fp_superblock == NULL) {
+      status = mdb_status(MDB_ERR_OPEN_FILE, "cannot create new superblock");
+    } else {
+      status = mdb_format_superblock(db, fp_superblock, db->level,
+                                     db->split, segments, NULL);
+      if (status.code == MDB_OK && fsync(fileno(fp_superblock)) != 0) {
+        status = mdb_status(MDB_ERR_FLUSH, "cannot sync new superblock");
+      }
+      fclose(fp_superblock);
+    }
+  }
+  if (status.code == MDB_OK
+      && !mdb_rename(db->path, ".db.super.new", ".db.super.compact")) {
+    status = mdb_status(MDB_ERR_WRITE, "cannot commit compaction");
+  }
+  if (status.code == MDB_OK) {
+    /// committed; should the swap fail halfway, the next open finishes it
+    status = mdb_recover_compact(db->path);
+  } else {
+    mdb_remove(db->path, ".db.super.new");
+    mdb_remove(db->path, ".db.index.compact");
+    mdb_remove(db->path, ".db.data.compact");
+  }
+  if (status.code != MDB_OK) {
+    if (slab_mode) {
+      mdb_slab_destroy(&slab);
+    }
+    free(heads);
+    return status;
+  }
+  return mdb_compact_reopen(db, heads, segments, index_end, data_end,
+                            slab_mode ? &slab : NULL);
+}
+
+/// moves the handle over to the files compaction swapped in
+static mdb_status_t mdb_compact_reopen(mdb_int_t *db, mdb_ptr_t *heads,
+                                       const mdb_ptr_t *segments,
+                                       mdb_ptr_t index_end,
+                                       mdb_ptr_t data_end, mdb_slab_t *slab) {
+  FILE *fp_superblock = mdb_fopen(db->path, ".db.super", "r+");
+  FILE *fp_index = mdb_fopen(db->path, ".db.index", "rb+");
+  FILE *fp_data = mdb_fopen(db->path, ".db.data", "rb+");
+  if (fp_superblock == NULL || fp_index == NULL || fp_data == NULL) {
+    if (fp_superblock != NULL) {
+      fclose(fp_superblock);
+    }
+    if (fp_index != NULL) {
+      fclose(fp_index);
+    }
+    if (fp_data != NULL) {
+      fclose(fp_data);
+    }
+    if (slab != NULL) {
+      mdb_slab_destroy(slab);
+    }
+    free(heads);
+    return mdb_status(MDB_ERR_OPEN_FILE, "cannot reopen compacted files");
+  }
+
+  if (db->index_map != NULL) {
+    (void)munmap(db->index_map, db->index_map_size);
+    db->index_map = NULL;
+    db->index_map_size = 0;
+  }
+  if (db->data_map != NULL) {
+    (void)munmap(db->data_map, db->data_map_size);
+    db->data_map = NULL;
+    db->data_map_size = 0;
+  }
+  if (db->flusher.running) {
+    (void)pthread_mutex_lock(&db->flusher.lock);
+  }
+  fclose(db->fp_superblock);
+  fclose(db->fp_index);
+  fclose(db->fp_data);
+  db->fp_superblock = fp_superblock;
+  db->fp_index = fp_index;
+  db->fp_data = fp_data;
+  if (db->pio) {
+    db->fd_index = fileno(fp_index);
+    db->fd_data = fileno(fp_data);
+  }
+  if (db->flusher.running) {
+    db->flusher.fd_index = fileno(fp_index);
+    db->flusher.fd_data = fileno(fp_data);
+    (void)pthread_mutex_unlock(&db->flusher.lock);
+  }
+
+  free(db->heads);
+  db->heads = heads;
+  memcpy(db->segments, segments, sizeof(db->segments));
+  db->super_level = db->level;
+  db->super_split = db->split;
+  db->layout_pending = false;
+  __atomic_store_n(&db->index_end, index_end, __ATOMIC_RELEASE);
+  __atomic_store_n(&db->data_end, data_end, __ATOMIC_RELEASE);
+  db->index_cap = index_end;
+  db->data_cap = data_end;
+  mdb_extent_clear(&db->free_map);
+  if (slab != NULL) {
+    mdb_slab_destroy(&db->slab);
+    db->slab = *slab;
+  }
+  db->compacting = false;
+  db->compact_vacated_count = 0;
+
+  if (db->options.flags & MDB_FLAG_MMAP_INDEX) {
+    mdb_status_t map_status = mdb_map_index(db);
+    STAT_CHECK_RET(map_status, {;});
+  }
+  if (db->options.flags & MDB_FLAG_MMAP_DATA) {
+    mdb_status_t map_status = mdb_map_data(db);
+    STAT_CHECK_RET(map_status, {;});
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// moves the values of one chain into lower free extents and its records
+/// into lower free slots. A moved record is linked in before its old slot
+/// is cleared, and the chain keeps its order.
+static mdb_status_t mdb_compact_chain(mdb_int_t *db, uint32_t bucket,
+                                      size_t *visited) {
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  char *value = NULL;
+  mdb_ptr_t save_ptr = mdb_bucket_slot(db, bucket);
+  mdb_ptr_t ptr;
+  mdb_status_t status = mdb_read_bucket(db, bucket, &ptr);
+  while (status.code == MDB_OK && ptr != 0) {
+    status = mdb_read_index(db, ptr, index);
+    if (status.code != MDB_OK) {
+      break;
+    }
+    (*visited)++;
+
+    mdb_ptr_t value_ptr = 0;
+    bool move_value = false;
+    if (index->value_size != 0) {
+      mdb_lock_alloc(db);
+      if (db->slab.page_size != 0) {
+        move_value = mdb_slab_take_below(db, index->value_size,
+                                         index->value_ptr, &value_ptr);
+      } else {
+        move_value = mdb_extent_take(&db->free_map, index->value_size,
+                                     &value_ptr);
+        if (move_value && value_ptr > index->value_ptr) {
+          mdb_extent_insert(&db->free_map, value_ptr, index->value_size);
+          move_value = false;
+        }
+      }
+      mdb_unlock_alloc(db);
+    }
+    if (move_value) {
+      char *new_value = (char*)realloc(value, index->value_size + 1);
+      if (new_value == NULL) {
+        status = mdb_status(MDB_ERR_ALLOC, "cannot allocate value buffer");
+      } else {
+        value = new_value;
+        status = mdb_read_data(db, index->value_ptr, index->value_size,
+                               value, index->value_size + 1);
+      }
+      if (status.code == MDB_OK) {
+        status = mdb_write_data(db, value_ptr, value, index->value_size);
+      }
+      if (status.code == MDB_OK) {
+        status = mdb_write_index(db, ptr, index->key, value_ptr,
+                                 index->value_size);
+      }
+      if (status.code != MDB_OK) {
+        (void)mdb_data_free(db, value_ptr, index->value_size);
+        break;
+      }
+      status = mdb_data_free(db, index->value_ptr, index->value_size);
+      index->value_ptr = value_ptr;
+    }
+
+    mdb_ptr_t freeptr = 0;
+    if (status.code == MDB_OK) {
+      status = mdb_read_nextptr(db, 0, &freeptr);
+    }
+    if (status.code == MDB_OK && freeptr != 0 && freeptr < ptr) {
+      if (db->compact_vacated_count == db->compact_vacated_cap) {
+        size_t cap = db->compact_vacated_cap != 0
+                     ? db->compact_vacated_cap * 2 : 64;
+        mdb_ptr_t *vacated = (mdb_ptr_t*)realloc(db->compact_vacated,
+                                                 cap * MDB_PTR_SIZE);
+        if (vacated == NULL) {
+          status = mdb_status(MDB_ERR_ALLOC, "cannot allocate slot list");
+          break;
+        }
+        db->compact_vacated = vacated;
+        db->compact_vacated_cap = cap;
+      }
+      mdb_ptr_t new_ptr;
+      status = mdb_index_alloc(db, &new_ptr);
+      if (status.code != MDB_OK) {
+        break;
+      }
+      status = mdb_write_index(db, new_ptr, index->key, index->value_ptr,
+                               index->value_size);
+      if (status.code == MDB_OK) {
+        status = mdb_write_nextptr(db, new_ptr, index->next_ptr);
+      }
+      if (status.code == MDB_OK) {
+        status = mdb_write_nextptr(db, save_ptr, new_ptr);
+      }
+      if (status.code != MDB_OK) {
+        (void)mdb_index_free(db, new_ptr);
+        break;
+      }
+      /// kept off the freelist for now, where it would be taken before the
+      /// lower slots still to be filled
+      db->compact_vacated[db->compact_vacated_count++] = ptr;
+      status = mdb_index_clear(db, ptr, 0);
+      ptr = new_ptr;
+    }
+    save_ptr = ptr;
+    ptr = index->next_ptr;
+  }
+  free(value);
+  return status;
+}
+
+/// rebuilds the index freelist in address order, vacated records included,
+/// and gives the free records and the free data extent at the end of the
+/// files back to the file system
+static mdb_status_t mdb_compact_trim(mdb_int_t *db) {
+  size_t count = db->compact_vacated_count;
+  size_t cap = count + 64;
+  mdb_ptr_t *slots = (mdb_ptr_t*)malloc(cap * MDB_PTR_SIZE);
+  if (slots == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate slot list");
+  }
+  if (count != 0) {
+    memcpy(slots, db->compact_vacated, count * MDB_PTR_SIZE);
+  }
+
+  mdb_ptr_t index_end = mdb_index_end(db);
+  size_t slots_max = index_end / db->index_record_size;
+  mdb_ptr_t ptr;
+  mdb_status_t status = mdb_read_nextptr(db, 0, &ptr);
+  while (status.code == MDB_OK && ptr != 0) {
+    if (count == slots_max) {
+      status = mdb_status(MDB_ERR_FORMAT, "index freelist has a cycle");
+      break;
+    }
+    if (count == cap) {
+      cap *= 2;
+      mdb_ptr_t *new_slots = (mdb_ptr_t*)realloc(slots, cap * MDB_PTR_SIZE);
+      if (new_slots == NULL) {
+        status = mdb_status(MDB_ERR_ALLOC, "cannot allocate slot list");
+        break;
+      }
+      slots = new_slots;
+    }
+    slots[count++] = ptr;
+    status = mdb_read_nextptr(db, ptr, &ptr);
+  }
+  STAT_CHECK_RET(status, { free(slots); });
+  qsort(slots, count, MDB_PTR_SIZE, mdb_bucket_cmp);
+
+  while (count != 0 && slots[count - 1] + db->index_record_size == index_end) {
+    index_end -= db->index_record_size;
+    count--;
+  }
+  db->batching = true;
+  for (size_t i = 0; i < count && status.code == MDB_OK; i++) {
+    status = mdb_write_nextptr(db, slots[i], i + 1 < count ? slots[i + 1] : 0);
+  }
+  if (status.code == MDB_OK) {
+    status = mdb_write_nextptr(db, 0, count != 0 ? slots[0] : 0);
+  }
+  free(slots);
+  mdb_status_t end_status = mdb_end_batch(db);
+  STAT_CHECK_RET(status, {;});
+  STAT_CHECK_RET(end_status, {;});
+  db->compact_vacated_count = 0;
+  if (db->wal.enabled) {
+    /// pages or a replay past the new ends would stretch the files again
+    status = mdb_wal_checkpoint(db);
+    STAT_CHECK_RET(status, {;});
+  }
+
+  if (index_end < mdb_index_end(db)) {
+    if (ftruncate(fileno(db->fp_index), (off_t)index_end) != 0) {
+      return mdb_status(MDB_ERR_WRITE, "cannot shrink index file");
+    }
+    __atomic_store_n(&db->index_end, index_end, __ATOMIC_RELEASE);
+    db->index_cap = index_end;
+  }
+
+  mdb_lock_alloc(db);
+  mdb_ptr_t data_end;
+  if (mdb_extent_take_tail(&db->free_map, db->data_end, &data_end)) {
+    if (ftruncate(fileno(db->fp_data), (off_t)data_end) != 0) {
+      mdb_extent_insert(&db->free_map, data_end, db->data_end - data_end);
+      status = mdb_status(MDB_ERR_WRITE, "cannot shrink data file");
+    } else {
+      __atomic_store_n(&db->data_end, data_end, __ATOMIC_RELEASE);
+      db->data_cap = data_end;
+    }
+  }
+  mdb_unlock_alloc(db);
+  return status;
+}
+
+static int mdb_extent_cmp(const void *lhs, const void *rhs) {
+  mdb_ptr_t l = ((const mdb_ptr_t*)lhs)[0];
+  mdb_ptr_t r = ((const mdb_ptr_t*)rhs)[0];
+  return (l > r) - (l < r);
+}
+
+/// walks every bucket chain once at open to rebuild the in-memory state
+/// that is not persisted: free data extents and the item count
+static mdb_status_t mdb_scan_index(mdb_int_t *db) {
+  if (fseek(db->fp_data, 0, SEEK_END) != 0) {
+    return mdb_status(MDB_ERR_SEEK, "cannot seek to end of data file");
+  }
+  db->data_end = (mdb_ptr_t)ftell(db->fp_data);
+  db->data_cap = db->data_end;
+
+  /// the filter is sized by the records the index file has room for, which
+  /// bounds the live ones
+  if ((db->options.flags & MDB_FLAG_BLOOM)
+      && !mdb_bloom_alloc(&db->bloom,
+                          (uint64_t)(db->index_end / db->index_record_size)
+                          * 2)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate filter");
+  }
+
+  /// live extents as (offset, size) pairs, collected from all bucket chains
+  size_t live_count = 0, live_cap = 64;
+  mdb_ptr_t *live = (mdb_ptr_t*)malloc(sizeof(mdb_ptr_t) * 2 * live_cap);
+  if (live == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate extent buffer");
+  }
+
+  mdb_index_t *index = alloca(sizeof(mdb_index_t)
+                              + db->options.key_size_max + 1);
+  uint32_t bucket_count = mdb_bucket_count(db);
+  for (uint32_t bucket = 0; bucket < bucket_count; bucket++) {
+    mdb_ptr_t ptr;
+    mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, &ptr);
+    STAT_CHECK_RET(bucket_read_status, { free(live); });
+    while (ptr != 0) {
+      mdb_status_t index_read_status = mdb_read_index(db, ptr, index);
+      STAT_CHECK_RET(index_read_status, { free(live); });
+      if (live_count == live_cap) {
+        live_cap *= 2;
+        mdb_ptr_t *new_live =
+            (mdb_ptr_t*)realloc(live, sizeof(mdb_ptr_t) * 2 * live_cap);
+        if (new_live == NULL) {
+          free(live);
+          return mdb_status(MDB_ERR_ALLOC, "cannot allocate extent buffer");
+        }
+        live = new_live;
+      }
+      live[live_count * 2] = index->value_ptr;
+      live[live_count * 2 + 1] = index->value_size;
+      live_count++;
+      mdb_bloom_add(&db->bloom, index->hash);
+      ptr = index->next_ptr;
+    }
+  }
+
+  qsort(live, live_count, sizeof(mdb_ptr_t) * 2, mdb_extent_cmp);
+  db->item_count = (uint32_t)live_count;
+  if (db->slab.page_size != 0) {
+    mdb_status_t load_status = mdb_slab_load(db, live, live_count);
+    free(live);
+    return load_status;
+  }
+
+  mdb_ptr_t cursor = 0;
+  for (size_t i = 0; i < live_count; i++) {
+    if (live[i * 2] > cursor) {
+      mdb_extent_insert(&db->free_map, cursor, live[i * 2] - cursor);
+    }
+    if (live[i * 2] + live[i * 2 + 1] > cursor) {
+      cursor = live[i * 2] + live[i * 2 + 1];
+    }
+  }
+  if (db->data_end > cursor) {
+    mdb_extent_insert(&db->free_map, cursor, db->data_end - cursor);
+  }
+
+  free(live);
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_extent_update(mdb_extent_t *node) {
+  node->max_size = node->size;
+  if (node->left != NULL && node->left->max_size > node->max_size) {
+    node->max_size = node->left->max_size;
+  }
+  if (node->right != NULL && node->right->max_size > node->max_size) {
+    node->max_size = node->right->max_size;
+  }
+}
+
+/// splits @p tree into extents with offset < @p offset and the rest
+static void mdb_extent_split(mdb_extent_t *tree, mdb_ptr_t offset,
+                             mdb_extent_t **lhs, mdb_extent_t **rhs) {
+  if (tree == NULL) {
+    *lhs = *rhs = NULL;
+  } else if (tree->offset < offset) {
+    mdb_extent_split(tree->right, offset, &(tree->right), rhs);
+    mdb_extent_update(tree);
+    *lhs = tree;
+  } else {
+    mdb_extent_split(tree->left, offset, lhs, &(tree->left));
+    mdb_extent_update(tree);
+    *rhs = tree;
+  }
+}
+
+static mdb_extent_t *mdb_extent_merge(mdb_extent_t *lhs, mdb_extent_t *rhs) {
+  if (lhs == NULL) {
+    return rhs;
+  }
+  if (rhs == NULL) {
+    return lhs;
+  }
+  if (lhs->priority > rhs->priority) {
+    lhs->right = mdb_extent_merge(lhs->right, rhs);
+    mdb_extent_update(lhs);
+    return lhs;
+  } else {
+    rhs->left = mdb_extent_merge(lhs, rhs->left);
+    mdb_extent_update(rhs);
+    return rhs;
+  }
+}
+
+/// detaches the extent starting exactly at @p offset, if there is one
+static mdb_extent_t *mdb_extent_detach(mdb_extent_t **tree, mdb_ptr_t offset) {
+  mdb_extent_t *lhs, *mid, *rhs;
+  mdb_extent_split(*tree, offset, &lhs, &mid);
+  mdb_extent_split(mid, offset + 1, &mid, &rhs);
+  *tree = mdb_extent_merge(lhs, rhs);
+  return mid;
+}
+
+static void mdb_extent_insert(mdb_extent_map_t *map, mdb_ptr_t offset,
+                              mdb_size_t size) {
+  if (size == 0) {
+    return;
+  }
+
+  mdb_extent_t *lhs, *rhs;
+  mdb_extent_split(map->root, offset, &lhs, &rhs);
+
+  mdb_extent_t *pred = lhs;
+  while (pred != NULL && pred->right != NULL) {
+    pred = pred->right;
+  }
+  mdb_extent_t *succ = rhs;
+  while (succ != NULL && succ->left != NULL) {
+    succ = succ->left;
+  }
+
+  mdb_extent_t *node = NULL;
+  if (pred != NULL && pred->offset + pred->size == offset) {
+    node = mdb_extent_detach(&lhs, pred->offset);
+    size += node->size;
+    offset = node->offset;
+  }
+  if (succ != NULL && offset + size == succ->offset) {
+    mdb_extent_t *merged = mdb_extent_detach(&rhs, succ->offset);
+    size += merged->size;
+    if (node == NULL) {
+      node = merged;
+    } else {
+      free(merged);
+    }
+  }
+  if (node == NULL) {
+    node = (mdb_extent_t*)malloc(sizeof(mdb_extent_t));
+    if (node == NULL) {
+      /// losing track of a free extent only leaks space in the data file
+      map->root = mdb_extent_merge(lhs, rhs);
+      return;
+    }
+  }
+
+  map->seed ^= map->seed << 13;
+  map->seed ^= map->seed >> 17;
+  map->seed ^= map->seed << 5;
+  node->offset = offset;
+  node->size = size;
+  node->priority = map->seed;
+  node->left = node->right = NULL;
+  mdb_extent_update(node);
+  map->root = mdb_extent_merge(mdb_extent_merge(lhs, node), rhs);
+}
+
+static bool mdb_extent_take(mdb_extent_map_t *map, mdb_size_t size,
+                            mdb_ptr_t *offset) {
+  if (map->root == NULL || map->root->max_size < size) {
+    return false;
+  }
+
+  mdb_extent_t *node = map->root;
+  for (;;) {
+    map->steps++;
+    if (node->left != NULL && node->left->max_size >= size) {
+      node = node->left;
+    } else if (node->size >= size) {
+      break;
+    } else {
+      node = node->right;
+    }
+  }
+
+  node = mdb_extent_detach(&map->root, node->offset);
+  *offset = node->offset;
+  mdb_ptr_t rest_offset = node->offset + size;
+  mdb_size_t rest_size = node->size - size;
+  free(node);
+  mdb_extent_insert(map, rest_offset, rest_size);
+  return true;
+}
+
+/// takes the extent which ends exactly at @p end, if there is one
+static bool mdb_extent_take_tail(mdb_extent_map_t *map, mdb_ptr_t end,
+                                 mdb_ptr_t *offset) {
+  mdb_extent_t *node = map->root;
+  while (node != NULL && node->right != NULL) {
+    node = node->right;
+  }
+  if (node == NULL || node->offset + node->size != end) {
+    return false;
+  }
+  node = mdb_extent_detach(&map->root, node->offset);
+  *offset = node->offset;
+  free(node);
+  return true;
+}
+
+static void mdb_extent_free_tree(mdb_extent_t *tree) {
+  if (tree != NULL) {
+    mdb_extent_free_tree(tree->left);
+    mdb_extent_free_tree(tree->right);
+    free(tree);
+  }
+}
+
+static void mdb_extent_clear(mdb_extent_map_t *map) {
+  mdb_extent_free_tree(map->root);
+  map->root = NULL;
+}
+
+static bool mdb_slab_init(mdb_slab_t *slab, uint32_t page_size) {
+  memset(slab, 0, sizeof(mdb_slab_t));
+  if (page_size < MDB_SLAB_PAGE_MIN || page_size > MDB_SLAB_PAGE_MAX
+      || (page_size & (page_size - 1)) != 0) {
+    return false;
+  }
+  slab->page_size = page_size;
+
+  /// a slot takes its own size plus one bit of the header bitmap
+  for (uint32_t slot = MDB_SLAB_MIN_SLOT; slot <= page_size / 4; slot *= 2) {
+    uint32_t cls = slab->class_count++;
+    uint64_t slots = (uint64_t)(page_size - MDB_SLAB_HEADER_SIZE) * 8
+                     / ((uint64_t)slot * 8 + 1);
+    uint32_t header_size;
+    for (;;) {
+      header_size = MDB_SLAB_HEADER_SIZE + (uint32_t)(slots + 63) / 64 * 8;
+      if (header_size + slots * slot <= page_size) {
+        break;
+      }
+      slots--;
+    }
+    slab->slots[cls] = (uint32_t)slots;
+    slab->header_size[cls] = header_size;
+    slab->partial[cls] = MDB_SLAB_NONE;
+  }
+  return true;
+}
+
+static void mdb_slab_destroy(mdb_slab_t *slab) {
+  for (uint32_t page = 0; page < slab->page_count; page++) {
+    free(slab->pages[page].bitmap);
+  }
+  free(slab->pages);
+  slab->pages = NULL;
+  slab->page_count = 0;
+}
+
+/// makes room for the descriptors of the first @p page_count pages
+static bool mdb_slab_reserve(mdb_slab_t *slab, uint32_t page_count) {
+  if (page_count <= slab->page_count) {
+    return true;
+  }
+  uint32_t new_count = slab->page_count != 0 ? slab->page_count : 64;
+  while (new_count < page_count) {
+    new_count *= 2;
+  }
+  mdb_slab_page_t *pages =
+      (mdb_slab_page_t*)realloc(slab->pages,
+                                new_count * sizeof(mdb_slab_page_t));
+  if (pages == NULL) {
+    return false;
+  }
+  memset(pages + slab->page_count, 0,
+         (new_count - slab->page_count) * sizeof(mdb_slab_page_t));
+  slab->pages = pages;
+  slab->page_count = new_count;
+  return true;
+}
+
+/// the size class of a value, or -1 for a value that takes whole pages
+static int mdb_slab_class(mdb_slab_t *slab, mdb_size_t size) {
+  int cls = 0;
+  for (uint32_t slot = MDB_SLAB_MIN_SLOT; cls < (int)slab->class_count;
+       slot *= 2, cls++) {
+    if (size <= slot) {
+      return cls;
+    }
+  }
+  return -1;
+}
+
+static uint32_t mdb_slab_run_pages(mdb_slab_t *slab, mdb_size_t size) {
+  return (uint32_t)(((uint64_t)size + MDB_SLAB_HEADER_SIZE
+                     + slab->page_size - 1) / slab->page_size);
+}
+
+static void mdb_slab_push(mdb_slab_t *slab, uint32_t page) {
+  mdb_slab_page_t *p = slab->pages + page;
+  p->prev = MDB_SLAB_NONE;
+  p->next = slab->partial[p->cls];
+  if (p->next != MDB_SLAB_NONE) {
+    slab->pages[p->next].prev = page;
+  }
+  slab->partial[p->cls] = page;
+}
+
+static void mdb_slab_unlink(mdb_slab_t *slab, uint32_t page) {
+  mdb_slab_page_t *p = slab->pages + page;
+  if (p->prev != MDB_SLAB_NONE) {
+    slab->pages[p->prev].next = p->next;
+  } else {
+    slab->partial[p->cls] = p->next;
+  }
+  if (p->next != MDB_SLAB_NONE) {
+    slab->pages[p->next].prev = p->prev;
+  }
+}
+
+static bool mdb_slab_make_page(mdb_slab_t *slab, uint32_t page, int cls) {
+  mdb_slab_page_t *p = slab->pages + page;
+  p->bitmap = (uint64_t*)calloc((slab->slots[cls] + 63) / 64,
+                                sizeof(uint64_t));
+  if (p->bitmap == NULL) {
+    return false;
+  }
+  p->kind = MDB_PAGE_SLAB;
+  p->cls = (uint8_t)cls;
+  p->pages = 1;
+  p->used = 0;
+  p->hint = 0;
+  return true;
+}
+
+static void mdb_slab_drop_page(mdb_slab_t *slab, uint32_t page) {
+  mdb_slab_page_t *p = slab->pages + page;
+  free(p->bitmap);
+  memset(p, 0, sizeof(mdb_slab_page_t));
+}
+
+/// takes the lowest free slot of a page with room left
+static uint32_t mdb_slab_take_slot(mdb_slab_t *slab, uint32_t page) {
+  mdb_slab_page_t *p = slab->pages + page;
+  uint32_t words = (slab->slots[p->cls] + 63) / 64;
+  while (p->hint < words && p->bitmap[p->hint] == UINT64_MAX) {
+    p->hint++;
+  }
+  uint32_t bit = p->hint * 64 + (uint32_t)__builtin_ctzll(~p->bitmap[p->hint]);
+  p->bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+  p->used++;
+  if (p->used == slab->slots[p->cls]) {
+    mdb_slab_unlink(slab, page);
+  }
+  return bit;
+}
+
+static mdb_ptr_t mdb_slab_slot_ptr(mdb_slab_t *slab, uint32_t page,
+                                   uint32_t slot) {
+  int cls = slab->pages[page].cls;
+  return (mdb_ptr_t)((uint64_t)page * slab->page_size
+                     + slab->header_size[cls]
+                     + (uint64_t)slot * (MDB_SLAB_MIN_SLOT << cls));
+}
+
+/// places a value of @p size, setting up a page from @p source when no page
+/// of its class has room. *page tells where it went and *fresh whether the
+/// page is new, so that the caller can persist its header.
+static mdb_status_t mdb_slab_place(mdb_slab_t *slab, mdb_size_t size,
+                                   mdb_page_source_t source, void *ctx,
+                                   mdb_ptr_t *ptr, uint32_t *page,
+                                   bool *fresh) {
+  int cls = mdb_slab_class(slab, size);
+  *fresh = cls < 0 || slab->partial[cls] == MDB_SLAB_NONE;
+  if (!*fresh) {
+    *page = slab->partial[cls];
+    *ptr = mdb_slab_slot_ptr(slab, *page, mdb_slab_take_slot(slab, *page));
+    return mdb_status(MDB_OK, NULL);
+  }
+
+  uint32_t pages = cls < 0 ? mdb_slab_run_pages(slab, size) : 1;
+  mdb_ptr_t run;
+  mdb_status_t source_status = source(ctx, pages, &run);
+  STAT_CHECK_RET(source_status, {;});
+  *page = run / slab->page_size;
+  if (!mdb_slab_reserve(slab, *page + pages)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate page table");
+  }
+  if (cls < 0) {
+    slab->pages[*page].kind = MDB_PAGE_LARGE;
+    slab->pages[*page].pages = pages;
+    slab->pages[*page].used = 1;
+    *ptr = run + MDB_SLAB_HEADER_SIZE;
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (!mdb_slab_make_page(slab, *page, cls)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate slot bitmap");
+  }
+  mdb_slab_push(slab, *page);
+  *ptr = mdb_slab_slot_ptr(slab, *page, mdb_slab_take_slot(slab, *page));
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// the on-disk header of a page; returns its size
+static uint32_t mdb_slab_encode_header(mdb_slab_t *slab, uint32_t page,
+                                       uint8_t *header) {
+  mdb_slab_page_t *p = slab->pages + page;
+  uint32_t count = p->kind == MDB_PAGE_SLAB ? slab->slots[p->cls] : p->pages;
+  header[0] = p->kind;
+  header[1] = p->kind == MDB_PAGE_SLAB ? p->cls : 0;
+  header[2] = header[3] = 0;
+  memcpy(header + 4, &count, sizeof(uint32_t));
+  if (p->kind != MDB_PAGE_SLAB) {
+    return MDB_SLAB_HEADER_SIZE;
+  }
+  uint32_t size = slab->header_size[p->cls];
+  memcpy(header + MDB_SLAB_HEADER_SIZE, p->bitmap,
+         size - MDB_SLAB_HEADER_SIZE);
+  return size;
+}
+
+static mdb_status_t mdb_slab_grow(void *ctx, uint32_t pages, mdb_ptr_t *ptr) {
+  mdb_int_t *db = (mdb_int_t*)ctx;
+  uint64_t size = (uint64_t)pages * db->slab.page_size;
+  if (size > UINT32_MAX - (uint64_t)db->data_end) {
+    return mdb_status(MDB_ERR_WRITE, "data file full");
+  }
+  return mdb_data_alloc_unlocked(db, (mdb_size_t)size, ptr);
+}
+
+/// allocates from the slab under the alloc lock. Only the bitmap byte of
+/// the slot is written back, or the whole header of a new page.
+static mdb_status_t mdb_slab_alloc(mdb_int_t *db, mdb_size_t valsize,
+                                   mdb_ptr_t *ptr) {
+  if (valsize == 0) {
+    *ptr = db->data_end;
+    return mdb_status(MDB_OK, NULL);
+  }
+  uint32_t page;
+  bool fresh;
+  mdb_status_t place_status = mdb_slab_place(&db->slab, valsize, mdb_slab_grow,
+                                             db, ptr, &page, &fresh);
+  STAT_CHECK_RET(place_status, {;});
+  return mdb_slab_persist(db, page, fresh ? MDB_SLAB_NONE : *ptr);
+}
+
+/// writes the header of @p page back, or just the bitmap byte of the slot
+/// at @p ptr unless that is MDB_SLAB_NONE
+static mdb_status_t mdb_slab_persist(mdb_int_t *db, uint32_t page,
+                                     mdb_ptr_t ptr) {
+  mdb_slab_t *slab = &db->slab;
+  mdb_slab_page_t *p = slab->pages + page;
+  mdb_ptr_t page_ptr = page * slab->page_size;
+  if (ptr == MDB_SLAB_NONE) {
+    uint8_t *header = alloca(p->kind == MDB_PAGE_SLAB
+                             ? slab->header_size[p->cls]
+                             : MDB_SLAB_HEADER_SIZE);
+    uint32_t size = mdb_slab_encode_header(slab, page, header);
+    return mdb_write_data(db, page_ptr, (const char*)header, size);
+  }
+  uint32_t slot = (ptr - page_ptr - slab->header_size[p->cls])
+                  / (MDB_SLAB_MIN_SLOT << p->cls);
+  return mdb_write_data(db, page_ptr + MDB_SLAB_HEADER_SIZE + slot / 8,
+                        (const char*)p->bitmap + slot / 8, 1);
+}
+
+/// gives a slot or a run of pages back under the alloc lock. A slab page
+/// that runs empty is released, unless it is the only one of its class
+/// with room, so that a class does not thrash over a page boundary.
+static mdb_status_t mdb_slab_release(mdb_int_t *db, mdb_ptr_t valptr,
+                                     mdb_size_t valsize) {
+  mdb_slab_t *slab = &db->slab;
+  if (valsize == 0) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  uint32_t page = valptr / slab->page_size;
+  mdb_slab_page_t *p = slab->pages + page;
+  mdb_ptr_t page_ptr = page * slab->page_size;
+  if (p->kind == MDB_PAGE_LARGE) {
+    uint32_t pages = p->pages;
+    memset(p, 0, sizeof(mdb_slab_page_t));
+    mdb_extent_insert(&db->free_map, page_ptr, pages * slab->page_size);
+    return mdb_slab_clear_pages(db, page, pages);
+  }
+
+  uint32_t slot = (valptr - page_ptr - slab->header_size[p->cls])
+                  / (MDB_SLAB_MIN_SLOT << p->cls);
+  bool was_full = p->used == slab->slots[p->cls];
+  p->bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+  p->used--;
+  if (slot / 64 < p->hint) {
+    p->hint = slot / 64;
+  }
+  if (was_full) {
+    mdb_slab_push(slab, page);
+  }
+  if (p->used != 0 || (slab->partial[p->cls] == page
+                       && p->next == MDB_SLAB_NONE)) {
+    return mdb_slab_persist(db, page, valptr);
+  }
+  mdb_slab_unlink(slab, page);
+  mdb_slab_drop_page(slab, page);
+  mdb_extent_insert(&db->free_map, page_ptr, slab->page_size);
+  return mdb_slab_clear_pages(db, page, 1);
+}
+
+/// makes @p pages pages from @p page read as free. They are punched out of
+/// the file where possible, or else have their headers cleared, one by one
+/// since values spanning a run leave arbitrary bytes where the headers of
+/// its later pages would be.
+static mdb_status_t mdb_slab_clear_pages(mdb_int_t *db, uint32_t page,
+                                         uint32_t pages) {
+  mdb_slab_t *slab = &db->slab;
+  mdb_ptr_t page_ptr = page * slab->page_size;
+  if (mdb_punch_hole(db, page_ptr, (size_t)pages * slab->page_size)) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  static const char zeros[MDB_SLAB_HEADER_SIZE];
+  for (uint32_t i = 0; i < pages; i++) {
+    mdb_status_t write_status =
+        mdb_write_data(db, page_ptr + i * slab->page_size, zeros,
+                       MDB_SLAB_HEADER_SIZE);
+    STAT_CHECK_RET(write_status, {;});
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// takes room for a value below @p limit, for compaction to move it there;
+/// fails rather than growing the file
+static bool mdb_slab_take_below(mdb_int_t *db, mdb_size_t valsize,
+                                mdb_ptr_t limit, mdb_ptr_t *ptr) {
+  mdb_slab_t *slab = &db->slab;
+  int cls = mdb_slab_class(slab, valsize);
+  uint32_t limit_page = limit / slab->page_size;
+  if (cls >= 0) {
+    uint32_t best = MDB_SLAB_NONE;
+    for (uint32_t page = slab->partial[cls]; page != MDB_SLAB_NONE;
+         page = slab->pages[page].next) {
+      if (page < limit_page && (best == MDB_SLAB_NONE || page < best)) {
+        best = page;
+      }
+    }
+    if (best == MDB_SLAB_NONE) {
+      return false;
+    }
+    *ptr = mdb_slab_slot_ptr(slab, best, mdb_slab_take_slot(slab, best));
+    return mdb_slab_persist(db, best, *ptr).code == MDB_OK;
+  }
+
+  uint32_t pages = mdb_slab_run_pages(slab, valsize);
+  mdb_ptr_t run;
+  if (!mdb_extent_take(&db->free_map, pages * slab->page_size, &run)) {
+    return false;
+  }
+  uint32_t page = run / slab->page_size;
+  if (page >= limit_page || !mdb_slab_reserve(slab, page + pages)) {
+    mdb_extent_insert(&db->free_map, run, pages * slab->page_size);
+    return false;
+  }
+  slab->pages[page].kind = MDB_PAGE_LARGE;
+  slab->pages[page].pages = pages;
+  slab->pages[page].used = 1;
+  *ptr = run + MDB_SLAB_HEADER_SIZE;
+  return mdb_slab_persist(db, page, MDB_SLAB_NONE).code == MDB_OK;
+}
+
+/// sets up @p page, which its header says is free, for the live value at
+/// @p ptr. A process that died could have written the index record of the
+/// value but not the header of its page, or freed the page after the value
+/// was written there. Pages inside a run of pages are never set up.
+static mdb_status_t mdb_slab_adopt(mdb_slab_t *slab, uint32_t page,
+                                   uint32_t page_total, mdb_ptr_t ptr,
+                                   mdb_size_t size) {
+  for (uint32_t before = page; before-- > 0; ) {
+    mdb_slab_page_t *p = slab->pages + before;
+    if (p->kind == MDB_PAGE_LARGE && before + p->pages > page) {
+      return mdb_status(MDB_ERR_FORMAT, "value outside of its slab page");
+    }
+    if (p->kind != MDB_PAGE_FREE) {
+      break;
+    }
+  }
+  int cls = mdb_slab_class(slab, size);
+  if (cls >= 0) {
+    if (!mdb_slab_make_page(slab, page, cls)) {
+      return mdb_status(MDB_ERR_ALLOC, "cannot allocate slot bitmap");
+    }
+    return mdb_status(MDB_OK, NULL);
+  }
+  uint32_t pages = mdb_slab_run_pages(slab, size);
+  if (ptr != (mdb_ptr_t)page * slab->page_size + MDB_SLAB_HEADER_SIZE
+      || pages > page_total - page) {
+    return mdb_status(MDB_ERR_FORMAT, "value outside of its slab page");
+  }
+  for (uint32_t i = 1; i < pages; i++) {
+    if (slab->pages[page + i].kind != MDB_PAGE_FREE) {
+      return mdb_status(MDB_ERR_FORMAT, "value outside of its slab page");
+    }
+  }
+  slab->pages[page].kind = MDB_PAGE_LARGE;
+  slab->pages[page].pages = pages;
+  return mdb_status(MDB_OK, NULL);
+}
+
+/// rebuilds the slab at open. The page headers give the layout, the live
+/// values found by the index scan say which slots are used; headers that
+/// disagree, say after a crash between a free and the index update, are
+/// written back, and empty pages are released. Without @p live, after a
+/// clean close, the slot bitmaps in the headers are taken as they are.
+/// After a crash, a header that cannot be read as one is taken for a free
+/// page, and a free page a live value points into is set up again for it.
+static mdb_status_t mdb_slab_load(mdb_int_t *db, const mdb_ptr_t *live,
+                                  size_t live_count) {
+  mdb_slab_t *slab = &db->slab;
+  if (db->data_end % slab->page_size != 0) {
+    return mdb_status(MDB_ERR_FORMAT, "data file is not made of whole pages");
+  }
+  uint32_t page_total = db->data_end / slab->page_size;
+  if (!mdb_slab_reserve(slab, page_total)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate page table");
+  }
+
+  uint8_t header[MDB_SLAB_HEADER_SIZE];
+  for (uint32_t page = 0; page < page_total; ) {
+    if (!mdb_read_raw(db, db->fp_data, db->fd_data, page * slab->page_size,
+                      header, MDB_SLAB_HEADER_SIZE)) {
+      return mdb_status(MDB_ERR_READ, "cannot read page header");
+    }
+    uint32_t count;
+    memcpy(&count, header + 4, sizeof(uint32_t));
+    bool bad_slab = header[0] == MDB_PAGE_SLAB
+                    && (header[1] >= slab->class_count
+                        || count != slab->slots[header[1]]);
+    bool bad_run = header[0] == MDB_PAGE_LARGE
+                   && (count == 0 || count > page_total - page);
+    if ((bad_slab || bad_run) && live != NULL) {
+      page++;
+    } else if (header[0] == MDB_PAGE_SLAB) {
+      if (bad_slab) {
+        return mdb_status(MDB_ERR_FORMAT, "bad slab page header");
+      }
+      if (!mdb_slab_make_page(slab, page, header[1])) {
+        return mdb_status(MDB_ERR_ALLOC, "cannot allocate slot bitmap");
+      }
+      mdb_slab_page_t *p = slab->pages + page;
+      uint32_t bitmap_size = slab->header_size[p->cls] - MDB_SLAB_HEADER_SIZE;
+      if (live == NULL
+          && !mdb_read_raw(db, db->fp_data, db->fd_data,
+                           page * slab->page_size + MDB_SLAB_HEADER_SIZE,
+                           p->bitmap, bitmap_size)) {
+        return mdb_status(MDB_ERR_READ, "cannot read page header");
+      }
+      for (uint32_t i = 0; live == NULL && i < bitmap_size / 8; i++) {
+        p->used += (uint32_t)__builtin_popcountll(p->bitmap[i]);
+      }
+      page++;
+    } else if (header[0] == MDB_PAGE_LARGE) {
+      if (bad_run) {
+        return mdb_status(MDB_ERR_FORMAT, "bad page run header");
+      }
+      slab->pages[page].kind = MDB_PAGE_LARGE;
+      slab->pages[page].pages = count;
+      slab->pages[page].used = live == NULL;
+      page += count;
+    } else {
+      page++;
+    }
+  }
+
+  for (size_t i = 0; i < live_count; i++) {
+    mdb_ptr_t ptr = live[i * 2];
+    mdb_size_t size = live[i * 2 + 1];
+    if (size == 0) {
+      continue;
+    }
+    uint32_t page = ptr / slab->page_size;
+    mdb_slab_page_t *p = page < page_total ? slab->pages + page : NULL;
+    mdb_ptr_t page_ptr = page * slab->page_size;
+    if (p != NULL && p->kind == MDB_PAGE_FREE) {
+      mdb_status_t adopt_status = mdb_slab_adopt(slab, page, page_total, ptr,
+                                                 size);
+      STAT_CHECK_RET(adopt_status, {;});
+    }
+    if (p != NULL && p->kind == MDB_PAGE_LARGE
+        && ptr == page_ptr + MDB_SLAB_HEADER_SIZE
+        && mdb_slab_run_pages(slab, size) == p->pages) {
+      p->used = 1;
+      continue;
+    }
+    if (p == NULL || p->kind != MDB_PAGE_SLAB
+        || mdb_slab_class(slab, size) != p->cls
+        || ptr < page_ptr + slab->header_size[p->cls]
+        || (ptr - page_ptr - slab->header_size[p->cls])
+           % (MDB_SLAB_MIN_SLOT << p->cls) != 0) {
+      return mdb_status(MDB_ERR_FORMAT, "value outside of its slab page");
+    }
+    uint32_t slot = (ptr - page_ptr - slab->header_size[p->cls])
+                    / (MDB_SLAB_MIN_SLOT << p->cls);
+    if (slot >= slab->slots[p->cls]) {
+      return mdb_status(MDB_ERR_FORMAT, "value outside of its slab page");
+    }
+    p->bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+    p->used++;
+  }
+
+  uint8_t *stored = alloca(slab->header_size[0]);
+  uint8_t *current = alloca(slab->header_size[0]);
+  for (uint32_t page = 0; page < page_total; ) {
+    mdb_slab_page_t *p = slab->pages + page;
+    mdb_ptr_t page_ptr = page * slab->page_size;
+    uint32_t pages = p->kind == MDB_PAGE_LARGE ? p->pages : 1;
+    if (p->kind != MDB_PAGE_FREE && p->used == 0) {
+      if (p->kind == MDB_PAGE_SLAB) {
+        mdb_slab_drop_page(slab, page);
+      } else {
+        memset(p, 0, sizeof(mdb_slab_page_t));
+      }
+      mdb_status_t clear_status = mdb_slab_clear_pages(db, page, pages);
+      STAT_CHECK_RET(clear_status, {;});
+    }
+    if (p->kind == MDB_PAGE_FREE) {
+      mdb_extent_insert(&db->free_map, page_ptr, pages * slab->page_size);
+    } else {
+      if (p->kind == MDB_PAGE_SLAB && p->used < slab->slots[p->cls]) {
+        mdb_slab_push(slab, page);
+      }
+      uint32_t size = mdb_slab_encode_header(slab, page, current);
+      if (!mdb_read_raw(db, db->fp_data, db->fd_data, page_ptr, stored,
+                        size)) {
+        return mdb_status(MDB_ERR_READ, "cannot read page header");
+      }
+      if (memcmp(stored, current, size) != 0) {
+        mdb_status_t write_status = mdb_slab_persist(db, page, MDB_SLAB_NONE);
+        STAT_CHECK_RET(write_status, {;});
+      }
+    }
+    page += pages;
+  }
+  return mdb_status(MDB_OK, NULL);
+}
+
+static mdb_status_t mdb_cache_init(mdb_cache_t *cache, uint64_t size,
+                                   bool locked) {
+  memset(cache, 0, sizeof(mdb_cache_t));
+  if (size == 0) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  for (size_t i = 0; locked && i < MDB_CACHE_SHARDS; i++) {
+    if (pthread_mutex_init(&cache->shards[i].lock, NULL) != 0) {
+      while (i-- > 0) {
+        (void)pthread_mutex_destroy(&cache->shards[i].lock);
+      }
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise cache locks");
+    }
+  }
+  cache->locked = locked;
+  cache->shard_budget = (size + MDB_CACHE_SHARDS - 1) / MDB_CACHE_SHARDS;
+  return mdb_status(MDB_OK, NULL);
+}
+
+static void mdb_cache_destroy(mdb_cache_t *cache) {
+  if (cache->shard_budget == 0) {
+    return;
+  }
+  for (size_t i = 0; i < MDB_CACHE_SHARDS; i++) {
+    mdb_cache_shard_t *shard = cache->shards + i;
+    for (uint32_t j = 0; j < shard->count; j++) {
+      free(shard->ring[j]);
+    }
+    free(shard->ring);
+    free(shard->table);
+    if (cache->locked) {
+      (void)pthread_mutex_destroy(&shard->lock);
+    }
+  }
+  cache->shard_budget = 0;
+}
+
+/// the shard is chosen by the high bits of the hash, and the slot in its
+/// table by the low ones
+static mdb_cache_shard_t *mdb_cache_lock(mdb_cache_t *cache, uint32_t hash) {
+  mdb_cache_shard_t *shard = cache->shards
+                             + (hash >> 24) % MDB_CACHE_SHARDS;
+  if (cache->locked) {
+    (void)pthread_mutex_lock(&shard->lock);
+  }
+  return shard;
+}
+
+static void mdb_cache_unlock(mdb_cache_t *cache, mdb_cache_shard_t *shard) {
+  if (cache->locked) {
+    (void)pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/// returns the link that points to the entry of @p key, or to NULL if there
+/// is none; NULL itself if the shard has no table yet
+static mdb_cache_entry_t **mdb_cache_find(mdb_cache_shard_t *shard,
+                                          const char *key, uint32_t hash) {
+  if (shard->table == NULL) {
+    return NULL;
+  }
+  mdb_cache_entry_t **link = shard->table + (hash & (shard->table_size - 1));
+  while (*link != NULL
+         && ((*link)->hash != hash || strcmp((*link)->data, key) != 0)) {
+    link = &((*link)->next);
+  }
+  return link;
+}
+
+static size_t mdb_cache_cost(const mdb_cache_entry_t *entry) {
+  return sizeof(mdb_cache_entry_t) + strlen(entry->data) + 1
+         + entry->value_size;
+}
+
+static void mdb_cache_remove(mdb_cache_shard_t *shard,
+                             mdb_cache_entry_t **link) {
+  mdb_cache_entry_t *entry = *link;
+  *link = entry->next;
+  mdb_cache_entry_t *last = shard->ring[--shard->count];
+  shard->ring[entry->slot] = last;
+  last->slot = entry->slot;
+  shard->bytes -= mdb_cache_cost(entry);
+  free(entry);
+}
+
+/// advances the hand past entries read since its last visit, clearing
+/// their mark, and evicts the first one that was not
+static void mdb_cache_evict(mdb_cache_shard_t *shard) {
+  for (;;) {
+    if (shard->hand >= shard->count) {
+      shard->hand = 0;
+    }
+    mdb_cache_entry_t *entry = shard->ring[shard->hand];
+    if (!entry->referenced) {
+      mdb_cache_remove(shard, mdb_cache_find(shard, entry->data, entry->hash));
+      return;
+    }
+    entry->referenced = false;
+    shard->hand++;
+  }
+}
+
+/// makes room for one more entry in the ring and the table, which is
+/// doubled once it holds as many entries as it has slots
+static bool mdb_cache_reserve(mdb_cache_shard_t *shard) {
+  if (shard->count == shard->ring_cap) {
+    uint32_t cap = shard->ring_cap != 0 ? shard->ring_cap * 2
+                                        : MDB_CACHE_TABLE_MIN;
+    mdb_cache_entry_t **ring = (mdb_cache_entry_t**)
+        realloc(shard->ring, sizeof(mdb_cache_entry_t*) * cap);
+    if (ring == NULL) {
+      return false;
+    }
+    shard->ring = ring;
+    shard->ring_cap = cap;
+  }
+  if (shard->count >= shard->table_size) {
+    uint32_t size = shard->table_size != 0 ? shard->table_size * 2
+                                           : MDB_CACHE_TABLE_MIN;
+    mdb_cache_entry_t **table =
+        (mdb_cache_entry_t**)calloc(size, sizeof(mdb_cache_entry_t*));
+    if (table == NULL) {
+      return false;
+    }
+    for (uint32_t i = 0; i < shard->count; i++) {
+      mdb_cache_entry_t *entry = shard->ring[i];
+      entry->next = table[entry->hash & (size - 1)];
+      table[entry->hash & (size - 1)] = entry;
+    }
+    free(shard->table);
+    shard->table = table;
+    shard->table_size = size;
+  }
+  return true;
+}
+
+/// copies the cached value of @p key into @p buf and sets @p status the way
+/// mdb_read_data would; returns false on a miss
+static bool mdb_cache_get(mdb_cache_t *cache, const char *key, uint32_t hash,
+                          char *buf, size_t bufsiz, mdb_status_t *status) {
+  if (cache->shard_budget == 0) {
+    return false;
+  }
+  mdb_cache_shard_t *shard = mdb_cache_lock(cache, hash);
+  mdb_cache_entry_t **link = mdb_cache_find(shard, key, hash);
+  mdb_cache_entry_t *entry = link != NULL ? *link : NULL;
+  if (entry == NULL) {
+    shard->misses++;
+    mdb_cache_unlock(cache, shard);
+    return false;
+  }
+  shard->hits++;
+  entry->referenced = true;
+  if (bufsiz < (size_t)entry->value_size + 1) {
+    *status = mdb_status(MDB_ERR_BUFSIZ, "value buffer size too small");
+  } else {
+    memcpy(buf, entry->data + strlen(key) + 1, entry->value_size);
+    buf[entry->value_size] = '\0';
+    *status = mdb_status(MDB_OK, NULL);
+  }
+  mdb_cache_unlock(cache, shard);
+  return true;
+}
+
+static void mdb_cache_put(mdb_cache_t *cache, const char *key, uint32_t hash,
+                          const char *value, mdb_size_t value_size) {
+  size_t key_size = strlen(key) + 1;
+  size_t cost = sizeof(mdb_cache_entry_t) + key_size + value_size;
+  /// a value that would push out a good part of its shard is not kept
+  if (cache->shard_budget == 0 || cost > cache->shard_budget / 4) {
+    return;
+  }
+  mdb_cache_shard_t *shard = mdb_cache_lock(cache, hash);
+  mdb_cache_entry_t **link = mdb_cache_find(shard, key, hash);
+  if ((link != NULL && *link != NULL) || !mdb_cache_reserve(shard)) {
+    mdb_cache_unlock(cache, shard);
+    return;
+  }
+  while (shard->bytes + cost > cache->shard_budget) {
+    mdb_cache_evict(shard);
+  }
+  mdb_cache_entry_t *entry = (mdb_cache_entry_t*)malloc(cost);
+  if (entry != NULL) {
+    entry->hash = hash;
+    entry->value_size = value_size;
+    entry->referenced = false;
+    memcpy(entry->data, key, key_size);
+    memcpy(entry->data + key_size, value, value_size);
+    link = shard->table + (hash & (shard->table_size - 1));
+    entry->next = *link;
+    *link = entry;
+    entry->slot = shard->count;
+    shard->ring[shard->count++] = entry;
+    shard->bytes += cost;
+  }
+  mdb_cache_unlock(cache, shard);
+}
+
+static void mdb_cache_drop(mdb_cache_t *cache, const char *key,
+                           uint32_t hash) {
+  if (cache->shard_budget == 0) {
+    return;
+  }
+  mdb_cache_shard_t *shard = mdb_cache_lock(cache, hash);
+  mdb_cache_entry_t **link = mdb_cache_find(shard, key, hash);
+  if (link != NULL && *link != NULL) {
+    mdb_cache_remove(shard, link);
+  }
+  mdb_cache_unlock(cache, shard);
+}
+
+/// sizes the filter for @p keys keys and clears it; the counters are kept
+static bool mdb_bloom_alloc(mdb_bloom_t *bloom, uint64_t keys) {
+  if (keys < MDB_BLOOM_MIN_KEYS) {
+    keys = MDB_BLOOM_MIN_KEYS;
+  }
+  if (keys > UINT32_MAX) {
+    keys = UINT32_MAX;
+  }
+  uint64_t block_count = (keys * MDB_BLOOM_BITS_PER_KEY + 255) / 256;
+  uint32_t *words = (uint32_t*)calloc(block_count * 8, sizeof(uint32_t));
+  if (words == NULL) {
+    return false;
+  }
+  free(bloom->words);
+  bloom->words = words;
+  bloom->block_count = (uint32_t)block_count;
+  bloom->capacity = (uint32_t)keys;
+  bloom->added = 0;
+  return true;
 }
 
-size_t mdb_index_size(mdb_t *handle) {
-  mdb_int_t *db = (mdb_int_t*)handle;
-  (void)fseek(db->fp_index, 0, SEEK_END);
-  return ftell(db->fp_index);
+/// lets every key through, and has the filter rebuilt by the next write
+static void mdb_bloom_saturate(mdb_bloom_t *bloom) {
+  memset(bloom->words, 0xff, (size_t)bloom->block_count * 8
+                             * sizeof(uint32_t));
+  __atomic_store_n(&bloom->added, bloom->capacity + 1, __ATOMIC_RELAXED);
 }
 
-size_t mdb_data_size(mdb_t *handle) {
-  mdb_int_t *db = (mdb_int_t*)handle;
-  (void)fseek(db->fp_data, 0, SEEK_END);
-  return ftell(db->fp_data);
+/// the block is picked by the high half of a remix of the hash and the
+/// bits in it by the low half
+static uint32_t *mdb_bloom_block(mdb_bloom_t *bloom, uint32_t hash,
+                                 uint32_t *key) {
+  uint64_t mixed = mdb_wymix(hash, 0x9e3779b97f4a7c15ull);
+  *key = (uint32_t)mixed;
+  uint32_t block = (uint32_t)(((mixed >> 32) * bloom->block_count) >> 32);
+  return bloom->words + (size_t)block * 8;
 }
 
-static mdb_status_t mdb_read_bucket(mdb_int_t *db, uint32_t bucket,
-                                    mdb_ptr_t *ptr) {
-  if (fseek(db->fp_index, (long)(MDB_PTR_SIZE * (bucket + 1)), SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to bucket");
+/// writers of different buckets add to the filter at the same time, so the
+/// bits are set atomically
+static void mdb_bloom_add(mdb_bloom_t *bloom, uint32_t hash) {
+  if (bloom->words == NULL) {
+    return;
   }
-  if (fread(ptr, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read bucket");
+  uint32_t key;
+  uint32_t *block = mdb_bloom_block(bloom, hash, &key);
+  for (size_t i = 0; i < 8; i++) {
+    __atomic_fetch_or(block + i, (uint32_t)1 << ((key * mdb_bloom_salts[i])
+                                                 >> 27),
+                      __ATOMIC_RELAXED);
   }
-  return mdb_status(MDB_OK, NULL);
+  __atomic_fetch_add(&bloom->added, 1, __ATOMIC_RELAXED);
 }
 
-static mdb_status_t mdb_read_index(mdb_int_t *db, mdb_ptr_t idxptr,
-                                   mdb_index_t *index) {
-  if (fseek(db->fp_index, (long)idxptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+/// false if no key with @p hash has been added since the filter was built
+static bool mdb_bloom_check(mdb_bloom_t *bloom, uint32_t hash) {
+  if (bloom->words == NULL) {
+    return true;
   }
-  if (fread(&(index->next_ptr), MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+  __atomic_fetch_add(&bloom->lookups, 1, __ATOMIC_RELAXED);
+  uint32_t key;
+  uint32_t *block = mdb_bloom_block(bloom, hash, &key);
+  for (size_t i = 0; i < 8; i++) {
+    uint32_t bit = (uint32_t)1 << ((key * mdb_bloom_salts[i]) >> 27);
+    if (!(__atomic_load_n(block + i, __ATOMIC_RELAXED) & bit)) {
+      __atomic_fetch_add(&bloom->negatives, 1, __ATOMIC_RELAXED);
+      return false;
+    }
   }
-  if (fread(index->key, 1, db->options.key_size_max, db->fp_index)
-      != db->options.key_size_max) {
-    return mdb_status(MDB_ERR_READ, "cannot read key");
+  return true;
+}
+
+/// counts lookups the filter let through that found nothing
+static void mdb_bloom_miss(mdb_bloom_t *bloom, uint64_t count) {
+  if (bloom->words != NULL && count != 0) {
+    __atomic_fetch_add(&bloom->false_positives, count, __ATOMIC_RELAXED);
   }
-  index->key[db->options.key_size_max] = '\0';
-  if (fread(&(index->value_ptr), MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read value ptr");
+}
+
+/// deleted keys keep their bits, so the filter is rebuilt once as many keys
+/// have been added as it was sized for
+static bool mdb_bloom_full(mdb_bloom_t *bloom) {
+  return bloom->words != NULL
+         && __atomic_load_n(&bloom->added, __ATOMIC_RELAXED)
+            > bloom->capacity;
+}
+
+/// rebuilds the filter from the hashes in the chains, sized for twice the
+/// current item count; called with the table locked exclusively. A filter
+/// left half built would turn away keys it missed.
+static mdb_status_t mdb_bloom_rebuild(mdb_int_t *db) {
+  if (!mdb_bloom_alloc(&db->bloom, (uint64_t)db->item_count * 2)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate filter");
   }
-  if (fread(&(index->value_size), MDB_DATALEN_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read value length");
+  uint32_t bucket_count = mdb_bucket_count(db);
+  for (uint32_t bucket = 0; bucket < bucket_count; bucket++) {
+    mdb_ptr_t ptr;
+    mdb_status_t bucket_read_status = mdb_read_bucket(db, bucket, &ptr);
+    STAT_CHECK_RET(bucket_read_status, { mdb_bloom_saturate(&db->bloom); });
+    while (ptr != 0) {
+      uint32_t hash;
+      mdb_status_t head_read_status = mdb_read_index_head(db, ptr, &ptr,
+                                                          &hash);
+      STAT_CHECK_RET(head_read_status, { mdb_bloom_saturate(&db->bloom); });
+      mdb_bloom_add(&db->bloom, hash);
+    }
   }
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_write_bucket(mdb_int_t *db, mdb_ptr_t bucket,
-                                     mdb_ptr_t value) {
-  if (fseek(db->fp_index, (long)(MDB_PTR_SIZE * (bucket + 1)), SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to bucket");
+/// brings the index and data files up to date with the log left by a
+/// process that did not get to close the database. The log ends at the
+/// first record that was not written in full.
+static mdb_status_t mdb_wal_replay(mdb_int_t *db, bool *replayed) {
+  *replayed = false;
+  char path[4096];
+  if (!mdb_make_path(path, sizeof(path), db->path, ".db.wal")) {
+    return mdb_status(MDB_ERR_OPEN_FILE, "log file path too long");
   }
-  if (fwrite(&value, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write bucket");
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return errno == ENOENT
+           ? mdb_status(MDB_OK, NULL)
+           : mdb_status(MDB_ERR_OPEN_FILE, "cannot open log file");
   }
-  if (fflush(db->fp_index) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    (void)close(fd);
+    return mdb_status(MDB_ERR_READ, "cannot stat log file");
+  }
+  if (db->shared && st.st_size != 0) {
+    /// other processes could already be writing over what it would redo
+    (void)close(fd);
+    return mdb_status(MDB_ERR_LOCK,
+                      "log must be replayed by an open that is not shared");
   }
-  return mdb_status(MDB_OK, NULL);
-}
 
-static mdb_status_t mdb_write_index(mdb_int_t *db, mdb_ptr_t idxptr,
-                                    const char *keybuf, mdb_ptr_t valptr,
-                                    mdb_size_t valsize) {
-  if (fseek(db->fp_index, (long)(idxptr + MDB_PTR_SIZE), SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+  int fd_index = db->pio ? db->fd_index : fileno(db->fp_index);
+  int fd_data = db->pio ? db->fd_data : fileno(db->fp_data);
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  bool layout_changed = false;
+  uint8_t *body = NULL;
+  size_t body_cap = 0;
+  for (uint64_t pos = 0; status.code == MDB_OK; ) {
+    uint8_t header[MDB_WAL_RECORD_HEADER];
+    uint32_t size, crc;
+    if (pread(fd, header, sizeof(header), (off_t)pos) != sizeof(header)) {
+      break;
+    }
+    memcpy(&size, header, sizeof(uint32_t));
+    memcpy(&crc, header + 4, sizeof(uint32_t));
+    if (size == 0 || pos + sizeof(header) + size > (uint64_t)st.st_size) {
+      break;
+    }
+    if (size > body_cap) {
+      uint8_t *new_body = (uint8_t*)realloc(body, size);
+      if (new_body == NULL) {
+        status = mdb_status(MDB_ERR_ALLOC, "cannot allocate log buffer");
+        break;
+      }
+      body = new_body;
+      body_cap = size;
+    }
+    if (pread(fd, body, size, (off_t)(pos + sizeof(header))) != size
+        || crc != mdb_crc32(body, size)) {
+      break;
+    }
+    status = mdb_wal_redo(db, body, size, &layout_changed);
+    *replayed = true;
+    pos += sizeof(header) + size;
   }
-  size_t key_len = strlen(keybuf);
-  if (fwrite(keybuf, 1, key_len, db->fp_index) < key_len) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write key part of index");
+  free(body);
+
+  /// slab mode wants the data file in whole pages, which a lost extension
+  /// of it may not have left
+  uint32_t page_size = db->slab.page_size;
+  if (status.code == MDB_OK && *replayed && page_size != 0
+      && fstat(fd_data, &st) == 0 && st.st_size % page_size != 0
+      && ftruncate(fd_data, (st.st_size / page_size + 1) * page_size) != 0) {
+    status = mdb_status(MDB_ERR_WRITE, "cannot stretch data file");
   }
-  size_t value_ptr_pos = idxptr + MDB_PTR_SIZE + db->options.key_size_max;
-  if (fseek(db->fp_index, (long)value_ptr_pos, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to value part of index");
+  if (status.code == MDB_OK && *replayed
+      && (fdatasync(fd_index) != 0 || fdatasync(fd_data) != 0)) {
+    status = mdb_status(MDB_ERR_FLUSH, "cannot sync database files");
   }
-  if (fwrite(&valptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write to value part of index");
+  if (status.code == MDB_OK && layout_changed) {
+    status = mdb_write_superblock(db, NULL);
+    if (status.code == MDB_OK
+        && fdatasync(fileno(db->fp_superblock)) != 0) {
+      status = mdb_status(MDB_ERR_FLUSH, "cannot sync superblock");
+    }
   }
-  if (fwrite(&valsize, MDB_DATALEN_SIZE, 1, db->fp_index) < 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write to value part of index");
+  /// the log is only emptied once what it held is safely in the files
+  if (status.code == MDB_OK && st.st_size != 0
+      && (ftruncate(fd, 0) != 0 || fdatasync(fd) != 0)) {
+    status = mdb_status(MDB_ERR_WRITE, "cannot empty log file");
   }
-  if (fflush(db->fp_index) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  (void)close(fd);
+  return status;
+}
+
+static mdb_status_t mdb_wal_redo(mdb_int_t *db, const uint8_t *body,
+                                 size_t size, bool *layout_changed) {
+  int fd_index = db->pio ? db->fd_index : fileno(db->fp_index);
+  int fd_data = db->pio ? db->fd_data : fileno(db->fp_data);
+  const size_t layout_size = sizeof(uint32_t) * 2
+                             + sizeof(mdb_ptr_t) * MDB_SEGMENTS_MAX;
+  size_t pos = 0;
+  while (pos < size) {
+    if (size - pos < MDB_WAL_ENTRY_HEADER) {
+      return mdb_status(MDB_ERR_FORMAT, "truncated log entry");
+    }
+    uint8_t kind = body[pos];
+    uint32_t offset, len;
+    memcpy(&offset, body + pos + 1, sizeof(uint32_t));
+    memcpy(&len, body + pos + 5, sizeof(uint32_t));
+    pos += MDB_WAL_ENTRY_HEADER;
+    size_t carried = kind == MDB_WAL_PUNCH ? 0 : len;
+    if (kind > MDB_WAL_LAYOUT || size - pos < carried) {
+      return mdb_status(MDB_ERR_FORMAT, "bad log entry");
+    }
+    const uint8_t *bytes = body + pos;
+    pos += carried;
+
+    if (kind == MDB_WAL_LAYOUT) {
+      if (len != layout_size) {
+        return mdb_status(MDB_ERR_FORMAT, "bad layout in log");
+      }
+      uint32_t level;
+      memcpy(&level, bytes, sizeof(uint32_t));
+      if (level + 1 >= MDB_SEGMENTS_MAX) {
+        return mdb_status(MDB_ERR_FORMAT, "bad layout in log");
+      }
+      db->level = level;
+      memcpy(&(db->split), bytes + 4, sizeof(uint32_t));
+      memcpy(db->segments, bytes + 8, sizeof(mdb_ptr_t) * MDB_SEGMENTS_MAX);
+      *layout_changed = true;
+    } else if (kind == MDB_WAL_PUNCH) {
+      if (!mdb_wal_zero(fd_data, offset, len)) {
+        return mdb_status(MDB_ERR_WRITE, "cannot clear data range");
+      }
+    } else if (!mdb_pwrite_all(kind == MDB_WAL_INDEX ? fd_index : fd_data,
+                               bytes, len, offset)) {
+      return mdb_status(MDB_ERR_WRITE, "cannot redo logged write");
+    }
   }
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_read_nextptr(mdb_int_t *db, mdb_ptr_t idxptr,
-                                     mdb_ptr_t *nextptr) {
-  if (fseek(db->fp_index, (long)idxptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+static mdb_status_t mdb_wal_init(mdb_int_t *db) {
+  mdb_wal_t *wal = &db->wal;
+  char path[4096];
+  if (!mdb_make_path(path, sizeof(path), db->path, ".db.wal")) {
+    return mdb_status(MDB_ERR_OPEN_FILE, "log file path too long");
   }
-  if (fread(nextptr, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read next ptr");
+  wal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (wal->fd < 0) {
+    return mdb_status(MDB_ERR_OPEN_FILE, "cannot open log file");
+  }
+  if (db->thread_safe) {
+    if (pthread_mutex_init(&wal->writer, NULL) != 0) {
+      (void)close(wal->fd);
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise log locks");
+    }
+    if (pthread_mutex_init(&wal->sync_lock, NULL) != 0) {
+      (void)pthread_mutex_destroy(&wal->writer);
+      (void)close(wal->fd);
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise log locks");
+    }
+    if (pthread_cond_init(&wal->synced, NULL) != 0) {
+      (void)pthread_mutex_destroy(&wal->sync_lock);
+      (void)pthread_mutex_destroy(&wal->writer);
+      (void)close(wal->fd);
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise log locks");
+    }
+    if (pthread_rwlock_init(&wal->page_lock, NULL) != 0) {
+      (void)pthread_cond_destroy(&wal->synced);
+      (void)pthread_mutex_destroy(&wal->sync_lock);
+      (void)pthread_mutex_destroy(&wal->writer);
+      (void)close(wal->fd);
+      return mdb_status(MDB_ERR_ALLOC, "cannot initialise log locks");
+    }
+    wal->locked = true;
   }
+  wal->enabled = true;
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_read_data(mdb_int_t *db, mdb_ptr_t valptr,
-                                  mdb_size_t valsize, char *valbuf,
-                                  mdb_size_t bufsiz) {
-  if (bufsiz < valsize + 1) {
-    return mdb_status(MDB_ERR_BUFSIZ, "value buffer size too small");
+/// what is still only in memory is lost, but not what is in the log
+static void mdb_wal_destroy(mdb_wal_t *wal) {
+  if (!wal->enabled) {
+    return;
   }
-  if (fseek(db->fp_data, (long)valptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to value");
+  mdb_wal_drop_pages(wal);
+  free(wal->pages);
+  free(wal->txn);
+  free(wal->pending);
+  free(wal->spare);
+  (void)close(wal->fd);
+  if (wal->locked) {
+    (void)pthread_rwlock_destroy(&wal->page_lock);
+    (void)pthread_cond_destroy(&wal->synced);
+    (void)pthread_mutex_destroy(&wal->sync_lock);
+    (void)pthread_mutex_destroy(&wal->writer);
   }
-  if (fread(valbuf, 1, valsize, db->fp_data) != valsize) {
-    return mdb_status(MDB_ERR_READ, "cannot read data");
+  memset(wal, 0, sizeof(mdb_wal_t));
+}
+
+/// starts a transaction; mutations take this before any other lock
+static void mdb_wal_begin(mdb_int_t *db) {
+  if (db->wal.locked) {
+    (void)pthread_mutex_lock(&db->wal.writer);
   }
-  valbuf[valsize] = '\0';
-  return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_write_nextptr(mdb_int_t *db, mdb_ptr_t ptr,
-                                      mdb_ptr_t nextptr) {
-  if (fseek(db->fp_index, (long)ptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to head of index file");
+/// logs what the transaction wrote, even after a failure part way, since
+/// the pages already show it, and lets the next writer in before waiting
+/// for the log to reach the disk
+static mdb_status_t mdb_wal_commit(mdb_int_t *db) {
+  mdb_wal_t *wal = &db->wal;
+  if (!wal->enabled) {
+    return mdb_status(MDB_OK, NULL);
   }
-  if (fwrite(&nextptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write to head of index file");
+  uint64_t lsn;
+  mdb_status_t status = mdb_wal_append(db, &lsn);
+  mdb_wal_lock_sync(wal);
+  uint64_t log_bytes = wal->log_size + wal->pending_size;
+  mdb_wal_unlock_sync(wal);
+  if (status.code == MDB_OK
+      && (log_bytes >= MDB_WAL_LOG_MAX
+          || wal->page_count >= MDB_WAL_PAGES_MAX)) {
+    status = mdb_wal_checkpoint(db);
   }
-  if (fflush(db->fp_index) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  if (wal->locked) {
+    (void)pthread_mutex_unlock(&wal->writer);
   }
-  return mdb_status(MDB_OK, NULL);
+  STAT_CHECK_RET(status, {;});
+  return mdb_wal_sync(db, lsn);
 }
 
-static mdb_status_t mdb_write_data(mdb_int_t *db, mdb_ptr_t valptr,
-                                   const char *valbuf, mdb_size_t valsize) {
-  if (fseek(db->fp_data, (long)valptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to value");
-  }
-  if (fwrite(valbuf, 1, valsize, db->fp_data) < valsize) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write data");
+/// moves the transaction to the pending log bytes; @p lsn is set to the
+/// position in the log that has to be synced for it to be durable
+static mdb_status_t mdb_wal_append(mdb_int_t *db, uint64_t *lsn) {
+  mdb_wal_t *wal = &db->wal;
+  mdb_wal_lock_sync(wal);
+  *lsn = wal->appended;
+  if (wal->txn_size == 0) {
+    mdb_wal_unlock_sync(wal);
+    return mdb_status(MDB_OK, NULL);
   }
-  if (fflush(db->fp_data) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  size_t record_size = MDB_WAL_RECORD_HEADER + wal->txn_size;
+  if (wal->pending_size + record_size > wal->pending_cap) {
+    size_t cap = wal->pending_cap != 0 ? wal->pending_cap : 4096;
+    while (cap < wal->pending_size + record_size) {
+      cap *= 2;
+    }
+    uint8_t *pending = (uint8_t*)realloc(wal->pending, cap);
+    if (pending == NULL) {
+      mdb_wal_unlock_sync(wal);
+      return mdb_status(MDB_ERR_ALLOC, "cannot allocate log buffer");
+    }
+    wal->pending = pending;
+    wal->pending_cap = cap;
   }
+  uint32_t size = (uint32_t)wal->txn_size;
+  uint32_t crc = mdb_crc32(wal->txn, wal->txn_size);
+  uint8_t *record = wal->pending + wal->pending_size;
+  memcpy(record, &size, sizeof(uint32_t));
+  memcpy(record + 4, &crc, sizeof(uint32_t));
+  memcpy(record + MDB_WAL_RECORD_HEADER, wal->txn, wal->txn_size);
+  wal->pending_size += record_size;
+  wal->appended += record_size;
+  *lsn = wal->appended;
+  mdb_wal_unlock_sync(wal);
+  wal->txn_size = 0;
+  mdb_stat_add(&db->stats.commits, 1);
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_stretch_index_file(mdb_int_t *db, mdb_ptr_t *ptr) {
-  if (fseek(db->fp_index, 0, SEEK_END) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to end of index file");
+/// group commit: the first waiter to find no sync running takes all that is
+/// pending and syncs it for everyone, and the rest wait for it
+static mdb_status_t mdb_wal_sync(mdb_int_t *db, uint64_t lsn) {
+  mdb_wal_t *wal = &db->wal;
+  mdb_wal_lock_sync(wal);
+  while (wal->durable < lsn && !wal->failed) {
+    if (wal->syncing) {
+      (void)pthread_cond_wait(&wal->synced, &wal->sync_lock);
+      continue;
+    }
+    wal->syncing = true;
+    uint8_t *buf = wal->pending;
+    size_t size = wal->pending_size, cap = wal->pending_cap;
+    uint64_t end = wal->appended;
+    off_t offset = (off_t)wal->log_size;
+    wal->pending = wal->spare;
+    wal->pending_cap = wal->spare_cap;
+    wal->pending_size = 0;
+    mdb_wal_unlock_sync(wal);
+
+    bool written = true;
+    for (size_t done = 0; written && done < size; ) {
+      ssize_t n = pwrite(wal->fd, buf + done, size - done,
+                         offset + (off_t)done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      written = n > 0;
+      done += written ? (size_t)n : 0;
+    }
+    written = written && fdatasync(wal->fd) == 0;
+    mdb_stat_io(db, true, size);
+    mdb_stat_add(&db->stats.syncs, 1);
+
+    mdb_wal_lock_sync(wal);
+    wal->spare = buf;
+    wal->spare_cap = cap;
+    if (written) {
+      wal->durable = end;
+      wal->log_size += size;
+    } else {
+      /// what the kernel did with the failed writes is unknown, so nothing
+      /// is committed after it
+      wal->failed = true;
+    }
+    wal->syncing = false;
+    if (wal->locked) {
+      (void)pthread_cond_broadcast(&wal->synced);
+    }
   }
-  *ptr = (mdb_ptr_t)ftell(db->fp_index);
+  bool failed = wal->failed && wal->durable < lsn;
+  mdb_wal_unlock_sync(wal);
+  return failed ? mdb_status(MDB_ERR_FLUSH, "cannot sync log file")
+                : mdb_status(MDB_OK, NULL);
+}
 
-  unsigned char zero = '\0';
-  for (size_t i = 0; i < db->index_record_size; i++) {
-    if (fwrite(&zero, 1, 1, db->fp_index) < 1) {
-      return mdb_status(MDB_ERR_WRITE, "cannot stretch index file");
+/// writes the pages back, syncs the files and empties the log. Called by
+/// the writer; any open transaction is committed first, so that the files
+/// never hold half of one.
+static mdb_status_t mdb_wal_checkpoint(mdb_int_t *db) {
+  mdb_wal_t *wal = &db->wal;
+  uint64_t lsn;
+  mdb_status_t status = mdb_wal_append(db, &lsn);
+  STAT_CHECK_RET(status, {;});
+  status = mdb_wal_sync(db, lsn);
+  STAT_CHECK_RET(status, {;});
+
+  /// readers go on reading the pages meanwhile
+  mdb_wal_lock_pages(wal, false);
+  status = mdb_wal_flush_pages(db);
+  mdb_wal_unlock_pages(wal);
+  STAT_CHECK_RET(status, {;});
+  if (fdatasync(db->fd_index) != 0 || fdatasync(db->fd_data) != 0) {
+    return mdb_status(MDB_ERR_FLUSH, "cannot sync database files");
+  }
+  mdb_stat_add(&db->stats.syncs, 2);
+  if (wal->layout_changed) {
+    status = mdb_write_superblock(db, NULL);
+    STAT_CHECK_RET(status, {;});
+    if (fdatasync(fileno(db->fp_superblock)) != 0) {
+      return mdb_status(MDB_ERR_FLUSH, "cannot sync superblock");
     }
+    wal->layout_changed = false;
   }
-  if (fflush(db->fp_index) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+
+  if (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0) {
+    return mdb_status(MDB_ERR_WRITE, "cannot empty log file");
   }
+  mdb_wal_lock_sync(wal);
+  wal->log_size = 0;
+  mdb_wal_unlock_sync(wal);
+  mdb_wal_lock_pages(wal, true);
+  mdb_wal_drop_pages(wal);
+  mdb_wal_unlock_pages(wal);
+  mdb_stat_add(&db->stats.checkpoints, 1);
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_index_alloc(mdb_int_t *db, mdb_ptr_t *ptr) {
-  mdb_ptr_t freeptr;
-  mdb_status_t freeptr_read_status = mdb_read_nextptr(db, 0, &freeptr);
-  STAT_CHECK_RET(freeptr_read_status, {;});
-
-  if (freeptr != 0) {
-    mdb_ptr_t new_freeptr;
-    mdb_status_t nextptr_read_stat =
-        mdb_read_nextptr(db, freeptr, &new_freeptr);
-    STAT_CHECK_RET(nextptr_read_stat, {;});
-    mdb_status_t freeptr_update_stat = mdb_write_nextptr(db, 0, new_freeptr);
-    STAT_CHECK_RET(freeptr_update_stat, {;});
-    mdb_status_t freeptr_cleanup_stat = mdb_write_nextptr(db, freeptr, 0);
-    STAT_CHECK_RET(freeptr_cleanup_stat, {;});
-    *ptr = freeptr;
+/// pages go out in file order, runs of neighbours in one call. The last
+/// page of a file is cut at its end, which it may only pass by a lost
+/// extension.
+static mdb_status_t mdb_wal_flush_pages(mdb_int_t *db) {
+  mdb_wal_t *wal = &db->wal;
+  if (wal->page_count == 0) {
     return mdb_status(MDB_OK, NULL);
-  } else {
-    return mdb_stretch_index_file(db, ptr);
   }
-}
+  mdb_wal_page_t **order = (mdb_wal_page_t**)malloc(sizeof(mdb_wal_page_t*)
+                                                    * wal->page_count);
+  if (order == NULL) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot allocate page list");
+  }
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < wal->table_size; i++) {
+    if (wal->pages[i].data != NULL) {
+      order[count++] = wal->pages + i;
+    }
+  }
+  qsort(order, count, sizeof(mdb_wal_page_t*), mdb_wal_page_cmp);
 
-static mdb_status_t mdb_data_alloc(mdb_int_t *db, mdb_size_t valsize,
-                                   mdb_ptr_t *ptr) {
-  if (fseek(db->fp_data, 0, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to head of data file");
+  struct stat st[2];
+  if (fstat(db->fd_index, &st[MDB_WAL_INDEX]) != 0
+      || fstat(db->fd_data, &st[MDB_WAL_DATA]) != 0) {
+    free(order);
+    return mdb_status(MDB_ERR_READ, "cannot stat database files");
   }
-  while (!feof(db->fp_data)) {
-    uint8_t byte;
-    if (fread(&byte, 1, 1, db->fp_data) != 1 && !feof(db->fp_data)) {
-      return mdb_status(MDB_ERR_READ, "cannot read data file");
+  struct iovec iov[64];
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  for (uint32_t i = 0; i < count && status.code == MDB_OK; ) {
+    mdb_wal_page_t *first = order[i];
+    uint8_t file = (uint8_t)(first->key >> 32);
+    int fd = file == MDB_WAL_INDEX ? db->fd_index : db->fd_data;
+    uint64_t offset = (first->key & UINT32_MAX) * MDB_WAL_PAGE_SIZE;
+    uint64_t file_size = (uint64_t)st[file].st_size;
+    uint32_t run = 1;
+    while (i + run < count && run < 64
+           && order[i + run]->key == first->key + run
+           && order[i + run]->punched == first->punched) {
+      run++;
     }
-    while (!feof(db->fp_data) && byte != '\0') {
-      if (fread(&byte, 1, 1, db->fp_data) != 1 && !feof(db->fp_data)) {
-        return mdb_status(MDB_ERR_READ, "cannot read data file");
+
+    if (first->punched) {
+      if (!mdb_wal_zero(fd, offset, (uint64_t)run * MDB_WAL_PAGE_SIZE)) {
+        status = mdb_status(MDB_ERR_WRITE, "cannot clear data pages");
       }
-    }
-    
-    mdb_ptr_t start_ptr = (mdb_ptr_t)ftell(db->fp_data);
-    while (!feof(db->fp_data) && byte == '\0') {
-      if (fread(&byte, 1, 1, db->fp_data) != 1 && !feof(db->fp_data)) {
-        return mdb_status(MDB_ERR_READ, "cannot read data file");
+    } else {
+      int iovcnt = 0;
+      uint64_t len = 0;
+      for (uint32_t j = 0; j < run; j++) {
+        uint64_t page_offset = offset + (uint64_t)j * MDB_WAL_PAGE_SIZE;
+        size_t page_len = MDB_WAL_PAGE_SIZE;
+        if (page_offset < file_size
+            && file_size - page_offset < MDB_WAL_PAGE_SIZE) {
+          page_len = (size_t)(file_size - page_offset);
+        }
+        iov[iovcnt].iov_base = order[i + j]->data;
+        iov[iovcnt].iov_len = page_len;
+        iovcnt++;
+        len += page_len;
+      }
+      mdb_stat_io(db, true, len);
+      if (!mdb_pwritev_all(fd, iov, iovcnt, (mdb_ptr_t)offset)) {
+        status = mdb_status(MDB_ERR_WRITE, "cannot write back pages");
       }
     }
-    mdb_ptr_t end_ptr = (mdb_ptr_t)ftell(db->fp_data);
+    i += run;
+  }
+  free(order);
+  return status;
+}
 
-    /// @todo currently we rely on the extra padding to keep correct results.
-    /// refactor and remove this padding sometime.
-    if (end_ptr - start_ptr >= valsize + 2) {
-      *ptr = start_ptr + 1;
-      return mdb_status(MDB_OK, NULL);
+/// adds an entry to the open transaction
+static bool mdb_wal_log(mdb_wal_t *wal, uint8_t kind, mdb_ptr_t offset,
+                        const void *buf, size_t len) {
+  size_t carried = kind == MDB_WAL_PUNCH ? 0 : len;
+  size_t size = MDB_WAL_ENTRY_HEADER + carried;
+  if (wal->txn_size + size > wal->txn_cap) {
+    size_t cap = wal->txn_cap != 0 ? wal->txn_cap : 1024;
+    while (cap < wal->txn_size + size) {
+      cap *= 2;
     }
+    uint8_t *txn = (uint8_t*)realloc(wal->txn, cap);
+    if (txn == NULL) {
+      return false;
+    }
+    wal->txn = txn;
+    wal->txn_cap = cap;
+  }
+  uint8_t *entry = wal->txn + wal->txn_size;
+  uint32_t len32 = (uint32_t)len;
+  entry[0] = kind;
+  memcpy(entry + 1, &offset, sizeof(uint32_t));
+  memcpy(entry + 5, &len32, sizeof(uint32_t));
+  if (carried != 0) {
+    memcpy(entry + MDB_WAL_ENTRY_HEADER, buf, carried);
   }
+  wal->txn_size += size;
+  return true;
+}
 
-  mdb_ptr_t end_ptr = (mdb_ptr_t)ftell(db->fp_data);
-  unsigned char zero = '\0';
-  for (size_t i = 0; i < valsize; i++) {
-    if (fwrite(&zero, 1, 1, db->fp_data) < 1) {
-      return mdb_status(MDB_ERR_WRITE, "cannot stretch data file");
+/// the write is logged and made to the pages, which stand in for the file
+/// until the next checkpoint
+static mdb_status_t mdb_wal_write(mdb_int_t *db, uint8_t file,
+                                  mdb_ptr_t offset, const void *buf,
+                                  size_t len) {
+  mdb_wal_t *wal = &db->wal;
+  if (len == 0) {
+    return mdb_status(MDB_OK, NULL);
+  }
+  if (!mdb_wal_log(wal, file, offset, buf, len)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot grow log transaction");
+  }
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  const uint8_t *p = (const uint8_t*)buf;
+  uint64_t pos = offset, end = (uint64_t)offset + len;
+  mdb_wal_lock_pages(wal, true);
+  while (pos < end) {
+    size_t at = (size_t)(pos % MDB_WAL_PAGE_SIZE);
+    size_t n = MDB_WAL_PAGE_SIZE - at;
+    if (n > end - pos) {
+      n = (size_t)(end - pos);
+    }
+    mdb_wal_page_t *page = mdb_wal_page(db, file,
+                                        (uint32_t)(pos / MDB_WAL_PAGE_SIZE),
+                                        n == MDB_WAL_PAGE_SIZE);
+    if (page == NULL) {
+      status = mdb_status(MDB_ERR_READ, "cannot load page for the log");
+      break;
     }
+    memcpy(page->data + at, p, n);
+    page->punched = false;
+    pos += n;
+    p += n;
   }
-  if (fflush(db->fp_data) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  mdb_wal_unlock_pages(wal);
+  return status;
+}
+
+/// @p offset and @p len are whole pages of the data file
+static mdb_status_t mdb_wal_punch(mdb_int_t *db, mdb_ptr_t offset,
+                                  size_t len) {
+  mdb_wal_t *wal = &db->wal;
+  if (!mdb_wal_log(wal, MDB_WAL_PUNCH, offset, NULL, len)) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot grow log transaction");
+  }
+  mdb_status_t status = mdb_status(MDB_OK, NULL);
+  mdb_wal_lock_pages(wal, true);
+  for (size_t done = 0; done < len; done += MDB_WAL_PAGE_SIZE) {
+    mdb_wal_page_t *page = mdb_wal_page(db, MDB_WAL_DATA,
+                                        (offset + done) / MDB_WAL_PAGE_SIZE,
+                                        true);
+    if (page == NULL) {
+      status = mdb_status(MDB_ERR_ALLOC, "cannot load page for the log");
+      break;
+    }
+    memset(page->data, 0, MDB_WAL_PAGE_SIZE);
+    page->punched = true;
+  }
+  mdb_wal_unlock_pages(wal);
+  return status;
+}
+
+/// a split is only seen in the superblock once its chain moves are in the
+/// files; until the next checkpoint the log has it
+static mdb_status_t mdb_wal_layout(mdb_int_t *db) {
+  uint8_t layout[sizeof(uint32_t) * 2 + sizeof(mdb_ptr_t) * MDB_SEGMENTS_MAX];
+  memcpy(layout, &(db->level), sizeof(uint32_t));
+  memcpy(layout + 4, &(db->split), sizeof(uint32_t));
+  memcpy(layout + 8, db->segments, sizeof(mdb_ptr_t) * MDB_SEGMENTS_MAX);
+  if (!mdb_wal_log(&db->wal, MDB_WAL_LAYOUT, 0, layout, sizeof(layout))) {
+    return mdb_status(MDB_ERR_ALLOC, "cannot grow log transaction");
   }
-  *ptr = end_ptr;
+  db->wal.layout_changed = true;
   return mdb_status(MDB_OK, NULL);
 }
 
-static mdb_status_t mdb_index_free(mdb_int_t *db, mdb_ptr_t ptr) {
-  if (fseek(db->fp_index, 0, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to head of index file");
+/// reads through the pages, going to the file only for parts they miss
+static bool mdb_wal_read(mdb_int_t *db, uint8_t file, mdb_ptr_t offset,
+                         void *buf, size_t len) {
+  mdb_wal_t *wal = &db->wal;
+  if (len == 0) {
+    return true;
   }
-  mdb_t freeptr;
-  if (fread(&freeptr, MDB_PTR_SIZE, 1, db->fp_index) != 1) {
-    return mdb_status(MDB_ERR_READ, "cannot read free ptr");
+  uint8_t *p = (uint8_t*)buf;
+  uint64_t first = offset / MDB_WAL_PAGE_SIZE;
+  uint64_t last = ((uint64_t)offset + len - 1) / MDB_WAL_PAGE_SIZE;
+  mdb_wal_lock_pages(wal, false);
+  bool covered = wal->page_count != 0;
+  for (uint64_t page = first; covered && page <= last; page++) {
+    covered = mdb_wal_slot(wal, ((uint64_t)file << 32) | page)->data != NULL;
   }
-
-  if (fseek(db->fp_index, 0, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to head of index file");
+  bool ok = true;
+  if (!covered) {
+    mdb_stat_io(db, false, len);
+    ok = mdb_pread_all(file == MDB_WAL_INDEX ? db->fd_index : db->fd_data,
+                       buf, len, offset);
   }
-  if (fwrite(&ptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write to head of index file");
+  for (uint64_t page = first; ok && wal->page_count != 0 && page <= last;
+       page++) {
+    mdb_wal_page_t *image = mdb_wal_slot(wal, ((uint64_t)file << 32) | page);
+    if (image->data == NULL) {
+      continue;
+    }
+    uint64_t begin = page * MDB_WAL_PAGE_SIZE;
+    uint64_t from = begin > offset ? begin : offset;
+    uint64_t to = begin + MDB_WAL_PAGE_SIZE;
+    if (to > (uint64_t)offset + len) {
+      to = (uint64_t)offset + len;
+    }
+    memcpy(p + (from - offset), image->data + (from - begin), to - from);
   }
+  mdb_wal_unlock_pages(wal);
+  return ok;
+}
 
-  if (fseek(db->fp_index, (long)ptr, SEEK_SET) != 0) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to ptr");
+/// the slot of @p key, or the empty one where it would go
+static mdb_wal_page_t *mdb_wal_slot(mdb_wal_t *wal, uint64_t key) {
+  uint32_t mask = wal->table_size - 1;
+  uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+  while (wal->pages[i].data != NULL && wal->pages[i].key != key) {
+    i = (i + 1) & mask;
   }
+  return wal->pages + i;
+}
 
-  if (fwrite(&freeptr, MDB_PTR_SIZE, 1, db->fp_index) < 1) {
-    return mdb_status(MDB_ERR_WRITE, "cannot write to ptr");
+/// the image of a page, read in from the file when it is not there yet
+/// unless it is about to be overwritten in @p whole
+static mdb_wal_page_t *mdb_wal_page(mdb_int_t *db, uint8_t file,
+                                    uint32_t page, bool whole) {
+  mdb_wal_t *wal = &db->wal;
+  uint64_t key = ((uint64_t)file << 32) | page;
+  if (wal->table_size != 0) {
+    mdb_wal_page_t *slot = mdb_wal_slot(wal, key);
+    if (slot->data != NULL) {
+      return slot;
+    }
+  }
+  if ((wal->page_count + 1) * 2 > wal->table_size) {
+    uint32_t table_size = wal->table_size != 0 ? wal->table_size * 2
+                                               : MDB_WAL_TABLE_MIN;
+    mdb_wal_page_t *pages = (mdb_wal_page_t*)calloc(table_size,
+                                                    sizeof(mdb_wal_page_t));
+    if (pages == NULL) {
+      return NULL;
+    }
+    mdb_wal_page_t *old_pages = wal->pages;
+    uint32_t old_size = wal->table_size;
+    wal->pages = pages;
+    wal->table_size = table_size;
+    for (uint32_t i = 0; i < old_size; i++) {
+      if (old_pages[i].data != NULL) {
+        *mdb_wal_slot(wal, old_pages[i].key) = old_pages[i];
+      }
+    }
+    free(old_pages);
   }
 
-  for (size_t i = 0; i < db->options.key_size_max; i++) {
-    char zero = '\0';
-    if (fwrite(&zero, 1, 1, db->fp_index) < 1) {
-      return mdb_status(MDB_ERR_WRITE, "cannot clean key part of index");
+  uint8_t *data = (uint8_t*)malloc(MDB_WAL_PAGE_SIZE);
+  if (data == NULL) {
+    return NULL;
+  }
+  if (!whole) {
+    int fd = file == MDB_WAL_INDEX ? db->fd_index : db->fd_data;
+    off_t offset = (off_t)page * MDB_WAL_PAGE_SIZE;
+    size_t done = 0;
+    while (done < MDB_WAL_PAGE_SIZE) {
+      ssize_t n = pread(fd, data + done, MDB_WAL_PAGE_SIZE - done,
+                        offset + (off_t)done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        free(data);
+        return NULL;
+      }
+      if (n == 0) {
+        memset(data + done, 0, MDB_WAL_PAGE_SIZE - done);
+        break;
+      }
+      done += (size_t)n;
     }
+    mdb_stat_io(db, false, done);
   }
+  mdb_wal_page_t *slot = mdb_wal_slot(wal, key);
+  slot->key = key;
+  slot->punched = false;
+  slot->data = data;
+  wal->page_count++;
+  return slot;
+}
 
-  if (fflush(db->fp_index) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+static void mdb_wal_drop_pages(mdb_wal_t *wal) {
+  for (uint32_t i = 0; i < wal->table_size; i++) {
+    free(wal->pages[i].data);
   }
+  free(wal->pages);
+  wal->pages = NULL;
+  wal->table_size = 0;
+  wal->page_count = 0;
+}
 
-  return mdb_status(MDB_OK, NULL);
+static int mdb_wal_page_cmp(const void *lhs, const void *rhs) {
+  uint64_t l = (*(mdb_wal_page_t* const*)lhs)->key;
+  uint64_t r = (*(mdb_wal_page_t* const*)rhs)->key;
+  return (l > r) - (l < r);
 }
 
-static mdb_status_t mdb_data_free(mdb_int_t *db, mdb_ptr_t valptr,
-                                  mdb_size_t valsize) {
-  if (fseek(db->fp_data, (long)valptr, SEEK_SET)) {
-    return mdb_status(MDB_ERR_SEEK, "cannot seek to data record");
+/// punches the range out, or writes zeros where that is not supported
+static bool mdb_wal_zero(int fd, uint64_t offset, uint64_t len) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)offset, (off_t)len) == 0) {
+    return true;
   }
-  uint8_t zero = '\0';
-  for (size_t i = 0; i < valsize; i++) {
-    if (fwrite(&zero, 1, 1, db->fp_data) != 1) {
-      return mdb_status(MDB_ERR_WRITE, "cannot write empty data");
+  static const uint8_t zeros[MDB_WAL_PAGE_SIZE];
+  for (uint64_t done = 0; done < len; done += MDB_WAL_PAGE_SIZE) {
+    size_t n = len - done < MDB_WAL_PAGE_SIZE ? (size_t)(len - done)
+                                              : MDB_WAL_PAGE_SIZE;
+    if (!mdb_pwrite_all(fd, zeros, n, (mdb_ptr_t)(offset + done))) {
+      return false;
     }
   }
-  if (fflush(db->fp_data) != 0) {
-    return mdb_status(MDB_ERR_FLUSH, "fflush failed");
+  return true;
+}
+
+static void mdb_wal_lock_pages(mdb_wal_t *wal, bool exclusive) {
+  if (wal->locked) {
+    if (exclusive) {
+      (void)pthread_rwlock_wrlock(&wal->page_lock);
+    } else {
+      (void)pthread_rwlock_rdlock(&wal->page_lock);
+    }
+  }
+}
+
+static void mdb_wal_unlock_pages(mdb_wal_t *wal) {
+  if (wal->locked) {
+    (void)pthread_rwlock_unlock(&wal->page_lock);
+  }
+}
+
+static void mdb_wal_lock_sync(mdb_wal_t *wal) {
+  if (wal->locked) {
+    (void)pthread_mutex_lock(&wal->sync_lock);
+  }
+}
+
+static void mdb_wal_unlock_sync(mdb_wal_t *wal) {
+  if (wal->locked) {
+    (void)pthread_mutex_unlock(&wal->sync_lock);
+  }
+}
+
+static void mdb_stat_add(uint64_t *counter, uint64_t n) {
+  (void)__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void mdb_stat_max(uint64_t *counter, uint64_t value) {
+  uint64_t seen = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  while (value > seen
+         && !__atomic_compare_exchange_n(counter, &seen, value, true,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+  }
+}
+
+/// one key looked up by walking @p hops records of its chain
+static void mdb_stat_chain(mdb_int_t *db, uint64_t hops) {
+  mdb_stat_add(&db->stats.lookups, 1);
+  mdb_stat_add(&db->stats.chain_hops, hops);
+  mdb_stat_max(&db->stats.chain_max, hops);
+}
+
+/// one read or write of @p bytes that goes to a file rather than a mapping;
+/// without positionless I/O each of them seeks first
+static void mdb_stat_io(mdb_int_t *db, bool write, size_t bytes) {
+  if (write) {
+    mdb_stat_add(&db->stats.file_writes, 1);
+    mdb_stat_add(&db->stats.bytes_written, bytes);
+  } else {
+    mdb_stat_add(&db->stats.file_reads, 1);
+    mdb_stat_add(&db->stats.bytes_read, bytes);
+  }
+  if (!db->pio) {
+    mdb_stat_add(&db->stats.seeks, 1);
+  }
+}
+
+/// CRC-32 (the zlib polynomial), four bits at a time
+static uint32_t mdb_crc32(const void *buf, size_t len) {
+  static const uint32_t table[16] = {
+    0x00000000u, 0x1db71064u, 0x3b6e20c8u, 0x26d930acu,
+    0x76dc4190u, 0x6b6b51f4u, 0x4db26158u, 0x5005713cu,
+    0xedb88320u, 0xf00f9344u, 0xd6d6a3e8u, 0xcb61b38cu,
+    0x9b64c2b0u, 0x86d3d2d4u, 0xa00ae278u, 0xbdbdf21cu
+  };
+  const uint8_t *p = (const uint8_t*)buf;
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ table[crc & 15];
+    crc = (crc >> 4) ^ table[crc & 15];
+  }
+  return ~crc;
+}
+
+/// superblock fields are little-endian whatever the host is
+static void mdb_put_le(uint8_t *p, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    p[i] = (uint8_t)(value >> (8 * i));
   }
-  return mdb_status(MDB_OK, NULL);
+}
+
+static uint64_t mdb_get_le(const uint8_t *p, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
 }
 
 static mdb_status_t mdb_status(uint8_t code, const char *desc) {
@@ -624,10 +7448,11 @@ static mdb_status_t mdb_status(uint8_t code, const char *desc) {
 }
 
 static mdb_int_t *mdb_alloc() {
-  mdb_int_t *ret = (mdb_int_t*)malloc(sizeof(mdb_int_t));
+  mdb_int_t *ret = (mdb_int_t*)calloc(1, sizeof(mdb_int_t));
   if (!ret) {
     return NULL;
   }
+  ret->free_map.seed = 0x9e3779b9u;
   ret->db_name = (char*)malloc(DB_NAME_MAX + 1);
   if (!ret->db_name) {
     free(ret);
@@ -638,32 +7463,133 @@ static mdb_int_t *mdb_alloc() {
 }
 
 static void mdb_free(mdb_int_t *db) {
+  mdb_flusher_stop(db);
+  if (db->index_map != NULL) {
+    if (db->options.msync_policy != MDB_MSYNC_NONE) {
+      (void)msync(db->index_map, db->index_end, MS_SYNC);
+    }
+    (void)munmap(db->index_map, db->index_map_size);
+  }
+  if (db->data_map != NULL) {
+    if (db->options.msync_policy != MDB_MSYNC_NONE) {
+      (void)msync(db->data_map, db->data_end, MS_SYNC);
+    }
+    (void)munmap(db->data_map, db->data_map_size);
+  }
+  mdb_wal_destroy(&db->wal);
   if (db->fp_superblock != NULL) {
     fclose(db->fp_superblock);
   }
   if (db->fp_index != NULL) {
+    mdb_file_release(db, db->fp_index, db->index_end, &db->index_cap);
     fclose(db->fp_index);
   }
   if (db->fp_data != NULL) {
+    mdb_file_release(db, db->fp_data, db->data_end, &db->data_cap);
     fclose(db->fp_data);
   }
+  if (db->thread_safe) {
+    for (size_t i = 0; i < MDB_LOCK_STRIPES; i++) {
+      (void)pthread_rwlock_destroy(&db->stripes[i]);
+    }
+    (void)pthread_rwlock_destroy(&db->table_lock);
+    (void)pthread_mutex_destroy(&db->alloc_lock);
+  }
+  mdb_extent_clear(&db->free_map);
+  mdb_slab_destroy(&db->slab);
+  mdb_cache_destroy(&db->cache);
+  free(db->bloom.words);
+  free(db->heads);
+  free(db->view_buf);
+  free(db->compact_vacated);
+  free(db->path);
   free(db->db_name);
   free(db);
 }
 
-static uint32_t mdb_hash(const char *key) {
-  uint32_t ret = 0;
-  for (uint32_t i = 0; *key != '\0'; ++key, ++i) {
-    ret += (uint32_t)*key * i;
+static uint64_t mdb_wymix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t mdb_wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static uint64_t mdb_wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/// wyhash-style hash; keys are at most KEY_SIZE_MAX_LIMIT bytes, so the
+/// wide three-lane loop of the original is left out
+static uint32_t mdb_hash(mdb_int_t *db, const char *key) {
+  static const uint64_t secret[2] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull
+  };
+
+  const uint8_t *p = (const uint8_t*)key;
+  size_t len = strlen(key);
+  uint64_t seed = db->options.hash_seed
+                  ^ mdb_wymix(db->options.hash_seed ^ secret[0], secret[1]);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (mdb_wyr4(p) << 32) | mdb_wyr4(p + ((len >> 3) << 2));
+      b = (mdb_wyr4(p + len - 4) << 32)
+          | mdb_wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    while (i > 16) {
+      seed = mdb_wymix(mdb_wyr8(p) ^ secret[1], mdb_wyr8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = mdb_wyr8(p + i - 16);
+    b = mdb_wyr8(p + i - 8);
+  }
+  uint64_t h = mdb_wymix(secret[1] ^ len, mdb_wymix(a ^ secret[1], b ^ seed));
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t mdb_bucket_of(mdb_int_t *db, uint32_t hash) {
+  uint32_t base = db->options.hash_buckets << db->level;
+  uint32_t bucket = hash % base;
+  if (bucket < db->split) {
+    bucket = hash % (base * 2);
   }
-  return ret;
+  return bucket;
+}
+
+static uint32_t mdb_bucket_count(mdb_int_t *db) {
+  return (db->options.hash_buckets << db->level) + db->split;
 }
 
 void mdb_close(mdb_t handle) {
   mdb_int_t *db = (mdb_int_t*)handle;
-  fclose(db->fp_superblock);
-  fclose(db->fp_index);
-  fclose(db->fp_data);
-  free(db->db_name);
-  free(db);
+  mdb_begin(db);
+  if (db->compact_vacated_count != 0) {
+    /// records vacated by an unfinished compaction pass would be lost to
+    /// the freelist otherwise
+    (void)mdb_compact_trim(db);
+  }
+  /// the superblock can only be marked clean once the files are current;
+  /// otherwise the log is left for the next open to replay
+  bool current = !db->wal.enabled
+                 || mdb_wal_checkpoint(db).code == MDB_OK;
+  (void)mdb_commit(db);
+  /// a failure only costs the next open a scan
+  if (!db->shared && current) {
+    (void)mdb_close_clean(db);
+  }
+  mdb_free(db);
 }
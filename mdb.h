@@ -18,8 +18,75 @@ typedef struct {
   uint32_t data_size_max;
   uint32_t hash_buckets;
   uint32_t items_max;
+  uint64_t hash_seed;
+  /* when not 0, the data file is divided into pages of this size, a power
+     of two from 4 KiB to 16 MiB, each serving one size class of values */
+  uint32_t slab_page_size;
+
+  /* runtime options, chosen on every open and not kept in the superblock */
+  uint32_t flags;
+  uint8_t msync_policy;
+  uint8_t max_load_factor;
+  /* the index and data files grow by this many bytes at a time, 1 MiB when
+     0; the unused tail is given back on close */
+  uint32_t grow_chunk;
+  /* bytes of recently read values kept in memory, by key; 0 turns the
+     cache off. It is always off in shared mode. */
+  uint64_t cache_size;
+  /* how far a mutation has got when it returns, see MDB_DURABILITY_*, and
+     the period of MDB_DURABILITY_PERIODIC in milliseconds, 1000 when 0 */
+  uint8_t durability;
+  uint32_t sync_interval_ms;
 } mdb_options_t;
 
+enum {
+  MDB_FLAG_MMAP_INDEX = 0x1,
+  MDB_FLAG_THREAD_SAFE = 0x2,
+  MDB_FLAG_SHARED = 0x4,
+  MDB_FLAG_MMAP_DATA = 0x8,
+  /* positionless pread/pwrite on file descriptors instead of stdio streams;
+     implied by MDB_FLAG_THREAD_SAFE and MDB_FLAG_SHARED */
+  MDB_FLAG_PIO = 0x10,
+  /* keeps a Bloom filter of the keys in memory, so that most lookups of
+     missing keys do not read the index; ignored in shared mode */
+  MDB_FLAG_BLOOM = 0x20,
+  /* logs every mutation to the .db.wal file before it reaches the index
+     and data files. Writers committing at the same time share one sync of
+     the log, and the changed pages are written back in bulk at checkpoints.
+     A crash loses no mutation that has returned and leaves none half done;
+     the log is replayed by the next open, with or without this flag.
+     Mutations are applied one at a time. Implies MDB_FLAG_PIO, turns the
+     mmap flags off, and is ignored in shared mode. */
+  MDB_FLAG_WAL = 0x40
+};
+
+/* A clean close always syncs the files. Before that, a crash of the process
+   loses what has not reached the kernel and a crash of the machine what has
+   not been synced:
+   NONE      each mutation reaches the kernel before it returns; nothing is
+             synced until close
+   ON_CLOSE  mutations stay in the stdio buffers until these fill up or the
+             database is closed, saving a flush per mutation; the same as
+             NONE with MDB_FLAG_PIO, and NONE in shared mode
+   PERIODIC  as NONE, and a background thread syncs the files every
+             sync_interval_ms if anything changed, which bounds what a crash
+             of the machine can lose
+   COMMIT    each mutation is synced before it returns
+   MDB_FLAG_WAL syncs every mutation to its log whatever is chosen here. */
+enum {
+  MDB_DURABILITY_NONE = 0,
+  MDB_DURABILITY_ON_CLOSE,
+  MDB_DURABILITY_PERIODIC,
+  MDB_DURABILITY_COMMIT
+};
+
+enum {
+  MDB_MSYNC_NONE = 0,
+  MDB_MSYNC_ON_CLOSE,
+  MDB_MSYNC_ASYNC,
+  MDB_MSYNC_SYNC
+};
+
 enum {
   MDB_OK = 0,
   MDB_NO_KEY,
@@ -34,6 +101,9 @@ enum {
   MDB_ERR_BUFSIZ,
   MDB_ERR_KEY_SIZE,
   MDB_ERR_VALUE_SIZE,
+  MDB_ERR_MMAP,
+  MDB_ERR_FORMAT,
+  MDB_ERR_LOCK,
   MDB_ERR_UNIMPLEMENTED = 100
 };
 
@@ -51,13 +121,181 @@ typedef struct {
 typedef void *mdb_t;
 
 mdb_status_t mdb_open(mdb_t *handle, const char *db_path);
+mdb_status_t mdb_open_ex(mdb_t *handle, const char *db_path,
+                         const mdb_options_t *options);
 mdb_status_t mdb_create(mdb_t *handle, mdb_options_t options);
 void mdb_close(mdb_t handle);
 mdb_status_t mdb_read(mdb_t handle, const char *key, char *buf, size_t bufsiz);
+/* the view stays valid until the next mutation of the database, or the next
+   mdb_read_view on the handle when the data file is not mapped */
+mdb_status_t mdb_read_view(mdb_t handle, const char *key, const void **value,
+                           size_t *size);
+mdb_status_t mdb_read_multi(mdb_t handle, const char *keys[], char *bufs[],
+                            size_t bufsizes[], mdb_status_t statuses[],
+                            size_t count);
 mdb_status_t mdb_write(mdb_t handle, const char *key, const char *value);
+mdb_status_t mdb_write_n(mdb_t handle, const char *key, const void *value,
+                         size_t size);
 mdb_status_t mdb_delete(mdb_t handle, const char *key);
+mdb_status_t mdb_write_batch(mdb_t handle, const char *keys[],
+                             const char *values[], size_t count);
+mdb_status_t mdb_delete_batch(mdb_t handle, const char *keys[], size_t count,
+                              size_t *deleted);
+
+typedef void *mdb_cursor_t;
+
+/* walks all records in index file order; key and value stay valid until the
+   next call on the cursor, and mdb_cursor_next returns MDB_NO_KEY at the end */
+mdb_status_t mdb_cursor_open(mdb_t handle, mdb_cursor_t *cursor);
+mdb_status_t mdb_cursor_next(mdb_cursor_t cursor, const char **key,
+                             const void **value, size_t *size);
+void mdb_cursor_close(mdb_cursor_t cursor);
+
+/* many lookups and writes in flight from one thread. mdb_read_async and
+   mdb_write_async copy the key but not buf or value, which must stay valid
+   until the callback. Callbacks run in mdb_async_poll, which waits until at
+   least min_complete requests have finished, or all that are left, and then
+   runs those of every finished one; *completed is how many ran. Requests
+   finish in any order, so a read may miss a write submitted before it until
+   the write's callback has run. Errors in submitting are returned and never
+   reach a callback. A context belongs to the thread that opened it and is
+   closed, which waits for its requests, before the database.
+   depth is the number of reads kept in flight on an io_uring ring, or of
+   threads in the fallback pool (at most 16), and 64 when 0. */
+typedef void *mdb_async_t;
+typedef void (*mdb_async_cb_t)(void *arg, mdb_status_t status);
+
+/* how a context gets its requests done. URING walks each chain with one
+   read in flight per request, no thread waiting on it; it needs a handle
+   opened with MDB_FLAG_PIO or MDB_FLAG_THREAD_SAFE that does not map its
+   files, log with MDB_FLAG_WAL or share them, and a kernel that allows
+   io_uring. Otherwise a thread safe handle gets a pool of THREADS making
+   the synchronous calls, and any other handle does them INLINE, while the
+   request is submitted. */
+enum {
+  MDB_ASYNC_URING = 0,
+  MDB_ASYNC_THREADS,
+  MDB_ASYNC_INLINE
+};
+
+mdb_status_t mdb_async_open(mdb_t handle, unsigned depth, mdb_async_t *async);
+mdb_status_t mdb_read_async(mdb_async_t async, const char *key, char *buf,
+                            size_t bufsiz, mdb_async_cb_t callback,
+                            void *arg);
+mdb_status_t mdb_write_async(mdb_async_t async, const char *key,
+                             const void *value, size_t size,
+                             mdb_async_cb_t callback, void *arg);
+mdb_status_t mdb_async_poll(mdb_async_t async, size_t min_complete,
+                            size_t *completed);
+uint8_t mdb_async_engine(mdb_async_t async);
+void mdb_async_close(mdb_async_t async);
+
+/* rewrites the live records into dense, bucket ordered files and swaps them
+   in. mdb_compact_step does the same online, moving records and values into
+   lower free space a few chains at a time, at least budget records per call
+   unless the pass ends; *done is set once a pass has finished and the files
+   have been shrunk. Records may move, so cursors open across either see an
+   undefined subset. Neither is available in shared mode. */
+mdb_status_t mdb_compact(mdb_t handle);
+mdb_status_t mdb_compact_step(mdb_t handle, size_t budget, bool *done);
+
 mdb_options_t mdb_get_options(mdb_t handle);
 
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t entries;
+  uint64_t bytes;
+} mdb_cache_stats_t;
+
+mdb_cache_stats_t mdb_get_cache_stats(mdb_t handle);
+
+/* false_positive_rate is the share of lookups of missing keys that the
+   filter let through to the index */
+typedef struct {
+  uint64_t lookups;
+  uint64_t negatives;
+  uint64_t false_positives;
+  double false_positive_rate;
+  uint64_t bytes;
+} mdb_filter_stats_t;
+
+mdb_filter_stats_t mdb_get_filter_stats(mdb_t handle);
+
+/* counters since the database was opened, kept for every handle. Chain
+   figures cover the lookups of single keys; alloc_steps is the number of
+   free extents looked at to place values. File I/O counts the reads and
+   writes that go to the files, seeks the ones done through stdio; access
+   through a mapping is not counted. flushes counts every flush of the
+   stdio buffers of the index and data files. With MDB_FLAG_WAL, commits
+   counts the mutations logged and checkpoints the times the files were
+   brought up to date; syncs includes those of the log, each of which covers
+   all commits waiting at the time. Cache and filter counters are copied from
+   mdb_get_cache_stats and mdb_get_filter_stats. */
+typedef struct {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t deletes;
+  uint64_t batches;
+  uint64_t splits;
+
+  uint64_t lookups;
+  uint64_t chain_hops;
+  uint64_t chain_max;
+
+  uint64_t allocs;
+  uint64_t alloc_steps;
+
+  uint64_t seeks;
+  uint64_t file_reads;
+  uint64_t file_writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t flushes;
+  uint64_t syncs;
+  uint64_t commits;
+  uint64_t checkpoints;
+
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t filter_negatives;
+  uint64_t filter_false_positives;
+} mdb_stats_t;
+
+mdb_stats_t mdb_get_stats(mdb_t handle);
+
+/* a survey of the table, taken by walking every bucket chain with up to
+   threads threads over ranges of buckets (0 means one per processor).
+   Writers wait until it is done. The last bin of chain_histogram counts
+   chains of MDB_INSPECT_CHAIN_BINS - 1 records or more. Free data bytes are
+   those not covered by a live value, whether zeroed, punched or slack in a
+   slab page. suggested_buckets is the power of two giving an average chain
+   of about one record, for creating the next database with. */
+#define MDB_INSPECT_CHAIN_BINS 16
+
+typedef struct {
+  uint32_t hash_buckets;
+  uint32_t buckets;
+  uint64_t items;
+  double load_factor;
+  double base_load_factor;
+  uint64_t chain_histogram[MDB_INSPECT_CHAIN_BINS];
+  uint64_t chain_max;
+  uint64_t freelist_length;
+
+  uint64_t index_bytes;
+  uint64_t data_bytes;
+  uint64_t live_bytes;
+  uint64_t free_bytes;
+  uint64_t free_extents;
+  uint64_t largest_free_extent;
+
+  uint32_t suggested_buckets;
+} mdb_inspect_t;
+
+mdb_status_t mdb_inspect(mdb_t handle, unsigned threads,
+                         mdb_inspect_t *report);
+
 size_t mdb_index_size(mdb_t *handle);
 size_t mdb_data_size(mdb_t *handle);
 
@@ -0,0 +1,744 @@
+#include "mdb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+/* YCSB style workloads against a fresh database: a load phase inserts the
+   initial records, then every thread runs its share of operations drawn
+   from the configured mix and key distribution */
+
+enum {
+  OP_READ = 0,
+  OP_UPDATE,
+  OP_INSERT,
+  OP_DELETE,
+  OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+  "read", "update", "insert", "delete"
+};
+
+enum {
+  DIST_UNIFORM = 0,
+  DIST_ZIPFIAN,
+  DIST_LATEST
+};
+
+typedef struct {
+  const char *path;
+  uint64_t records;
+  uint64_t ops;
+  unsigned threads;
+  unsigned mix[OP_COUNT];
+  int dist;
+  double theta;
+  unsigned key_min;
+  unsigned key_max;
+  unsigned value_min;
+  unsigned value_max;
+  uint32_t buckets;
+  uint32_t flags;
+  uint64_t cache_size;
+  uint32_t slab_page_size;
+  uint8_t durability;
+  uint32_t sync_interval_ms;
+  unsigned async_depth;
+  uint64_t seed;
+} bench_config_t;
+
+/* latencies are kept in log-linear buckets: 32 linear steps for every
+   power of two of nanoseconds, which bounds the error to about 3% */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+  uint64_t errors;
+} histogram_t;
+
+static unsigned hist_bucket(uint64_t ns) {
+  if (ns < (1u << HIST_SUB_BITS)) {
+    return (unsigned)ns;
+  }
+  unsigned msb = 63 - (unsigned)__builtin_clzll(ns);
+  unsigned shift = msb - HIST_SUB_BITS;
+  unsigned sub = (unsigned)(ns >> shift) & ((1u << HIST_SUB_BITS) - 1);
+  return ((shift + 1) << HIST_SUB_BITS) + sub;
+}
+
+/* the upper bound of a bucket, so percentiles err on the slow side */
+static uint64_t hist_value(unsigned bucket) {
+  if (bucket < (1u << HIST_SUB_BITS)) {
+    return bucket;
+  }
+  unsigned shift = (bucket >> HIST_SUB_BITS) - 1;
+  uint64_t sub = bucket & ((1u << HIST_SUB_BITS) - 1);
+  return (((uint64_t)1 << HIST_SUB_BITS | sub) << shift)
+         + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_add(histogram_t *hist, uint64_t ns) {
+  hist->counts[hist_bucket(ns)]++;
+  hist->total++;
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+}
+
+static void hist_merge(histogram_t *into, const histogram_t *from) {
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    into->counts[i] += from->counts[i];
+  }
+  into->total += from->total;
+  into->errors += from->errors;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+static uint64_t hist_percentile(const histogram_t *hist, double p) {
+  uint64_t rank = (uint64_t)ceil(p * (double)hist->total);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank && seen != 0) {
+      uint64_t value = hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+static double rng_double(uint64_t *state) {
+  return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t fnv64(uint64_t value) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < 8; i++) {
+    hash ^= value & 0xff;
+    hash *= 0x100000001b3ull;
+    value >>= 8;
+  }
+  return hash;
+}
+
+/* the zipfian generator of Gray et al. as used by YCSB, over a fixed item
+   count; ranks are scrambled so that hot keys are spread over the table */
+typedef struct {
+  uint64_t items;
+  double theta;
+  double zetan;
+  double alpha;
+  double eta;
+} zipfian_t;
+
+static double zeta(uint64_t n, double theta) {
+  double sum = 0;
+  for (uint64_t i = 1; i <= n; i++) {
+    sum += 1.0 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+static void zipfian_init(zipfian_t *z, uint64_t items, double theta) {
+  z->items = items;
+  z->theta = theta;
+  z->zetan = zeta(items, theta);
+  z->alpha = 1.0 / (1.0 - theta);
+  z->eta = (1.0 - pow(2.0 / (double)items, 1.0 - theta))
+           / (1.0 - zeta(2, theta) / z->zetan);
+}
+
+static uint64_t zipfian_next(const zipfian_t *z, uint64_t *rng) {
+  double u = rng_double(rng);
+  double uz = u * z->zetan;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + pow(0.5, z->theta)) {
+    return 1;
+  }
+  uint64_t rank = (uint64_t)((double)z->items
+                             * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return rank < z->items ? rank : z->items - 1;
+}
+
+typedef struct {
+  const bench_config_t *config;
+  const zipfian_t *zipfian;
+  mdb_t db;
+  uint64_t *next_key;
+  unsigned id;
+  histogram_t hists[OP_COUNT];
+  struct slots_s *slots;
+  uint8_t engine;
+} worker_t;
+
+static size_t make_key(const bench_config_t *config, uint64_t k, char *buf) {
+  uint64_t h = fnv64(k);
+  unsigned len = config->key_min
+                 + (unsigned)(h % (config->key_max - config->key_min + 1));
+  int n = snprintf(buf, config->key_max + 1, "u%llu",
+                   (unsigned long long)k);
+  for (unsigned i = (unsigned)n; i < len; i++) {
+    buf[i] = 'a' + (char)((h >> (i % 60)) % 26);
+  }
+  buf[len > (unsigned)n ? len : (unsigned)n] = '\0';
+  return strlen(buf);
+}
+
+static size_t make_value(const bench_config_t *config, uint64_t *rng,
+                         char *buf) {
+  size_t len = config->value_min
+               + (size_t)(rng_next(rng)
+                          % (config->value_max - config->value_min + 1));
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = 'A' + (char)((i * 7 + len) % 26);
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+static uint64_t pick_key(worker_t *w, uint64_t *rng) {
+  uint64_t inserted = __atomic_load_n(w->next_key, __ATOMIC_RELAXED);
+  if (inserted == 0) {
+    return 0;
+  }
+  switch (w->config->dist) {
+  case DIST_ZIPFIAN:
+    return fnv64(zipfian_next(w->zipfian, rng)) % inserted;
+  case DIST_LATEST: {
+    uint64_t back = zipfian_next(w->zipfian, rng);
+    return back < inserted ? inserted - 1 - back : 0;
+  }
+  default:
+    return rng_next(rng) % inserted;
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* draws the next operation from the mix and makes up its key and value */
+static int pick_op(worker_t *w, uint64_t *rng, char *key, char *value,
+                   size_t *size) {
+  const bench_config_t *config = w->config;
+  unsigned mix_total = 0;
+  for (int op = 0; op < OP_COUNT; op++) {
+    mix_total += config->mix[op];
+  }
+  unsigned roll = (unsigned)(rng_next(rng) % mix_total);
+  int op = 0;
+  while (roll >= config->mix[op]) {
+    roll -= config->mix[op];
+    op++;
+  }
+
+  uint64_t k = op == OP_INSERT
+               ? __atomic_fetch_add(w->next_key, 1, __ATOMIC_RELAXED)
+               : pick_key(w, rng);
+  make_key(config, k, key);
+  *size = op == OP_UPDATE || op == OP_INSERT ? make_value(config, rng, value)
+                                             : 0;
+  return op;
+}
+
+/* an operation in flight with --async; latency runs from submission to
+   the callback */
+typedef struct {
+  worker_t *w;
+  int op;
+  uint64_t start;
+  char *key;
+  char *value;
+  size_t next_free;
+} slot_t;
+
+typedef struct slots_s {
+  slot_t *slots;
+  size_t free_head;
+} slots_t;
+
+static void async_done(void *opaque, mdb_status_t status) {
+  slot_t *slot = (slot_t*)opaque;
+  hist_add(&slot->w->hists[slot->op], now_ns() - slot->start);
+  if (status.code != MDB_OK && status.code != MDB_NO_KEY) {
+    slot->w->hists[slot->op].errors++;
+  }
+  slots_t *slots = slot->w->slots;
+  slot->next_free = slots->free_head;
+  slots->free_head = (size_t)(slot - slots->slots);
+}
+
+/* keeps up to async_depth operations in flight on one context. There is
+   no asynchronous delete, so deletes are done in between. */
+static void worker_async(worker_t *w, uint64_t *rng, uint64_t ops) {
+  const bench_config_t *config = w->config;
+  size_t depth = config->async_depth;
+  slots_t slots;
+  slots.slots = (slot_t*)calloc(depth, sizeof(slot_t));
+  char *buffers = (char*)malloc(depth * (config->key_max + 32
+                                         + config->value_max + 1));
+  mdb_async_t async;
+  if (slots.slots == NULL || buffers == NULL
+      || mdb_async_open(w->db, config->async_depth, &async).code != MDB_OK) {
+    free(slots.slots);
+    free(buffers);
+    return;
+  }
+  for (size_t i = 0; i < depth; i++) {
+    slots.slots[i].w = w;
+    slots.slots[i].key = buffers + i * (config->key_max + 32
+                                        + config->value_max + 1);
+    slots.slots[i].value = slots.slots[i].key + config->key_max + 32;
+    slots.slots[i].next_free = i + 1;
+  }
+  slots.free_head = 0;
+  w->slots = &slots;
+  w->engine = mdb_async_engine(async);
+
+  for (uint64_t i = 0; i < ops; i++) {
+    while (slots.free_head == depth) {
+      mdb_async_poll(async, 1, NULL);
+    }
+    slot_t *slot = slots.slots + slots.free_head;
+    size_t size;
+    slot->op = pick_op(w, rng, slot->key, slot->value, &size);
+    slot->start = now_ns();
+    slots.free_head = slot->next_free;
+    if (slot->op == OP_DELETE) {
+      async_done(slot, mdb_delete(w->db, slot->key));
+      continue;
+    }
+    mdb_status_t status =
+        slot->op == OP_READ
+        ? mdb_read_async(async, slot->key, slot->value,
+                         config->value_max + 1, async_done, slot)
+        : mdb_write_async(async, slot->key, slot->value, size, async_done,
+                          slot);
+    if (status.code != MDB_OK) {
+      async_done(slot, status);
+    }
+  }
+  mdb_async_close(async);
+  w->slots = NULL;
+  free(slots.slots);
+  free(buffers);
+}
+
+static void *worker_main(void *opaque) {
+  worker_t *w = (worker_t*)opaque;
+  const bench_config_t *config = w->config;
+  uint64_t rng = config->seed * 0x9e3779b97f4a7c15ull + w->id + 1;
+  uint64_t ops = config->ops / config->threads
+                 + (w->id < config->ops % config->threads ? 1 : 0);
+  if (config->async_depth != 0) {
+    worker_async(w, &rng, ops);
+    return NULL;
+  }
+
+  char *key = (char*)malloc(config->key_max + 32);
+  char *value = (char*)malloc(config->value_max + 1);
+  if (key == NULL || value == NULL) {
+    free(key);
+    free(value);
+    return NULL;
+  }
+  for (uint64_t i = 0; i < ops; i++) {
+    size_t size;
+    int op = pick_op(w, &rng, key, value, &size);
+    uint64_t start = now_ns();
+    mdb_status_t status;
+    switch (op) {
+    case OP_READ:
+      status = mdb_read(w->db, key, value, config->value_max + 1);
+      break;
+    case OP_DELETE:
+      status = mdb_delete(w->db, key);
+      break;
+    default:
+      status = mdb_write_n(w->db, key, value, size);
+      break;
+    }
+    hist_add(&w->hists[op], now_ns() - start);
+    /* missing keys are expected once deletes are in the mix */
+    if (status.code != MDB_OK && status.code != MDB_NO_KEY) {
+      w->hists[op].errors++;
+    }
+  }
+  free(key);
+  free(value);
+  return NULL;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --path P            database path (mdb_bench)\n"
+          "  --workload a|b|c|d  YCSB preset: a 50/50 read/update, b 95/5,\n"
+          "                      c read only, d 95/5 read/insert latest\n"
+          "  --records N         records loaded up front (100000)\n"
+          "  --ops N             operations in the run phase (1000000)\n"
+          "  --threads N         worker threads (1)\n"
+          "  --read/--update/--insert/--delete W\n"
+          "                      relative weights of the operation mix\n"
+          "  --dist uniform|zipfian|latest  key distribution (zipfian)\n"
+          "  --theta T           zipfian skew (0.99)\n"
+          "  --key-size MIN:MAX  key length range (24:24)\n"
+          "  --value-size MIN:MAX  value length range (100:100)\n"
+          "  --buckets N         initial hash buckets (1024)\n"
+          "  --cache BYTES       read cache size (0)\n"
+          "  --slab PAGE         slab page size (0)\n"
+          "  --durability none|close|periodic|commit  (none)\n"
+          "  --sync-interval MS  period of --durability periodic (1000)\n"
+          "  --async DEPTH       keep DEPTH operations in flight per thread\n"
+          "                      through an async context; implies --pio\n"
+          "  --mmap --pio --bloom --wal  open flags\n"
+          "  --seed N            random seed (1)\n",
+          argv0);
+}
+
+static bool parse_range(const char *arg, unsigned *min, unsigned *max) {
+  char *end;
+  unsigned long lo = strtoul(arg, &end, 10);
+  unsigned long hi = lo;
+  if (*end == ':') {
+    hi = strtoul(end + 1, &end, 10);
+  }
+  if (*end != '\0' || lo > hi) {
+    return false;
+  }
+  *min = (unsigned)lo;
+  *max = (unsigned)hi;
+  return true;
+}
+
+static bool parse_args(int argc, char *argv[], bench_config_t *config) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool has_value = i + 1 < argc;
+    const char *value = has_value ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--mmap") == 0) {
+      config->flags |= MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA;
+      continue;
+    } else if (strcmp(arg, "--pio") == 0) {
+      config->flags |= MDB_FLAG_PIO;
+      continue;
+    } else if (strcmp(arg, "--bloom") == 0) {
+      config->flags |= MDB_FLAG_BLOOM;
+      continue;
+    } else if (strcmp(arg, "--wal") == 0) {
+      config->flags |= MDB_FLAG_WAL;
+      continue;
+    }
+    if (!has_value) {
+      return false;
+    }
+    i++;
+    if (strcmp(arg, "--path") == 0) {
+      config->path = value;
+    } else if (strcmp(arg, "--workload") == 0) {
+      memset(config->mix, 0, sizeof(config->mix));
+      config->dist = DIST_ZIPFIAN;
+      switch (value[0]) {
+      case 'a':
+        config->mix[OP_READ] = 50;
+        config->mix[OP_UPDATE] = 50;
+        break;
+      case 'b':
+        config->mix[OP_READ] = 95;
+        config->mix[OP_UPDATE] = 5;
+        break;
+      case 'c':
+        config->mix[OP_READ] = 100;
+        break;
+      case 'd':
+        config->mix[OP_READ] = 95;
+        config->mix[OP_INSERT] = 5;
+        config->dist = DIST_LATEST;
+        break;
+      default:
+        return false;
+      }
+    } else if (strcmp(arg, "--records") == 0) {
+      config->records = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--ops") == 0) {
+      config->ops = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--threads") == 0) {
+      config->threads = (unsigned)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--read") == 0) {
+      config->mix[OP_READ] = (unsigned)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--update") == 0) {
+      config->mix[OP_UPDATE] = (unsigned)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--insert") == 0) {
+      config->mix[OP_INSERT] = (unsigned)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--delete") == 0) {
+      config->mix[OP_DELETE] = (unsigned)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--dist") == 0) {
+      if (strcmp(value, "uniform") == 0) {
+        config->dist = DIST_UNIFORM;
+      } else if (strcmp(value, "zipfian") == 0) {
+        config->dist = DIST_ZIPFIAN;
+      } else if (strcmp(value, "latest") == 0) {
+        config->dist = DIST_LATEST;
+      } else {
+        return false;
+      }
+    } else if (strcmp(arg, "--theta") == 0) {
+      config->theta = strtod(value, NULL);
+    } else if (strcmp(arg, "--key-size") == 0) {
+      if (!parse_range(value, &config->key_min, &config->key_max)) {
+        return false;
+      }
+    } else if (strcmp(arg, "--value-size") == 0) {
+      if (!parse_range(value, &config->value_min, &config->value_max)) {
+        return false;
+      }
+    } else if (strcmp(arg, "--buckets") == 0) {
+      config->buckets = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--cache") == 0) {
+      config->cache_size = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--slab") == 0) {
+      config->slab_page_size = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--durability") == 0) {
+      if (strcmp(value, "none") == 0) {
+        config->durability = MDB_DURABILITY_NONE;
+      } else if (strcmp(value, "close") == 0) {
+        config->durability = MDB_DURABILITY_ON_CLOSE;
+      } else if (strcmp(value, "periodic") == 0) {
+        config->durability = MDB_DURABILITY_PERIODIC;
+      } else if (strcmp(value, "commit") == 0) {
+        config->durability = MDB_DURABILITY_COMMIT;
+      } else {
+        return false;
+      }
+    } else if (strcmp(arg, "--sync-interval") == 0) {
+      config->sync_interval_ms = (uint32_t)strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--async") == 0) {
+      config->async_depth = (unsigned)strtoul(value, NULL, 10);
+      config->flags |= MDB_FLAG_PIO;
+    } else if (strcmp(arg, "--seed") == 0) {
+      config->seed = strtoull(value, NULL, 10);
+    } else {
+      return false;
+    }
+  }
+
+  unsigned mix_total = 0;
+  for (int op = 0; op < OP_COUNT; op++) {
+    mix_total += config->mix[op];
+  }
+  /* keys are "u" and the record number, padded up to the minimum length */
+  return mix_total != 0 && config->threads != 0 && config->buckets != 0
+         && config->key_max >= 21 && config->key_max <= KEY_SIZE_MAX_LIMIT
+         && config->theta > 0 && config->theta < 1;
+}
+
+static void print_sizes(const char *phase, mdb_t db) {
+  printf("%-6s index %zu bytes, data %zu bytes\n", phase,
+         mdb_index_size(db), mdb_data_size(db));
+}
+
+static void print_hist(const char *name, const histogram_t *hist,
+                       double seconds) {
+  if (hist->total == 0) {
+    return;
+  }
+  printf("%-7s %10llu ops %12.0f ops/s  p50 %8.2f us  p99 %8.2f us  "
+         "p999 %8.2f us  max %9.2f us",
+         name, (unsigned long long)hist->total,
+         (double)hist->total / seconds,
+         hist_percentile(hist, 0.50) / 1000.0,
+         hist_percentile(hist, 0.99) / 1000.0,
+         hist_percentile(hist, 0.999) / 1000.0,
+         hist->max / 1000.0);
+  if (hist->errors != 0) {
+    printf("  %llu errors", (unsigned long long)hist->errors);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  bench_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.path = "mdb_bench";
+  config.records = 100000;
+  config.ops = 1000000;
+  config.threads = 1;
+  config.mix[OP_READ] = 50;
+  config.mix[OP_UPDATE] = 50;
+  config.dist = DIST_ZIPFIAN;
+  config.theta = 0.99;
+  config.key_min = config.key_max = 24;
+  config.value_min = config.value_max = 100;
+  config.buckets = 1024;
+  config.seed = 1;
+  if (!parse_args(argc, argv, &config)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  mdb_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.db_name = (char*)config.path;
+  options.key_size_max = (uint16_t)config.key_max;
+  options.data_size_max = config.value_max;
+  options.hash_buckets = config.buckets;
+  options.items_max = ITEMS_MAX_LIMIT;
+  options.slab_page_size = config.slab_page_size;
+  options.flags = config.flags
+                  | (config.threads > 1 ? MDB_FLAG_THREAD_SAFE : 0);
+  options.cache_size = config.cache_size;
+  options.durability = config.durability;
+  options.sync_interval_ms = config.sync_interval_ms;
+
+  mdb_t db;
+  mdb_status_t status = mdb_create(&db, options);
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: cannot create %s: %s\n", argv[0], config.path,
+            status.desc != NULL ? status.desc : "unknown error");
+    return 1;
+  }
+  print_sizes("empty", db);
+
+  /* the load phase goes through batches, like a bulk import would */
+  uint64_t next_key = 0;
+  uint64_t rng = config.seed;
+  enum { LOAD_BATCH = 1024 };
+  char *keys = (char*)malloc((size_t)LOAD_BATCH * (config.key_max + 32));
+  char *values = (char*)malloc((size_t)LOAD_BATCH * (config.value_max + 1));
+  const char *key_ptrs[LOAD_BATCH];
+  const char *value_ptrs[LOAD_BATCH];
+  if (keys == NULL || values == NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  uint64_t load_start = now_ns();
+  while (next_key < config.records && status.code == MDB_OK) {
+    size_t count = 0;
+    for (; count < LOAD_BATCH && next_key < config.records; count++) {
+      char *key = keys + count * (config.key_max + 32);
+      char *value = values + count * (config.value_max + 1);
+      make_key(&config, next_key++, key);
+      make_value(&config, &rng, value);
+      key_ptrs[count] = key;
+      value_ptrs[count] = value;
+    }
+    status = mdb_write_batch(db, key_ptrs, value_ptrs, count);
+  }
+  double load_seconds = (double)(now_ns() - load_start) / 1e9;
+  free(keys);
+  free(values);
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: load failed: %s\n", argv[0],
+            status.desc != NULL ? status.desc : "unknown error");
+    mdb_close(db);
+    return 1;
+  }
+  printf("load   %llu records in %.2f s, %.0f records/s\n",
+         (unsigned long long)config.records, load_seconds,
+         (double)config.records / (load_seconds > 0 ? load_seconds : 1e-9));
+  print_sizes("loaded", db);
+
+  zipfian_t zipfian;
+  zipfian_init(&zipfian, config.records > 2 ? config.records : 2,
+               config.theta);
+  worker_t *workers = (worker_t*)calloc(config.threads, sizeof(worker_t));
+  pthread_t *threads = (pthread_t*)calloc(config.threads, sizeof(pthread_t));
+  if (workers == NULL || threads == NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  uint64_t run_start = now_ns();
+  for (unsigned t = 0; t < config.threads; t++) {
+    workers[t].config = &config;
+    workers[t].zipfian = &zipfian;
+    workers[t].db = db;
+    workers[t].next_key = &next_key;
+    workers[t].id = t;
+    pthread_create(&threads[t], NULL, worker_main, &workers[t]);
+  }
+  histogram_t hists[OP_COUNT];
+  histogram_t all;
+  memset(hists, 0, sizeof(hists));
+  memset(&all, 0, sizeof(all));
+  for (unsigned t = 0; t < config.threads; t++) {
+    pthread_join(threads[t], NULL);
+    for (int op = 0; op < OP_COUNT; op++) {
+      hist_merge(&hists[op], &workers[t].hists[op]);
+      hist_merge(&all, &workers[t].hists[op]);
+    }
+  }
+  double run_seconds = (double)(now_ns() - run_start) / 1e9;
+  if (run_seconds <= 0) {
+    run_seconds = 1e-9;
+  }
+
+  printf("run    %llu ops on %u threads in %.2f s\n",
+         (unsigned long long)all.total, config.threads, run_seconds);
+  if (config.async_depth != 0) {
+    static const char *engines[] = { "io_uring", "threads", "inline" };
+    printf("async  depth %u on %s\n", config.async_depth,
+           engines[workers[0].engine]);
+  }
+  for (int op = 0; op < OP_COUNT; op++) {
+    print_hist(op_names[op], &hists[op], run_seconds);
+  }
+  print_hist("total", &all, run_seconds);
+  print_sizes("final", db);
+  mdb_stats_t stats = mdb_get_stats(db);
+  printf("io     %llu reads, %llu writes, %llu seeks, %llu flushes, "
+         "%llu syncs, %llu bytes read, %llu bytes written\n",
+         (unsigned long long)stats.file_reads,
+         (unsigned long long)stats.file_writes,
+         (unsigned long long)stats.seeks, (unsigned long long)stats.flushes,
+         (unsigned long long)stats.syncs, (unsigned long long)stats.bytes_read,
+         (unsigned long long)stats.bytes_written);
+  printf("chains %.2f records per lookup, longest %llu, %llu splits\n",
+         stats.lookups != 0 ? (double)stats.chain_hops / stats.lookups : 0.0,
+         (unsigned long long)stats.chain_max,
+         (unsigned long long)stats.splits);
+  if (config.cache_size != 0) {
+    mdb_cache_stats_t cache = mdb_get_cache_stats(db);
+    printf("cache  %llu hits, %llu misses\n",
+           (unsigned long long)cache.hits, (unsigned long long)cache.misses);
+  }
+  if (config.flags & MDB_FLAG_BLOOM) {
+    mdb_filter_stats_t filter = mdb_get_filter_stats(db);
+    printf("filter %llu negatives, false positive rate %.4f\n",
+           (unsigned long long)filter.negatives, filter.false_positive_rate);
+  }
+  if (config.flags & MDB_FLAG_WAL) {
+    printf("log    %llu commits, %llu syncs, %llu checkpoints\n",
+           (unsigned long long)stats.commits, (unsigned long long)stats.syncs,
+           (unsigned long long)stats.checkpoints);
+  }
+
+  free(workers);
+  free(threads);
+  /* with --durability close this is where the writes are paid for */
+  uint64_t close_start = now_ns();
+  mdb_close(db);
+  printf("close  %.3f s\n", (double)(now_ns() - close_start) / 1e9);
+  return all.errors != 0 ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+#include "mdb.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* compacts a database in place, either in one go or, with --online, in
+   small steps the way a process serving traffic would */
+int main(int argc, char *argv[]) {
+  bool online = argc == 3 && strcmp(argv[2], "--online") == 0;
+  if (argc != 2 && !online) {
+    fprintf(stderr, "usage: %s <db path> [--online]\n", argv[0]);
+    return 2;
+  }
+
+  mdb_t db;
+  mdb_status_t status = mdb_open(&db, argv[1]);
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], argv[1],
+            status.desc != NULL ? status.desc : "unknown error");
+    return 1;
+  }
+
+  size_t index_size = mdb_index_size(db);
+  size_t data_size = mdb_data_size(db);
+  if (online) {
+    bool done = false;
+    while (status.code == MDB_OK && !done) {
+      status = mdb_compact_step(db, 4096, &done);
+    }
+  } else {
+    status = mdb_compact(db);
+  }
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: cannot compact %s: %s\n", argv[0], argv[1],
+            status.desc != NULL ? status.desc : "unknown error");
+    mdb_close(db);
+    return 1;
+  }
+
+  printf("index: %zu -> %zu bytes\n", index_size, mdb_index_size(db));
+  printf("data: %zu -> %zu bytes\n", data_size, mdb_data_size(db));
+  mdb_close(db);
+  return 0;
+}
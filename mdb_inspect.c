@@ -0,0 +1,68 @@
+#include "mdb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* reports how evenly the keys of a database are spread over its buckets,
+   and how much of its data file is holes */
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s <db path> [threads]\n", argv[0]);
+    return 2;
+  }
+  unsigned threads = argc == 3 ? (unsigned)strtoul(argv[2], NULL, 10) : 0;
+
+  mdb_t db;
+  mdb_status_t status = mdb_open(&db, argv[1]);
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], argv[1],
+            status.desc != NULL ? status.desc : "unknown error");
+    return 1;
+  }
+
+  mdb_inspect_t report;
+  status = mdb_inspect(db, threads, &report);
+  mdb_close(db);
+  if (status.code != MDB_OK) {
+    fprintf(stderr, "%s: cannot inspect %s: %s\n", argv[0], argv[1],
+            status.desc != NULL ? status.desc : "unknown error");
+    return 1;
+  }
+
+  printf("items: %llu in %u buckets (hash_buckets %u)\n",
+         (unsigned long long)report.items, report.buckets,
+         report.hash_buckets);
+  printf("load factor: %.2f per bucket, %.2f per initial bucket\n",
+         report.load_factor, report.base_load_factor);
+  printf("chain lengths:\n");
+  uint64_t widest = 1;
+  for (int i = 0; i < MDB_INSPECT_CHAIN_BINS; i++) {
+    if (report.chain_histogram[i] > widest) {
+      widest = report.chain_histogram[i];
+    }
+  }
+  for (int i = 0; i < MDB_INSPECT_CHAIN_BINS; i++) {
+    int bar = (int)(report.chain_histogram[i] * 40 / widest);
+    printf("  %2d%s %10llu %.*s\n", i,
+           i == MDB_INSPECT_CHAIN_BINS - 1 ? "+" : " ",
+           (unsigned long long)report.chain_histogram[i], bar,
+           "########################################");
+  }
+  printf("longest chain: %llu\n", (unsigned long long)report.chain_max);
+  printf("index: %llu bytes, %llu records on the freelist\n",
+         (unsigned long long)report.index_bytes,
+         (unsigned long long)report.freelist_length);
+  printf("data: %llu bytes, %llu live, %llu free (%.1f%%) in %llu extents, "
+         "largest %llu\n",
+         (unsigned long long)report.data_bytes,
+         (unsigned long long)report.live_bytes,
+         (unsigned long long)report.free_bytes,
+         report.data_bytes != 0
+             ? 100.0 * (double)report.free_bytes / (double)report.data_bytes
+             : 0.0,
+         (unsigned long long)report.free_extents,
+         (unsigned long long)report.largest_free_extent);
+  printf("suggested hash_buckets: %u\n", report.suggested_buckets);
+  return 0;
+}
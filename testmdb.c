@@ -3,10 +3,15 @@
 #include "vktest.h"
 #include "mdb.h"
 
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 void happy_test0() {
   VK_TEST_SECTION_BEGIN("misakawa happy test");
 
-  mdb_options_t options;
+  mdb_options_t options = { 0 };
   options.db_name = "misakawa";
   options.key_size_max = 64;
   options.data_size_max = 256;
@@ -40,12 +45,13 @@ void happy_test0() {
 void reopen_test1() {
   VK_TEST_SECTION_BEGIN("lambda re-open test");
 
-  mdb_options_t options;
+  mdb_options_t options = { 0 };
   options.db_name = "lambda";
   options.key_size_max = 64;
   options.data_size_max = 256;
   options.hash_buckets = 128;
   options.items_max = 166716;
+  options.hash_seed = 0x19260817;
 
   mdb_t db;
   (void)mdb_create(&db, options);
@@ -62,6 +68,7 @@ void reopen_test1() {
   VK_ASSERT_EQUALS(options.data_size_max, db1_options.data_size_max);
   VK_ASSERT_EQUALS(options.hash_buckets, db1_options.hash_buckets);
   VK_ASSERT_EQUALS(options.items_max, db1_options.items_max);
+  VK_ASSERT_EQUALS(options.hash_seed, db1_options.hash_seed);
 
   VK_ASSERT_EQUALS(MDB_OK, reopen_status.code);
 
@@ -88,7 +95,7 @@ void load_test2() {
   char key[4] = { 0 };
   size_t i = 0;
 
-  mdb_options_t options;
+  mdb_options_t options = { 0 };
   options.db_name = "accelerator";
   options.key_size_max = 8;
   options.data_size_max = 256;
@@ -148,7 +155,7 @@ void load_test3() {
   char key[4] = { 0 };
   size_t i = 0;
 
-  mdb_options_t options;
+  mdb_options_t options = { 0 };
   options.db_name = "gabriel";
   options.key_size_max = 8;
   options.data_size_max = 256;
@@ -250,6 +257,2118 @@ delete_done:
   VK_TEST_SECTION_END("gabriel load test");
 }
 
+void reuse_test4() {
+  VK_TEST_SECTION_BEGIN("komakan data reuse test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "komakan";
+  options.key_size_max = 8;
+  options.data_size_max = 256;
+  options.hash_buckets = 128;
+  options.items_max = 166716;
+
+  mdb_t db;
+  (void)mdb_create(&db, options);
+  (void)mdb_write(db, "a", "scarlet");
+  (void)mdb_write(db, "b", "flandre");
+  (void)mdb_write(db, "c", "remilia");
+  (void)mdb_delete(db, "b");
+  mdb_close(db);
+
+  mdb_status_t reopen_status = mdb_open(&db, "komakan");
+  VK_ASSERT_EQUALS(MDB_OK, reopen_status.code);
+  size_t data_size = mdb_data_size(db);
+
+  mdb_status_t write_status = mdb_write(db, "d", "sakuya");
+  VK_ASSERT_EQUALS(MDB_OK, write_status.code);
+  VK_ASSERT_EQUALS(data_size, mdb_data_size(db));
+
+  char buffer[257];
+  mdb_status_t read_status = mdb_read(db, "c", buffer, 257);
+  VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+  VK_ASSERT_EQUALS_S("remilia", buffer);
+  read_status = mdb_read(db, "d", buffer, 257);
+  VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+  VK_ASSERT_EQUALS_S("sakuya", buffer);
+
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("komakan data reuse test");
+}
+
+void mmap_test5() {
+  VK_TEST_SECTION_BEGIN("railgun mmap index test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "railgun";
+  options.key_size_max = 250;
+  options.data_size_max = 256;
+  options.hash_buckets = 128;
+  options.items_max = 166716;
+  options.flags = MDB_FLAG_MMAP_INDEX;
+  options.msync_policy = MDB_MSYNC_ON_CLOSE;
+
+  mdb_t db;
+  mdb_status_t create_status = mdb_create(&db, options);
+  VK_ASSERT_EQUALS(MDB_OK, create_status.code);
+
+  /// 5000 records of ~260 bytes forces the index mapping to grow
+  char key[8];
+  char value[16];
+  for (int i = 0; i < 5000; i++) {
+    sprintf(key, "%d", i);
+    sprintf(value, "v%d", i * 7);
+    mdb_status_t write_status = mdb_write(db, key, value);
+    VK_ASSERT_EQUALS(MDB_OK, write_status.code);
+  }
+  for (int i = 0; i < 5000; i += 3) {
+    sprintf(key, "%d", i);
+    mdb_status_t delete_status = mdb_delete(db, key);
+    VK_ASSERT_EQUALS(MDB_OK, delete_status.code);
+  }
+  mdb_close(db);
+
+  mdb_status_t reopen_status = mdb_open_ex(&db, "railgun", &options);
+  VK_ASSERT_EQUALS(MDB_OK, reopen_status.code);
+
+  char buffer[257];
+  char expected[16];
+  for (int i = 0; i < 5000; i++) {
+    sprintf(key, "%d", i);
+    mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+    if (i % 3 == 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+    } else {
+      sprintf(expected, "v%d", i * 7);
+      VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+      VK_ASSERT_EQUALS_S(expected, buffer);
+    }
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("railgun mmap index test");
+}
+
+void batch_test6() {
+  VK_TEST_SECTION_BEGIN("index batch test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "index";
+  options.key_size_max = 8;
+  options.data_size_max = 256;
+  options.hash_buckets = 64;
+  options.items_max = 166716;
+
+  mdb_t db;
+  (void)mdb_create(&db, options);
+  (void)mdb_write(db, "k7", "old");
+
+  static char key_store[2001][8];
+  static char value_store[2001][16];
+  const char *keys[2001];
+  const char *values[2001];
+  for (int i = 0; i < 2000; i++) {
+    sprintf(key_store[i], "k%d", i);
+    sprintf(value_store[i], "value%d", i);
+    keys[i] = key_store[i];
+    values[i] = value_store[i];
+  }
+  /// the later duplicate of k42 wins
+  keys[2000] = "k42";
+  values[2000] = "latest";
+
+  mdb_status_t batch_status = mdb_write_batch(db, keys, values, 2001);
+  VK_ASSERT_EQUALS(MDB_OK, batch_status.code);
+
+  char buffer[257];
+  for (int i = 0; i < 2000; i++) {
+    mdb_status_t read_status = mdb_read(db, keys[i], buffer, 257);
+    VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+    VK_ASSERT_EQUALS_S(i == 42 ? "latest" : values[i], buffer);
+  }
+
+  size_t deleted = 0;
+  mdb_status_t delete_status = mdb_delete_batch(db, keys, 1000, &deleted);
+  VK_ASSERT_EQUALS(MDB_OK, delete_status.code);
+  VK_ASSERT_EQUALS(1000, deleted);
+
+  for (int i = 1000; i < 2000; i++) {
+    values[i] = "overwritten";
+  }
+  batch_status = mdb_write_batch(db, keys + 1000, values + 1000, 1000);
+  VK_ASSERT_EQUALS(MDB_OK, batch_status.code);
+  mdb_close(db);
+
+  (void)mdb_open(&db, "index");
+  for (int i = 0; i < 2000; i++) {
+    mdb_status_t read_status = mdb_read(db, keys[i], buffer, 257);
+    if (i < 1000) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+    } else {
+      VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+      VK_ASSERT_EQUALS_S("overwritten", buffer);
+    }
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("index batch test");
+}
+
+void multi_test7() {
+  VK_TEST_SECTION_BEGIN("kamijou multi-get test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "kamijou";
+  options.key_size_max = 8;
+  options.data_size_max = 256;
+  options.hash_buckets = 32;
+  options.items_max = 166716;
+
+  mdb_t db;
+  (void)mdb_create(&db, options);
+
+  static char key_store[600][8];
+  static char buf_store[600][32];
+  const char *keys[600];
+  char *bufs[600];
+  size_t bufsizes[600];
+  mdb_status_t statuses[600];
+  for (int i = 0; i < 600; i++) {
+    sprintf(key_store[i], "m%d", i);
+    keys[i] = key_store[i];
+    bufs[i] = buf_store[i];
+    bufsizes[i] = 32;
+    if (i < 500) {
+      char value[32];
+      sprintf(value, "imagine breaker %d", i);
+      (void)mdb_write(db, keys[i], value);
+    }
+  }
+  bufsizes[7] = 4;
+
+  mdb_status_t multi_status = mdb_read_multi(db, keys, bufs, bufsizes,
+                                             statuses, 600);
+  VK_ASSERT_EQUALS(MDB_OK, multi_status.code);
+  for (int i = 0; i < 600; i++) {
+    if (i == 7) {
+      VK_ASSERT_EQUALS(MDB_ERR_BUFSIZ, statuses[i].code);
+    } else if (i < 500) {
+      char expected[32];
+      sprintf(expected, "imagine breaker %d", i);
+      VK_ASSERT_EQUALS(MDB_OK, statuses[i].code);
+      VK_ASSERT_EQUALS_S(expected, bufs[i]);
+    } else {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, statuses[i].code);
+    }
+  }
+
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("kamijou multi-get test");
+}
+
+typedef struct {
+  mdb_t db;
+  int id;
+  int failures;
+} thread_test_arg_t;
+
+/// vktest counters are not thread safe, so workers only count failures
+static void *thread_test_worker(void *opaque) {
+  thread_test_arg_t *arg = (thread_test_arg_t*)opaque;
+  char key[16];
+  char value[32];
+  char buffer[64];
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "t%d_%d", arg->id, i);
+    sprintf(value, "accelerator %d", i * arg->id);
+    if (mdb_write(arg->db, key, value).code != MDB_OK) {
+      arg->failures++;
+    }
+    if (mdb_read(arg->db, key, buffer, 64).code != MDB_OK
+        || strcmp(buffer, value) != 0) {
+      arg->failures++;
+    }
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    sprintf(key, "t%d_%d", arg->id, i);
+    if (mdb_delete(arg->db, key).code != MDB_OK) {
+      arg->failures++;
+    }
+  }
+  return NULL;
+}
+
+void thread_test8() {
+  VK_TEST_SECTION_BEGIN("accelerator thread safe test");
+
+  for (int round = 0; round < 2; round++) {
+    mdb_options_t options = { 0 };
+    options.db_name = "accelerator";
+    options.key_size_max = 16;
+    options.data_size_max = 256;
+    options.hash_buckets = 16;
+    options.items_max = 166716;
+    options.flags = MDB_FLAG_THREAD_SAFE
+                    | (round == 1 ? MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA
+                                  : 0);
+
+    mdb_t db;
+    mdb_status_t create_status = mdb_create(&db, options);
+    VK_ASSERT_EQUALS(MDB_OK, create_status.code);
+
+    pthread_t threads[8];
+    thread_test_arg_t args[8];
+    for (int t = 0; t < 8; t++) {
+      args[t].db = db;
+      args[t].id = t + 1;
+      args[t].failures = 0;
+      pthread_create(&threads[t], NULL, thread_test_worker, &args[t]);
+    }
+    for (int t = 0; t < 8; t++) {
+      pthread_join(threads[t], NULL);
+      VK_ASSERT_EQUALS(0, args[t].failures);
+    }
+    mdb_close(db);
+
+    (void)mdb_open_ex(&db, "accelerator", &options);
+    char key[16];
+    char expected[32];
+    char buffer[64];
+    for (int t = 1; t <= 8; t++) {
+      for (int i = 0; i < 1000; i++) {
+        sprintf(key, "t%d_%d", t, i);
+        mdb_status_t read_status = mdb_read(db, key, buffer, 64);
+        if (i % 2 == 0) {
+          VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+        } else {
+          sprintf(expected, "accelerator %d", i * t);
+          VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+          VK_ASSERT_EQUALS_S(expected, buffer);
+        }
+      }
+    }
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("accelerator thread safe test");
+}
+
+/// every child process opens the database on its own and counts failures
+/// in its exit status
+static int shared_test_child(int id) {
+  mdb_options_t options = { 0 };
+  options.flags = MDB_FLAG_SHARED;
+  mdb_t db;
+  if (mdb_open_ex(&db, "shirai", &options).code != MDB_OK) {
+    return 1;
+  }
+  int failures = 0;
+  char key[16];
+  char value[32];
+  char buffer[64];
+  for (int i = 0; i < 500; i++) {
+    sprintf(key, "p%d_%d", id, i);
+    sprintf(value, "teleport %d", i + id);
+    if (mdb_write(db, key, value).code != MDB_OK) {
+      failures++;
+    }
+    if (mdb_read(db, key, buffer, 64).code != MDB_OK
+        || strcmp(buffer, value) != 0) {
+      failures++;
+    }
+    if (i % 5 == 0 && mdb_delete(db, key).code != MDB_OK) {
+      failures++;
+    }
+  }
+  mdb_close(db);
+  return failures > 0;
+}
+
+void shared_test9() {
+  VK_TEST_SECTION_BEGIN("shirai shared access test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "shirai";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 8;
+  options.items_max = 166716;
+
+  mdb_t db;
+  mdb_status_t create_status = mdb_create(&db, options);
+  VK_ASSERT_EQUALS(MDB_OK, create_status.code);
+  mdb_close(db);
+
+  pid_t children[4];
+  for (int p = 0; p < 4; p++) {
+    children[p] = fork();
+    if (children[p] == 0) {
+      _exit(shared_test_child(p + 1));
+    }
+    VK_ASSERT(children[p] > 0);
+  }
+  for (int p = 0; p < 4; p++) {
+    int wstatus;
+    VK_ASSERT_EQUALS(children[p], waitpid(children[p], &wstatus, 0));
+    VK_ASSERT(WIFEXITED(wstatus));
+    VK_ASSERT_EQUALS(0, WEXITSTATUS(wstatus));
+  }
+
+  (void)mdb_open(&db, "shirai");
+  char key[16];
+  char expected[32];
+  char buffer[64];
+  for (int id = 1; id <= 4; id++) {
+    for (int i = 0; i < 500; i++) {
+      sprintf(key, "p%d_%d", id, i);
+      mdb_status_t read_status = mdb_read(db, key, buffer, 64);
+      if (i % 5 == 0) {
+        VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      } else {
+        sprintf(expected, "teleport %d", i + id);
+        VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+        VK_ASSERT_EQUALS_S(expected, buffer);
+      }
+    }
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("shirai shared access test");
+}
+
+void view_test10() {
+  VK_TEST_SECTION_BEGIN("mikoto zero-copy view test");
+
+  for (int round = 0; round < 2; round++) {
+    mdb_options_t options = { 0 };
+    options.db_name = "mikoto";
+    options.key_size_max = 16;
+    options.data_size_max = 4096;
+    options.hash_buckets = 64;
+    options.items_max = 166716;
+    options.flags = round == 1 ? MDB_FLAG_MMAP_DATA : 0;
+
+    mdb_t db;
+    mdb_status_t create_status = mdb_create(&db, options);
+    VK_ASSERT_EQUALS(MDB_OK, create_status.code);
+
+    /// binary values with embedded zero bytes; 600 of 4000 bytes also grow
+    /// the data mapping past its first size
+    static unsigned char payload[4000];
+    char key[16];
+    for (int i = 0; i < 600; i++) {
+      for (int j = 0; j < 4000; j++) {
+        payload[j] = (unsigned char)((i + j) % 7 == 0 ? 0 : i * j);
+      }
+      sprintf(key, "bin%d", i);
+      mdb_status_t write_status = mdb_write_n(db, key, payload, 4000);
+      VK_ASSERT_EQUALS(MDB_OK, write_status.code);
+    }
+    mdb_status_t empty_status = mdb_write_n(db, "empty", "", 0);
+    VK_ASSERT_EQUALS(MDB_OK, empty_status.code);
+    mdb_close(db);
+
+    (void)mdb_open_ex(&db, "mikoto", &options);
+    for (int i = 0; i < 600; i++) {
+      for (int j = 0; j < 4000; j++) {
+        payload[j] = (unsigned char)((i + j) % 7 == 0 ? 0 : i * j);
+      }
+      sprintf(key, "bin%d", i);
+      const void *value = NULL;
+      size_t size = 0;
+      mdb_status_t view_status = mdb_read_view(db, key, &value, &size);
+      VK_ASSERT_EQUALS(MDB_OK, view_status.code);
+      VK_ASSERT_EQUALS(4000, size);
+      VK_ASSERT_EQUALS(0, memcmp(value, payload, 4000));
+    }
+
+    const void *value = NULL;
+    size_t size = 1;
+    mdb_status_t view_status = mdb_read_view(db, "empty", &value, &size);
+    VK_ASSERT_EQUALS(MDB_OK, view_status.code);
+    VK_ASSERT_EQUALS(0, size);
+    view_status = mdb_read_view(db, "nothing", &value, &size);
+    VK_ASSERT_EQUALS(MDB_NO_KEY, view_status.code);
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("mikoto zero-copy view test");
+}
+
+void cursor_test11() {
+  VK_TEST_SECTION_BEGIN("othinus cursor test");
+
+  for (int round = 0; round < 2; round++) {
+    mdb_options_t options = { 0 };
+    options.db_name = "othinus";
+    options.key_size_max = 16;
+    options.data_size_max = 256;
+    options.hash_buckets = 8;
+    options.items_max = 166716;
+    options.max_load_factor = 2;
+    options.flags = round == 1 ? MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA : 0;
+
+    mdb_t db;
+    (void)mdb_create(&db, options);
+
+    /// enough keys for several bucket segments to sit between the records
+    char key[16];
+    char value[32];
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "c%d", i);
+      sprintf(value, "gungnir %d", i * 3);
+      (void)mdb_write(db, key, value);
+    }
+    for (int i = 0; i < 3000; i += 4) {
+      sprintf(key, "c%d", i);
+      (void)mdb_delete(db, key);
+    }
+    (void)mdb_write(db, "", "empty key");
+
+    static bool seen[3000];
+    memset(seen, 0, sizeof(seen));
+    bool seen_empty = false;
+    int count = 0;
+
+    mdb_cursor_t cursor;
+    mdb_status_t open_status = mdb_cursor_open(db, &cursor);
+    VK_ASSERT_EQUALS(MDB_OK, open_status.code);
+    const char *cursor_key;
+    const void *cursor_value;
+    size_t size;
+    while (mdb_cursor_next(cursor, &cursor_key, &cursor_value,
+                           &size).code == MDB_OK) {
+      count++;
+      if (cursor_key[0] == '\0') {
+        VK_ASSERT_NOT(seen_empty);
+        VK_ASSERT_EQUALS(9, size);
+        VK_ASSERT_EQUALS(0, memcmp(cursor_value, "empty key", 9));
+        seen_empty = true;
+        continue;
+      }
+      int i = atoi(cursor_key + 1);
+      VK_ASSERT(i % 4 != 0);
+      VK_ASSERT_NOT(seen[i]);
+      seen[i] = true;
+      sprintf(value, "gungnir %d", i * 3);
+      VK_ASSERT_EQUALS(strlen(value), size);
+      VK_ASSERT_EQUALS(0, memcmp(cursor_value, value, size));
+    }
+    mdb_cursor_close(cursor);
+    VK_ASSERT(seen_empty);
+    VK_ASSERT_EQUALS(2251, count);
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("othinus cursor test");
+}
+
+static void compact_test_value(char *value, int i, int generation) {
+  sprintf(value, "imagine breaker %d", i);
+  for (int k = 0; k < (i + generation) % 7; k++) {
+    strcat(value, " breaker");
+  }
+}
+
+static void compact_test_verify(mdb_t db, const int *generation) {
+  char key[16];
+  char value[128];
+  char buffer[257];
+  for (int i = 0; i < 3000; i++) {
+    sprintf(key, "t%d", i);
+    mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+    if (generation[i] < 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+    } else {
+      VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+      compact_test_value(value, i, generation[i]);
+      VK_ASSERT_EQUALS_S(value, buffer);
+    }
+  }
+}
+
+void compact_test12() {
+  VK_TEST_SECTION_BEGIN("kamijou compact test");
+
+  for (int round = 0; round < 4; round++) {
+    bool online = round >= 2;
+    mdb_options_t options = { 0 };
+    options.db_name = "kamijou";
+    options.key_size_max = 16;
+    options.data_size_max = 256;
+    options.hash_buckets = 8;
+    options.items_max = 166716;
+    options.max_load_factor = 2;
+    options.flags = round % 2 == 1 ? MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA
+                                   : 0;
+    if (round == 3) {
+      options.flags |= MDB_FLAG_THREAD_SAFE;
+    }
+
+    /// leftovers of an unfinished compaction are dropped at open
+    FILE *stray = fopen("kamijou.db.index.compact", "w");
+    fclose(stray);
+
+    mdb_t db;
+    (void)mdb_create(&db, options);
+    mdb_close(db);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kamijou", &options).code);
+    VK_ASSERT_NOT(fopen("kamijou.db.index.compact", "r"));
+
+    static int generation[3000];
+    char key[16];
+    char value[128];
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "t%d", i);
+      compact_test_value(value, i, 0);
+      (void)mdb_write(db, key, value);
+      generation[i] = 0;
+    }
+    size_t live_size = 0;
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "t%d", i);
+      if (i % 4 != 0) {
+        (void)mdb_delete(db, key);
+        generation[i] = -1;
+      } else {
+        compact_test_value(value, i, 0);
+        live_size += strlen(value);
+      }
+    }
+    size_t index_size = mdb_index_size(db);
+    size_t data_size = mdb_data_size(db);
+
+    if (online) {
+      /// the handle keeps taking writes between steps
+      bool done = false;
+      int steps = 0;
+      while (!done) {
+        VK_ASSERT_EQUALS(MDB_OK, mdb_compact_step(db, 100, &done).code);
+        int i = (steps * 4) % 3000;
+        sprintf(key, "t%d", i);
+        generation[i]++;
+        compact_test_value(value, i, generation[i]);
+        VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+        steps++;
+        VK_ASSERT(steps < 1000);
+      }
+      VK_ASSERT(steps > 1);
+      VK_ASSERT(mdb_data_size(db) < data_size);
+    } else {
+      VK_ASSERT_EQUALS(MDB_OK, mdb_compact(db).code);
+      VK_ASSERT_EQUALS(live_size, mdb_data_size(db));
+    }
+    VK_ASSERT(mdb_index_size(db) < index_size);
+    compact_test_verify(db, generation);
+
+    (void)mdb_write(db, "t1", "railgun");
+    generation[1] = 0;
+    (void)mdb_delete(db, "t1");
+    generation[1] = -1;
+    mdb_close(db);
+
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kamijou", &options).code);
+    compact_test_verify(db, generation);
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("kamijou compact test");
+}
+
+static size_t slab_test_size(int i, int generation) {
+  /// mostly small values around a few sizes, and every 17th one spans pages
+  if ((i + generation) % 17 == 0) {
+    return 1500 + (size_t)(i * 31 % 3000);
+  }
+  static const size_t sizes[] = { 12, 30, 60, 100, 250 };
+  return sizes[(i + generation) % 5] + (size_t)(i % 3);
+}
+
+static void slab_test_fill(char *value, int i, int generation, size_t size) {
+  for (size_t k = 0; k < size; k++) {
+    value[k] = (char)('a' + (i * 7 + generation + (int)k) % 26);
+  }
+}
+
+static void slab_test_verify(mdb_t db, const int *generation) {
+  char key[16];
+  static char value[5000];
+  static char buffer[5001];
+  for (int i = 0; i < 1500; i++) {
+    sprintf(key, "s%d", i);
+    mdb_status_t read_status = mdb_read(db, key, buffer, sizeof(buffer));
+    if (generation[i] < 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      continue;
+    }
+    VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+    size_t size = slab_test_size(i, generation[i]);
+    slab_test_fill(value, i, generation[i], size);
+    VK_ASSERT_EQUALS(0, memcmp(value, buffer, size));
+    VK_ASSERT_EQUALS('\0', buffer[size]);
+  }
+}
+
+void slab_test13() {
+  VK_TEST_SECTION_BEGIN("tokiwadai slab test");
+
+  mdb_options_t bad_options = { 0 };
+  bad_options.db_name = "tokiwadai";
+  bad_options.key_size_max = 16;
+  bad_options.data_size_max = 5000;
+  bad_options.hash_buckets = 64;
+  bad_options.slab_page_size = 5000;
+  mdb_t bad_db;
+  VK_ASSERT_EQUALS(MDB_ERR_LOGIC, mdb_create(&bad_db, bad_options).code);
+
+  for (int round = 0; round < 2; round++) {
+    mdb_options_t options = bad_options;
+    options.slab_page_size = 4096;
+    options.items_max = 166716;
+    options.flags = round == 1 ? MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA
+                                 | MDB_FLAG_THREAD_SAFE
+                               : 0;
+
+    mdb_t db;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+
+    static int generation[1500];
+    static char value[5000];
+    char key[16];
+    for (int i = 0; i < 1500; i++) {
+      sprintf(key, "s%d", i);
+      size_t size = slab_test_size(i, 0);
+      slab_test_fill(value, i, 0, size);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write_n(db, key, value, size).code);
+      generation[i] = 0;
+    }
+    size_t full_size = mdb_data_size(db);
+    VK_ASSERT_EQUALS(0, full_size % 4096);
+
+    /// churn through the same mix of sizes; freed slots and pages are
+    /// reused, so the file barely grows
+    for (int g = 1; g <= 4; g++) {
+      for (int i = 0; i < 1500; i++) {
+        sprintf(key, "s%d", i);
+        if ((i + g) % 3 == 0) {
+          (void)mdb_delete(db, key);
+          generation[i] = -1;
+          continue;
+        }
+        size_t size = slab_test_size(i, g);
+        slab_test_fill(value, i, g, size);
+        VK_ASSERT_EQUALS(MDB_OK, mdb_write_n(db, key, value, size).code);
+        generation[i] = g;
+      }
+    }
+    slab_test_verify(db, generation);
+    VK_ASSERT(mdb_data_size(db) <= full_size + full_size / 4);
+    VK_ASSERT_EQUALS(0, mdb_data_size(db) % 4096);
+    mdb_close(db);
+
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+    VK_ASSERT_EQUALS(4096, mdb_get_options(db).slab_page_size);
+    slab_test_verify(db, generation);
+
+    /// a batch places every value in a slot of its own
+    const char *batch_keys[] = { "s1", "s2", "s3" };
+    const char *batch_values[] = { "uiharu", "saten", "konori mii" };
+    VK_ASSERT_EQUALS(MDB_OK,
+                     mdb_write_batch(db, batch_keys, batch_values, 3).code);
+    char buffer[64];
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "s2", buffer, 64).code);
+    VK_ASSERT_EQUALS_S("saten", buffer);
+    for (int i = 1; i <= 3; i++) {
+      sprintf(key, "s%d", i);
+      (void)mdb_delete(db, key);
+      generation[i] = -1;
+    }
+
+    bool done = false;
+    while (!done) {
+      VK_ASSERT_EQUALS(MDB_OK, mdb_compact_step(db, 200, &done).code);
+    }
+    slab_test_verify(db, generation);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_compact(db).code);
+    VK_ASSERT(mdb_data_size(db) < full_size);
+    slab_test_verify(db, generation);
+    mdb_close(db);
+
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+    slab_test_verify(db, generation);
+    mdb_close(db);
+
+    /// a process that dies can leave records pointing into pages whose
+    /// headers never reached the file; open sets those pages up again
+    pid_t child = fork();
+    if (child == 0) {
+      if (mdb_open_ex(&db, "tokiwadai", &options).code != MDB_OK) {
+        _exit(1);
+      }
+      for (int i = 0; i < 1500; i += 2) {
+        sprintf(key, "s%d", i);
+        size_t size = slab_test_size(i, 5);
+        slab_test_fill(value, i, 5, size);
+        if (mdb_write_n(db, key, value, size).code != MDB_OK) {
+          _exit(1);
+        }
+      }
+      _exit(0);
+    }
+    VK_ASSERT(child > 0);
+    int wstatus;
+    VK_ASSERT_EQUALS(child, waitpid(child, &wstatus, 0));
+    VK_ASSERT(WIFEXITED(wstatus));
+    VK_ASSERT_EQUALS(0, WEXITSTATUS(wstatus));
+    for (int i = 0; i < 1500; i += 2) {
+      generation[i] = 5;
+    }
+    struct stat st;
+    VK_ASSERT_EQUALS(0, stat("tokiwadai.db.data", &st));
+    FILE *fp = fopen("tokiwadai.db.data", "rb+");
+    VK_ASSERT(fp != NULL);
+    static const char zeros[8];
+    for (long offset = 0; offset < (long)st.st_size; ) {
+      /// the later pages of a run hold value bytes where a header would be
+      unsigned char header[8];
+      VK_ASSERT_EQUALS(0, fseek(fp, offset, SEEK_SET));
+      VK_ASSERT_EQUALS(1, fread(header, sizeof(header), 1, fp));
+      uint32_t pages = 1;
+      if (header[0] == 2) {
+        memcpy(&pages, header + 4, sizeof(pages));
+      }
+      VK_ASSERT_EQUALS(0, fseek(fp, offset, SEEK_SET));
+      VK_ASSERT_EQUALS(1, fwrite(zeros, sizeof(zeros), 1, fp));
+      offset += (long)pages * 4096;
+    }
+    fclose(fp);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+    slab_test_verify(db, generation);
+    for (int i = 1; i < 1500; i += 2) {
+      sprintf(key, "s%d", i);
+      size_t size = slab_test_size(i, 6);
+      slab_test_fill(value, i, 6, size);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write_n(db, key, value, size).code);
+      generation[i] = 6;
+    }
+    slab_test_verify(db, generation);
+    mdb_close(db);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+    slab_test_verify(db, generation);
+    mdb_close(db);
+
+    /// keeping values ahead of their records costs no flushes of its own:
+    /// a batch flushes each file once, and ON_CLOSE not at all. Only new
+    /// keys are written, since pages falling empty are flushed and punched.
+    static char flush_key_buf[2][200][16];
+    static char flush_value_buf[200][32];
+    const char *flush_keys[2][200];
+    const char *flush_values[200];
+    for (int i = 0; i < 200; i++) {
+      for (int d = 0; d < 2; d++) {
+        sprintf(flush_key_buf[d][i], "f%d-%d", d, i);
+        flush_keys[d][i] = flush_key_buf[d][i];
+      }
+      sprintf(flush_value_buf[i], "kuroko %d", i);
+      flush_values[i] = flush_value_buf[i];
+    }
+    for (uint8_t durability = MDB_DURABILITY_NONE;
+         durability <= MDB_DURABILITY_ON_CLOSE; durability++) {
+      options.durability = durability;
+      VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+      const char **keys = flush_keys[durability];
+      uint64_t flushes = mdb_get_stats(db).flushes;
+      VK_ASSERT_EQUALS(MDB_OK,
+                       mdb_write_batch(db, keys, flush_values, 100).code);
+      for (int i = 100; i < 200; i++) {
+        VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, keys[i], flush_values[i]).code);
+      }
+      uint64_t expected = 0;
+      if (round == 0 && durability == MDB_DURABILITY_NONE) {
+        expected = 2 + 2 * 100;
+      }
+      VK_ASSERT_EQUALS(expected, mdb_get_stats(db).flushes - flushes);
+      mdb_close(db);
+    }
+    options.durability = MDB_DURABILITY_NONE;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "tokiwadai", &options).code);
+    for (int d = 0; d < 2; d++) {
+      for (int i = 0; i < 200; i++) {
+        VK_ASSERT_EQUALS(MDB_OK,
+                         mdb_read(db, flush_keys[d][i], buffer, 64).code);
+        VK_ASSERT_EQUALS_S(flush_values[i], buffer);
+        VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, flush_keys[d][i]).code);
+      }
+    }
+    slab_test_verify(db, generation);
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("tokiwadai slab test");
+}
+
+void pio_test14() {
+  VK_TEST_SECTION_BEGIN("sisters pio test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "sisters";
+  options.key_size_max = 32;
+  options.data_size_max = 256;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+  options.flags = MDB_FLAG_PIO;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  char key[32];
+  char value[64];
+  char buffer[257];
+  for (int i = 0; i < 2000; i++) {
+    sprintf(key, "misaka %d", 10000 + i);
+    sprintf(value, "serial %d", i * 7);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  for (int i = 0; i < 2000; i += 3) {
+    sprintf(key, "misaka %d", 10000 + i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+  mdb_close(db);
+
+  /// the same files work with either backend
+  for (int round = 0; round < 2; round++) {
+    options.flags = round == 0 ? 0 : MDB_FLAG_PIO;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "sisters", &options).code);
+    for (int i = 0; i < 2000; i++) {
+      sprintf(key, "misaka %d", 10000 + i);
+      mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+      if (i % 3 == 0) {
+        VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      } else {
+        VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+        sprintf(value, "serial %d", i * 7);
+        VK_ASSERT_EQUALS_S(value, buffer);
+      }
+    }
+    sprintf(key, "last order %d", round);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, "20001").code);
+    mdb_close(db);
+  }
+
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "sisters", &options).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "last order 0", buffer, 257).code);
+  VK_ASSERT_EQUALS_S("20001", buffer);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "last order 1", buffer, 257).code);
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("sisters pio test");
+}
+
+static size_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+void grow_test15() {
+  VK_TEST_SECTION_BEGIN("mikoto grow test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "mikoto";
+  options.key_size_max = 32;
+  options.data_size_max = 256;
+  options.hash_buckets = 64;
+  options.items_max = 166716;
+  options.grow_chunk = 65536;
+
+  const uint32_t flags[] = { 0, MDB_FLAG_PIO,
+                             MDB_FLAG_MMAP_INDEX | MDB_FLAG_MMAP_DATA };
+  for (int round = 0; round < 3; round++) {
+    options.flags = flags[round];
+    options.slab_page_size = round == 2 ? 16384 : 0;
+
+    mdb_t db;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+    char key[32];
+    char value[128];
+    char buffer[257];
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "railgun %d", i);
+      sprintf(value, "%0*d", 16 + i % 100, i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+    }
+
+    /// the files run ahead of what is in use, by whole chunks
+    size_t index_size = mdb_index_size(db);
+    size_t data_size = mdb_data_size(db);
+    VK_ASSERT(file_size("mikoto.db.index") > index_size);
+    VK_ASSERT_EQUALS(0, file_size("mikoto.db.index") % 65536);
+    VK_ASSERT(file_size("mikoto.db.data") >= data_size);
+    VK_ASSERT_EQUALS(0, file_size("mikoto.db.data") % 65536);
+    mdb_close(db);
+
+    /// and are cut back on close
+    VK_ASSERT_EQUALS(index_size, file_size("mikoto.db.index"));
+    VK_ASSERT_EQUALS(data_size, file_size("mikoto.db.data"));
+
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "mikoto", &options).code);
+    VK_ASSERT_EQUALS(index_size, mdb_index_size(db));
+    VK_ASSERT_EQUALS(data_size, mdb_data_size(db));
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "railgun %d", i);
+      sprintf(value, "%0*d", 16 + i % 100, i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+      VK_ASSERT_EQUALS_S(value, buffer);
+    }
+    mdb_close(db);
+  }
+
+  VK_TEST_SECTION_END("mikoto grow test");
+}
+
+static size_t file_blocks(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (size_t)st.st_blocks : 0;
+}
+
+void punch_test16() {
+  VK_TEST_SECTION_BEGIN("shirai punch test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "shirai";
+  options.key_size_max = 32;
+  options.data_size_max = 1 << 20;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+
+  size_t size = 300000;
+  char *value = (char*)malloc(size);
+  for (int round = 0; round < 2; round++) {
+    options.slab_page_size = round == 0 ? 0 : 16384;
+    options.flags = round == 0 ? 0 : MDB_FLAG_MMAP_DATA;
+
+    mdb_t db;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+    char key[32];
+    for (int i = 0; i < 16; i++) {
+      sprintf(key, "kuroko %d", i);
+      memset(value, 'a' + i, size);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write_n(db, key, value, size).code);
+    }
+    mdb_close(db);
+
+    /// deleting big values gives their blocks back
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "shirai", &options).code);
+    size_t blocks = file_blocks("shirai.db.data");
+    size_t data_size = mdb_data_size(db);
+    for (int i = 0; i < 16; i += 2) {
+      sprintf(key, "kuroko %d", i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+    }
+    VK_ASSERT(file_blocks("shirai.db.data") < blocks * 3 / 4);
+    VK_ASSERT_EQUALS(data_size, mdb_data_size(db));
+    mdb_close(db);
+
+    /// the holes read as free space and are filled again
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "shirai", &options).code);
+    for (int i = 0; i < 16; i += 2) {
+      sprintf(key, "judgment %d", i);
+      memset(value, 'A' + i, size);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write_n(db, key, value, size).code);
+    }
+    VK_ASSERT_EQUALS(data_size, mdb_data_size(db));
+    for (int i = 0; i < 16; i++) {
+      sprintf(key, i % 2 == 0 ? "judgment %d" : "kuroko %d", i);
+      memset(value, (i % 2 == 0 ? 'A' : 'a') + i, size);
+      const void *view;
+      size_t view_size;
+      VK_ASSERT_EQUALS(MDB_OK, mdb_read_view(db, key, &view, &view_size).code);
+      VK_ASSERT_EQUALS(size, view_size);
+      VK_ASSERT(memcmp(view, value, size) == 0);
+    }
+    mdb_close(db);
+  }
+  free(value);
+
+  VK_TEST_SECTION_END("shirai punch test");
+}
+
+/// every worker checks that its own updates are never hidden by the cache
+static void *cache_test_worker(void *opaque) {
+  thread_test_arg_t *arg = (thread_test_arg_t*)opaque;
+  char key[16];
+  char value[32];
+  char buffer[64];
+  for (int i = 0; i < 500; i++) {
+    sprintf(key, "c%d_%d", arg->id, i % 50);
+    for (int version = 0; version < 2; version++) {
+      sprintf(value, "index %d %d", i, version);
+      if (mdb_write(arg->db, key, value).code != MDB_OK) {
+        arg->failures++;
+      }
+      for (int r = 0; r < 3; r++) {
+        if (mdb_read(arg->db, key, buffer, 64).code != MDB_OK
+            || strcmp(buffer, value) != 0) {
+          arg->failures++;
+        }
+      }
+    }
+    if (i % 7 == 0) {
+      if (mdb_delete(arg->db, key).code != MDB_OK
+          || mdb_read(arg->db, key, buffer, 64).code != MDB_NO_KEY) {
+        arg->failures++;
+      }
+    }
+  }
+  return NULL;
+}
+
+void cache_test17() {
+  VK_TEST_SECTION_BEGIN("index cache test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "index";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+  options.cache_size = 65536;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  char key[16];
+  char value[64];
+  char buffer[257];
+  for (int i = 0; i < 2000; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "prohibited %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+
+  /// a skewed workload: most reads go to a small hot set
+  for (int i = 0; i < 20000; i++) {
+    int k = i % 5 != 0 ? i % 50 : (i * 7919) % 2000;
+    sprintf(key, "k%d", k);
+    sprintf(value, "prohibited %d", k);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+    VK_ASSERT_EQUALS_S(value, buffer);
+  }
+  mdb_cache_stats_t stats = mdb_get_cache_stats(db);
+  VK_ASSERT_EQUALS(20000, stats.hits + stats.misses);
+  VK_ASSERT(stats.hits > 15000);
+  VK_ASSERT(stats.bytes <= 65536);
+  VK_ASSERT(stats.entries > 0);
+
+  /// writes, deletes and batches are never shadowed by cached values
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "k1", buffer, 257).code);
+  VK_ASSERT_EQUALS(MDB_ERR_BUFSIZ, mdb_read(db, "k1", buffer, 4).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, "k1", "book of the law").code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "k1", buffer, 257).code);
+  VK_ASSERT_EQUALS_S("book of the law", buffer);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, "k2").code);
+  VK_ASSERT_EQUALS(MDB_NO_KEY, mdb_read(db, "k2", buffer, 257).code);
+  const char *keys[] = { "k3", "k4" };
+  const char *values[] = { "othinus", "aleister" };
+  VK_ASSERT_EQUALS(MDB_OK, mdb_write_batch(db, keys, values, 2).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "k3", buffer, 257).code);
+  VK_ASSERT_EQUALS_S("othinus", buffer);
+  size_t deleted;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_delete_batch(db, keys, 2, &deleted).code);
+  VK_ASSERT_EQUALS(MDB_NO_KEY, mdb_read(db, "k4", buffer, 257).code);
+  mdb_close(db);
+
+  options.flags = MDB_FLAG_THREAD_SAFE;
+  options.cache_size = 16384;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "index", &options).code);
+  pthread_t threads[8];
+  thread_test_arg_t args[8];
+  for (int t = 0; t < 8; t++) {
+    args[t].db = db;
+    args[t].id = t + 1;
+    args[t].failures = 0;
+    pthread_create(&threads[t], NULL, cache_test_worker, &args[t]);
+  }
+  for (int t = 0; t < 8; t++) {
+    pthread_join(threads[t], NULL);
+    VK_ASSERT_EQUALS(0, args[t].failures);
+  }
+  VK_ASSERT(mdb_get_cache_stats(db).hits > 0);
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("index cache test");
+}
+
+void bloom_test18() {
+  VK_TEST_SECTION_BEGIN("saten bloom test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "saten";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 64;
+  options.items_max = 166716;
+  options.flags = MDB_FLAG_BLOOM;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  char key[16];
+  char value[32];
+  char buffer[257];
+  for (int i = 0; i < 5000; i++) {
+    sprintf(key, "s%d", i);
+    sprintf(value, "level %d", i % 6);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  for (int i = 0; i < 5000; i += 5) {
+    sprintf(key, "s%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+
+  for (int round = 0; round < 2; round++) {
+    /// no key that is there is ever ruled out
+    for (int i = 0; i < 5000; i++) {
+      sprintf(key, "s%d", i);
+      mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+      if (i % 5 == 0) {
+        VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      } else {
+        sprintf(value, "level %d", i % 6);
+        VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+        VK_ASSERT_EQUALS_S(value, buffer);
+      }
+    }
+
+    mdb_filter_stats_t before = mdb_get_filter_stats(db);
+    for (int i = 0; i < 20000; i++) {
+      sprintf(key, "m%d", i);
+      VK_ASSERT_EQUALS(MDB_NO_KEY, mdb_read(db, key, buffer, 257).code);
+      VK_ASSERT_EQUALS(MDB_NO_KEY, mdb_delete(db, key).code);
+    }
+    mdb_filter_stats_t after = mdb_get_filter_stats(db);
+    VK_ASSERT_EQUALS(40000, after.lookups - before.lookups);
+    VK_ASSERT(after.negatives - before.negatives > 36000);
+    VK_ASSERT(after.false_positive_rate < 0.1);
+    VK_ASSERT(after.bytes > 0);
+
+    const char *keys[4] = { "s1", "m1", "s5", "s6" };
+    char bufs[4][64];
+    char *buf_ptrs[4] = { bufs[0], bufs[1], bufs[2], bufs[3] };
+    size_t bufsizes[4] = { 64, 64, 64, 64 };
+    mdb_status_t statuses[4];
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read_multi(db, keys, buf_ptrs, bufsizes,
+                                            statuses, 4).code);
+    VK_ASSERT_EQUALS(MDB_OK, statuses[0].code);
+    VK_ASSERT_EQUALS(MDB_NO_KEY, statuses[1].code);
+    VK_ASSERT_EQUALS(MDB_NO_KEY, statuses[2].code);
+    VK_ASSERT_EQUALS(MDB_OK, statuses[3].code);
+    VK_ASSERT_EQUALS_S("level 0", bufs[3]);
+
+    /// the filter is rebuilt from the chains on open
+    mdb_close(db);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "saten", &options).code);
+  }
+  mdb_close(db);
+
+  options.hash_buckets = 16;
+  options.flags = MDB_FLAG_BLOOM | MDB_FLAG_THREAD_SAFE;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  pthread_t threads[8];
+  thread_test_arg_t args[8];
+  for (int t = 0; t < 8; t++) {
+    args[t].db = db;
+    args[t].id = t + 1;
+    args[t].failures = 0;
+    pthread_create(&threads[t], NULL, thread_test_worker, &args[t]);
+  }
+  for (int t = 0; t < 8; t++) {
+    pthread_join(threads[t], NULL);
+    VK_ASSERT_EQUALS(0, args[t].failures);
+  }
+  for (int t = 1; t <= 8; t++) {
+    sprintf(key, "t%d_%d", t, 999);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("saten bloom test");
+}
+
+void stats_test20() {
+  VK_TEST_SECTION_BEGIN("kuroko stats test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "kuroko";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 8;
+  options.items_max = 166716;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  mdb_stats_t stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(0, stats.writes);
+  VK_ASSERT_EQUALS(0, stats.lookups);
+
+  char key[16];
+  char value[32];
+  char buffer[257];
+  for (int i = 0; i < 200; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "teleport %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(200, stats.writes);
+  VK_ASSERT_EQUALS(200, stats.allocs);
+  VK_ASSERT(stats.splits > 0);
+  VK_ASSERT(stats.lookups >= 200);
+  VK_ASSERT(stats.chain_max >= 1);
+  VK_ASSERT(stats.chain_hops >= stats.chain_max);
+  VK_ASSERT(stats.file_writes > 0);
+  VK_ASSERT(stats.seeks >= stats.file_writes);
+  VK_ASSERT(stats.bytes_written > 200 * 10);
+  VK_ASSERT(stats.flushes > 0);
+
+  mdb_stats_t before = stats;
+  for (int i = 0; i < 200; i++) {
+    sprintf(key, "k%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+  }
+  VK_ASSERT_EQUALS(MDB_NO_KEY, mdb_read(db, "nobody", buffer, 257).code);
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(201, stats.reads - before.reads);
+  VK_ASSERT_EQUALS(201, stats.lookups - before.lookups);
+  VK_ASSERT(stats.bytes_read - before.bytes_read > 200 * 10);
+  VK_ASSERT_EQUALS(before.bytes_written, stats.bytes_written);
+
+  /// freed values are handed out again from the free map
+  for (int i = 0; i < 50; i++) {
+    sprintf(key, "k%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+  for (int i = 0; i < 50; i++) {
+    sprintf(key, "j%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, "judgment").code);
+  }
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(50, stats.deletes);
+  VK_ASSERT(stats.alloc_steps >= 50);
+
+  const char *keys[3] = { "k100", "j1", "k1" };
+  const char *values[3] = { "a", "b", "c" };
+  VK_ASSERT_EQUALS(MDB_OK, mdb_write_batch(db, keys, values, 3).code);
+  char bufs[3][64];
+  char *buf_ptrs[3] = { bufs[0], bufs[1], bufs[2] };
+  size_t bufsizes[3] = { 64, 64, 64 };
+  mdb_status_t statuses[3];
+  before = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read_multi(db, keys, buf_ptrs, bufsizes,
+                                          statuses, 3).code);
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(1, stats.batches);
+  VK_ASSERT_EQUALS(253, stats.writes);
+  VK_ASSERT_EQUALS(3, stats.reads - before.reads);
+  VK_ASSERT_EQUALS(3, stats.lookups - before.lookups);
+  mdb_close(db);
+
+  /// positionless I/O never seeks, and cache hits are passed through
+  options.flags = MDB_FLAG_PIO;
+  options.cache_size = 1 << 16;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kuroko", &options).code);
+  for (int round = 0; round < 2; round++) {
+    for (int i = 50; i < 200; i++) {
+      sprintf(key, "k%d", i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+    }
+  }
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(0, stats.seeks);
+  VK_ASSERT(stats.file_reads > 0);
+  VK_ASSERT_EQUALS(300, stats.reads);
+  VK_ASSERT_EQUALS(150, stats.cache_hits);
+  VK_ASSERT_EQUALS(150, stats.cache_misses);
+  VK_ASSERT_EQUALS(150, stats.lookups);
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("kuroko stats test");
+}
+
+void inspect_test21() {
+  VK_TEST_SECTION_BEGIN("last order inspect test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "last_order";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 8;
+  options.items_max = 166716;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  mdb_inspect_t report;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &report).code);
+  VK_ASSERT_EQUALS(0, report.items);
+  VK_ASSERT_EQUALS(8, report.chain_histogram[0]);
+  VK_ASSERT_EQUALS(0, report.data_bytes);
+
+  char key[16];
+  char value[32];
+  uint64_t live_bytes = 0;
+  for (int i = 0; i < 5000; i++) {
+    sprintf(key, "a%d", i);
+    sprintf(value, "vector %d", i * 7);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+    if (i % 10 != 0) {
+      live_bytes += strlen(value);
+    }
+  }
+  for (int i = 0; i < 5000; i += 10) {
+    sprintf(key, "a%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+
+  mdb_inspect_t reports[2];
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &reports[0]).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 4, &reports[1]).code);
+  for (int i = 0; i < 2; i++) {
+    mdb_inspect_t *r = &reports[i];
+    VK_ASSERT_EQUALS(8, r->hash_buckets);
+    VK_ASSERT(r->buckets >= 5000 / 4);
+    VK_ASSERT_EQUALS(4500, r->items);
+    uint64_t chains = 0, items = 0;
+    for (int bin = 0; bin < MDB_INSPECT_CHAIN_BINS; bin++) {
+      chains += r->chain_histogram[bin];
+      items += r->chain_histogram[bin] * bin;
+    }
+    VK_ASSERT_EQUALS(r->buckets, chains);
+    VK_ASSERT(items <= r->items);
+    VK_ASSERT(r->chain_max >= 1);
+    VK_ASSERT(r->load_factor <= 4.0);
+    VK_ASSERT(r->base_load_factor > 500.0);
+    VK_ASSERT_EQUALS(500, r->freelist_length);
+    VK_ASSERT_EQUALS(live_bytes, r->live_bytes);
+    VK_ASSERT_EQUALS(r->data_bytes, r->live_bytes + r->free_bytes);
+    VK_ASSERT(r->free_extents > 0);
+    VK_ASSERT(r->largest_free_extent > 0);
+    VK_ASSERT(r->largest_free_extent <= r->free_bytes);
+    VK_ASSERT_EQUALS(8192, r->suggested_buckets);
+  }
+  VK_ASSERT(memcmp(&reports[0], &reports[1], sizeof(mdb_inspect_t)) == 0);
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("last order inspect test");
+}
+
+static void copy_file(const char *from, const char *to) {
+  FILE *in = fopen(from, "rb");
+  FILE *out = fopen(to, "wb");
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    fwrite(buffer, 1, size, out);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+void super_test22() {
+  VK_TEST_SECTION_BEGIN("touma superblock test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "touma";
+  options.key_size_max = 16;
+  options.data_size_max = 256;
+  options.hash_buckets = 8;
+  options.items_max = 166716;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  char key[16];
+  char value[32];
+  char buffer[257];
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "t%d", i);
+    sprintf(value, "imagine breaker %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  for (int i = 0; i < 1000; i += 4) {
+    sprintf(key, "t%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+
+  /// a copy taken while the database is open has to be scanned
+  const char *suffixes[3] = { ".db.super", ".db.index", ".db.data" };
+  char from[64], to[64];
+  for (int i = 0; i < 3; i++) {
+    sprintf(from, "touma%s", suffixes[i]);
+    sprintf(to, "fiamma%s", suffixes[i]);
+    copy_file(from, to);
+  }
+  mdb_inspect_t before;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &before).code);
+  mdb_close(db);
+
+  FILE *fp = fopen("touma.db.super", "rb");
+  unsigned char magic[4];
+  VK_ASSERT_EQUALS(4, fread(magic, 1, 4, fp));
+  fclose(fp);
+  VK_ASSERT_EQUALS(0x89, magic[0]);
+  VK_ASSERT_EQUALS('M', magic[1]);
+  VK_ASSERT_EQUALS('D', magic[2]);
+  VK_ASSERT_EQUALS('B', magic[3]);
+
+  /// a clean close leaves everything the open needs in the superblock
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "touma").code);
+  VK_ASSERT_EQUALS(0, mdb_get_stats(db).file_reads);
+  mdb_inspect_t after;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &after).code);
+  VK_ASSERT_EQUALS(750, after.items);
+  VK_ASSERT_EQUALS(before.free_bytes, after.free_bytes);
+  VK_ASSERT_EQUALS(before.free_extents, after.free_extents);
+  for (int i = 0; i < 1000; i++) {
+    sprintf(key, "t%d", i);
+    sprintf(value, "imagine breaker %d", i);
+    mdb_status_t status = mdb_read(db, key, buffer, 257);
+    if (i % 4 == 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, status.code);
+    } else {
+      VK_ASSERT_EQUALS(MDB_OK, status.code);
+      VK_ASSERT_EQUALS_S(value, buffer);
+    }
+  }
+  for (int i = 0; i < 1000; i += 4) {
+    sprintf(key, "t%d", i);
+    sprintf(value, "imagine breaker %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &after).code);
+  VK_ASSERT_EQUALS(1000, after.items);
+  VK_ASSERT_EQUALS(before.data_bytes, after.data_bytes);
+  mdb_close(db);
+
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "fiamma").code);
+  VK_ASSERT(mdb_get_stats(db).file_reads > 0);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_inspect(db, 1, &after).code);
+  VK_ASSERT_EQUALS(750, after.items);
+  VK_ASSERT(after.free_bytes >= before.free_bytes);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "t999", buffer, 257).code);
+  VK_ASSERT_EQUALS_S("imagine breaker 999", buffer);
+  mdb_close(db);
+
+  /// any damage to the header is caught by its checksum
+  fp = fopen("touma.db.super", "rb+");
+  fseek(fp, 9, SEEK_SET);
+  fputc('!', fp);
+  fclose(fp);
+  VK_ASSERT_EQUALS(MDB_ERR_FORMAT, mdb_open(&db, "touma").code);
+
+  /// the old text superblock is still read, and replaced on open
+  options.hash_buckets = 1024;
+  options.hash_seed = 4242;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  for (int i = 0; i < 100; i++) {
+    sprintf(key, "t%d", i);
+    sprintf(value, "imagine breaker %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  mdb_close(db);
+  fp = fopen("touma.db.super", "w");
+  fprintf(fp, "touma\n16\n256\n1024\n166716\n1 4242\n0 0 0\n0\n");
+  fclose(fp);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "touma").code);
+  VK_ASSERT(mdb_get_stats(db).file_reads > 0);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, "t42", buffer, 257).code);
+  VK_ASSERT_EQUALS_S("imagine breaker 42", buffer);
+  mdb_close(db);
+  fp = fopen("touma.db.super", "rb");
+  VK_ASSERT_EQUALS(4, fread(magic, 1, 4, fp));
+  fclose(fp);
+  VK_ASSERT_EQUALS(0x89, magic[0]);
+
+  VK_TEST_SECTION_END("touma superblock test");
+}
+
+static void wal_test_value(char *value, int i, int generation) {
+  sprintf(value, "frenda %d.%d", i, generation);
+}
+
+/// writes, overwrites and deletes the log replays must reproduce
+static void wal_test_fill(mdb_t db, int count) {
+  char key[32];
+  char value[64];
+  for (int i = 0; i < count; i++) {
+    sprintf(key, "sister %d", i);
+    wal_test_value(value, i, 0);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  for (int i = 0; i < count; i += 3) {
+    sprintf(key, "sister %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+  }
+  for (int i = 0; i < count; i += 5) {
+    sprintf(key, "sister %d", i);
+    wal_test_value(value, i, 1);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+}
+
+static void wal_test_verify(mdb_t db, int count) {
+  char key[32];
+  char value[64];
+  char buffer[257];
+  for (int i = 0; i < count; i++) {
+    sprintf(key, "sister %d", i);
+    mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+    if (i % 5 == 0) {
+      wal_test_value(value, i, 1);
+    } else if (i % 3 == 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      continue;
+    } else {
+      wal_test_value(value, i, 0);
+    }
+    VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+    VK_ASSERT_EQUALS_S(value, buffer);
+  }
+}
+
+void wal_test23() {
+  VK_TEST_SECTION_BEGIN("frenda write-ahead log test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "frenda";
+  options.key_size_max = 32;
+  options.data_size_max = 1024;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+  options.flags = MDB_FLAG_WAL;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  wal_test_fill(db, 3000);
+  wal_test_verify(db, 3000);
+  mdb_stats_t stats = mdb_get_stats(db);
+  VK_ASSERT(stats.commits >= 4600);
+  VK_ASSERT(stats.syncs > 0);
+  mdb_close(db);
+
+  /// a clean close leaves nothing to replay, and the files open either way
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "frenda").code);
+  wal_test_verify(db, 3000);
+  mdb_close(db);
+  VK_ASSERT(access("frenda.db.wal", F_OK) != 0);
+
+  /// a process that dies without closing leaves its commits in the log
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  mdb_close(db);
+  pid_t child = fork();
+  if (child == 0) {
+    if (mdb_open_ex(&db, "frenda", &options).code != MDB_OK) {
+      _exit(1);
+    }
+    char key[32];
+    char value[64];
+    for (int i = 0; i < 3000; i++) {
+      sprintf(key, "sister %d", i);
+      wal_test_value(value, i, 0);
+      if (mdb_write(db, key, value).code != MDB_OK) {
+        _exit(1);
+      }
+    }
+    for (int i = 0; i < 3000; i += 3) {
+      sprintf(key, "sister %d", i);
+      if (mdb_delete(db, key).code != MDB_OK) {
+        _exit(1);
+      }
+    }
+    for (int i = 0; i < 3000; i += 5) {
+      sprintf(key, "sister %d", i);
+      wal_test_value(value, i, 1);
+      if (mdb_write(db, key, value).code != MDB_OK) {
+        _exit(1);
+      }
+    }
+    _exit(0);
+  }
+  VK_ASSERT(child > 0);
+  int wstatus;
+  VK_ASSERT_EQUALS(child, waitpid(child, &wstatus, 0));
+  VK_ASSERT(WIFEXITED(wstatus));
+  VK_ASSERT_EQUALS(0, WEXITSTATUS(wstatus));
+  VK_ASSERT(file_size("frenda.db.wal") > 0);
+
+  /// a torn record at the end is where the log stops
+  FILE *fp = fopen("frenda.db.wal", "ab");
+  fwrite("\x40\x00\x00\x00torn", 1, 8, fp);
+  fclose(fp);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "frenda").code);
+  wal_test_verify(db, 3000);
+  mdb_close(db);
+  VK_ASSERT(access("frenda.db.wal", F_OK) != 0);
+
+  /// concurrent commits share syncs of the log
+  options.flags = MDB_FLAG_WAL | MDB_FLAG_THREAD_SAFE;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  pthread_t threads[8];
+  thread_test_arg_t args[8];
+  for (int t = 0; t < 8; t++) {
+    args[t].db = db;
+    args[t].id = t + 1;
+    args[t].failures = 0;
+    pthread_create(&threads[t], NULL, thread_test_worker, &args[t]);
+  }
+  for (int t = 0; t < 8; t++) {
+    pthread_join(threads[t], NULL);
+    VK_ASSERT_EQUALS(0, args[t].failures);
+  }
+  stats = mdb_get_stats(db);
+  VK_ASSERT_EQUALS(12000, stats.commits);
+  mdb_close(db);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "frenda").code);
+  char key[32];
+  char expected[32];
+  char buffer[1025];
+  for (int t = 1; t <= 8; t++) {
+    for (int i = 0; i < 1000; i++) {
+      sprintf(key, "t%d_%d", t, i);
+      mdb_status_t read_status = mdb_read(db, key, buffer, 1025);
+      if (i % 2 == 0) {
+        VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      } else {
+        sprintf(expected, "accelerator %d", i * t);
+        VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+        VK_ASSERT_EQUALS_S(expected, buffer);
+      }
+    }
+  }
+  mdb_close(db);
+
+  /// a transaction that outgrows the page limit is written back right away
+  options.flags = MDB_FLAG_WAL;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  static char values[20000][1001];
+  static char keys[20000][32];
+  const char *key_list[20000];
+  const char *value_list[20000];
+  for (int i = 0; i < 20000; i++) {
+    sprintf(keys[i], "batch %d", i);
+    memset(values[i], 'a' + i % 26, 1000);
+    values[i][1000] = '\0';
+    key_list[i] = keys[i];
+    value_list[i] = values[i];
+  }
+  VK_ASSERT_EQUALS(MDB_OK,
+                   mdb_write_batch(db, key_list, value_list, 20000).code);
+  VK_ASSERT(mdb_get_stats(db).checkpoints >= 1);
+  wal_test_fill(db, 1000);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_compact(db).code);
+  wal_test_verify(db, 1000);
+  for (int i = 0; i < 20000; i += 97) {
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, keys[i], buffer, 1025).code);
+    VK_ASSERT_EQUALS_S(values[i], buffer);
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("frenda write-ahead log test");
+}
+
+void durability_test24() {
+  VK_TEST_SECTION_BEGIN("aleister durability test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "aleister";
+  options.key_size_max = 32;
+  options.data_size_max = 256;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+
+  char key[32];
+  char value[64];
+  char buffer[257];
+  static char batch_keys[125][32];
+  static char batch_values[125][64];
+  const char *batch_key_list[125];
+  const char *batch_value_list[125];
+  for (int round = 0; round < 8; round++) {
+    options.durability = (uint8_t)(round / 2);
+    options.sync_interval_ms = 10;
+    options.flags = round % 2 == 1 ? MDB_FLAG_PIO : 0;
+    mdb_t db;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+    /// creating the files flushes them once
+    uint64_t flushes = mdb_get_stats(db).flushes;
+    for (int i = 0; i < 500; i++) {
+      sprintf(key, "magician %d", i);
+      sprintf(value, "aiwass %d", i * round);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+    }
+    for (int i = 0; i < 500; i += 4) {
+      sprintf(key, "magician %d", i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_delete(db, key).code);
+    }
+    /// updates in place, and a batch, which counts as one mutation
+    for (int i = 1; i < 500; i += 4) {
+      sprintf(key, "magician %d", i);
+      sprintf(value, "aiwass %d", i * round);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+    }
+    for (int i = 0; i < 125; i++) {
+      sprintf(batch_keys[i], "magician %d", i * 4 + 2);
+      sprintf(batch_values[i], "aiwass %d", (i * 4 + 2) * round);
+      batch_key_list[i] = batch_keys[i];
+      batch_value_list[i] = batch_values[i];
+    }
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write_batch(db, batch_key_list,
+                                             batch_value_list, 125).code);
+    mdb_stats_t stats = mdb_get_stats(db);
+    /// the splits are paid for by the flushes of their mutations, and pio
+    /// leaves nothing in the stdio buffers
+    VK_ASSERT(stats.splits > 0);
+    if (round % 2 == 1) {
+      VK_ASSERT_EQUALS(0, stats.flushes - flushes);
+    }
+    switch (options.durability) {
+    case MDB_DURABILITY_NONE:
+      VK_ASSERT_EQUALS(0, stats.syncs);
+      if (round % 2 == 0) {
+        /// one flush of each file per mutation
+        VK_ASSERT_EQUALS(2 * 751, stats.flushes - flushes);
+      }
+      break;
+    case MDB_DURABILITY_ON_CLOSE:
+      VK_ASSERT_EQUALS(0, stats.syncs);
+      VK_ASSERT_EQUALS(0, stats.flushes - flushes);
+      break;
+    case MDB_DURABILITY_PERIODIC: {
+      /// the flusher catches up, then has nothing to do while idle
+      for (int wait = 0; wait < 500 && mdb_get_stats(db).syncs == 0; wait++) {
+        usleep(10000);
+      }
+      usleep(50000);
+      uint64_t syncs = mdb_get_stats(db).syncs;
+      VK_ASSERT(syncs > 0);
+      usleep(50000);
+      VK_ASSERT_EQUALS(syncs, mdb_get_stats(db).syncs);
+      break;
+    }
+    case MDB_DURABILITY_COMMIT:
+      VK_ASSERT_EQUALS(2 * 751, stats.syncs);
+      break;
+    }
+    mdb_close(db);
+
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "aleister").code);
+    for (int i = 0; i < 500; i++) {
+      sprintf(key, "magician %d", i);
+      mdb_status_t read_status = mdb_read(db, key, buffer, 257);
+      if (i % 4 == 0) {
+        VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+      } else {
+        sprintf(value, "aiwass %d", i * round);
+        VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+        VK_ASSERT_EQUALS_S(value, buffer);
+      }
+    }
+    mdb_close(db);
+  }
+
+  /// what a mutation has handed to the kernel outlives the process
+  options.durability = MDB_DURABILITY_NONE;
+  options.flags = 0;
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  mdb_close(db);
+  pid_t child = fork();
+  if (child == 0) {
+    if (mdb_open_ex(&db, "aleister", &options).code != MDB_OK) {
+      _exit(1);
+    }
+    for (int i = 0; i < 500; i++) {
+      sprintf(key, "magician %d", i);
+      sprintf(value, "crowley %d", i);
+      if (mdb_write(db, key, value).code != MDB_OK) {
+        _exit(1);
+      }
+    }
+    _exit(0);
+  }
+  VK_ASSERT(child > 0);
+  int wstatus;
+  VK_ASSERT_EQUALS(child, waitpid(child, &wstatus, 0));
+  VK_ASSERT(WIFEXITED(wstatus));
+  VK_ASSERT_EQUALS(0, WEXITSTATUS(wstatus));
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&db, "aleister").code);
+  for (int i = 0; i < 500; i++) {
+    sprintf(key, "magician %d", i);
+    sprintf(value, "crowley %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, key, buffer, 257).code);
+    VK_ASSERT_EQUALS_S(value, buffer);
+  }
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("aleister durability test");
+}
+
+/// one request of the async test; the callback checks what it got
+typedef struct {
+  mdb_async_t async;
+  int *completed;
+  int *failures;
+  uint8_t expect;
+  char key[32];
+  char expected[64];
+  char buffer[64];
+  int chain;
+} async_test_req_t;
+
+static void async_test_done(void *arg, mdb_status_t status) {
+  async_test_req_t *req = (async_test_req_t*)arg;
+  (*req->completed)++;
+  if (status.code != req->expect
+      || (status.code == MDB_OK && req->expected[0] != '\0'
+          && strcmp(req->expected, req->buffer) != 0)) {
+    (*req->failures)++;
+  }
+}
+
+static void async_test_written(void *arg, mdb_status_t status) {
+  async_test_req_t *req = (async_test_req_t*)arg;
+  (*req->completed)++;
+  if (status.code != req->expect) {
+    (*req->failures)++;
+  }
+}
+
+/// each completion submits the read of the next key
+static void async_test_chain(void *arg, mdb_status_t status) {
+  async_test_req_t *req = (async_test_req_t*)arg;
+  async_test_done(arg, status);
+  if (--req->chain > 0) {
+    int i = 1000 + req->chain;
+    sprintf(req->key, "index %d", i);
+    sprintf(req->expected, "hyouka %d", i);
+    if (mdb_read_async(req->async, req->key, req->buffer, 64,
+                       async_test_chain, req).code != MDB_OK) {
+      (*req->failures)++;
+    }
+  }
+}
+
+/// reads and writes a few thousand keys through a context, and polls it
+/// until they are all done
+static void async_test_round(mdb_t db, mdb_async_t async, int round) {
+  int completed = 0, failures = 0;
+  async_test_req_t *reqs =
+      (async_test_req_t*)calloc(3600, sizeof(async_test_req_t));
+  for (int i = 0; i < 3600; i++) {
+    async_test_req_t *req = reqs + i;
+    req->completed = &completed;
+    req->failures = &failures;
+    if (i < 3000) {
+      sprintf(req->key, "index %d", i);
+      if (round > 0 && i < 1000) {
+        sprintf(req->expected, "round %d value %d", round - 1, i);
+      } else {
+        sprintf(req->expected, "hyouka %d", i);
+      }
+      req->expect = MDB_OK;
+    } else {
+      sprintf(req->key, "missing %d", i);
+      req->expect = MDB_NO_KEY;
+    }
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read_async(async, req->key, req->buffer, 64,
+                                            async_test_done, req).code);
+  }
+  size_t done = 0;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_poll(async, 3600, &done).code);
+  VK_ASSERT_EQUALS(3600, done);
+  VK_ASSERT_EQUALS(3600, completed);
+  VK_ASSERT_EQUALS(0, failures);
+
+  /// writes, then reads that see them once their callbacks have run
+  completed = 0;
+  for (int i = 0; i < 1200; i++) {
+    async_test_req_t *req = reqs + i;
+    sprintf(req->key, i < 1000 ? "index %d" : "new index %d", i);
+    sprintf(req->expected, "round %d value %d", round, i);
+    req->expect = MDB_OK;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write_async(async, req->key, req->expected,
+                                             strlen(req->expected),
+                                             async_test_written,
+                                             req).code);
+  }
+  while (completed < 1200) {
+    VK_ASSERT_EQUALS(MDB_OK, mdb_async_poll(async, 1, &done).code);
+  }
+  completed = 0;
+  for (int i = 0; i < 1200; i++) {
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read_async(async, reqs[i].key,
+                                            reqs[i].buffer, 64,
+                                            async_test_done, reqs + i).code);
+  }
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_poll(async, 1200, &done).code);
+  VK_ASSERT_EQUALS(1200, completed);
+  VK_ASSERT_EQUALS(0, failures);
+
+  /// small buffers, long keys and requests submitted from callbacks
+  reqs[0].expect = MDB_ERR_BUFSIZ;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read_async(async, "index 2000", reqs[0].buffer,
+                                          4, async_test_done, reqs).code);
+  VK_ASSERT_EQUALS(MDB_ERR_KEY_SIZE,
+                   mdb_read_async(async, "index of librorum prohibitorum",
+                                  reqs[1].buffer, 64, async_test_done,
+                                  reqs + 1).code);
+  completed = 0;
+  for (int c = 1; c <= 8; c++) {
+    async_test_req_t *req = reqs + c;
+    req->async = async;
+    req->chain = 50;
+    req->expect = MDB_OK;
+    sprintf(req->key, "index %d", 2000 + c);
+    sprintf(req->expected, "hyouka %d", 2000 + c);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read_async(async, req->key, req->buffer, 64,
+                                            async_test_chain, req).code);
+  }
+  while (completed < 1 + 8 * 50) {
+    VK_ASSERT_EQUALS(MDB_OK, mdb_async_poll(async, 1, &done).code);
+  }
+  VK_ASSERT_EQUALS(1 + 8 * 50, completed);
+  VK_ASSERT_EQUALS(0, failures);
+  free(reqs);
+
+  char buffer[64];
+  char value[64];
+  for (int i = 0; i < 1200; i++) {
+    sprintf(value, "round %d value %d", round, i);
+    sprintf(buffer, i < 1000 ? "index %d" : "new index %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_read(db, buffer, buffer, 64).code);
+    VK_ASSERT_EQUALS_S(value, buffer);
+  }
+}
+
+/// rewrites the first keys and adds new ones, splitting the table, while
+/// the main thread reads through the ring
+static void *async_test_writer(void *opaque) {
+  thread_test_arg_t *arg = (thread_test_arg_t*)opaque;
+  char key[32];
+  char value[64];
+  for (int i = 0; i < 20000; i++) {
+    sprintf(key, "index %d", i % 500);
+    sprintf(value, "hyouka %d gen %d", i % 500, i);
+    if (mdb_write(arg->db, key, value).code != MDB_OK) {
+      arg->failures++;
+    }
+    sprintf(key, "writer %d", i);
+    if (i % 4 == 0 && mdb_write(arg->db, key, value).code != MDB_OK) {
+      arg->failures++;
+    }
+  }
+  __atomic_store_n(&arg->id, 0, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void async_test_racing(void *arg, mdb_status_t status) {
+  async_test_req_t *req = (async_test_req_t*)arg;
+  (*req->completed)++;
+  size_t prefix = strlen(req->expected);
+  if (status.code != MDB_OK || strncmp(req->buffer, req->expected, prefix) != 0
+      || (req->buffer[prefix] != '\0' && req->buffer[prefix] != ' ')) {
+    (*req->failures)++;
+  }
+}
+
+void async_test25() {
+  VK_TEST_SECTION_BEGIN("kazakiri async test");
+
+  mdb_options_t options = { 0 };
+  options.db_name = "kazakiri";
+  options.key_size_max = 24;
+  options.data_size_max = 256;
+  options.hash_buckets = 16;
+  options.items_max = 166716;
+  options.flags = MDB_FLAG_PIO;
+
+  mdb_t db;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&db, options).code);
+  char key[32];
+  char value[64];
+  for (int i = 0; i < 3000; i++) {
+    sprintf(key, "index %d", i);
+    sprintf(value, "hyouka %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+
+  /// a ring with far fewer entries than requests; without io_uring the
+  /// handle is not thread safe, so they are done as they are submitted
+  mdb_async_t async;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_open(db, 16, &async).code);
+  VK_ASSERT(mdb_async_engine(async) != MDB_ASYNC_THREADS);
+  uint64_t file_reads = mdb_get_stats(db).file_reads;
+  async_test_round(db, async, 0);
+  if (mdb_async_engine(async) == MDB_ASYNC_URING) {
+    VK_ASSERT(mdb_get_stats(db).file_reads > file_reads + 3000);
+  }
+  mdb_async_close(async);
+  mdb_close(db);
+
+  /// a pool of threads for a handle mapping its index, and the calling
+  /// thread when that handle is not thread safe
+  options.flags = MDB_FLAG_THREAD_SAFE | MDB_FLAG_MMAP_INDEX;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kazakiri", &options).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_open(db, 0, &async).code);
+  VK_ASSERT_EQUALS(MDB_ASYNC_THREADS, mdb_async_engine(async));
+  async_test_round(db, async, 1);
+  mdb_async_close(async);
+  mdb_close(db);
+
+  options.flags = MDB_FLAG_MMAP_INDEX;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kazakiri", &options).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_open(db, 0, &async).code);
+  VK_ASSERT_EQUALS(MDB_ASYNC_INLINE, mdb_async_engine(async));
+  async_test_round(db, async, 2);
+  mdb_async_close(async);
+  mdb_close(db);
+
+  /// lookups in flight while another thread rewrites their chains never
+  /// see a value of another key
+  options.flags = MDB_FLAG_THREAD_SAFE;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&db, "kazakiri", &options).code);
+  for (int i = 0; i < 500; i++) {
+    sprintf(key, "index %d", i);
+    sprintf(value, "hyouka %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(db, key, value).code);
+  }
+  VK_ASSERT_EQUALS(MDB_OK, mdb_async_open(db, 64, &async).code);
+  thread_test_arg_t writer = { db, 1, 0 };
+  pthread_t thread;
+  pthread_create(&thread, NULL, async_test_writer, &writer);
+  int completed = 0, failures = 0, rounds = 0;
+  async_test_req_t *reqs =
+      (async_test_req_t*)calloc(500, sizeof(async_test_req_t));
+  while (__atomic_load_n(&writer.id, __ATOMIC_RELAXED) != 0 || rounds < 4) {
+    for (int i = 0; i < 500; i++) {
+      reqs[i].completed = &completed;
+      reqs[i].failures = &failures;
+      sprintf(reqs[i].key, "index %d", i);
+      sprintf(reqs[i].expected, "hyouka %d", i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_read_async(async, reqs[i].key,
+                                              reqs[i].buffer, 64,
+                                              async_test_racing,
+                                              reqs + i).code);
+    }
+    VK_ASSERT_EQUALS(MDB_OK, mdb_async_poll(async, 500, NULL).code);
+    rounds++;
+  }
+  pthread_join(thread, NULL);
+  VK_ASSERT_EQUALS(0, writer.failures);
+  VK_ASSERT_EQUALS(500 * rounds, completed);
+  VK_ASSERT_EQUALS(0, failures);
+  free(reqs);
+  mdb_async_close(async);
+  mdb_close(db);
+
+  VK_TEST_SECTION_END("kazakiri async test");
+}
+
 int main() {
   VK_TEST_BEGIN;
 
@@ -257,6 +2376,27 @@ int main() {
   reopen_test1();
   load_test2();
   load_test3();
+  reuse_test4();
+  mmap_test5();
+  batch_test6();
+  multi_test7();
+  thread_test8();
+  shared_test9();
+  view_test10();
+  cursor_test11();
+  compact_test12();
+  slab_test13();
+  pio_test14();
+  grow_test15();
+  punch_test16();
+  cache_test17();
+  bloom_test18();
+  stats_test20();
+  inspect_test21();
+  super_test22();
+  wal_test23();
+  durability_test24();
+  async_test25();
 
   VK_TEST_END;
 }
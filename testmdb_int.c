@@ -5,6 +5,7 @@
 
 #include <time.h>
 #include <stdbool.h>
+#include <sys/wait.h>
 
 #define TESTDB_DB_NAME "testdb"
 #define TESTDB_KEY_SIZE_MAX 8
@@ -13,7 +14,7 @@
 #define TESTDB_ITEMS_MAX 65536
 
 mdb_options_t get_default_options() {
-  mdb_options_t ret;
+  mdb_options_t ret = { 0 };
   ret.db_name = TESTDB_DB_NAME;
   ret.key_size_max = TESTDB_KEY_SIZE_MAX;
   ret.data_size_max = TESTDB_DATA_SIZE_MAX;
@@ -30,15 +31,20 @@ mdb_options_t get_options_no_hash_buckets() {
 
 mdb_int_t open_test_db(mdb_options_t options) {
   mdb_int_t ret;
+  memset(&ret, 0, sizeof(ret));
   ret.options = options;
+  ret.free_map.seed = 0x9e3779b9u;
   ret.fp_superblock = fopen("super", "wb+");
   ret.fp_index = fopen("index", "wb+");
   mdb_ptr_t free_ptr = 0;
   fwrite(&free_ptr, MDB_PTR_SIZE, 1, ret.fp_index);
+  ret.index_end = MDB_PTR_SIZE;
+  ret.heads = (mdb_ptr_t*)calloc(1, MDB_PTR_SIZE);
   ret.fp_data = fopen("data", "wb+");
 
   ret.index_record_size = ret.options.key_size_max
                           + MDB_PTR_SIZE * 2
+                          + MDB_HASH_SIZE
                           + MDB_DATALEN_SIZE;
   return ret;
 }
@@ -47,6 +53,8 @@ void close_test_db(mdb_int_t db) {
   fclose(db.fp_superblock);
   fclose(db.fp_index);
   fclose(db.fp_data);
+  mdb_extent_clear(&db.free_map);
+  free(db.heads);
 }
 
 void generate_random_key(char *buffer) {
@@ -290,6 +298,420 @@ void test4() {
   VK_TEST_SECTION_END("data reuse");
 }
 
+void test5() {
+  VK_TEST_SECTION_BEGIN("free extent coalescing");
+
+  mdb_int_t testdb = open_test_db(get_options_no_hash_buckets());
+
+  mdb_ptr_t valptr_arr[16];
+  char buffer[64] = {0};
+  for (size_t i = 0; i < 16; i++) {
+    memset(buffer, i + 1, 64);
+    mdb_status_t alloc_status = mdb_data_alloc(&testdb, 64, valptr_arr + i);
+    VK_ASSERT_EQUALS(MDB_OK, alloc_status.code);
+    (void)mdb_write_data(&testdb, valptr_arr[i], buffer, 64);
+  }
+  VK_ASSERT_EQUALS(16 * 64, mdb_data_size((mdb_t*)&testdb));
+
+  for (size_t i = 4; i < 8; i++) {
+    mdb_status_t free_status = mdb_data_free(&testdb, valptr_arr[i], 64);
+    VK_ASSERT_EQUALS(MDB_OK, free_status.code);
+  }
+
+  mdb_ptr_t big_ptr;
+  mdb_status_t alloc_status = mdb_data_alloc(&testdb, 4 * 64, &big_ptr);
+  VK_ASSERT_EQUALS(MDB_OK, alloc_status.code);
+  VK_ASSERT_EQUALS(valptr_arr[4], big_ptr);
+  VK_ASSERT_EQUALS(16 * 64, mdb_data_size((mdb_t*)&testdb));
+
+  (void)mdb_data_free(&testdb, valptr_arr[15], 64);
+  alloc_status = mdb_data_alloc(&testdb, 96, &big_ptr);
+  VK_ASSERT_EQUALS(MDB_OK, alloc_status.code);
+  VK_ASSERT_EQUALS(valptr_arr[15], big_ptr);
+  VK_ASSERT_EQUALS(15 * 64 + 96, mdb_data_size((mdb_t*)&testdb));
+
+  close_test_db(testdb);
+
+  VK_TEST_SECTION_END("free extent coalescing");
+}
+
+void test6() {
+  VK_TEST_SECTION_BEGIN("hash distribution");
+
+  mdb_options_t options = get_default_options();
+  options.hash_buckets = 128;
+  options.hash_seed = 166716;
+  mdb_int_t testdb = open_test_db(options);
+
+  size_t chain_length[128] = {0};
+  char key[4] = {0};
+  for (char c1 = '0'; c1 <= '9'; c1++) {
+    for (char c2 = '0'; c2 <= '9'; c2++) {
+      for (char c3 = '0'; c3 <= '9'; c3++) {
+        key[0] = c1;
+        key[1] = c2;
+        key[2] = c3;
+        chain_length[mdb_bucket_of(&testdb, mdb_hash(&testdb, key))]++;
+      }
+    }
+  }
+
+  size_t empty_buckets = 0, longest_chain = 0;
+  for (size_t i = 0; i < 128; i++) {
+    if (chain_length[i] == 0) {
+      empty_buckets++;
+    }
+    if (chain_length[i] > longest_chain) {
+      longest_chain = chain_length[i];
+    }
+  }
+  fprintf(stderr, "empty buckets = %zu, longest chain = %zu\n",
+          empty_buckets, longest_chain);
+  VK_ASSERT(empty_buckets <= 2);
+  VK_ASSERT(longest_chain <= 20);
+
+  VK_ASSERT_NOT_EQUALS(mdb_hash(&testdb, "ab"), mdb_hash(&testdb, "ba"));
+  VK_ASSERT_NOT_EQUALS(mdb_hash(&testdb, ""), mdb_hash(&testdb, "a"));
+
+  close_test_db(testdb);
+
+  VK_TEST_SECTION_END("hash distribution");
+}
+
+void test7() {
+  VK_TEST_SECTION_BEGIN("incremental rehashing");
+
+  mdb_options_t options = get_default_options();
+  options.db_name = "lhtest";
+  options.hash_buckets = 4;
+  options.max_load_factor = 2;
+
+  mdb_t handle;
+  mdb_status_t create_status = mdb_create(&handle, options);
+  VK_ASSERT_EQUALS(MDB_OK, create_status.code);
+  mdb_int_t *db = (mdb_int_t*)handle;
+
+  char key[TESTDB_KEY_SIZE_MAX];
+  char value[16];
+  for (int i = 0; i < 3000; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "v%d", i);
+    mdb_status_t write_status = mdb_write(handle, key, value);
+    VK_ASSERT_EQUALS(MDB_OK, write_status.code);
+    VK_ASSERT(db->item_count <= 2 * mdb_bucket_count(db) + 1);
+  }
+  for (int i = 0; i < 3000; i += 2) {
+    sprintf(key, "k%d", i);
+    (void)mdb_delete(handle, key);
+  }
+
+  uint32_t level = db->level, split = db->split;
+  fprintf(stderr, "level = %u, split = %u, buckets = %u\n", level, split,
+          mdb_bucket_count(db));
+  VK_ASSERT(mdb_bucket_count(db) >= 1500);
+  mdb_close(handle);
+
+  mdb_status_t open_status = mdb_open(&handle, "lhtest");
+  VK_ASSERT_EQUALS(MDB_OK, open_status.code);
+  db = (mdb_int_t*)handle;
+  VK_ASSERT_EQUALS(level, db->level);
+  VK_ASSERT_EQUALS(split, db->split);
+  VK_ASSERT_EQUALS(1500, db->item_count);
+
+  char buffer[16];
+  for (int i = 0; i < 3000; i++) {
+    sprintf(key, "k%d", i);
+    mdb_status_t read_status = mdb_read(handle, key, buffer, 16);
+    if (i % 2 == 0) {
+      VK_ASSERT_EQUALS(MDB_NO_KEY, read_status.code);
+    } else {
+      sprintf(value, "v%d", i);
+      VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+      VK_ASSERT_EQUALS_S(value, buffer);
+    }
+  }
+  mdb_close(handle);
+
+  VK_TEST_SECTION_END("incremental rehashing");
+}
+
+/// does the first @p writes pointer writes of the next split the way
+/// mdb_maybe_split does them, and tells whether it ran out before the end
+bool split_partially(mdb_int_t *db, int writes) {
+  uint32_t base = db->options.hash_buckets << db->level;
+  uint32_t old_bucket = db->split;
+  uint32_t modulus = base * 2;
+  mdb_ptr_t save_ptr = mdb_bucket_slot(db, old_bucket);
+  mdb_ptr_t tail_ptr = mdb_bucket_slot(db, base + old_bucket);
+  mdb_ptr_t ptr = db->heads[old_bucket + 1];
+  while (ptr != 0) {
+    mdb_ptr_t next_ptr;
+    uint32_t hash;
+    (void)mdb_read_index_head(db, ptr, &next_ptr, &hash);
+    if (hash % modulus == old_bucket) {
+      save_ptr = ptr;
+    } else {
+      mdb_ptr_t links[3][2] = {
+        { tail_ptr, ptr }, { save_ptr, next_ptr }, { ptr, 0 }
+      };
+      for (size_t i = 0; i < 3; i++) {
+        if (writes-- == 0) {
+          return true;
+        }
+        (void)mdb_write_nextptr(db, links[i][0], links[i][1]);
+      }
+      tail_ptr = ptr;
+    }
+    ptr = next_ptr;
+  }
+  return false;
+}
+
+void test8_verify(mdb_t handle, int count) {
+  char key[16];
+  char value[16];
+  char buffer[16];
+  for (int i = 0; i < count; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "v%d", i);
+    mdb_status_t read_status = mdb_read(handle, key, buffer, 16);
+    VK_ASSERT_EQUALS(MDB_OK, read_status.code);
+    VK_ASSERT_EQUALS_S(value, buffer);
+  }
+}
+
+void test8() {
+  VK_TEST_SECTION_BEGIN("interrupted split");
+
+  uint32_t flags[] = { 0, MDB_FLAG_PIO, MDB_FLAG_MMAP_INDEX };
+  for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+    mdb_options_t options = get_default_options();
+    options.db_name = "lhsplit";
+    options.hash_buckets = 2;
+    options.max_load_factor = 2;
+    options.flags = flags[f];
+
+    /// a split at the current level has made the segment the next one
+    /// moves records into
+    mdb_t handle;
+    VK_ASSERT_EQUALS(MDB_OK, mdb_create(&handle, options).code);
+    mdb_int_t *db = (mdb_int_t*)handle;
+    char key[16];
+    char value[16];
+    int count = 0;
+    while (count < 40 || db->split == 0) {
+      sprintf(key, "k%d", count);
+      sprintf(value, "v%d", count);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, key, value).code);
+      count++;
+    }
+    uint32_t level = db->level, split = db->split;
+    mdb_close(handle);
+
+    /// a process dies after every possible number of writes of the split
+    bool cut_short = true;
+    for (int writes = 0; cut_short; writes++) {
+      pid_t child = fork();
+      if (child == 0) {
+        if (mdb_open_ex(&handle, "lhsplit", &options).code != MDB_OK) {
+          _exit(2);
+        }
+        _exit(split_partially((mdb_int_t*)handle, writes) ? 1 : 0);
+      }
+      VK_ASSERT(child > 0);
+      int wstatus;
+      VK_ASSERT_EQUALS(child, waitpid(child, &wstatus, 0));
+      VK_ASSERT(WIFEXITED(wstatus));
+      VK_ASSERT(WEXITSTATUS(wstatus) < 2);
+      cut_short = WEXITSTATUS(wstatus) == 1;
+
+      VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&handle, "lhsplit",
+                                           &options).code);
+      db = (mdb_int_t*)handle;
+      VK_ASSERT_EQUALS(level, db->level);
+      VK_ASSERT_EQUALS(split, db->split);
+      VK_ASSERT_EQUALS((uint32_t)count, db->item_count);
+      VK_ASSERT_EQUALS(0, db->heads[(options.hash_buckets << level) + split
+                                    + 1]);
+      test8_verify(handle, count);
+      mdb_close(handle);
+    }
+
+    /// a split that failed part way is undone before it is tried again
+    VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&handle, "lhsplit", &options).code);
+    db = (mdb_int_t*)handle;
+    VK_ASSERT(!split_partially(db, 1 << 30));
+    VK_ASSERT_EQUALS(MDB_OK, mdb_split_undo(db).code);
+    test8_verify(handle, count);
+    for (int i = count; i < count * 4; i++) {
+      sprintf(key, "k%d", i);
+      sprintf(value, "v%d", i);
+      VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, key, value).code);
+    }
+    VK_ASSERT(db->split != split || db->level != level);
+    test8_verify(handle, count * 4);
+    mdb_close(handle);
+  }
+
+  /// through stdio the split pointer waits for the index to be flushed,
+  /// which ON_CLOSE only does at close; the splits made since are undone
+  mdb_options_t options = get_default_options();
+  options.db_name = "lhsplit";
+  options.hash_buckets = 2;
+  options.max_load_factor = 2;
+  options.durability = MDB_DURABILITY_ON_CLOSE;
+  mdb_t handle;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&handle, options).code);
+  mdb_int_t *db = (mdb_int_t*)handle;
+  char key[16];
+  char value[16];
+  for (int i = 0; i < 40; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "v%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, key, value).code);
+  }
+  uint32_t level = db->level, split = db->split;
+  mdb_close(handle);
+  pid_t child = fork();
+  if (child == 0) {
+    if (mdb_open_ex(&handle, "lhsplit", &options).code != MDB_OK) {
+      _exit(1);
+    }
+    db = (mdb_int_t*)handle;
+    for (int i = 40; i < 400; i++) {
+      sprintf(key, "k%d", i);
+      sprintf(value, "v%d", i);
+      if (mdb_write(handle, key, value).code != MDB_OK) {
+        _exit(1);
+      }
+    }
+    if (db->level == level || fflush(db->fp_index) != 0
+        || fflush(db->fp_data) != 0) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  VK_ASSERT(child > 0);
+  int wstatus;
+  VK_ASSERT_EQUALS(child, waitpid(child, &wstatus, 0));
+  VK_ASSERT(WIFEXITED(wstatus));
+  VK_ASSERT_EQUALS(0, WEXITSTATUS(wstatus));
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&handle, "lhsplit", &options).code);
+  db = (mdb_int_t*)handle;
+  VK_ASSERT_EQUALS(level, db->level);
+  VK_ASSERT_EQUALS(split, db->split);
+  VK_ASSERT_EQUALS(400, db->item_count);
+  test8_verify(handle, 400);
+  for (int i = 400; i < 800; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "v%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, key, value).code);
+  }
+  test8_verify(handle, 800);
+  mdb_close(handle);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open_ex(&handle, "lhsplit", &options).code);
+  test8_verify(handle, 800);
+  mdb_close(handle);
+
+  VK_TEST_SECTION_END("interrupted split");
+}
+
+void test9_read_super(uint8_t *header, long *size) {
+  FILE *fp = fopen("lhsuper.db.super", "rb");
+  VK_ASSERT(fp != NULL);
+  VK_ASSERT_EQUALS(MDB_SUPER_SIZE, fread(header, 1, MDB_SUPER_SIZE, fp));
+  VK_ASSERT_EQUALS(0, fseek(fp, 0, SEEK_END));
+  *size = ftell(fp);
+  fclose(fp);
+}
+
+void test9() {
+  VK_TEST_SECTION_BEGIN("superblock clean flag");
+
+  mdb_options_t options = get_default_options();
+  options.db_name = "lhsuper";
+  options.hash_buckets = 300;
+  mdb_t handle;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&handle, options).code);
+  char key[16];
+  char value[64];
+  for (int i = 0; i < 400; i++) {
+    sprintf(key, "k%d", i);
+    sprintf(value, "value %d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, key, value).code);
+  }
+  for (int i = 0; i < 400; i += 3) {
+    sprintf(key, "k%d", i);
+    VK_ASSERT_EQUALS(MDB_OK, mdb_delete(handle, key).code);
+  }
+  mdb_close(handle);
+
+  /// the fields are little-endian on any host
+  uint8_t header[MDB_SUPER_SIZE];
+  long size;
+  test9_read_super(header, &size);
+  VK_ASSERT_EQUALS(300 & 0xff, header[MDB_SUPER_BUCKETS_AT]);
+  VK_ASSERT_EQUALS(300 >> 8, header[MDB_SUPER_BUCKETS_AT + 1]);
+  VK_ASSERT_EQUALS(MDB_SUPER_CLEAN, header[MDB_SUPER_FLAGS_AT]);
+  VK_ASSERT_EQUALS(266, mdb_get_le(header + MDB_SUPER_ITEMS_AT, 4));
+  VK_ASSERT(size > MDB_SUPER_SIZE);
+
+  /// extents that fail their checksum are not used, but the superblock
+  /// still has to be marked dirty before the files change
+  FILE *fp = fopen("lhsuper.db.super", "rb+");
+  VK_ASSERT_EQUALS(0, fseek(fp, -1, SEEK_END));
+  int last = fgetc(fp);
+  VK_ASSERT_EQUALS(0, fseek(fp, -1, SEEK_END));
+  fputc(last ^ 0x5a, fp);
+  fclose(fp);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_open(&handle, "lhsuper").code);
+  VK_ASSERT_EQUALS(266, ((mdb_int_t*)handle)->item_count);
+  test9_read_super(header, &size);
+  VK_ASSERT_EQUALS(0, header[MDB_SUPER_FLAGS_AT]);
+  VK_ASSERT_EQUALS(MDB_SUPER_SIZE, size);
+  char buffer[64];
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read(handle, "k1", buffer, 64).code);
+  VK_ASSERT_EQUALS_S("value 1", buffer);
+  mdb_close(handle);
+
+  VK_TEST_SECTION_END("superblock clean flag");
+}
+
+void test10() {
+  VK_TEST_SECTION_BEGIN("failed bucket read");
+
+  /// in shared mode the bucket heads are read from the index file, and a
+  /// read that fails must stop the lookup rather than walk garbage
+  mdb_options_t options = get_default_options();
+  options.db_name = "lhmulti";
+  options.flags = MDB_FLAG_SHARED;
+  mdb_t handle;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_create(&handle, options).code);
+  VK_ASSERT_EQUALS(MDB_OK, mdb_write(handle, "misaka", "mikoto").code);
+  mdb_int_t *db = (mdb_int_t*)handle;
+  int fd_index = db->fd_index;
+  db->fd_index = open("/dev/null", O_RDONLY);
+  VK_ASSERT(db->fd_index >= 0);
+  const char *keys[] = { "misaka" };
+  char buffer[16];
+  char *bufs[] = { buffer };
+  size_t bufsizes[] = { sizeof(buffer) };
+  mdb_status_t statuses[1];
+  mdb_status_t status = mdb_read_multi(handle, keys, bufs, bufsizes,
+                                       statuses, 1);
+  VK_ASSERT_EQUALS(MDB_ERR_READ, status.code);
+  VK_ASSERT_EQUALS(MDB_ERR_READ, statuses[0].code);
+  close(db->fd_index);
+  db->fd_index = fd_index;
+  VK_ASSERT_EQUALS(MDB_OK, mdb_read_multi(handle, keys, bufs, bufsizes,
+                                          statuses, 1).code);
+  VK_ASSERT_EQUALS(MDB_OK, statuses[0].code);
+  VK_ASSERT_EQUALS_S("mikoto", buffer);
+  mdb_close(handle);
+
+  VK_TEST_SECTION_END("failed bucket read");
+}
+
 int main() {
   srand(time(NULL));
 
@@ -301,6 +723,12 @@ int main() {
   for (size_t i = 0; i < 8; i++) {
     test4();
   }
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
 
   VK_TEST_END;
 